@@ -10,10 +10,17 @@
 /*
  * Implements the AES-CCM encryption and decryption for 128-bit keys.
  *
- * Uses the aes_encrypt function in aes.h, so you need to include that too:
+ * Uses the aes_expand_key and aes_encrypt_blocks functions in aes.h,
+ * and the aes_ctr_increment function in aes-ctr.h, so you need to include those too:
  * #include "aes.h"
+ * #include "aes-ctr.h"
  * #include "aes-ccm.h"
  *
+ * Messages that are not all in memory at once, such as firmware images,
+ * can be processed in parts with aes_ccm_init(), aes_ccm_aad(),
+ * aes_ccm_update() and aes_ccm_final(), as long as their lengths are known
+ * in advance.
+ *
  * References:
  * [CCM] Recommendation for Block Cipher Modes of Operation:
  *       The CCM Mode for Authentication and Confidentiality
@@ -21,145 +28,658 @@
  *       http://nvlpubs.nist.gov/nistpubs/Legacy/SP/nistspecialpublication800-38c.pdf
  */
 
+#ifdef AES_AESNI
+#include <tmmintrin.h>
+#endif
+
+/*
+ * Holds what is common to the blocks of a message: the expanded block cipher
+ * key, and the counter block Ctr0 with the flags and the nonce, which are
+ * formatted once, so that the counter blocks and B0 only need their
+ * last bytes changed.
+ */
+struct aes_ccm_context {
+  const struct aes_key *key;  /* the block cipher key expanded by aes_expand_key() */
+  unsigned char ctr0[16];  /* the counter block Ctr0: flags || nonce || 0 */
+  int nonce_length;  /* number of bytes of the nonce */
+};
+
 /*
- * Internal function that performs the Counter (CTR) mode
- * which is used for both encrypting a payload and decrypting
- * a ciphertext (the payload part only, excluding the MAC).
+ * Internal function that prepares the context of a message.
  *
- * output: pointer to input_length bytes to store the ciphertext/payload
+ * ctx: pointer to the aes_ccm_context structure to initialize
+ * key: pointer to the block cipher key expanded by aes_expand_key()
  * nonce: pointer to the nonce
  * nonce_length: number of bytes of the nonce
- * input: pointer to the payload/ciphertext to encrypt/decrypt
- * input_length: number of bytes of the input payload/ciphertext
- * key: pointer to the 16-byte (128-bit) block cipher key
+ *
+ * Returns 0 on success, or -1 if the nonce is not 7 to 13 bytes long
+ * (and then ctx is not changed).
  *
  * References:
- * [CCM] 6.1 Generation-Encryption Process
+ * [CCM] A.1 Length Requirements
  * [CCM] A.3 Formatting of the Counter Blocks
  */
-static void aes_ccm_ctr(void *output, const void *nonce, int nonce_length, const void *input, int input_length, const void *key) {
-  char x[16];
-  int counter;
-  int i, n;
+static int aes_ccm_set_nonce(struct aes_ccm_context *ctx, const struct aes_key *key, const void *nonce, int nonce_length) {
+  int i;
 
-  counter = 0;
-  for (n = 0; n < input_length; n += 16) {
-    /* Generate the counter block CTRj */
-    x[0] = 14 - nonce_length;
-    for (i = 0; i < nonce_length; i++) {
-      x[i + 1] = ((char *)nonce)[i];
-    }
-    counter++;
-    for (i = 0; i < 15 - nonce_length; i++) {
-      if (i < (int)sizeof(counter)) {
-        x[15 - i] = counter >> (i * 8);
-      } else {
-        x[15 - i] = 0;
+  if (nonce_length < 7 || nonce_length > 13) {
+    return -1;
+  }
+  ctx->key = key;
+  ctx->nonce_length = nonce_length;
+  ctx->ctr0[0] = 14 - nonce_length;
+  for (i = 0; i < nonce_length; i++) {
+    ctx->ctr0[i + 1] = ((unsigned char *)nonce)[i];
+  }
+  for (i = nonce_length + 1; i < 16; i++) {
+    ctx->ctr0[i] = 0;
+  }
+  return 0;
+}
+
+/*
+ * Internal function that adds data to a CBC-MAC, a whole block at a time
+ * when the data is aligned with the blocks.
+ *
+ * y: pointer to the 16-byte (128-bit) block Yi-1
+ * i: number of bytes of the current block already added to y
+ * data: pointer to the data
+ * length: number of bytes of the data
+ * key: pointer to the expanded block cipher key
+ *
+ * Returns the number of bytes of the current block added to y.
+ *
+ * [CCM] 6.1 Step 4. For i = 1 to r, do Yi = CIPHk(Bi xor Yi-1)
+ */
+static int aes_ccm_cbc_mac(unsigned char *y, int i, const unsigned char *data, size_t length, const struct aes_key *key) {
+  int j;
+
+  while (length > 0) {
+    if (i == 0 && length >= 16) {
+      for (j = 0; j < 16; j++) {
+        y[j] ^= data[j];
       }
+      aes_encrypt_block(key, y, y);
+      data += 16;
+      length -= 16;
+      continue;
     }
-    /* Sj = CIPHk(CTRj) */
-    aes_encrypt(x, x, key);
-    /* C = P xor MSBplen(S) */
-    for (i = 0; i < 16 && n + i < input_length; i++) {
-      ((char *)output)[n + i] = ((char *)input)[n + i] ^ x[i];
+    y[i++] ^= *data++;
+    length--;
+    if (i == 16) {
+      aes_encrypt_block(key, y, y);
+      i = 0;
     }
   }
+  return i;
 }
 
 /*
- * Internal function that generates and encrypts a MAC.
+ * Internal function that formats the first block B0 of the CBC-MAC
+ * from a copy of the counter block Ctr0, which already has the nonce.
  *
- * mac: pointer to mac_length bytes to store the encrypted MAC
+ * b0: pointer to the 16-byte copy of Ctr0 to turn into B0
  * mac_length: number of bytes of the MAC
- * nonce: pointer to the nonce
- * nonce_length: number of bytes of the nonce
- * ad: pointer to the associated data
  * ad_length: number of bytes of the associated data
- * payload: pointer to the payload
  * payload_length: number of bytes of the payload
- * key: pointer to the 16-byte (128-bit) block cipher key
+ * ctx: pointer to the context of the message
+ *
+ * Returns 0 on success, or -1 if the MAC is not 4, 6, 8, 10, 12, 14 or 16
+ * bytes long (and then b0 is not changed), or if the payload length does not
+ * fit in the 15 - nonce_length bytes of B0 (and then the counter would wrap around).
+ *
+ * References:
+ * [CCM] A.1 Length Requirements
+ * [CCM] A.2.1 Formatting of the Control Information and the Nonce
+ */
+static int aes_ccm_format_b0(unsigned char *b0, int mac_length, size_t ad_length, size_t payload_length, const struct aes_ccm_context *ctx) {
+  int i;
+
+  if (mac_length < 4 || mac_length > 16 || mac_length % 2) {
+    return -1;
+  }
+  b0[0] = (ad_length > 0) << 6 | ((mac_length - 2) / 2) << 3 | (14 - ctx->nonce_length);
+  if (ctx->nonce_length == 13) {
+    /* The most common case, as in IEEE 802.15.4 and ZigBee: Q is 2 bytes */
+    b0[14] = payload_length >> 8;
+    b0[15] = payload_length;
+    return payload_length > 0xffff ? -1 : 0;
+  }
+  for (i = 15; i > ctx->nonce_length; i--) {
+    b0[i] = payload_length;
+    payload_length >>= 8;
+  }
+  return payload_length ? -1 : 0;
+}
+
+/*
+ * Internal function that encodes the length of the associated data.
+ *
+ * a: pointer to 10 bytes to store the encoding
+ * ad_length: number of bytes of the associated data
+ *
+ * Returns the number of bytes of the encoding: 0, 2, 6 or 10.
+ *
+ * [CCM] A.2.2 Formatting of the Associated Data
+ */
+static int aes_ccm_format_ad_length(unsigned char *a, size_t ad_length) {
+  int i, n;
+
+  if (ad_length == 0) {
+    return 0;
+  }
+  if (ad_length < 0xff00) {
+    a[0] = ad_length >> 8;
+    a[1] = ad_length;
+    return 2;
+  }
+  /* 0xff 0xfe and 4 bytes below 2^32, 0xff 0xff and 8 bytes above */
+  n = ad_length >> 16 >> 16 ? 8 : 4;
+  a[0] = 0xff;
+  a[1] = n == 8 ? 0xff : 0xfe;
+  for (i = n + 1; i >= 2; i--) {
+    a[i] = ad_length;
+    ad_length >>= 8;
+  }
+  return n + 2;
+}
+
+/*
+ * Internal function that starts the CBC-MAC of a message: formats and
+ * encrypts B0, together with the counter block Ctr0, and adds the
+ * encoding of the length of the associated data.
+ *
+ * y: pointer to 16 bytes to store the CBC-MAC block
+ * s0: pointer to 16 bytes to store S0 = CIPHk(Ctr0), which encrypts the MAC
+ * mac_length: number of bytes of the MAC
+ * ad_length: number of bytes of the associated data
+ * payload_length: number of bytes of the payload
+ * ctx: pointer to the context of the message
+ *
+ * Returns the number of bytes of the current block added to y,
+ * to be followed by the associated data, or -1 if the length of the MAC
+ * is not valid or the payload is too long for the length of the nonce.
  *
  * References:
  * [CCM] 6.1 Generation-Encryption Process
  * [CCM] A.2 Formatting of the Input Data
  */
-static void aes_ccm_mac(void *mac, int mac_length, const void *nonce, int nonce_length, const void *ad, int ad_length, const void *payload, int payload_length, const void *key) {
-  char x[16];
-  int i, n;
+static int aes_ccm_start(unsigned char *y, unsigned char *s0, int mac_length, size_t ad_length, size_t payload_length, const struct aes_ccm_context *ctx) {
+  unsigned char x[2][16];  /* B0 then Y0, and Ctr0 then S0 */
+  unsigned char a[10];  /* the encoding of the length of the associated data */
+  int i;
 
-  /* [CCM] A.2.1 Formatting of the Control Information and the Nonce */
-  x[0] = (ad_length > 0) << 6 | ((mac_length - 2) / 2) << 3 | (14 - nonce_length);
-  for (i = 0; i < nonce_length; i++) {
-    x[i + 1] = ((char *)nonce)[i];
+  for (i = 0; i < 16; i++) {
+    x[0][i] = ctx->ctr0[i];
+    x[1][i] = ctx->ctr0[i];
   }
-  for (i = 0; i < 15 - nonce_length; i++) {
-    if (i < (int)sizeof(payload_length)) {
-      x[15 - i] = payload_length >> (i * 8);
-    } else {
-      x[15 - i] = 0;
-    }
-  }
-  /* Y0 = CIPHk(B0) */
-  aes_encrypt(x, x, key);
-
-  /* [CCM] A.2.2 Formatting of the Associated Data */
-  if (ad_length > 0) {
-    if (ad_length >= 0xff00) {
-      x[0] ^= 0xff;
-      x[1] ^= 0xfe;
-      x[2] ^= ad_length >> 24;
-      x[3] ^= ad_length >> 16;
-      x[4] ^= ad_length >> 8;
-      x[5] ^= ad_length;
-      i = 6;
-    } else {
-      x[0] ^= ad_length >> 8;
-      x[1] ^= ad_length;
-      i = 2;
+  if (aes_ccm_format_b0(x[0], mac_length, ad_length, payload_length, ctx)) {
+    return -1;
+  }
+  /* Y0 = CIPHk(B0), and S0 = CIPHk(Ctr0) at the same time */
+  aes_encrypt_blocks(ctx->key, x, x, 2);
+  for (i = 0; i < 16; i++) {
+    y[i] = x[0][i];
+    s0[i] = x[1][i];
+  }
+
+  return aes_ccm_cbc_mac(y, 0, a, aes_ccm_format_ad_length(a, ad_length), ctx->key);
+}
+
+#ifdef AES_AESNI
+
+/*
+ * Internal function that encrypts or decrypts whole blocks of the payload
+ * and adds them to the CBC-MAC with the AES-NI instructions, interleaving
+ * the rounds of each CBC-MAC block with those of a counter block.
+ * When decrypting, the CBC-MAC of a block is computed with the counter
+ * block of the next one, as it needs the decrypted payload.
+ * Stops before the counter would carry out of its 32 least significant bits
+ * (or out of the counter bytes if there are less than 4), and leaves those
+ * blocks to aes_ccm_crypt().
+ * Returns the number of blocks processed.
+ */
+__attribute__((target("aes,sse2,ssse3")))
+static size_t aes_ccm_crypt_aesni(unsigned char *output, const unsigned char *input, size_t n, unsigned char *y, unsigned char *counter, int counter_bytes, int decrypt, const struct aes_key *key) {
+  const __m128i *rk = (const __m128i *)key->round_keys;
+  const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i ctr;  /* the counter block with its bytes reversed */
+  __m128i mac, m, s, p, k;
+  unsigned c, max;
+  size_t done;
+  int round;
+
+  max = counter_bytes >= 4 ? 0xffffffff : (1u << (8 * counter_bytes)) - 1;
+  ctr = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)counter), swap);
+  c = (unsigned)_mm_cvtsi128_si32(ctr) & max;
+  mac = _mm_loadu_si128((const __m128i *)y);
+
+  if (!decrypt) {
+    for (done = 0; done < n && c != max; done++) {
+      p = _mm_loadu_si128((const __m128i *)input + done);
+      k = _mm_loadu_si128(rk);
+      m = _mm_xor_si128(_mm_xor_si128(mac, p), k);
+      s = _mm_xor_si128(_mm_shuffle_epi8(ctr, swap), k);
+      for (round = 1; round < 10; round++) {
+        k = _mm_loadu_si128(rk + round);
+        m = _mm_aesenc_si128(m, k);
+        s = _mm_aesenc_si128(s, k);
+      }
+      k = _mm_loadu_si128(rk + 10);
+      mac = _mm_aesenclast_si128(m, k);
+      _mm_storeu_si128((__m128i *)output + done, _mm_xor_si128(_mm_aesenclast_si128(s, k), p));
+      ctr = _mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 1));
+      c++;
     }
-    for (n = 0; n < ad_length; n++) {
-      /* Yi = CIPHk(Bi xor Yi-1) */
-      x[i++] ^= ((char *)ad)[n];
-      if (i == 16) {
-        i = 0;
-        aes_encrypt(x, x, key);
+  } else {
+    /* m = Yi-1 xor Pi of the previous block, once there is one */
+    m = mac;
+    for (done = 0; done < n && c != max; done++) {
+      k = _mm_loadu_si128(rk);
+      m = _mm_xor_si128(m, k);
+      s = _mm_xor_si128(_mm_shuffle_epi8(ctr, swap), k);
+      for (round = 1; round < 10; round++) {
+        k = _mm_loadu_si128(rk + round);
+        m = _mm_aesenc_si128(m, k);
+        s = _mm_aesenc_si128(s, k);
+      }
+      k = _mm_loadu_si128(rk + 10);
+      if (done > 0) {
+        mac = _mm_aesenclast_si128(m, k);
       }
+      p = _mm_xor_si128(_mm_aesenclast_si128(s, k), _mm_loadu_si128((const __m128i *)input + done));
+      _mm_storeu_si128((__m128i *)output + done, p);
+      m = _mm_xor_si128(mac, p);
+      ctr = _mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 1));
+      c++;
     }
-    if (i) {
-      aes_encrypt(x, x, key);
+    if (done > 0) {
+      m = _mm_xor_si128(m, _mm_loadu_si128(rk));
+      for (round = 1; round < 10; round++) {
+        m = _mm_aesenc_si128(m, _mm_loadu_si128(rk + round));
+      }
+      mac = _mm_aesenclast_si128(m, _mm_loadu_si128(rk + 10));
     }
   }
 
-  /* [CCM] A.2.3 Formatting of the Payload */
-  for (i = 0, n = 0; n < payload_length; n++) {
-    /* Yi = CIPHk(Bi xor Yi-1) */
-    x[i++] ^= ((char *)payload)[n];
-    if (i == 16) {
-      i = 0;
-      aes_encrypt(x, x, key);
+  _mm_storeu_si128((__m128i *)y, mac);
+  _mm_storeu_si128((__m128i *)counter, _mm_shuffle_epi8(ctr, swap));
+  return done;
+}
+
+#endif
+
+/*
+ * Internal function that encrypts or decrypts the payload in Counter (CTR)
+ * mode and adds it to the CBC-MAC in a single pass, encrypting each
+ * CBC-MAC block together with a counter block.
+ * When decrypting, the CBC-MAC of a block is computed with the counter
+ * block of the next one, as it needs the decrypted payload.
+ *
+ * output: pointer to length bytes to store the ciphertext/payload
+ * input: pointer to the payload/ciphertext to encrypt/decrypt
+ * length: number of bytes of the input
+ * y: pointer to the 16-byte CBC-MAC block, updated with the payload
+ * counter: pointer to the 16-byte counter block of the first input block,
+ *          updated to the counter block that follows the last input block
+ * decrypt: 0 to encrypt, or 1 to decrypt
+ * ctx: pointer to the context of the message
+ *
+ * The output may overlap the input only if they are at the same address.
+ *
+ * References:
+ * [CCM] 6.1 Generation-Encryption Process, steps 4 and 7 to 8
+ * [CCM] 6.2 Decryption-Validation Process, steps 3 to 4 and 7 to 8
+ */
+static void aes_ccm_crypt(void *output, const void *input, size_t length, unsigned char *y, unsigned char *counter, int decrypt, const struct aes_ccm_context *ctx) {
+  unsigned char *out = (unsigned char *)output;
+  const unsigned char *in = (const unsigned char *)input;
+  unsigned char x[2][16];  /* Yi-1 xor Pi then Yi, and CTRi then Si */
+  unsigned char p;
+  int pending = 0;  /* whether x[0] holds a block of the CBC-MAC to encrypt */
+  size_t n;
+  int i;
+
+  while (length > 0) {
+#ifdef AES_AESNI
+    if (ctx->key->backend == AES_BACKEND_AESNI) {
+      if (pending) {
+        aes_encrypt_block(ctx->key, y, x[0]);
+        pending = 0;
+      }
+      n = aes_ccm_crypt_aesni(out, in, length / 16, y, counter, 15 - ctx->nonce_length, decrypt, ctx->key) * 16;
+      out += n;
+      in += n;
+      length -= n;
+      if (length == 0) {
+        break;
+      }
+    }
+#endif
+    n = length < 16 ? length : 16;
+    for (i = 0; i < 16; i++) {
+      x[1][i] = counter[i];
     }
+    aes_ctr_increment(counter, 15 - ctx->nonce_length);
+
+    if (!decrypt) {
+      /* Yi = CIPHk(Bi xor Yi-1) with Bi = Pi padded with zeros, and Si = CIPHk(CTRi) */
+      for (i = 0; i < 16; i++) {
+        x[0][i] = i < (int)n ? y[i] ^ in[i] : y[i];
+      }
+      aes_encrypt_blocks(ctx->key, x, x, 2);
+      for (i = 0; i < 16; i++) {
+        y[i] = x[0][i];
+      }
+      for (i = 0; i < (int)n; i++) {
+        out[i] = in[i] ^ x[1][i];
+      }
+    } else {
+      /* Si = CIPHk(CTRi), and the CBC-MAC of the previous block */
+      if (pending) {
+        aes_encrypt_blocks(ctx->key, x, x, 2);
+        for (i = 0; i < 16; i++) {
+          y[i] = x[0][i];
+        }
+      } else {
+        aes_encrypt_block(ctx->key, x[1], x[1]);
+      }
+      for (i = 0; i < 16; i++) {
+        x[0][i] = y[i];
+      }
+      for (i = 0; i < (int)n; i++) {
+        p = in[i] ^ x[1][i];
+        out[i] = p;
+        x[0][i] ^= p;
+      }
+      pending = 1;
+    }
+    out += n;
+    in += n;
+    length -= n;
+  }
+
+  if (pending) {
+    aes_encrypt_block(ctx->key, y, x[0]);
+  }
+}
+
+/*
+ * Internal function that performs the AES-CCM encryption or decryption of
+ * the payload and computes the encrypted MAC.
+ *
+ * output: pointer to length bytes to store the ciphertext/payload
+ * mac: pointer to mac_length bytes to store the encrypted MAC
+ * mac_length: number of bytes of the MAC
+ * ad: pointer to the associated data
+ * ad_length: number of bytes of the associated data
+ * input: pointer to the payload/ciphertext (without the MAC)
+ * length: number of bytes of the payload/ciphertext
+ * decrypt: 0 to encrypt, or 1 to decrypt
+ * ctx: pointer to the context of the message
+ *
+ * Returns 0 on success, or -1 if the length of the MAC is not valid or the
+ * payload is too long for the length of the nonce (and then nothing is output).
+ *
+ * References:
+ * [CCM] 6.1 Generation-Encryption Process
+ * [CCM] 6.2 Decryption-Validation Process
+ */
+static int aes_ccm_process(void *output, unsigned char *mac, int mac_length, const void *ad, size_t ad_length, const void *input, size_t length, int decrypt, const struct aes_ccm_context *ctx) {
+  unsigned char y[16];  /* the CBC-MAC block Yi */
+  unsigned char s0[16];  /* S0 = CIPHk(Ctr0) */
+  unsigned char counter[16];  /* the counter block CTRi */
+  int i;
+
+  i = aes_ccm_start(y, s0, mac_length, ad_length, length, ctx);
+  if (i < 0) {
+    return -1;
+  }
+  if (aes_ccm_cbc_mac(y, i, (const unsigned char *)ad, ad_length, ctx->key)) {
+    aes_encrypt_block(ctx->key, y, y);
   }
-  if (i) {
-    aes_encrypt(x, x, key);
+
+  /* The payload, starting with the counter block CTR1 */
+  for (i = 0; i < 15; i++) {
+    counter[i] = ctx->ctr0[i];
   }
+  counter[15] = 1;
+  aes_ccm_crypt(output, input, length, y, counter, decrypt, ctx);
 
-  /* Get the MAC: T = MSBtlen(Yr) */
+  /* Get the MAC: T = MSBtlen(Yr), and encrypt it: U = T xor MSBlen(S0) */
   for (i = 0; i < mac_length; i++) {
-    ((char *)mac)[i] = x[i];
+    mac[i] = y[i] ^ s0[i];
   }
+  return 0;
+}
 
-  /* Encrypt the MAC: U = T xor MSBlen(S0) */
-  x[0] = 14 - nonce_length;
-  for (i = 0; i < nonce_length; i++) {
-    x[i + 1] = ((char *)nonce)[i];
+/*
+ * Holds the state of an AES-CCM encryption or decryption
+ * between the calls to the streaming functions.
+ */
+struct aes_ccm_state {
+  struct aes_ccm_context ctx;  /* the context of the message */
+  unsigned char y[16];  /* the CBC-MAC block, with the bytes of the current block added */
+  unsigned char s0[16];  /* S0 = CIPHk(Ctr0) */
+  unsigned char counter[16];  /* the next counter block */
+  unsigned char key_stream[16];  /* the key stream of the current counter block */
+  int position;  /* number of bytes of the current block added to y */
+  int mac_length;  /* number of bytes of the MAC */
+  size_t ad_left;  /* number of bytes of associated data still expected */
+  size_t payload_left;  /* number of bytes of payload still expected */
+  int decrypt;  /* 0 to encrypt, 1 to decrypt */
+};
+
+/*
+ * Internal function that completes the current block of the CBC-MAC,
+ * padded with zeros.
+ */
+static void aes_ccm_state_pad(struct aes_ccm_state *state) {
+  if (state->position > 0) {
+    aes_encrypt_block(state->ctx.key, state->y, state->y);
+    state->position = 0;
+  }
+}
+
+/*
+ * Starts an AES-CCM encryption or decryption, whose lengths must be known
+ * in advance, because they are part of the first block of the CBC-MAC.
+ * state: pointer to the aes_ccm_state structure to initialize
+ * mac_length: number of bytes of the MAC
+ * nonce: pointer to the nonce
+ * nonce_length: number of bytes of the nonce
+ * ad_length: total number of bytes of the associated data
+ * payload_length: total number of bytes of the payload
+ * ctx: pointer to the block cipher key expanded by aes_expand_key(),
+ *      which must remain available until aes_ccm_final()
+ * decrypt: 0 to encrypt, 1 to decrypt
+ *
+ * Then call aes_ccm_aad() for the associated data, if any,
+ * aes_ccm_update() for the payload, and aes_ccm_final() for the MAC.
+ * Only the current block is kept in the state, so a large payload
+ * does not need to be in memory all at once.
+ *
+ * Returns 0 on success, or -1 if the MAC is not 4, 6, 8, 10, 12, 14 or 16
+ * bytes long, if the nonce is not 7 to 13 bytes long, or if the payload
+ * is too long for the length of the nonce: less than
+ * 2^(8 * (15 - nonce_length)) bytes.
+ *
+ * [CCM] 6.1 Generation-Encryption Process, steps 1 to 3
+ */
+static int aes_ccm_init(struct aes_ccm_state *state, int mac_length, const void *nonce, int nonce_length, size_t ad_length, size_t payload_length, const struct aes_key *ctx, int decrypt) {
+  int i;
+
+  if (aes_ccm_set_nonce(&state->ctx, ctx, nonce, nonce_length)) {
+    return -1;
   }
-  for (i = 0; i < 15 - nonce_length; i++) {
-    x[15 - i] = 0;
+  state->position = aes_ccm_start(state->y, state->s0, mac_length, ad_length, payload_length, &state->ctx);
+  if (state->position < 0) {
+    return -1;
   }
-  aes_encrypt(x, x, key);
-  for (i = 0; i < mac_length; i++) {
-    ((char *)mac)[i] ^= x[i];
+  for (i = 0; i < 15; i++) {
+    state->counter[i] = state->ctx.ctr0[i];
   }
+  state->counter[15] = 1;
+  state->mac_length = mac_length;
+  state->ad_left = ad_length;
+  state->payload_left = payload_length;
+  state->decrypt = decrypt;
+  if (ad_length == 0) {
+    aes_ccm_state_pad(state);
+  }
+  return 0;
+}
+
+/*
+ * Adds associated data to an AES-CCM encryption or decryption.
+ * state: pointer to the state initialized by aes_ccm_init()
+ * ad: pointer to the associated data
+ * ad_length: number of bytes of the associated data
+ *
+ * Can be called several times, but only before aes_ccm_update().
+ * Returns 0 on success, or -1 if the total length of the associated data
+ * would exceed the length given to aes_ccm_init() (and then nothing is added).
+ *
+ * [CCM] A.2.2 Formatting of the Associated Data
+ */
+static int aes_ccm_aad(struct aes_ccm_state *state, const void *ad, size_t ad_length) {
+  if (ad_length > state->ad_left) {
+    return -1;
+  }
+  state->position = aes_ccm_cbc_mac(state->y, state->position, (const unsigned char *)ad, ad_length, state->ctx.key);
+  state->ad_left -= ad_length;
+  if (state->ad_left == 0) {
+    aes_ccm_state_pad(state);
+  }
+  return 0;
+}
+
+/*
+ * Encrypts or decrypts the next part of the payload.
+ * state: pointer to the state initialized by aes_ccm_init()
+ * output: pointer to length bytes of memory to store the ciphertext/payload
+ * input: pointer to the payload/ciphertext (without the MAC)
+ * length: number of bytes of the input
+ *
+ * Can be called several times, with parts of any length.
+ * The output may overlap the input only if they are at the same address.
+ *
+ * When decrypting, the payload is output before the MAC is verified
+ * by aes_ccm_final(), so it must not be used until then.
+ *
+ * Returns 0 on success, or -1 if not all the associated data has been added,
+ * or if the total length of the payload would exceed the length given
+ * to aes_ccm_init() (and then nothing is encrypted or decrypted).
+ *
+ * [CCM] 6.1 Generation-Encryption Process, steps 4 to 8
+ */
+static int aes_ccm_update(struct aes_ccm_state *state, void *output, const void *input, size_t length) {
+  unsigned char *out = (unsigned char *)output;
+  const unsigned char *in = (const unsigned char *)input;
+  unsigned char p;
+  size_t n;
+
+  if (state->ad_left > 0 || length > state->payload_left) {
+    return -1;
+  }
+  state->payload_left -= length;
+
+  while (length > 0) {
+    if (state->position == 0 && length >= 16) {
+      /* Whole blocks, in a single pass */
+      n = length & ~(size_t)15;
+      aes_ccm_crypt(out, in, n, state->y, state->counter, state->decrypt, &state->ctx);
+    } else {
+      /* Part of a block, with the key stream of its counter block */
+      if (state->position == 0) {
+        aes_encrypt_block(state->ctx.key, state->key_stream, state->counter);
+        aes_ctr_increment(state->counter, 15 - state->ctx.nonce_length);
+      }
+      for (n = 0; n < length && state->position < 16; n++) {
+        p = state->decrypt ? in[n] ^ state->key_stream[state->position] : in[n];
+        out[n] = in[n] ^ state->key_stream[state->position];
+        state->y[state->position++] ^= p;
+      }
+      if (state->position == 16) {
+        aes_encrypt_block(state->ctx.key, state->y, state->y);
+        state->position = 0;
+      }
+    }
+    out += n;
+    in += n;
+    length -= n;
+  }
+  return 0;
+}
+
+/*
+ * Completes an AES-CCM encryption or decryption:
+ * stores the encrypted MAC, or verifies it.
+ * state: pointer to the state initialized by aes_ccm_init()
+ * mac: pointer to mac_length bytes of memory to store the encrypted MAC
+ *      when encrypting, or with the encrypted MAC to verify when decrypting
+ *
+ * Returns 0 on success, or -1 if the verification of the MAC fails,
+ * or if not all the associated data and payload have been added.
+ *
+ * [CCM] 6.1 Generation-Encryption Process, steps 5 and 8
+ * [CCM] 6.2 Decryption-Validation Process, step 10
+ */
+static int aes_ccm_final(struct aes_ccm_state *state, void *mac) {
+  unsigned char diff = 0;
+  int i;
+
+  if (state->ad_left > 0 || state->payload_left > 0) {
+    return -1;
+  }
+  aes_ccm_state_pad(state);
+
+  if (!state->decrypt) {
+    for (i = 0; i < state->mac_length; i++) {
+      ((unsigned char *)mac)[i] = state->y[i] ^ state->s0[i];
+    }
+    return 0;
+  }
+
+  /* Check the MAC, taking the same time wherever it differs */
+  for (i = 0; i < state->mac_length; i++) {
+    diff |= state->y[i] ^ state->s0[i] ^ ((unsigned char *)mac)[i];
+  }
+  return diff ? -1 : 0;
+}
+
+/*
+ * Performs the AES-CCM generation-encryption process
+ * (encrypts the payload and the appended MAC)
+ * with a block cipher key previously expanded by aes_expand_key().
+ *
+ * ciphertext: pointer to (payload_length + mac_length) bytes to store the ciphertext
+ * mac_length: number of bytes of the MAC
+ * nonce: pointer to the nonce
+ * nonce_length: number of bytes of the nonce
+ * ad: pointer to the associated data
+ * ad_length: number of bytes of the associated data
+ * payload: pointer to the payload
+ * payload_length: number of bytes of the payload
+ * ctx: pointer to the expanded block cipher key
+ *
+ * The ciphertext may overlap the payload only if they are at the same address.
+ * Returns 0 on success, or -1 if the MAC is not 4, 6, 8, 10, 12, 14 or 16
+ * bytes long, if the nonce is not 7 to 13 bytes long, or if the payload
+ * is too long for the length of the nonce: less than
+ * 2^(8 * (15 - nonce_length)) bytes (and then nothing is encrypted).
+ *
+ * Reference:
+ * [CCM] 6.1 Generation-Encryption Process
+ */
+static int aes_ccm_encrypt_ctx(void *ciphertext, int mac_length, const void *nonce, int nonce_length, const void *ad, size_t ad_length, const void *payload, size_t payload_length, const struct aes_key *ctx) {
+  struct aes_ccm_context c;
+
+  if (aes_ccm_set_nonce(&c, ctx, nonce, nonce_length)) {
+    return -1;
+  }
+  /* Encrypt the payload, and append the encrypted MAC */
+  return aes_ccm_process(ciphertext, (unsigned char *)ciphertext + payload_length, mac_length, ad, ad_length, payload, payload_length, 0, &c);
 }
 
 /*
@@ -176,20 +696,27 @@ static void aes_ccm_mac(void *mac, int mac_length, const void *nonce, int nonce_
  * payload_length: number of bytes of the payload
  * key: pointer to the 16-byte (128-bit) block cipher key
  *
+ * Returns 0 on success, or -1 if the lengths of the MAC or the nonce are
+ * not valid, or if the payload is too long for the length of the nonce
+ * (and then nothing is encrypted).
+ *
  * Reference:
  * [CCM] 6.1 Generation-Encryption Process
  */
-static void aes_ccm_encrypt(void *ciphertext, int mac_length, const void *nonce, int nonce_length, const void *ad, int ad_length, const void *payload, int payload_length, const void *key) {
-  /* Encrypt the payload */
-  aes_ccm_ctr(ciphertext, nonce, nonce_length, payload, payload_length, key);
-  /* Encrypt and append the MAC */
-  aes_ccm_mac((char *)ciphertext + payload_length, mac_length, nonce, nonce_length, ad, ad_length, payload, payload_length, key);
+static int aes_ccm_encrypt(void *ciphertext, int mac_length, const void *nonce, int nonce_length, const void *ad, size_t ad_length, const void *payload, size_t payload_length, const void *key) {
+  struct aes_key ctx;
+
+  aes_expand_key(&ctx, key);
+  return aes_ccm_encrypt_ctx(ciphertext, mac_length, nonce, nonce_length, ad, ad_length, payload, payload_length, &ctx);
 }
 
 /*
  * Performs the AES-CCM decryption-validation process
- * (decrypts the ciphertext and checks and removes the MAC).
- * Returns 0 if the MAC verification succeeds, or -1 if it fails.
+ * (decrypts the ciphertext and checks and removes the MAC)
+ * with a block cipher key previously expanded by aes_expand_key().
+ * Returns 0 if the MAC verification succeeds, or -1 if it fails
+ * (and then the payload is overwritten with zeros) or if the lengths
+ * are not valid.
  *
  * payload: pointer to (ciphertext_length - mac_length) bytes to store the decrypted payload
  * mac_length: number of bytes of the MAC
@@ -199,30 +726,481 @@ static void aes_ccm_encrypt(void *ciphertext, int mac_length, const void *nonce,
  * ad_length: number of bytes of the associated data
  * ciphertext: pointer to the ciphertext
  * ciphertext_length: number of bytes of the ciphertext (including the encrypted MAC)
- * key: pointer to the 16-byte (128-bit) block cipher key
+ * ctx: pointer to the expanded block cipher key
  *
  * Reference:
  * [CCM] 6.2 Decryption-Validation Process
  */
-static int aes_ccm_decrypt(void *payload, int mac_length, const void *nonce, int nonce_length, const void *ad, int ad_length, const void *ciphertext, int ciphertext_length, const void *key) {
-  char mac[16];
-  int payload_length;
+static int aes_ccm_decrypt_ctx(void *payload, int mac_length, const void *nonce, int nonce_length, const void *ad, size_t ad_length, const void *ciphertext, size_t ciphertext_length, const struct aes_key *ctx) {
+  struct aes_ccm_context c;
+  unsigned char mac[16];
+  unsigned char diff = 0;
+  size_t payload_length, n;
   int i;
 
+  if (ciphertext_length < (size_t)mac_length) {
+    return -1;
+  }
   payload_length = ciphertext_length - mac_length;
+  if (aes_ccm_set_nonce(&c, ctx, nonce, nonce_length)) {
+    return -1;
+  }
 
-  /* Decrypt the payload part of the ciphertext */
-  aes_ccm_ctr(payload, nonce, nonce_length, ciphertext, payload_length, key);
-
-  /* Calculate the encrypted MAC */
-  aes_ccm_mac(mac, mac_length, nonce, nonce_length, ad, ad_length, payload, payload_length, key);
+  /* Decrypt the payload part of the ciphertext, and calculate the encrypted MAC */
+  if (aes_ccm_process(payload, mac, mac_length, ad, ad_length, ciphertext, payload_length, 1, &c)) {
+    return -1;
+  }
 
-  /* Check the received and calculated MACs */
+  /* Check the received and calculated MACs, taking the same time wherever they differ */
   for (i = 0; i < mac_length; i++) {
-    if (mac[i] != ((char *)ciphertext)[payload_length + i]) {
-      return -1;
+    diff |= mac[i] ^ ((unsigned char *)ciphertext)[payload_length + i];
+  }
+  if (diff) {
+    /* [CCM] 6.2 Step 10: do not release the payload if the MAC is not valid */
+    for (n = 0; n < payload_length; n++) {
+      ((unsigned char *)payload)[n] = 0;
     }
+    return -1;
   }
 
   return 0;
 }
+
+/*
+ * Performs the AES-CCM decryption-validation process
+ * (decrypts the ciphertext and checks and removes the MAC).
+ * Returns 0 if the MAC verification succeeds, or -1 if it fails
+ * (and then the payload is overwritten with zeros) or if the lengths
+ * are not valid.
+ *
+ * payload: pointer to (ciphertext_length - mac_length) bytes to store the decrypted payload
+ * mac_length: number of bytes of the MAC
+ * nonce: pointer to the nonce
+ * nonce_length: number of bytes of the nonce
+ * ad: pointer to the associated data
+ * ad_length: number of bytes of the associated data
+ * ciphertext: pointer to the ciphertext
+ * ciphertext_length: number of bytes of the ciphertext (including the encrypted MAC)
+ * key: pointer to the 16-byte (128-bit) block cipher key
+ *
+ * Reference:
+ * [CCM] 6.2 Decryption-Validation Process
+ */
+static int aes_ccm_decrypt(void *payload, int mac_length, const void *nonce, int nonce_length, const void *ad, size_t ad_length, const void *ciphertext, size_t ciphertext_length, const void *key) {
+  struct aes_key ctx;
+
+  aes_expand_key(&ctx, key);
+  return aes_ccm_decrypt_ctx(payload, mac_length, nonce, nonce_length, ad, ad_length, ciphertext, ciphertext_length, &ctx);
+}
+
+/*
+ * Maximum number of frames whose CBC-MAC chains aes_ccm_batch() interleaves.
+ */
+#define AES_CCM_BATCH 8
+
+/*
+ * Describes one frame of aes_ccm_encrypt_batch() or aes_ccm_decrypt_batch(),
+ * each with its own key.
+ */
+struct aes_ccm_frame {
+  const struct aes_key *key;  /* pointer to the block cipher key expanded by aes_expand_key() */
+  const void *nonce;  /* pointer to the nonce */
+  int nonce_length;  /* number of bytes of the nonce */
+  const void *ad;  /* pointer to the associated data */
+  size_t ad_length;  /* number of bytes of the associated data */
+  const void *input;  /* pointer to the payload, or to the ciphertext (including the encrypted MAC) */
+  size_t input_length;  /* number of bytes of the input */
+  void *output;  /* pointer to memory to store the ciphertext (input_length + mac_length bytes),
+                    or the payload (input_length - mac_length bytes) */
+  int mac_length;  /* number of bytes of the MAC */
+  int result;  /* set to 0 on success, or to -1 if the verification of the MAC fails or a length is not valid */
+};
+
+/*
+ * Internal structure with the progress of a frame in aes_ccm_batch().
+ */
+struct aes_ccm_lane {
+  struct aes_ccm_frame *frame;  /* the frame */
+  struct aes_ccm_context ctx;  /* the context of the frame */
+  unsigned char y[16];  /* B0, then the CBC-MAC block */
+  unsigned char s0[16];  /* S0 = CIPHk(Ctr0) */
+  unsigned char counter[16];  /* the next counter block */
+  unsigned char first[16];  /* the first block of the formatted associated data */
+  unsigned char last[16];  /* a last partial block, padded with zeros */
+  int a_length;  /* number of bytes of the encoding of the length of the associated data */
+  size_t length;  /* number of bytes of the payload */
+  size_t ad_blocks;  /* number of blocks of the formatted associated data */
+  size_t mac_blocks;  /* number of blocks after B0 added to the CBC-MAC */
+  size_t ctr_blocks;  /* number of blocks of the payload encrypted/decrypted */
+  int step;  /* bit 0 set if a block of the CBC-MAC, bit 1 if a counter block, is in the current step */
+};
+
+/*
+ * Internal structure with one of the blocks that aes_ccm_encrypt_slots()
+ * encrypts, and what to do with the result.
+ */
+struct aes_ccm_slot {
+  const struct aes_key *key;  /* the expanded key of the block */
+  const unsigned char *a;  /* pointer to the 16 bytes of the block */
+  const unsigned char *b;  /* pointer to 16 bytes to xor with the block first, or NULL */
+  unsigned char *output;  /* pointer to memory to store the result */
+  const unsigned char *input;  /* pointer to length bytes to xor with the result, or NULL to store all of it */
+  int length;  /* number of bytes of input and output if input is not NULL */
+};
+
+/*
+ * Internal function that completes the output of a slot.
+ */
+static void aes_ccm_slot_output(const struct aes_ccm_slot *slot, const unsigned char *e) {
+  int i;
+
+  if (slot->input) {
+    for (i = 0; i < slot->length; i++) {
+      slot->output[i] = slot->input[i] ^ e[i];
+    }
+  } else {
+    for (i = 0; i < 16; i++) {
+      slot->output[i] = e[i];
+    }
+  }
+}
+
+#ifdef AES_AESNI
+
+/*
+ * Internal function that loads the block of a slot, xored with the first round key.
+ */
+__attribute__((target("aes,sse2")))
+static __m128i aes_ccm_slot_load(const struct aes_ccm_slot *slot) {
+  __m128i x;
+
+  x = _mm_loadu_si128((const __m128i *)slot->a);
+  if (slot->b) {
+    x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)slot->b));
+  }
+  return _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)slot->key->round_keys));
+}
+
+/*
+ * Internal function that stores the result of a slot, after the last round.
+ */
+__attribute__((target("aes,sse2")))
+static void aes_ccm_slot_store(const struct aes_ccm_slot *slot, __m128i x) {
+  unsigned char e[16];
+
+  x = _mm_aesenclast_si128(x, _mm_loadu_si128((const __m128i *)slot->key->round_keys + 10));
+  if (!slot->input) {
+    _mm_storeu_si128((__m128i *)slot->output, x);
+  } else if (slot->length == 16) {
+    _mm_storeu_si128((__m128i *)slot->output, _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)slot->input)));
+  } else {
+    _mm_storeu_si128((__m128i *)e, x);
+    aes_ccm_slot_output(slot, e);
+  }
+}
+
+/*
+ * Internal function that encrypts the blocks of n slots, each with its own
+ * key, with the AES-NI instructions, interleaving the rounds of 8 blocks.
+ * All the blocks of a group of 8 are loaded before any result is stored.
+ */
+__attribute__((target("aes,sse2")))
+static void aes_ccm_encrypt_slots_aesni(const struct aes_ccm_slot *slots, int n) {
+  const __m128i *k0, *k1, *k2, *k3, *k4, *k5, *k6, *k7;
+  __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+  const struct aes_ccm_slot *s;
+  int round;
+
+  for (; n > 0; n -= 8, slots += 8) {
+    /* Fill the 8 lanes, repeating the first slot if there are less */
+    s = slots;
+    k0 = (const __m128i *)s->key->round_keys;
+    b0 = aes_ccm_slot_load(s);
+    s = slots + (n > 1 ? 1 : 0);
+    k1 = (const __m128i *)s->key->round_keys;
+    b1 = aes_ccm_slot_load(s);
+    s = slots + (n > 2 ? 2 : 0);
+    k2 = (const __m128i *)s->key->round_keys;
+    b2 = aes_ccm_slot_load(s);
+    s = slots + (n > 3 ? 3 : 0);
+    k3 = (const __m128i *)s->key->round_keys;
+    b3 = aes_ccm_slot_load(s);
+    s = slots + (n > 4 ? 4 : 0);
+    k4 = (const __m128i *)s->key->round_keys;
+    b4 = aes_ccm_slot_load(s);
+    s = slots + (n > 5 ? 5 : 0);
+    k5 = (const __m128i *)s->key->round_keys;
+    b5 = aes_ccm_slot_load(s);
+    s = slots + (n > 6 ? 6 : 0);
+    k6 = (const __m128i *)s->key->round_keys;
+    b6 = aes_ccm_slot_load(s);
+    s = slots + (n > 7 ? 7 : 0);
+    k7 = (const __m128i *)s->key->round_keys;
+    b7 = aes_ccm_slot_load(s);
+    for (round = 1; round < 10; round++) {
+      b0 = _mm_aesenc_si128(b0, _mm_loadu_si128(k0 + round));
+      b1 = _mm_aesenc_si128(b1, _mm_loadu_si128(k1 + round));
+      b2 = _mm_aesenc_si128(b2, _mm_loadu_si128(k2 + round));
+      b3 = _mm_aesenc_si128(b3, _mm_loadu_si128(k3 + round));
+      b4 = _mm_aesenc_si128(b4, _mm_loadu_si128(k4 + round));
+      b5 = _mm_aesenc_si128(b5, _mm_loadu_si128(k5 + round));
+      b6 = _mm_aesenc_si128(b6, _mm_loadu_si128(k6 + round));
+      b7 = _mm_aesenc_si128(b7, _mm_loadu_si128(k7 + round));
+    }
+    aes_ccm_slot_store(slots, b0);
+    if (n > 1) aes_ccm_slot_store(slots + 1, b1);
+    if (n > 2) aes_ccm_slot_store(slots + 2, b2);
+    if (n > 3) aes_ccm_slot_store(slots + 3, b3);
+    if (n > 4) aes_ccm_slot_store(slots + 4, b4);
+    if (n > 5) aes_ccm_slot_store(slots + 5, b5);
+    if (n > 6) aes_ccm_slot_store(slots + 6, b6);
+    if (n > 7) aes_ccm_slot_store(slots + 7, b7);
+  }
+}
+
+#endif
+
+/*
+ * Internal function that encrypts the blocks of n slots, each with its own key,
+ * and stores the results.
+ */
+static void aes_ccm_encrypt_slots(const struct aes_ccm_slot *slots, int n) {
+  unsigned char x[16];
+  int i, j;
+
+#ifdef AES_AESNI
+  for (i = 0; i < n && slots[i].key->backend == AES_BACKEND_AESNI; i++) {
+  }
+  if (i == n) {
+    aes_ccm_encrypt_slots_aesni(slots, n);
+    return;
+  }
+#endif
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < 16; j++) {
+      x[j] = slots[i].b ? slots[i].a[j] ^ slots[i].b[j] : slots[i].a[j];
+    }
+    aes_encrypt_block(slots[i].key, x, x);
+    aes_ccm_slot_output(slots + i, x);
+  }
+}
+
+/*
+ * Internal function that returns the block of a frame in aes_ccm_batch()
+ * that is added to the CBC-MAC after B0 and the given number of blocks:
+ * a block of the formatted associated data, or of the payload.
+ * Points into the frame for whole blocks, or else to a copy padded with zeros.
+ *
+ * [CCM] A.2.2 Formatting of the Associated Data
+ * [CCM] A.2.3 Formatting of the Payload
+ */
+static const unsigned char *aes_ccm_lane_block(struct aes_ccm_lane *l, size_t index, int decrypt) {
+  const unsigned char *data;
+  size_t length;
+  int i;
+
+  if (index == 0 && l->ad_blocks > 0) {
+    return l->first;
+  }
+  if (index < l->ad_blocks) {
+    data = (const unsigned char *)l->frame->ad + (16 * index - l->a_length);
+    length = l->frame->ad_length - (16 * index - l->a_length);
+  } else {
+    data = (const unsigned char *)(decrypt ? l->frame->output : l->frame->input) + 16 * (index - l->ad_blocks);
+    length = l->length - 16 * (index - l->ad_blocks);
+  }
+  if (length >= 16) {
+    return data;
+  }
+  for (i = 0; i < 16; i++) {
+    l->last[i] = i < (int)length ? data[i] : 0;
+  }
+  return l->last;
+}
+
+/*
+ * Implements aes_ccm_encrypt_batch() and aes_ccm_decrypt_batch().
+ *
+ * The CBC-MAC of a frame is a chain where each block waits for the previous
+ * one, so with short frames the processor mostly waits for the AES rounds.
+ * Up to AES_CCM_BATCH frames are processed at the same time, in steps:
+ * at each step, the next block of the CBC-MAC and the next counter block
+ * of every frame are encrypted together by aes_ccm_encrypt_slots().
+ * When decrypting, a block of the payload is added to the CBC-MAC at the
+ * step after its counter block; when encrypting, a counter block is not
+ * used before the block of the payload is added to the CBC-MAC, so that
+ * the output may be at the same address as the input.
+ */
+static int aes_ccm_batch(struct aes_ccm_frame *frames, int n, int decrypt) {
+  struct aes_ccm_lane lanes[AES_CCM_BATCH];
+  struct aes_ccm_slot slots[2 * AES_CCM_BATCH];
+  struct aes_ccm_slot *slot;
+  struct aes_ccm_lane *l;
+  const unsigned char *data;
+  unsigned char diff;
+  size_t m, offset;
+  int first, next, count, j, k;
+  int failed = 0;
+
+  for (first = 0; first < n; first = next) {
+    /* B0 and Ctr0 of each frame, skipping those with lengths that are not valid */
+    slot = slots;
+    for (next = first, count = 0; next < n && count < AES_CCM_BATCH; next++) {
+      l = lanes + count;
+      l->frame = frames + next;
+      if (aes_ccm_set_nonce(&l->ctx, l->frame->key, l->frame->nonce, l->frame->nonce_length)
+          || (decrypt && l->frame->input_length < (size_t)l->frame->mac_length)) {
+        l->frame->result = -1;
+        failed++;
+        continue;
+      }
+      l->length = l->frame->input_length - (decrypt ? l->frame->mac_length : 0);
+      for (k = 0; k < 16; k++) {
+        l->y[k] = l->ctx.ctr0[k];
+        l->counter[k] = l->ctx.ctr0[k];
+      }
+      if (aes_ccm_format_b0(l->y, l->frame->mac_length, l->frame->ad_length, l->length, &l->ctx)) {
+        l->frame->result = -1;
+        failed++;
+        continue;
+      }
+      count++;
+      l->counter[15] = 1;
+      slot->key = l->frame->key;
+      slot->a = l->y;
+      slot->b = NULL;
+      slot->output = l->y;
+      slot->input = NULL;
+      slot++;
+      slot->key = l->frame->key;
+      slot->a = l->ctx.ctr0;
+      slot->b = NULL;
+      slot->output = l->s0;
+      slot->input = NULL;
+      slot++;
+
+      /* [CCM] A.2.2 Formatting of the Associated Data, the encoding of its length first */
+      l->a_length = aes_ccm_format_ad_length(l->first, l->frame->ad_length);
+      for (k = l->a_length; k < 16; k++) {
+        l->first[k] = (size_t)(k - l->a_length) < l->frame->ad_length ? ((const unsigned char *)l->frame->ad)[k - l->a_length] : 0;
+      }
+      l->ad_blocks = l->frame->ad_length / 16 + (l->a_length + l->frame->ad_length % 16 + 15) / 16;
+      l->mac_blocks = 0;
+      l->ctr_blocks = 0;
+    }
+    aes_ccm_encrypt_slots(slots, (int)(slot - slots));
+
+    /* The associated data and the payload, one block of each frame at a time */
+    for (;;) {
+      slot = slots;
+      for (j = 0; j < count; j++) {
+        l = lanes + j;
+        l->step = 0;
+        m = l->mac_blocks;
+        if (m < l->ad_blocks || (16 * (m - l->ad_blocks) < l->length && (!decrypt || m - l->ad_blocks < l->ctr_blocks))) {
+          /* Yi = CIPHk(Bi xor Yi-1), with the next block of the associated data or of the payload */
+          slot->key = l->frame->key;
+          slot->a = l->y;
+          slot->b = aes_ccm_lane_block(l, m, decrypt);
+          slot->output = l->y;
+          slot->input = NULL;
+          slot++;
+          l->step = 1;
+          m++;
+        }
+        offset = 16 * l->ctr_blocks;
+        if (offset < l->length && (decrypt || l->ad_blocks + l->ctr_blocks < m)) {
+          /* C = P xor MSBplen(S), or P = C xor MSBplen(S), for the next block of the payload */
+          slot->key = l->frame->key;
+          slot->a = l->counter;
+          slot->b = NULL;
+          slot->output = (unsigned char *)l->frame->output + offset;
+          slot->input = (const unsigned char *)l->frame->input + offset;
+          slot->length = l->length - offset < 16 ? (int)(l->length - offset) : 16;
+          slot++;
+          l->step |= 2;
+        }
+      }
+      if (slot == slots) {
+        break;
+      }
+
+      aes_ccm_encrypt_slots(slots, (int)(slot - slots));
+
+      for (j = 0; j < count; j++) {
+        l = lanes + j;
+        l->mac_blocks += l->step & 1;
+        if (l->step & 2) {
+          aes_ctr_increment(l->counter, 15 - l->ctx.nonce_length);
+          l->ctr_blocks++;
+        }
+      }
+    }
+
+    /* T = MSBtlen(Yr), encrypted with S0, appended or verified */
+    for (j = 0; j < count; j++) {
+      l = lanes + j;
+      l->frame->result = 0;
+      if (!decrypt) {
+        for (k = 0; k < l->frame->mac_length; k++) {
+          ((unsigned char *)l->frame->output)[l->length + k] = l->y[k] ^ l->s0[k];
+        }
+        continue;
+      }
+      data = (const unsigned char *)l->frame->input + l->length;
+      for (diff = 0, k = 0; k < l->frame->mac_length; k++) {
+        diff |= l->y[k] ^ l->s0[k] ^ data[k];
+      }
+      if (diff) {
+        for (offset = 0; offset < l->length; offset++) {
+          ((unsigned char *)l->frame->output)[offset] = 0;
+        }
+        l->frame->result = -1;
+        failed++;
+      }
+    }
+  }
+
+  return failed;
+}
+
+/*
+ * Performs the AES-CCM generation-encryption process for many frames,
+ * each with its own key, such as the frames sent to the devices of a network.
+ * frames: pointer to the array of frames, each with its key, nonce,
+ *         nonce_length, ad, ad_length, input (the payload), input_length,
+ *         output (for the ciphertext with the encrypted MAC) and mac_length
+ * n: number of frames
+ *
+ * Processes more short frames per second than calling
+ * aes_ccm_encrypt_ctx() for each of them.
+ * Returns the number of frames that failed because the length of the MAC
+ * or of the nonce is not valid, or the payload is too long for the length
+ * of the nonce, whose result is set to -1 (and which are not encrypted),
+ * or 0 for the others.
+ *
+ * [CCM] 6.1 Generation-Encryption Process
+ */
+static int aes_ccm_encrypt_batch(struct aes_ccm_frame *frames, int n) {
+  return aes_ccm_batch(frames, n, 0);
+}
+
+/*
+ * Performs the AES-CCM decryption-validation process for many frames,
+ * each with its own key, such as the frames received from the devices
+ * of a network.
+ * frames: pointer to the array of frames, each with its key, nonce,
+ *         nonce_length, ad, ad_length, input (the ciphertext with the
+ *         encrypted MAC), input_length, output (for the payload) and mac_length
+ * n: number of frames
+ *
+ * Returns the number of frames that failed, whose result is set to -1,
+ * or 0 for the others. The payload of a frame whose MAC does not verify
+ * is overwritten with zeros, and a frame whose lengths are not valid
+ * is not decrypted.
+ *
+ * [CCM] 6.2 Decryption-Validation Process
+ */
+static int aes_ccm_decrypt_batch(struct aes_ccm_frame *frames, int n) {
+  return aes_ccm_batch(frames, n, 1);
+}
@@ -0,0 +1,217 @@
+/*
+ * aes-ctr.h: Advanced Encryption Standard Counter (AES-CTR) mode
+ *
+ * https://github.com/andrebdo/c-crumbs/blob/master/aes-ctr.h
+ *
+ * This is free and unencumbered software released into the public domain.
+ * For more information, please refer to UNLICENSE or http://unlicense.org
+ */
+
+/*
+ * Implements the Counter (CTR) mode encryption and decryption for 128-bit keys.
+ * It is also used by the AES-GCM and AES-CCM modes in aes-gcm.h and aes-ccm.h.
+ *
+ * Uses the aes_encrypt_blocks function in aes.h, so you need to include that too:
+ * #include "aes.h"
+ * #include "aes-ctr.h"
+ *
+ * References:
+ * [CTR] Recommendation for Block Cipher Modes of Operation: Methods and Techniques,
+ *       NIST Special Publication 800-38A, December 2001
+ *       http://nvlpubs.nist.gov/nistpubs/Legacy/SP/nistspecialpublication800-38a.pdf
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#ifdef AES_AESNI
+#include <tmmintrin.h>
+#endif
+
+/*
+ * Increments the counter part of a counter block (the counter_bytes
+ * least significant bytes, as a big-endian number modulo 2^(8*counter_bytes)).
+ *
+ * [CTR] B.1 The Standard Incrementing Function
+ */
+static void aes_ctr_increment(unsigned char *counter, int counter_bytes) {
+  int i;
+
+  for (i = 15; i >= 16 - counter_bytes; i--) {
+    if (++counter[i]) {
+      break;
+    }
+  }
+}
+
+#ifdef AES_AESNI
+
+/*
+ * Encrypts or decrypts whole blocks with the AES-NI instructions, keeping
+ * the counter blocks in registers and interleaving the rounds of 8 blocks.
+ * Stops early, before the counter would carry out of its 32 least
+ * significant bits (or out of the counter bytes if there are less than 4),
+ * and leaves those blocks to aes_ctr().
+ * Returns the number of blocks processed.
+ */
+__attribute__((target("aes,sse2,ssse3")))
+static size_t aes_ctr_aesni(unsigned char *output, const unsigned char *input, size_t n, unsigned char *counter, int counter_bytes, const struct aes_key *ctx) {
+  const __m128i *rk = (const __m128i *)ctx->round_keys;
+  const __m128i *in = (const __m128i *)input;
+  __m128i *out = (__m128i *)output;
+  const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i ctr;  /* the counter block with its bytes reversed, so that its last 4 bytes are a 32-bit integer */
+  __m128i k, b0, b1, b2, b3, b4, b5, b6, b7;
+  unsigned c, max;
+  size_t done;
+  int round;
+
+  max = counter_bytes >= 4 ? 0xffffffff : (1u << (8 * counter_bytes)) - 1;
+  ctr = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)counter), swap);
+  c = (unsigned)_mm_cvtsi128_si32(ctr) & max;
+
+  for (done = 0; n - done >= 8 && max - c >= 8; done += 8) {
+    k = _mm_loadu_si128(rk);
+    b0 = _mm_xor_si128(_mm_shuffle_epi8(ctr, swap), k);
+    b1 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 1)), swap), k);
+    b2 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 2)), swap), k);
+    b3 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 3)), swap), k);
+    b4 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 4)), swap), k);
+    b5 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 5)), swap), k);
+    b6 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 6)), swap), k);
+    b7 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 7)), swap), k);
+    ctr = _mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 8));
+    c += 8;
+    for (round = 1; round < 10; round++) {
+      k = _mm_loadu_si128(rk + round);
+      b0 = _mm_aesenc_si128(b0, k);
+      b1 = _mm_aesenc_si128(b1, k);
+      b2 = _mm_aesenc_si128(b2, k);
+      b3 = _mm_aesenc_si128(b3, k);
+      b4 = _mm_aesenc_si128(b4, k);
+      b5 = _mm_aesenc_si128(b5, k);
+      b6 = _mm_aesenc_si128(b6, k);
+      b7 = _mm_aesenc_si128(b7, k);
+    }
+    k = _mm_loadu_si128(rk + 10);
+    _mm_storeu_si128(out + 0, _mm_xor_si128(_mm_aesenclast_si128(b0, k), _mm_loadu_si128(in + 0)));
+    _mm_storeu_si128(out + 1, _mm_xor_si128(_mm_aesenclast_si128(b1, k), _mm_loadu_si128(in + 1)));
+    _mm_storeu_si128(out + 2, _mm_xor_si128(_mm_aesenclast_si128(b2, k), _mm_loadu_si128(in + 2)));
+    _mm_storeu_si128(out + 3, _mm_xor_si128(_mm_aesenclast_si128(b3, k), _mm_loadu_si128(in + 3)));
+    _mm_storeu_si128(out + 4, _mm_xor_si128(_mm_aesenclast_si128(b4, k), _mm_loadu_si128(in + 4)));
+    _mm_storeu_si128(out + 5, _mm_xor_si128(_mm_aesenclast_si128(b5, k), _mm_loadu_si128(in + 5)));
+    _mm_storeu_si128(out + 6, _mm_xor_si128(_mm_aesenclast_si128(b6, k), _mm_loadu_si128(in + 6)));
+    _mm_storeu_si128(out + 7, _mm_xor_si128(_mm_aesenclast_si128(b7, k), _mm_loadu_si128(in + 7)));
+    in += 8;
+    out += 8;
+  }
+
+  /* The rest, 4 blocks at a time for short messages, then 1 */
+  for (; n - done >= 4 && max - c >= 4; done += 4) {
+    k = _mm_loadu_si128(rk);
+    b0 = _mm_xor_si128(_mm_shuffle_epi8(ctr, swap), k);
+    b1 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 1)), swap), k);
+    b2 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 2)), swap), k);
+    b3 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 3)), swap), k);
+    ctr = _mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 4));
+    c += 4;
+    for (round = 1; round < 10; round++) {
+      k = _mm_loadu_si128(rk + round);
+      b0 = _mm_aesenc_si128(b0, k);
+      b1 = _mm_aesenc_si128(b1, k);
+      b2 = _mm_aesenc_si128(b2, k);
+      b3 = _mm_aesenc_si128(b3, k);
+    }
+    k = _mm_loadu_si128(rk + 10);
+    _mm_storeu_si128(out + 0, _mm_xor_si128(_mm_aesenclast_si128(b0, k), _mm_loadu_si128(in + 0)));
+    _mm_storeu_si128(out + 1, _mm_xor_si128(_mm_aesenclast_si128(b1, k), _mm_loadu_si128(in + 1)));
+    _mm_storeu_si128(out + 2, _mm_xor_si128(_mm_aesenclast_si128(b2, k), _mm_loadu_si128(in + 2)));
+    _mm_storeu_si128(out + 3, _mm_xor_si128(_mm_aesenclast_si128(b3, k), _mm_loadu_si128(in + 3)));
+    in += 4;
+    out += 4;
+  }
+
+  for (; n - done >= 1 && max - c >= 1; done++) {
+    b0 = _mm_xor_si128(_mm_shuffle_epi8(ctr, swap), _mm_loadu_si128(rk));
+    for (round = 1; round < 10; round++) {
+      b0 = _mm_aesenc_si128(b0, _mm_loadu_si128(rk + round));
+    }
+    b0 = _mm_aesenclast_si128(b0, _mm_loadu_si128(rk + 10));
+    _mm_storeu_si128(out++, _mm_xor_si128(b0, _mm_loadu_si128(in++)));
+    ctr = _mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 1));
+    c++;
+  }
+
+  _mm_storeu_si128((__m128i *)counter, _mm_shuffle_epi8(ctr, swap));
+  return done;
+}
+
+#endif
+
+/*
+ * Encrypts or decrypts data in Counter (CTR) mode.
+ * output: pointer to length bytes of memory to store the ciphertext/plaintext
+ * input: pointer to the plaintext/ciphertext
+ * length: number of bytes of the input
+ * counter: pointer to the 16-byte counter block of the first input block,
+ *          updated to the counter block that follows the last input block
+ *          (so that consecutive calls continue the same key stream, as long
+ *          as all but the last one have a length multiple of 16)
+ * counter_bytes: number of least significant bytes of the counter block that
+ *                are incremented for each block, from 1 to 16
+ *                (4 for the inc32 function of AES-GCM)
+ * ctx: pointer to the key expanded by aes_expand_key()
+ *
+ * The output may overlap the input only if they are at the same address.
+ * Up to 8 counter blocks are generated and encrypted together, and the
+ * last partial block is handled once, at the end.
+ *
+ * [CTR] 6.5 The Counter Mode
+ */
+static AES_UNUSED void aes_ctr(void *output, const void *input, size_t length, void *counter, int counter_bytes, const struct aes_key *ctx) {
+  unsigned char *out = (unsigned char *)output;
+  const unsigned char *in = (const unsigned char *)input;
+  unsigned char *cb = (unsigned char *)counter;
+  unsigned char x[8 * 16];  /* up to 8 counter blocks, encrypted together */
+  unsigned long a, b;
+  size_t i, n;
+  int j;
+
+  while (length > 0) {
+#ifdef AES_AESNI
+    if (ctx->backend == AES_BACKEND_AESNI) {
+      n = aes_ctr_aesni(out, in, length / 16, cb, counter_bytes, ctx) * 16;
+      out += n;
+      in += n;
+      length -= n;
+      if (length == 0) {
+        break;
+      }
+    }
+#endif
+    /* Tj = the next counter blocks */
+    n = length < sizeof(x) ? length : sizeof(x);
+    for (i = 0; i < n; i += 16) {
+      for (j = 0; j < 16; j++) {
+        x[i + j] = cb[j];
+      }
+      aes_ctr_increment(cb, counter_bytes);
+    }
+    /* Oj = CIPHk(Tj) */
+    aes_encrypt_blocks(ctx, x, x, (int)((n + 15) / 16));
+    /* Cj = Pj xor Oj, a word at a time (memcpy() for any alignment) */
+    for (i = 0; i < (n & ~(size_t)15); i += sizeof(a)) {
+      memcpy(&a, in + i, sizeof(a));
+      memcpy(&b, x + i, sizeof(b));
+      a ^= b;
+      memcpy(out + i, &a, sizeof(a));
+    }
+    /* C*n = P*n xor MSBu(On) for the last partial block */
+    for (; i < n; i++) {
+      out[i] = in[i] ^ x[i];
+    }
+    out += n;
+    in += n;
+    length -= n;
+  }
+}
@@ -11,25 +11,69 @@
  * Implements the AES-GCM authenticated encryption and decryption functions
  * for 128-bit keys.
  *
- * Uses the aes_encrypt function in aes.h, so you need to include that too:
+ * Uses the aes_expand_key and aes_encrypt_block functions in aes.h,
+ * and the aes_ctr function in aes-ctr.h, so you need to include those too:
  * #include "aes.h"
+ * #include "aes-ctr.h"
  * #include "aes-gcm.h"
  *
+ * Messages that are not all in memory at once can be processed in parts
+ * with aes_gcm_init(), aes_gcm_aad(), aes_gcm_update() and aes_gcm_final().
+ *
+ * Without the PCLMULQDQ instruction, the GHASH function uses 4-bit tables
+ * indexed by the data, whose timing can leak it through the processor caches.
+ * With AES_CONSTANT_TIME defined, it uses carry-less multiplications built
+ * from masked 64-bit integer multiplications instead [CTMUL].
+ *
  * References:
  * [GCM] Recommendation for Block Cipher Modes of Operation:
  *       Galois/Counter Mode (GCM) and GMAC,
  *       NIST Special Publication 800-38D, November 2007
  *       http://csrc.nist.gov/publications/nistpubs/800-38D/SP-800-38D.pdf
+ * [SHOUP] V. Shoup, On Fast and Provably Secure Message Authentication
+ *         Based on Universal Hashing, CRYPTO 1996.
+ *         (the 4-bit tables are as described in the original GCM submission,
+ *         D. McGrew and J. Viega, The Galois/Counter Mode of Operation, 2005)
+ * [CLMUL] S. Gueron and M. E. Kounavis, Intel Carry-Less Multiplication
+ *         Instruction and its Usage for Computing the GCM Mode, Intel, 2010.
+ * [CTMUL] T. Pornin, Constant-Time Mul, BearSSL, 2017.
+ *         https://www.bearssl.org/constanttime.html#ghash-for-gcm
+ */
+
+#ifdef AES_AESNI
+#include <tmmintrin.h>
+#endif
+
+/*
+ * Holds an AES-GCM key, as computed by aes_gcm_expand_key():
+ * the expanded block cipher key and the tables to multiply by the hash subkey H.
  */
+struct aes_gcm_key {
+  struct aes_key aes;  /* the expanded block cipher key */
+  unsigned char h[16];  /* the hash subkey H */
+#ifdef AES_CONSTANT_TIME
+  unsigned long hw[2];  /* H as two 64-bit big-endian words */
+#else
+  unsigned m[16][4];  /* M[i] = i * H for each 4-bit i, as four 32-bit big-endian words */
+#endif
+#ifdef AES_AESNI
+  int clmul;  /* nonzero to use the PCLMULQDQ instruction */
+  unsigned char h_powers[4][16];  /* H, H^2, H^3 and H^4, with their bytes reversed */
+#endif
+};
 
 /*
  * Computes the multiplication of blocks X and Y and stores the result in X.
  * x: pointer to 16 bytes (128 bits) of memory with X
  * y: pointer to 16 bytes (128 bits) of memory with Y
  *
+ * This is the straightforward bit by bit algorithm of the specification,
+ * kept as a reference and for the few multiplications by other values than H:
+ * the GHASH function uses aes_gcm_mul_h() instead.
+ *
  * [GCM] 6.3 Multiplication Operation on Blocks
  */
-static void aes_gcm_mul(void *x, const void *y) {
+static AES_UNUSED void aes_gcm_mul(void *x, const void *y) {
   unsigned char z[16];
   unsigned char v[16];
   unsigned char lsb1;
@@ -70,198 +114,1647 @@ static void aes_gcm_mul(void *x, const void *y) {
   }
 }
 
+#ifdef AES_CONSTANT_TIME
+
 /*
- * Calculates an authentication tag.
- * tag: pointer to 16 bytes (128 bits) of memory to store the calculated tag
- * iv: pointer to the initialization vector (12 bytes (96 bits))
- * aad: pointer to the additional authenticated data
- * aad_length: number of bytes of the additional authenticated data
- * text: pointer to the text (plaintext or ciphertext)
- * text_length: number of bytes of the text
- * key: pointer to the encryption key (16 bytes (128 bits))
+ * Computes the 64 least significant bits of the carry-less product of x and y.
  *
- * Used internally by the aes_gcm_encrypt and aes_gcm_decrypt functions.
- * Can also be called externally to calculate just a GMAC:
- * aes_gcm_tag(gmac, iv, aad, aad_length, NULL, 0, key)
+ * [CTMUL] Each integer multiplication only has 1 bit set every 4 bits in its
+ * operands, so the carries of its 16 sums of 4 bits never reach the next
+ * bit that is kept: the result is the same as with carry-less multiplications.
+ */
+static unsigned long aes_gcm_bmul64(unsigned long x, unsigned long y) {
+  const unsigned long m0 = 0x1111111111111111UL;
+  const unsigned long m1 = 0x2222222222222222UL;
+  const unsigned long m2 = 0x4444444444444444UL;
+  const unsigned long m3 = 0x8888888888888888UL;
+  unsigned long x0, x1, x2, x3, y0, y1, y2, y3, z0, z1, z2, z3;
+
+  x0 = x & m0;
+  x1 = x & m1;
+  x2 = x & m2;
+  x3 = x & m3;
+  y0 = y & m0;
+  y1 = y & m1;
+  y2 = y & m2;
+  y3 = y & m3;
+  z0 = (x0 * y0) ^ (x1 * y3) ^ (x2 * y2) ^ (x3 * y1);
+  z1 = (x0 * y1) ^ (x1 * y0) ^ (x2 * y3) ^ (x3 * y2);
+  z2 = (x0 * y2) ^ (x1 * y1) ^ (x2 * y0) ^ (x3 * y3);
+  z3 = (x0 * y3) ^ (x1 * y2) ^ (x2 * y1) ^ (x3 * y0);
+  return (z0 & m0) | (z1 & m1) | (z2 & m2) | (z3 & m3);
+}
+
+/*
+ * Reverses the order of the bits of a 64-bit word.
+ */
+static unsigned long aes_gcm_rev64(unsigned long x) {
+  x = (x & 0x5555555555555555UL) << 1 | (x >> 1 & 0x5555555555555555UL);
+  x = (x & 0x3333333333333333UL) << 2 | (x >> 2 & 0x3333333333333333UL);
+  x = (x & 0x0f0f0f0f0f0f0f0fUL) << 4 | (x >> 4 & 0x0f0f0f0f0f0f0f0fUL);
+  x = (x & 0x00ff00ff00ff00ffUL) << 8 | (x >> 8 & 0x00ff00ff00ff00ffUL);
+  x = (x & 0x0000ffff0000ffffUL) << 16 | (x >> 16 & 0x0000ffff0000ffffUL);
+  return x << 32 | x >> 32;
+}
+
+/*
+ * Loads 8 bytes as a 64-bit big-endian word.
+ */
+static unsigned long aes_gcm_load64(const unsigned char *p) {
+  return (unsigned long)p[0] << 56 | (unsigned long)p[1] << 48 | (unsigned long)p[2] << 40 | (unsigned long)p[3] << 32
+    | (unsigned long)p[4] << 24 | (unsigned long)p[5] << 16 | (unsigned long)p[6] << 8 | p[7];
+}
+
+/*
+ * Computes the multiplication of blocks X and Y, with Y as two 64-bit
+ * big-endian words, and stores the result in X, taking the same time
+ * whatever their values.
+ * x: pointer to 16 bytes (128 bits) of memory with X
+ * y: the 64 first and 64 last bits of Y
  *
- * [GCM] 6.4 GHASH Function
- * [GCM] 6.5 GCTR Function
- * [GCM] 7.1 Algorithm for the Authenticated Encryption Function
+ * [CTMUL] The bits of the blocks are reflected, so the 128 least significant
+ * bits of the 256-bit product come from the products of the words, and the
+ * 128 most significant bits from the products of the reversed words.
+ * Karatsuba: 3 products of 64-bit words instead of 4 for each half.
+ * The product is then shifted left by 1 bit and reduced modulo
+ * x^128 + x^7 + x^2 + x + 1.
+ */
+static void aes_gcm_mul_ct(unsigned char *x, const unsigned long *y) {
+  unsigned long x0, x1, x2, x0r, x1r, x2r, y0, y1, y2, y0r, y1r, y2r;
+  unsigned long z0, z1, z2, z0h, z1h, z2h, v0, v1, v2, v3;
+  int i;
+
+  x1 = aes_gcm_load64(x);
+  x0 = aes_gcm_load64(x + 8);
+  y1 = y[0];
+  y0 = y[1];
+  x2 = x0 ^ x1;
+  y2 = y0 ^ y1;
+  x0r = aes_gcm_rev64(x0);
+  x1r = aes_gcm_rev64(x1);
+  x2r = x0r ^ x1r;
+  y0r = aes_gcm_rev64(y0);
+  y1r = aes_gcm_rev64(y1);
+  y2r = y0r ^ y1r;
+
+  z0 = aes_gcm_bmul64(x0, y0);
+  z1 = aes_gcm_bmul64(x1, y1);
+  z2 = aes_gcm_bmul64(x2, y2);
+  z0h = aes_gcm_bmul64(x0r, y0r);
+  z1h = aes_gcm_bmul64(x1r, y1r);
+  z2h = aes_gcm_bmul64(x2r, y2r);
+  z2 ^= z0 ^ z1;
+  z2h ^= z0h ^ z1h;
+  z0h = aes_gcm_rev64(z0h) >> 1;
+  z1h = aes_gcm_rev64(z1h) >> 1;
+  z2h = aes_gcm_rev64(z2h) >> 1;
+
+  /* The 256-bit product v3:v2:v1:v0, shifted left by 1 bit */
+  v0 = z0;
+  v1 = z0h ^ z2;
+  v2 = z1 ^ z2h;
+  v3 = z1h;
+  v3 = v3 << 1 | v2 >> 63;
+  v2 = v2 << 1 | v1 >> 63;
+  v1 = v1 << 1 | v0 >> 63;
+  v0 = v0 << 1;
+
+  /* Reduce */
+  v2 ^= v0 ^ v0 >> 1 ^ v0 >> 2 ^ v0 >> 7;
+  v1 ^= v0 << 63 ^ v0 << 62 ^ v0 << 57;
+  v3 ^= v1 ^ v1 >> 1 ^ v1 >> 2 ^ v1 >> 7;
+  v2 ^= v1 << 63 ^ v1 << 62 ^ v1 << 57;
+
+  for (i = 0; i < 8; i++) {
+    x[i] = v3 >> (56 - 8 * i);
+    x[i + 8] = v2 >> (56 - 8 * i);
+  }
+}
+
+#endif
+
+#ifdef AES_AESNI
+
+/*
+ * Checks if the processor supports the PCLMULQDQ instruction
+ * (and the SSE2 and SSSE3 instructions used along with it).
+ * Returns nonzero if it does, or 0 if it doesn't.
+ */
+static int aes_gcm_has_clmul(void) {
+  static int has_clmul = -1;  /* not checked yet */
+  unsigned eax, ebx, ecx, edx;
+  int has;
+
+  /* Threads may check at the same time: each stores the same value, atomically */
+  has = __atomic_load_n(&has_clmul, __ATOMIC_RELAXED);
+  if (has < 0) {
+    has = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL) && (ecx & bit_SSSE3) && (edx & bit_SSE2);
+    __atomic_store_n(&has_clmul, has, __ATOMIC_RELAXED);
+  }
+  return has;
+}
+
+/*
+ * Reduces a 256-bit carry-less product hi:mid:lo, where mid overlaps
+ * the 64 most significant bits of lo and the 64 least significant bits of hi,
+ * to the 128-bit result of the multiplication in GF(2^128).
+ *
+ * The blocks have their bytes reversed, so the bits of the product are
+ * reflected: it is shifted left by 1 bit and reduced modulo
+ * x^128 + x^7 + x^2 + x + 1 as in [CLMUL] Algorithm 5.
+ */
+__attribute__((target("pclmul,sse2")))
+static __m128i aes_gcm_clmul_reduce(__m128i lo, __m128i mid, __m128i hi) {
+  __m128i t, u, v;
+
+  lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+  hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+  /* Shift hi:lo left by 1 bit */
+  t = _mm_srli_epi32(lo, 31);
+  u = _mm_srli_epi32(hi, 31);
+  lo = _mm_slli_epi32(lo, 1);
+  hi = _mm_slli_epi32(hi, 1);
+  v = _mm_srli_si128(t, 12);
+  u = _mm_slli_si128(u, 4);
+  t = _mm_slli_si128(t, 4);
+  lo = _mm_or_si128(lo, t);
+  hi = _mm_or_si128(hi, u);
+  hi = _mm_or_si128(hi, v);
+
+  /* Reduce: first phase */
+  t = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+  u = _mm_srli_si128(t, 4);
+  lo = _mm_xor_si128(lo, _mm_slli_si128(t, 12));
+
+  /* Reduce: second phase */
+  t = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+  t = _mm_xor_si128(t, u);
+  lo = _mm_xor_si128(lo, t);
+  return _mm_xor_si128(hi, lo);
+}
+
+/*
+ * Accumulates the 256-bit carry-less product of a and b into hi:mid:lo.
+ */
+#define AES_GCM_CLMUL(a, b, lo, mid, hi) do { \
+    lo = _mm_xor_si128(lo, _mm_clmulepi64_si128(a, b, 0x00)); \
+    mid = _mm_xor_si128(mid, _mm_clmulepi64_si128(a, b, 0x01)); \
+    mid = _mm_xor_si128(mid, _mm_clmulepi64_si128(a, b, 0x10)); \
+    hi = _mm_xor_si128(hi, _mm_clmulepi64_si128(a, b, 0x11)); \
+  } while (0)
+
+/*
+ * Computes the powers H, H^2, H^3 and H^4 of the hash subkey.
+ * ctx: pointer to the aes_gcm_key structure to store them
+ * h: pointer to 16 bytes (128 bits) of memory with H
+ */
+__attribute__((target("pclmul,sse2,ssse3")))
+static void aes_gcm_expand_key_clmul(struct aes_gcm_key *ctx, const unsigned char *h) {
+  const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i h1, hn, lo, mid, hi;
+  int i;
+
+  h1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)h), swap);
+  hn = h1;
+  _mm_storeu_si128((__m128i *)ctx->h_powers[0], hn);
+  for (i = 1; i < 4; i++) {
+    lo = mid = hi = _mm_setzero_si128();
+    AES_GCM_CLMUL(hn, h1, lo, mid, hi);
+    hn = aes_gcm_clmul_reduce(lo, mid, hi);
+    _mm_storeu_si128((__m128i *)ctx->h_powers[i], hn);
+  }
+}
+
+/*
+ * Implements aes_gcm_ghash() with the PCLMULQDQ instruction.
+ *
+ * Groups of 4 blocks are folded with a single reduction ([CLMUL] Algorithm 6):
+ * Y4 = (Y0 ^ X1) * H^4 ^ X2 * H^3 ^ X3 * H^2 ^ X4 * H
+ */
+__attribute__((target("pclmul,sse2,ssse3")))
+static void aes_gcm_ghash_clmul(const struct aes_gcm_key *ctx, void *y, const void *data, size_t length) {
+  const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  const unsigned char *p = (const unsigned char *)data;
+  const __m128i h1 = _mm_loadu_si128((const __m128i *)ctx->h_powers[0]);
+  const __m128i h2 = _mm_loadu_si128((const __m128i *)ctx->h_powers[1]);
+  const __m128i h3 = _mm_loadu_si128((const __m128i *)ctx->h_powers[2]);
+  const __m128i h4 = _mm_loadu_si128((const __m128i *)ctx->h_powers[3]);
+  unsigned char last[16];  /* the last partial block, zero-padded */
+  __m128i z, x, lo, mid, hi;
+  size_t i;
+
+  z = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)y), swap);
+
+  for (; length >= 64; length -= 64, p += 64) {
+    lo = mid = hi = _mm_setzero_si128();
+    x = _mm_xor_si128(z, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), swap));
+    AES_GCM_CLMUL(x, h4, lo, mid, hi);
+    x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), swap);
+    AES_GCM_CLMUL(x, h3, lo, mid, hi);
+    x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), swap);
+    AES_GCM_CLMUL(x, h2, lo, mid, hi);
+    x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), swap);
+    AES_GCM_CLMUL(x, h1, lo, mid, hi);
+    z = aes_gcm_clmul_reduce(lo, mid, hi);
+  }
+
+  for (; length > 0; length -= 16, p += 16) {
+    if (length >= 16) {
+      x = _mm_loadu_si128((const __m128i *)p);
+    } else {
+      for (i = 0; i < 16; i++) {
+        last[i] = i < length ? p[i] : 0;
+      }
+      x = _mm_loadu_si128((const __m128i *)last);
+      length = 16;
+    }
+    x = _mm_xor_si128(z, _mm_shuffle_epi8(x, swap));
+    lo = mid = hi = _mm_setzero_si128();
+    AES_GCM_CLMUL(x, h1, lo, mid, hi);
+    z = aes_gcm_clmul_reduce(lo, mid, hi);
+  }
+
+  _mm_storeu_si128((__m128i *)y, _mm_shuffle_epi8(z, swap));
+}
+
+#endif
+
+/*
+ * Expands an AES-GCM key: the block cipher key, the hash subkey H
+ * and the table of its multiples used by aes_gcm_mul_h()
+ * (or only H as two 64-bit words if AES_CONSTANT_TIME is defined).
+ * ctx: pointer to the aes_gcm_key structure to store the expanded key
+ * key: pointer to the 16-byte (128-bit) key
+ *
+ * [SHOUP] 4-bit tables: the bits of each 4-bit index i are the coefficients
+ * of x^0 to x^3 (the most significant bit is x^0), so M[8] = H,
+ * M[4] = H * x, M[2] = H * x^2, M[1] = H * x^3, and the other entries
+ * are sums of these.
+ * With the PCLMULQDQ instruction, computes the powers of H that it uses instead.
  */
-static void aes_gcm_tag(void *tag, const void *iv, const void *aad, int aad_length, const void *text, int text_length, const void *key) {
+static void aes_gcm_expand_key(struct aes_gcm_key *ctx, const void *key) {
   unsigned char h[16];  /* the hash subkey */
-  unsigned char j0[16];  /* the pre-counter block */
-  int i, j;
+#ifndef AES_CONSTANT_TIME
+  unsigned *m;
+  int j;
+#endif
+  int i;
+
+  aes_expand_key(&ctx->aes, key);
 
   /* [GCM] 7.1 Step 1. H = CIPH_K(0^128) */
   for (i = 0; i < 16; i++) {
     h[i] = 0;
   }
-  aes_encrypt(h, h, key);
-
-  /* [GCM] 7.1 Step 5. S = GHASH_H(A || 0^v || C || 0^u || len(A)64 || len(C)64) */
+  aes_encrypt_block(&ctx->aes, h, h);
   for (i = 0; i < 16; i++) {
-    ((unsigned char *)tag)[i] = 0;
+    ctx->h[i] = h[i];
+  }
+
+#ifdef AES_CONSTANT_TIME
+  ctx->hw[0] = aes_gcm_load64(h);
+  ctx->hw[1] = aes_gcm_load64(h + 8);
+#else
+  for (j = 0; j < 4; j++) {
+    ctx->m[0][j] = 0;
+    ctx->m[8][j] = (unsigned)h[4 * j] << 24 | (unsigned)h[4 * j + 1] << 16 | (unsigned)h[4 * j + 2] << 8 | h[4 * j + 3];
   }
-  for (i = 0; i < aad_length; i += 16) {
-    for (j = 0; j < 16 && i + j < aad_length; j++) {
-      ((unsigned char *)tag)[j] ^= ((unsigned char *)aad)[i + j];
+  /* [GCM] 6.3 Vi+1 = (Vi >> 1) ^ R if LSB1(Vi) = 1 */
+  for (i = 4; i > 0; i >>= 1) {
+    m = ctx->m[i];
+    m[0] = ctx->m[2 * i][0] >> 1;
+    m[1] = ctx->m[2 * i][1] >> 1 | ctx->m[2 * i][0] << 31;
+    m[2] = ctx->m[2 * i][2] >> 1 | ctx->m[2 * i][1] << 31;
+    m[3] = ctx->m[2 * i][3] >> 1 | ctx->m[2 * i][2] << 31;
+    if (ctx->m[2 * i][3] & 1) {
+      m[0] ^= 0xe1000000;  /* R = 11100001 || 0^120 */
     }
-    aes_gcm_mul(tag, h);
   }
-  for (i = 0; i < text_length; i += 16) {
-    for (j = 0; j < 16 && i + j < text_length; j++) {
-      ((unsigned char *)tag)[j] ^= ((unsigned char *)text)[i + j];
+  for (i = 2; i < 16; i <<= 1) {
+    for (j = 1; j < i; j++) {
+      ctx->m[i + j][0] = ctx->m[i][0] ^ ctx->m[j][0];
+      ctx->m[i + j][1] = ctx->m[i][1] ^ ctx->m[j][1];
+      ctx->m[i + j][2] = ctx->m[i][2] ^ ctx->m[j][2];
+      ctx->m[i + j][3] = ctx->m[i][3] ^ ctx->m[j][3];
     }
-    aes_gcm_mul(tag, h);
   }
-  /*
-  ((unsigned char *)tag)[0] ^= aad_length >> 53;
-  ((unsigned char *)tag)[1] ^= aad_length >> 45;
-  ((unsigned char *)tag)[2] ^= aad_length >> 37;
-  */
-  ((unsigned char *)tag)[3] ^= aad_length >> 29;
-  ((unsigned char *)tag)[4] ^= aad_length >> 21;
-  ((unsigned char *)tag)[5] ^= aad_length >> 13;
-  ((unsigned char *)tag)[6] ^= aad_length >> 5;
-  ((unsigned char *)tag)[7] ^= aad_length << 3;
-  /*
-  ((unsigned char *)tag)[8] ^= text_length >> 53;
-  ((unsigned char *)tag)[9] ^= text_length >> 45;
-  ((unsigned char *)tag)[10] ^= text_length >> 37;
-  */
-  ((unsigned char *)tag)[11] ^= text_length >> 29;
-  ((unsigned char *)tag)[12] ^= text_length >> 21;
-  ((unsigned char *)tag)[13] ^= text_length >> 13;
-  ((unsigned char *)tag)[14] ^= text_length >> 5;
-  ((unsigned char *)tag)[15] ^= text_length << 3;
-  aes_gcm_mul(tag, h);
+#endif
 
-  /* [GCM] 7.1 Step 6. T = MSBt(GCTRk(J0,S)) */
-  for (i = 0; i < 12; i++) {
-    j0[i] = ((unsigned char *)iv)[i];
-  }
-  j0[12] = 0;
-  j0[13] = 0;
-  j0[14] = 0;
-  j0[15] = 1;
-  aes_encrypt(j0, j0, key);
-  for (i = 0; i < 16; i++) {
-    ((unsigned char *)tag)[i] ^= j0[i];
+#ifdef AES_AESNI
+  ctx->clmul = aes_gcm_has_clmul();
+  if (ctx->clmul) {
+    aes_gcm_expand_key_clmul(ctx, h);
   }
+#endif
 }
 
 /*
- * Implements the steps that are common to the encryption and decryption:
- * steps 2 and 3 of the authenticated encryption function and
- * steps 3 and 4 of the authenticated decryption function.
- * 
- * output: pointer to input_length bytes of memory to store the ciphertext/plaintext
- * iv: pointer to the 12-byte (96-bit) initialization vector
- * input: pointer to the plaintext/ciphertext
- * input_length: number of bytes of the input
- * aad: pointer to the additional authenticated data
- * aad_length: number of bytes of the additional authenticated data
- * key: pointer to the 16-byte (128-bit) key
+ * Computes the multiplication of the block X by the hash subkey H
+ * and stores the result in X.
+ * ctx: pointer to the key expanded by aes_gcm_expand_key()
+ * x: pointer to 16 bytes (128 bits) of memory with X
  *
- * [GCM] 7.1 Algorithm for the Authenticated Encryption Function
- * [GCM] 7.2 Algorithm for the Authenticated Decryption Function
+ * Uses [SHOUP] 4-bit tables: Horner's rule on the 32 4-bit digits of X,
+ * from the highest degree (the last digit) to the lowest one,
+ * multiplying by x^4 between them.
+ * With AES_CONSTANT_TIME defined, uses aes_gcm_mul_ct() instead.
+ *
+ * [GCM] 6.3 Multiplication Operation on Blocks
  */
-static void aes_gcm_encrypt_or_decrypt(void *output, const void *iv, const void *input, int input_length, const void *key) {
-  unsigned char cb[16];  /* the counter block CBi */
-  unsigned counter;
-  int i, m;
-
-  /* J0 = IV || 0^31 || 1 */
-  for (i = 0; i < 12; i++) {
-    cb[i] = ((unsigned char *)iv)[i];
-  }
-  counter = 1;
-
-  /* C = GCTR_K(inc32(J0), P) */
-  for (m = 0; m < input_length - 16; m += 16) {
-    /* [GCM] 6.5 GCTR Function, 5. For i = 2 to n, let CBi = inc32(CBi-1) */
-    counter++;
-    cb[12] = counter >> 24;
-    cb[13] = counter >> 16;
-    cb[14] = counter >> 8;
-    cb[15] = counter;
-    /* [GCM] 6.5 GCTR Function, 6. For i = 1 to n - 1, let Yi = Xi ^ CIPHk(CBi) */
-    aes_encrypt((unsigned char *)output + m, cb, key);
-    for (i = 0; i < 16; i++) {
-      ((unsigned char *)output)[m + i] ^= ((unsigned char *)input)[m + i];
+#ifdef AES_CONSTANT_TIME
+static void aes_gcm_mul_h(const struct aes_gcm_key *ctx, void *x) {
+  aes_gcm_mul_ct((unsigned char *)x, ctx->hw);
+}
+#else
+static void aes_gcm_mul_h(const struct aes_gcm_key *ctx, void *x) {
+  /* The reduction of the 4 bits shifted out by a multiplication by x^4 */
+  static const unsigned r4[16] = {
+    0x00000000, 0x1c200000, 0x38400000, 0x24600000, 0x70800000, 0x6ca00000, 0x48c00000, 0x54e00000,
+    0xe1000000, 0xfd200000, 0xd9400000, 0xc5600000, 0x91800000, 0x8da00000, 0xa9c00000, 0xb5e00000
+  };
+  unsigned char *p = (unsigned char *)x;
+  const unsigned *m;
+  unsigned z0, z1, z2, z3, rem;
+  int i;
+
+  m = ctx->m[p[15] & 15];
+  z0 = m[0];
+  z1 = m[1];
+  z2 = m[2];
+  z3 = m[3];
+  for (i = 31; i > 0; i--) {
+    /* Z = Z * x^4 + M[next digit] */
+    rem = z3 & 15;
+    z3 = z3 >> 4 | z2 << 28;
+    z2 = z2 >> 4 | z1 << 28;
+    z1 = z1 >> 4 | z0 << 28;
+    z0 = z0 >> 4 ^ r4[rem];
+    m = ctx->m[(i & 1) ? p[i >> 1] >> 4 : p[(i - 1) >> 1] & 15];
+    z0 ^= m[0];
+    z1 ^= m[1];
+    z2 ^= m[2];
+    z3 ^= m[3];
+  }
+
+  p[0] = z0 >> 24;
+  p[1] = z0 >> 16;
+  p[2] = z0 >> 8;
+  p[3] = z0;
+  p[4] = z1 >> 24;
+  p[5] = z1 >> 16;
+  p[6] = z1 >> 8;
+  p[7] = z1;
+  p[8] = z2 >> 24;
+  p[9] = z2 >> 16;
+  p[10] = z2 >> 8;
+  p[11] = z2;
+  p[12] = z3 >> 24;
+  p[13] = z3 >> 16;
+  p[14] = z3 >> 8;
+  p[15] = z3;
+}
+#endif
+
+/*
+ * Updates a GHASH value Y with data, zero-padded to a multiple of 16 bytes.
+ * ctx: pointer to the key expanded by aes_gcm_expand_key()
+ * y: pointer to 16 bytes (128 bits) of memory with Y
+ * data: pointer to the data
+ * length: number of bytes of the data
+ *
+ * [GCM] 6.4 GHASH Function, Step 3. Yi = (Yi-1 ^ Xi) * H
+ */
+static void aes_gcm_ghash(const struct aes_gcm_key *ctx, void *y, const void *data, size_t length) {
+  size_t i, j;
+
+#ifdef AES_AESNI
+  if (ctx->clmul) {
+    aes_gcm_ghash_clmul(ctx, y, data, length);
+    return;
+  }
+#endif
+
+  for (i = 0; i < length; i += 16) {
+    for (j = 0; j < 16 && i + j < length; j++) {
+      ((unsigned char *)y)[j] ^= ((unsigned char *)data)[i + j];
     }
+    aes_gcm_mul_h(ctx, y);
+  }
+}
+
+/*
+ * The maximum lengths, in bits, as 64-bit big-endian numbers:
+ * 2^64 - 1 for the additional authenticated data,
+ * and 2^39 - 256 for the text, so that the 32-bit counter does not wrap
+ * around to the pre-counter block J0.
+ *
+ * [GCM] 5.2.1.1 Input Data
+ */
+static const unsigned char aes_gcm_max_aad_bits[8] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+static const unsigned char aes_gcm_max_text_bits[8] = { 0x00, 0x00, 0x00, 0x7f, 0xff, 0xff, 0xff, 0x00 };
+
+/*
+ * Adds the number of bits of length bytes to a 64-bit big-endian bit length,
+ * like len(A)64 and len(C)64.
+ * bits: pointer to 8 bytes (64 bits) of memory with the bit length to update
+ * length: number of bytes to add
+ * max: pointer to 8 bytes (64 bits) of memory with the maximum bit length
+ *
+ * Works with any size of size_t, without 64-bit integers.
+ * Returns 0 on success, or -1 if the result would exceed max
+ * (and then the bit length is left unchanged).
+ */
+static int aes_gcm_add_bits(unsigned char *bits, size_t length, const unsigned char *max) {
+  unsigned char sum[8];
+  unsigned carry = 0;
+  unsigned add;
+  int i;
+
+  /* length * 8, 8 bits at a time from the least significant ones */
+  add = (unsigned)(length << 3) & 0xff;
+  length >>= 5;
+  for (i = 7; i >= 0; i--) {
+    carry += bits[i] + add;
+    sum[i] = (unsigned char)carry;
+    carry >>= 8;
+    add = (unsigned)length & 0xff;
+    length >>= 8;
+  }
+  if (carry || length) {
+    return -1;
+  }
+  for (i = 0; i < 8 && sum[i] == max[i]; i++) {
+  }
+  if (i < 8 && sum[i] > max[i]) {
+    return -1;
   }
-  /* [GCM] 6.5 GCTR Function, Step 7. Let Yn = Xn ^ MSBlen(Xn)(CIPHk(CBn)) */
-  counter++;
-  cb[12] = counter >> 24;
-  cb[13] = counter >> 16;
-  cb[14] = counter >> 8;
-  cb[15] = counter;
-  aes_encrypt(cb, cb, key);
-  for (i = 0; i < input_length - m; i++) {
-    ((unsigned char *)output)[m + i] = ((unsigned char *)input)[m + i] ^ cb[i];
+  for (i = 0; i < 8; i++) {
+    bits[i] = sum[i];
   }
+  return 0;
 }
 
 /*
- * Implements the AES-GCM authenticated encryption algorithm.
+ * Checks the length of an authentication tag: 16, 15, 14, 13 or 12 bytes,
+ * or 8 or 4 bytes for the applications that [GCM] Appendix C allows.
+ * Returns 0 if it is valid, or -1 if not.
  *
- * Outputs:
- * ciphertext: pointer to plaintext_length bytes of memory to store the ciphertext
- * tag: pointer to 16 bytes (128 bits) of memory to store the authentication tag
+ * [GCM] 5.2.1.2 Output Data
+ */
+static int aes_gcm_check_tag_length(int tag_length) {
+  return (tag_length >= 12 && tag_length <= 16) || tag_length == 8 || tag_length == 4 ? 0 : -1;
+}
+
+/*
+ * Completes the calculation of an authentication tag: hashes the lengths
+ * into the GHASH value in tag and encrypts it.
+ * tag: pointer to 16 bytes (128 bits) of memory with GHASH_H(A || 0^v || C || 0^u),
+ *      to store the calculated tag
+ * j0: pointer to the 16-byte (128-bit) pre-counter block J0
+ * lengths: pointer to the 16-byte (128-bit) block len(A)64 || len(C)64
+ * ctx: pointer to the key expanded by aes_gcm_expand_key()
  *
- * Inputs:
- * iv: pointer to the initialization vector (12 bytes (96 bits))
- * plaintext: pointer to the plaintext
- * plaintext_length: number of bytes of the plaintext
+ * [GCM] 7.1 Algorithm for the Authenticated Encryption Function, Steps 5 and 6
+ */
+static void aes_gcm_tag_final(void *tag, const void *j0, const unsigned char *lengths, const struct aes_gcm_key *ctx) {
+  unsigned char e[16];  /* CIPH_K(J0) */
+  int i;
+
+  /* [GCM] 7.1 Step 5. S = GHASH_H(A || 0^v || C || 0^u || len(A)64 || len(C)64) */
+  aes_gcm_ghash(ctx, tag, lengths, 16);
+
+  /* [GCM] 7.1 Step 6. T = MSBt(GCTRk(J0,S)) */
+  aes_encrypt_block(&ctx->aes, e, j0);
+  for (i = 0; i < 16; i++) {
+    ((unsigned char *)tag)[i] ^= e[i];
+  }
+}
+
+/*
+ * Computes the pre-counter block J0 from an initialization vector.
+ * ctx: pointer to the key expanded by aes_gcm_expand_key()
+ * j0: pointer to 16 bytes (128 bits) of memory to store J0
+ * iv: pointer to the initialization vector
+ * iv_length: number of bytes of the initialization vector, at least 1
+ *
+ * Returns 0 on success, or -1 if iv_length is 0 (and then J0 is not computed):
+ * J0 would be GHASH_H(0^128) = 0 for every message, and [GCM] 5.2.1.1
+ * requires 1 <= len(IV).
+ *
+ * [GCM] 7.1 Step 2.
+ * If len(IV) = 96, then let J0 = IV || 0^31 || 1.
+ * If len(IV) != 96, then let s = 128 * ceil(len(IV) / 128) - len(IV),
+ * and let J0 = GHASH_H(IV || 0^(s+64) || [len(IV)]64).
+ */
+static int aes_gcm_j0(const struct aes_gcm_key *ctx, unsigned char *j0, const void *iv, size_t iv_length) {
+  unsigned char lengths[16];  /* 0^64 || [len(IV)]64 */
+  int i;
+
+  if (iv_length == 0) {
+    return -1;
+  }
+  if (iv_length == 12) {
+    for (i = 0; i < 12; i++) {
+      j0[i] = ((unsigned char *)iv)[i];
+    }
+    j0[12] = 0;
+    j0[13] = 0;
+    j0[14] = 0;
+    j0[15] = 1;
+    return 0;
+  }
+
+  for (i = 0; i < 16; i++) {
+    j0[i] = 0;
+    lengths[i] = 0;
+  }
+  aes_gcm_add_bits(lengths + 8, iv_length, aes_gcm_max_aad_bits);
+  aes_gcm_ghash(ctx, j0, iv, iv_length);
+  aes_gcm_ghash(ctx, j0, lengths, 16);
+  return 0;
+}
+
+/*
+ * Calculates an authentication tag with an expanded key.
+ * tag: pointer to 16 bytes (128 bits) of memory to store the calculated tag
+ * iv: pointer to the initialization vector
+ * iv_length: number of bytes of the initialization vector (12 is recommended)
  * aad: pointer to the additional authenticated data
  * aad_length: number of bytes of the additional authenticated data
- * key: pointer to the 16-byte (128-bit) key
+ * text: pointer to the text (plaintext or ciphertext)
+ * text_length: number of bytes of the text
+ * ctx: pointer to the key expanded by aes_gcm_expand_key()
+ *
+ * The lengths must not exceed the maximum lengths of [GCM] 5.2.1.1.
+ * Returns 0 on success, or -1 if iv_length is 0 (and then no tag is stored).
  *
+ * [GCM] 6.4 GHASH Function
+ * [GCM] 6.5 GCTR Function
  * [GCM] 7.1 Algorithm for the Authenticated Encryption Function
  */
-static void aes_gcm_encrypt(void *ciphertext, void *tag, const void *iv, const void *plaintext, int plaintext_length, const void *aad, int aad_length, const void *key) {
-  /* Encrypt the plaintext */
-  aes_gcm_encrypt_or_decrypt(ciphertext, iv, plaintext, plaintext_length, key);
-  /* Calculate the tag */
-  aes_gcm_tag(tag, iv, aad, aad_length, ciphertext, plaintext_length, key);
+static int aes_gcm_tag_ctx(void *tag, const void *iv, size_t iv_length, const void *aad, size_t aad_length, const void *text, size_t text_length, const struct aes_gcm_key *ctx) {
+  unsigned char j0[16];  /* the pre-counter block */
+  unsigned char lengths[16];  /* len(A)64 || len(C)64 */
+  int i;
+
+  if (aes_gcm_j0(ctx, j0, iv, iv_length)) {
+    return -1;
+  }
+
+  for (i = 0; i < 16; i++) {
+    ((unsigned char *)tag)[i] = 0;
+    lengths[i] = 0;
+  }
+  aes_gcm_add_bits(lengths, aad_length, aes_gcm_max_aad_bits);
+  aes_gcm_add_bits(lengths + 8, text_length, aes_gcm_max_text_bits);
+  aes_gcm_ghash(ctx, tag, aad, aad_length);
+  aes_gcm_ghash(ctx, tag, text, text_length);
+  aes_gcm_tag_final(tag, j0, lengths, ctx);
+  return 0;
 }
 
 /*
- * Implements the AES-GCM authenticated decryption algorithm.
- *
- * Outputs:
- * plaintext: pointer to ciphertext_length bytes of memory to store the plaintext
- *
- * Inputs:
+ * Calculates an authentication tag.
+ * tag: pointer to 16 bytes (128 bits) of memory to store the calculated tag
  * iv: pointer to the initialization vector (12 bytes (96 bits))
- * ciphertext: pointer to the ciphertext
- * ciphertext_length: number of bytes of the ciphertext
  * aad: pointer to the additional authenticated data
  * aad_length: number of bytes of the additional authenticated data
- * tag: pointer to the authentication tag
- * tag_length: number of bytes of the authentication tag
- * key: pointer to the 16-byte (128-bit () key
+ * text: pointer to the text (plaintext or ciphertext)
+ * text_length: number of bytes of the text
+ * key: pointer to the encryption key (16 bytes (128 bits))
+ *
+ * Can be called to calculate just a GMAC:
+ * aes_gcm_tag(gmac, iv, aad, aad_length, NULL, 0, key)
+ */
+static void aes_gcm_tag(void *tag, const void *iv, const void *aad, size_t aad_length, const void *text, size_t text_length, const void *key) {
+  struct aes_gcm_key ctx;
+
+  aes_gcm_expand_key(&ctx, key);
+  aes_gcm_tag_ctx(tag, iv, 12, aad, aad_length, text, text_length, &ctx);
+}
+
+/*
+ * Holds the state of an AES-GCM encryption or decryption that processes
+ * the message in parts, with aes_gcm_init(), aes_gcm_aad(), aes_gcm_update()
+ * and aes_gcm_final().
+ */
+struct aes_gcm_state {
+  const struct aes_gcm_key *key;  /* the expanded key */
+  unsigned char j0[16];  /* the pre-counter block J0 */
+  unsigned char cb[16];  /* the next counter block */
+  unsigned char y[16];  /* the GHASH value of the blocks hashed so far */
+  unsigned char block[16];  /* the bytes of the next block to hash */
+  unsigned char key_stream[16];  /* the key stream of the current counter block */
+  int block_length;  /* number of bytes in block */
+  int key_stream_used;  /* number of bytes of key_stream already used (16 if none left) */
+  int decrypt;  /* 0 to encrypt, 1 to decrypt */
+  int text_started;  /* nonzero after the first call to aes_gcm_update() */
+  int invalid;  /* nonzero if aes_gcm_init() failed, so that the other functions fail */
+  unsigned char lengths[16];  /* len(A)64 || len(C)64 so far */
+};
+
+/*
+ * Number of bytes that aes_gcm_update() encrypts and hashes at a time,
+ * small enough to stay in the first level data cache between the two,
+ * and a multiple of the 8 blocks of aes_ctr() and of the 4 blocks
+ * of the PCLMULQDQ GHASH.
+ */
+#define AES_GCM_CHUNK 4096
+
+/*
+ * Starts an AES-GCM encryption or decryption.
+ * state: pointer to the aes_gcm_state structure to initialize
+ * iv: pointer to the initialization vector
+ * iv_length: number of bytes of the initialization vector (12 is recommended)
+ * ctx: pointer to the key expanded by aes_gcm_expand_key(),
+ *      which must remain available until aes_gcm_final()
+ * decrypt: 0 to encrypt, 1 to decrypt
  *
- * Returns 0 on success, or -1 if the verification of the tag fails.
+ * Then call aes_gcm_aad() for the additional authenticated data, if any,
+ * aes_gcm_update() for the text, and aes_gcm_final() for the tag.
+ * Returns 0 on success, or -1 if iv_length is 0, and then aes_gcm_aad(),
+ * aes_gcm_update() and aes_gcm_final() fail too.
  *
- * [GCM] 7.2 Algorithm for the Authenticated Decryption Function
+ * [GCM] 7.1 Algorithm for the Authenticated Encryption Function, Step 2
  */
-static int aes_gcm_decrypt(void *plaintext, const void *iv, const void *ciphertext, int ciphertext_length, const void *aad, int aad_length, const void *tag, int tag_length, const void *key) {
-  unsigned char t[16];  /* the calculated tag */
+static int aes_gcm_init(struct aes_gcm_state *state, const void *iv, size_t iv_length, const struct aes_gcm_key *ctx, int decrypt) {
   int i;
 
-  /* Check the tag */
-  aes_gcm_tag(t, iv, aad, aad_length, ciphertext, ciphertext_length, key);
-  for (i = 0; i < tag_length; i++) {
-    if (t[i] != ((unsigned char *)tag)[i]) {
-      return -1;
+  state->key = ctx;
+  state->invalid = aes_gcm_j0(ctx, state->j0, iv, iv_length);
+  /* CB1 = inc32(J0) */
+  for (i = 0; i < 16; i++) {
+    state->cb[i] = state->invalid ? 0 : state->j0[i];
+    state->y[i] = 0;
+  }
+  aes_ctr_increment(state->cb, 4);
+  state->block_length = 0;
+  state->key_stream_used = 16;
+  state->decrypt = decrypt;
+  state->text_started = 0;
+  for (i = 0; i < 16; i++) {
+    state->lengths[i] = 0;
+  }
+  return state->invalid;
+}
+
+/*
+ * Hashes data that may not start or end at a block boundary,
+ * keeping the last partial block for later.
+ */
+static void aes_gcm_state_hash(struct aes_gcm_state *state, const unsigned char *data, size_t length) {
+  size_t n;
+
+  if (state->block_length > 0) {
+    while (length > 0 && state->block_length < 16) {
+      state->block[state->block_length++] = *data++;
+      length--;
     }
+    if (state->block_length < 16) {
+      return;
+    }
+    aes_gcm_ghash(state->key, state->y, state->block, 16);
+    state->block_length = 0;
+  }
+  n = length & ~(size_t)15;
+  aes_gcm_ghash(state->key, state->y, data, n);
+  data += n;
+  length -= n;
+  while (length > 0) {
+    state->block[state->block_length++] = *data++;
+    length--;
   }
+}
 
-  /* Decrypt the ciphertext */
-  aes_gcm_encrypt_or_decrypt(plaintext, iv, ciphertext, ciphertext_length, key);
+/*
+ * Hashes the last partial block, zero-padded.
+ *
+ * [GCM] 7.1 Step 5. A || 0^v and C || 0^u
+ */
+static void aes_gcm_state_pad(struct aes_gcm_state *state) {
+  if (state->block_length > 0) {
+    aes_gcm_ghash(state->key, state->y, state->block, state->block_length);
+    state->block_length = 0;
+  }
+}
 
+/*
+ * Adds additional authenticated data to an AES-GCM encryption or decryption.
+ * state: pointer to the state initialized by aes_gcm_init()
+ * aad: pointer to the additional authenticated data
+ * aad_length: number of bytes of the additional authenticated data
+ *
+ * Can be called several times, but only before aes_gcm_update().
+ * Returns 0 on success, or -1 if aes_gcm_init() failed, if aes_gcm_update()
+ * has already been called, or if the total length of the additional authenticated data would exceed
+ * 2^61 - 1 bytes (and then nothing is added).
+ */
+static int aes_gcm_aad(struct aes_gcm_state *state, const void *aad, size_t aad_length) {
+  if (state->invalid || state->text_started || aes_gcm_add_bits(state->lengths, aad_length, aes_gcm_max_aad_bits)) {
+    return -1;
+  }
+  aes_gcm_state_hash(state, (const unsigned char *)aad, aad_length);
   return 0;
 }
+
+/*
+ * Encrypts or decrypts the next part of the text.
+ * state: pointer to the state initialized by aes_gcm_init()
+ * output: pointer to length bytes of memory to store the ciphertext/plaintext
+ * input: pointer to the plaintext/ciphertext
+ * length: number of bytes of the input
+ *
+ * Can be called several times, with parts of any length.
+ * The output may overlap the input only if they are at the same address.
+ * Each chunk of the input is hashed right after it is encrypted,
+ * or right before it is decrypted, while it is in the cache.
+ *
+ * When decrypting, the plaintext is output before the tag is verified
+ * by aes_gcm_final(), so it must not be used until then.
+ *
+ * Returns 0 on success, or -1 if aes_gcm_init() failed, or if the total
+ * length of the text would exceed 2^36 - 32 bytes, after which the counter
+ * would wrap around (and then nothing is encrypted or decrypted).
+ *
+ * [GCM] 6.5 GCTR Function
+ */
+static int aes_gcm_update(struct aes_gcm_state *state, void *output, const void *input, size_t length) {
+  unsigned char *out = (unsigned char *)output;
+  const unsigned char *in = (const unsigned char *)input;
+  size_t n;
+  int i;
+
+  if (state->invalid || aes_gcm_add_bits(state->lengths + 8, length, aes_gcm_max_text_bits)) {
+    return -1;
+  }
+  if (!state->text_started) {
+    aes_gcm_state_pad(state);
+    state->text_started = 1;
+  }
+
+  while (length > 0) {
+    if (state->key_stream_used < 16) {
+      /* Use the rest of the key stream of a partial block */
+      n = 16 - state->key_stream_used;
+      n = length < n ? length : n;
+    } else {
+      /* Whole blocks */
+      n = length < AES_GCM_CHUNK ? length & ~(size_t)15 : AES_GCM_CHUNK;
+      if (n == 0) {
+        /* The last partial block: 7. Let Yn = Xn ^ MSBlen(Xn)(CIPHk(CBn)) */
+        aes_encrypt_block(&state->key->aes, state->key_stream, state->cb);
+        aes_ctr_increment(state->cb, 4);
+        state->key_stream_used = 0;
+        n = length;
+      }
+    }
+    if (state->decrypt) {
+      aes_gcm_state_hash(state, in, n);
+    }
+    if (state->key_stream_used < 16) {
+      for (i = 0; i < (int)n; i++) {
+        out[i] = in[i] ^ state->key_stream[state->key_stream_used++];
+      }
+    } else {
+      aes_ctr(out, in, n, state->cb, 4, &state->key->aes);
+    }
+    if (!state->decrypt) {
+      aes_gcm_state_hash(state, out, n);
+    }
+    out += n;
+    in += n;
+    length -= n;
+  }
+  return 0;
+}
+
+/*
+ * Completes an AES-GCM encryption or decryption:
+ * stores the authentication tag, or verifies it.
+ * state: pointer to the state initialized by aes_gcm_init()
+ * tag: pointer to tag_length bytes of memory to store the authentication tag
+ *      when encrypting, or with the authentication tag to verify when decrypting
+ * tag_length: number of bytes of the authentication tag, 16, 15, 14, 13, 12, 8 or 4
+ *
+ * Returns 0 on success, or -1 if the verification of the tag fails,
+ * if aes_gcm_init() failed, or if tag_length is not valid
+ * (and then no tag is stored).
+ *
+ * [GCM] 7.1 Algorithm for the Authenticated Encryption Function, Steps 5 and 6
+ * [GCM] 7.2 Algorithm for the Authenticated Decryption Function, Step 8
+ */
+static int aes_gcm_final(struct aes_gcm_state *state, void *tag, int tag_length) {
+  unsigned char t[16];  /* the calculated tag */
+  unsigned char diff = 0;
+  int i;
+
+  if (state->invalid || aes_gcm_check_tag_length(tag_length)) {
+    return -1;
+  }
+  aes_gcm_state_pad(state);
+  for (i = 0; i < 16; i++) {
+    t[i] = state->y[i];
+  }
+  aes_gcm_tag_final(t, state->j0, state->lengths, state->key);
+
+  if (!state->decrypt) {
+    for (i = 0; i < tag_length; i++) {
+      ((unsigned char *)tag)[i] = t[i];
+    }
+    return 0;
+  }
+
+  /* Check the tag, taking the same time wherever it differs */
+  for (i = 0; i < tag_length; i++) {
+    diff |= t[i] ^ ((unsigned char *)tag)[i];
+  }
+  return diff ? -1 : 0;
+}
+
+/*
+ * Implements the AES-GCM authenticated encryption algorithm
+ * with a key previously expanded by aes_gcm_expand_key().
+ *
+ * Outputs:
+ * ciphertext: pointer to plaintext_length bytes of memory to store the ciphertext
+ * tag: pointer to 16 bytes (128 bits) of memory to store the authentication tag
+ *
+ * Inputs:
+ * iv: pointer to the initialization vector
+ * iv_length: number of bytes of the initialization vector (12 is recommended)
+ * plaintext: pointer to the plaintext
+ * plaintext_length: number of bytes of the plaintext
+ * aad: pointer to the additional authenticated data
+ * aad_length: number of bytes of the additional authenticated data
+ * ctx: pointer to the expanded key
+ *
+ * Returns 0 on success, or -1 if iv_length is 0 or if a length exceeds
+ * the maximum of [GCM] 5.2.1.1 (2^36 - 32 bytes of plaintext).
+ *
+ * [GCM] 7.1 Algorithm for the Authenticated Encryption Function
+ */
+static int aes_gcm_encrypt_ctx(void *ciphertext, void *tag, const void *iv, size_t iv_length, const void *plaintext, size_t plaintext_length, const void *aad, size_t aad_length, const struct aes_gcm_key *ctx) {
+  struct aes_gcm_state state;
+
+  if (aes_gcm_init(&state, iv, iv_length, ctx, 0) || aes_gcm_aad(&state, aad, aad_length) || aes_gcm_update(&state, ciphertext, plaintext, plaintext_length)) {
+    return -1;
+  }
+  return aes_gcm_final(&state, tag, 16);
+}
+
+/*
+ * Implements the AES-GCM authenticated encryption algorithm.
+ *
+ * Outputs:
+ * ciphertext: pointer to plaintext_length bytes of memory to store the ciphertext
+ * tag: pointer to 16 bytes (128 bits) of memory to store the authentication tag
+ *
+ * Inputs:
+ * iv: pointer to the initialization vector (12 bytes (96 bits))
+ * plaintext: pointer to the plaintext
+ * plaintext_length: number of bytes of the plaintext
+ * aad: pointer to the additional authenticated data
+ * aad_length: number of bytes of the additional authenticated data
+ * key: pointer to the 16-byte (128-bit) key
+ *
+ * Returns 0 on success, or -1 if a length exceeds the maximum of [GCM] 5.2.1.1
+ * (2^36 - 32 bytes of plaintext).
+ *
+ * [GCM] 7.1 Algorithm for the Authenticated Encryption Function
+ */
+static int aes_gcm_encrypt(void *ciphertext, void *tag, const void *iv, const void *plaintext, size_t plaintext_length, const void *aad, size_t aad_length, const void *key) {
+  struct aes_gcm_key ctx;
+
+  aes_gcm_expand_key(&ctx, key);
+  return aes_gcm_encrypt_ctx(ciphertext, tag, iv, 12, plaintext, plaintext_length, aad, aad_length, &ctx);
+}
+
+/*
+ * Implements the AES-GCM authenticated decryption algorithm
+ * with a key previously expanded by aes_gcm_expand_key().
+ *
+ * Outputs:
+ * plaintext: pointer to ciphertext_length bytes of memory to store the plaintext
+ *
+ * Inputs:
+ * iv: pointer to the initialization vector
+ * iv_length: number of bytes of the initialization vector (12 is recommended)
+ * ciphertext: pointer to the ciphertext
+ * ciphertext_length: number of bytes of the ciphertext
+ * aad: pointer to the additional authenticated data
+ * aad_length: number of bytes of the additional authenticated data
+ * tag: pointer to the authentication tag
+ * tag_length: number of bytes of the authentication tag, 16, 15, 14, 13, 12, 8 or 4
+ * ctx: pointer to the expanded key
+ *
+ * Returns 0 on success, or -1 if the verification of the tag fails,
+ * if a length exceeds the maximum of [GCM] 5.2.1.1, or if iv_length is 0
+ * or tag_length is not valid (and then nothing is decrypted).
+ * The plaintext is decrypted while the tag is calculated, so if the
+ * verification fails it is overwritten with zeros.
+ *
+ * [GCM] 7.2 Algorithm for the Authenticated Decryption Function
+ */
+static int aes_gcm_decrypt_ctx(void *plaintext, const void *iv, size_t iv_length, const void *ciphertext, size_t ciphertext_length, const void *aad, size_t aad_length, const void *tag, int tag_length, const struct aes_gcm_key *ctx) {
+  struct aes_gcm_state state;
+  size_t i;
+
+  if (aes_gcm_check_tag_length(tag_length)) {
+    return -1;
+  }
+  if (aes_gcm_init(&state, iv, iv_length, ctx, 1) || aes_gcm_aad(&state, aad, aad_length) || aes_gcm_update(&state, plaintext, ciphertext, ciphertext_length)) {
+    return -1;
+  }
+  if (aes_gcm_final(&state, (void *)tag, tag_length)) {
+    for (i = 0; i < ciphertext_length; i++) {
+      ((unsigned char *)plaintext)[i] = 0;
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Implements the AES-GCM authenticated decryption algorithm.
+ *
+ * Outputs:
+ * plaintext: pointer to ciphertext_length bytes of memory to store the plaintext
+ *
+ * Inputs:
+ * iv: pointer to the initialization vector (12 bytes (96 bits))
+ * ciphertext: pointer to the ciphertext
+ * ciphertext_length: number of bytes of the ciphertext
+ * aad: pointer to the additional authenticated data
+ * aad_length: number of bytes of the additional authenticated data
+ * tag: pointer to the authentication tag
+ * tag_length: number of bytes of the authentication tag, 16, 15, 14, 13, 12, 8 or 4
+ * key: pointer to the 16-byte (128-bit) key
+ *
+ * Returns 0 on success, or -1 if the verification of the tag fails
+ * (and then the plaintext is overwritten with zeros), or if tag_length
+ * is not valid (and then nothing is decrypted).
+ *
+ * [GCM] 7.2 Algorithm for the Authenticated Decryption Function
+ */
+static int aes_gcm_decrypt(void *plaintext, const void *iv, const void *ciphertext, size_t ciphertext_length, const void *aad, size_t aad_length, const void *tag, int tag_length, const void *key) {
+  struct aes_gcm_key ctx;
+
+  aes_gcm_expand_key(&ctx, key);
+  return aes_gcm_decrypt_ctx(plaintext, iv, 12, ciphertext, ciphertext_length, aad, aad_length, tag, tag_length, &ctx);
+}
+
+/*
+ * Maximum number of segments of aes_gcm_encrypt_parallel() and aes_gcm_decrypt_parallel().
+ */
+#define AES_GCM_MAX_SEGMENTS 64
+
+/*
+ * Runs task(arg, i) for each i from 0 to n - 1, possibly in parallel
+ * on the threads of the pool, and returns when all of them are done.
+ * The tasks are independent, so they may run in any order.
+ */
+typedef void aes_gcm_run_function(void *pool, void (*task)(void *arg, int i), void *arg, int n);
+
+/*
+ * Holds the work of aes_gcm_encrypt_parallel() and aes_gcm_decrypt_parallel().
+ */
+struct aes_gcm_parallel {
+  const struct aes_gcm_key *key;
+  unsigned char *output;
+  const unsigned char *input;
+  size_t length;  /* number of bytes of the input */
+  size_t segment_length;  /* number of bytes of each segment but the last, a multiple of 16 */
+  unsigned char cb[16];  /* the counter block CB1 */
+  unsigned char y[AES_GCM_MAX_SEGMENTS][16];  /* the GHASH value of each segment, from 0 */
+  int decrypt;  /* 0 to encrypt, 1 to decrypt */
+};
+
+/*
+ * Computes X = X * H^n, for the blocks that follow X in a GHASH,
+ * by repeated squaring of H.
+ *
+ * [GCM] 6.4 GHASH Function: Ym = X1 * H^m ^ X2 * H^(m-1) ^ ... ^ Xm * H
+ */
+static void aes_gcm_mul_h_power(const struct aes_gcm_key *ctx, unsigned char *x, size_t n) {
+  unsigned char p[16];  /* H^(2^i) */
+#ifdef AES_CONSTANT_TIME
+  unsigned long pw[2];
+#endif
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    p[i] = ctx->h[i];
+  }
+  for (; n > 0; n >>= 1) {
+#ifdef AES_CONSTANT_TIME
+    pw[0] = aes_gcm_load64(p);
+    pw[1] = aes_gcm_load64(p + 8);
+    if (n & 1) {
+      aes_gcm_mul_ct(x, pw);
+    }
+    if (n > 1) {
+      aes_gcm_mul_ct(p, pw);
+    }
+#else
+    if (n & 1) {
+      aes_gcm_mul(x, p);
+    }
+    if (n > 1) {
+      aes_gcm_mul(p, p);
+    }
+#endif
+  }
+}
+
+/*
+ * Encrypts or decrypts and hashes one segment of an aes_gcm_parallel.
+ * arg: pointer to the aes_gcm_parallel structure
+ * i: index of the segment
+ */
+static void aes_gcm_parallel_segment(void *arg, int i) {
+  struct aes_gcm_parallel *p = (struct aes_gcm_parallel *)arg;
+  const struct aes_gcm_key *ctx = p->key;
+  size_t offset = (size_t)i * p->segment_length;
+  size_t end = p->length - offset < p->segment_length ? p->length : offset + p->segment_length;
+  size_t blocks = offset / 16;
+  unsigned char cb[16];
+  unsigned long c;
+  size_t n;
+  int j;
+
+  /* CBj = inc32^(j-1)(CB1) for the first block of the segment */
+  for (j = 0; j < 16; j++) {
+    cb[j] = p->cb[j];
+    p->y[i][j] = 0;
+  }
+  c = (unsigned long)cb[12] << 24 | (unsigned long)cb[13] << 16 | (unsigned long)cb[14] << 8 | cb[15];
+  c = (c + (unsigned long)(blocks & 0xffffffffUL)) & 0xffffffffUL;
+  cb[12] = (unsigned char)(c >> 24);
+  cb[13] = (unsigned char)(c >> 16);
+  cb[14] = (unsigned char)(c >> 8);
+  cb[15] = (unsigned char)c;
+
+  for (; offset < end; offset += n) {
+    n = end - offset < AES_GCM_CHUNK ? end - offset : AES_GCM_CHUNK;
+    if (p->decrypt) {
+      aes_gcm_ghash(ctx, p->y[i], p->input + offset, n);
+      aes_ctr(p->output + offset, p->input + offset, n, cb, 4, &ctx->aes);
+    } else {
+      aes_ctr(p->output + offset, p->input + offset, n, cb, 4, &ctx->aes);
+      aes_gcm_ghash(ctx, p->y[i], p->output + offset, n);
+    }
+  }
+}
+
+/*
+ * Runs the tasks one after the other, when no pool is given.
+ */
+static void aes_gcm_run_serial(void *pool, void (*task)(void *arg, int i), void *arg, int n) {
+  int i;
+
+  (void)pool;
+  for (i = 0; i < n; i++) {
+    task(arg, i);
+  }
+}
+
+/*
+ * Implements aes_gcm_encrypt_parallel() and aes_gcm_decrypt_parallel(),
+ * storing the calculated tag in t.
+ *
+ * The text is split into segments of whole blocks. Each task computes the
+ * counter blocks of its segment from its offset, and the GHASH of its segment
+ * starting from 0. The GHASH values are then combined with powers of H:
+ * Y = (((Y_A * H^m1) ^ Y1) * H^m2 ^ Y2) ... where mi is the number of blocks
+ * of segment i.
+ */
+static int aes_gcm_crypt_parallel(void *output, unsigned char *t, const void *iv, size_t iv_length, const void *input, size_t length, const void *aad, size_t aad_length, const struct aes_gcm_key *ctx, int segments, aes_gcm_run_function *run, void *pool, int decrypt) {
+  struct aes_gcm_parallel p;
+  unsigned char j0[16];  /* the pre-counter block */
+  unsigned char lengths[16];  /* len(A)64 || len(C)64 */
+  size_t blocks;
+  int i, j;
+
+  for (i = 0; i < 16; i++) {
+    lengths[i] = 0;
+    t[i] = 0;
+  }
+  if (aes_gcm_add_bits(lengths, aad_length, aes_gcm_max_aad_bits) || aes_gcm_add_bits(lengths + 8, length, aes_gcm_max_text_bits)) {
+    return -1;
+  }
+
+  /* CB1 = inc32(J0) */
+  if (aes_gcm_j0(ctx, j0, iv, iv_length)) {
+    return -1;
+  }
+  for (i = 0; i < 16; i++) {
+    p.cb[i] = j0[i];
+  }
+  aes_ctr_increment(p.cb, 4);
+
+  /* Split the text in segments of whole blocks, multiples of the chunk size if possible */
+  blocks = (length + 15) / 16;
+  segments = segments < 1 ? 1 : segments > AES_GCM_MAX_SEGMENTS ? AES_GCM_MAX_SEGMENTS : segments;
+  p.segment_length = (blocks + segments - 1) / segments * 16;
+  if (p.segment_length > AES_GCM_CHUNK) {
+    p.segment_length = (p.segment_length + AES_GCM_CHUNK - 1) / AES_GCM_CHUNK * AES_GCM_CHUNK;
+  }
+  segments = p.segment_length ? (int)((length + p.segment_length - 1) / p.segment_length) : 0;
+
+  p.key = ctx;
+  p.output = (unsigned char *)output;
+  p.input = (const unsigned char *)input;
+  p.length = length;
+  p.decrypt = decrypt;
+  if (segments > 0) {
+    (run ? run : aes_gcm_run_serial)(pool, aes_gcm_parallel_segment, &p, segments);
+  }
+
+  /* Combine the GHASH values of the additional authenticated data and of the segments */
+  aes_gcm_ghash(ctx, t, aad, aad_length);
+  for (i = 0; i < segments; i++) {
+    blocks = length - i * p.segment_length < p.segment_length ? (length - i * p.segment_length + 15) / 16 : p.segment_length / 16;
+    aes_gcm_mul_h_power(ctx, t, blocks);
+    for (j = 0; j < 16; j++) {
+      t[j] ^= p.y[i][j];
+    }
+  }
+
+  aes_gcm_tag_final(t, j0, lengths, ctx);
+  return 0;
+}
+
+/*
+ * Implements the AES-GCM authenticated encryption algorithm
+ * on several threads, for long plaintexts.
+ *
+ * Outputs:
+ * ciphertext: pointer to plaintext_length bytes of memory to store the ciphertext
+ * tag: pointer to 16 bytes (128 bits) of memory to store the authentication tag
+ *
+ * Inputs:
+ * iv: pointer to the initialization vector
+ * iv_length: number of bytes of the initialization vector (12 is recommended)
+ * plaintext: pointer to the plaintext
+ * plaintext_length: number of bytes of the plaintext
+ * aad: pointer to the additional authenticated data
+ * aad_length: number of bytes of the additional authenticated data
+ * ctx: pointer to the key expanded by aes_gcm_expand_key()
+ * segments: number of segments to split the plaintext in, usually the number
+ *           of threads, up to AES_GCM_MAX_SEGMENTS
+ * run: pointer to a function that runs the segments on the threads of the pool,
+ *      or NULL to run them one after the other on the calling thread
+ * pool: pointer passed to run, such as a thread pool of the program
+ *
+ * The ciphertext and tag are the same as those of aes_gcm_encrypt().
+ * Returns 0 on success, or -1 if iv_length is 0 or if a length exceeds
+ * the maximum of [GCM] 5.2.1.1.
+ *
+ * [GCM] 7.1 Algorithm for the Authenticated Encryption Function
+ */
+static int aes_gcm_encrypt_parallel(void *ciphertext, void *tag, const void *iv, size_t iv_length, const void *plaintext, size_t plaintext_length, const void *aad, size_t aad_length, const struct aes_gcm_key *ctx, int segments, aes_gcm_run_function *run, void *pool) {
+  return aes_gcm_crypt_parallel(ciphertext, (unsigned char *)tag, iv, iv_length, plaintext, plaintext_length, aad, aad_length, ctx, segments, run, pool, 0);
+}
+
+/*
+ * Implements the AES-GCM authenticated decryption algorithm
+ * on several threads, for long ciphertexts.
+ *
+ * Outputs:
+ * plaintext: pointer to ciphertext_length bytes of memory to store the plaintext
+ *
+ * Inputs:
+ * iv: pointer to the initialization vector
+ * iv_length: number of bytes of the initialization vector (12 is recommended)
+ * ciphertext: pointer to the ciphertext
+ * ciphertext_length: number of bytes of the ciphertext
+ * aad: pointer to the additional authenticated data
+ * aad_length: number of bytes of the additional authenticated data
+ * tag: pointer to the authentication tag
+ * tag_length: number of bytes of the authentication tag, 16, 15, 14, 13, 12, 8 or 4
+ * ctx: pointer to the key expanded by aes_gcm_expand_key()
+ * segments, run, pool: as in aes_gcm_encrypt_parallel()
+ *
+ * Returns 0 on success, or -1 if the verification of the tag fails
+ * (and then the plaintext is overwritten with zeros),
+ * if a length exceeds the maximum of [GCM] 5.2.1.1, or if iv_length is 0
+ * or tag_length is not valid (and then nothing is decrypted).
+ *
+ * [GCM] 7.2 Algorithm for the Authenticated Decryption Function
+ */
+static int aes_gcm_decrypt_parallel(void *plaintext, const void *iv, size_t iv_length, const void *ciphertext, size_t ciphertext_length, const void *aad, size_t aad_length, const void *tag, int tag_length, const struct aes_gcm_key *ctx, int segments, aes_gcm_run_function *run, void *pool) {
+  unsigned char t[16];  /* the calculated tag */
+  unsigned char diff = 0;
+  size_t i;
+
+  if (aes_gcm_check_tag_length(tag_length)) {
+    return -1;
+  }
+  if (aes_gcm_crypt_parallel(plaintext, t, iv, iv_length, ciphertext, ciphertext_length, aad, aad_length, ctx, segments, run, pool, 1)) {
+    return -1;
+  }
+
+  /* Check the tag, taking the same time wherever it differs */
+  for (i = 0; i < (size_t)tag_length; i++) {
+    diff |= t[i] ^ ((unsigned char *)tag)[i];
+  }
+  if (diff) {
+    for (i = 0; i < ciphertext_length; i++) {
+      ((unsigned char *)plaintext)[i] = 0;
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Number of messages of aes_gcm_encrypt_batch() and aes_gcm_decrypt_batch()
+ * whose counter blocks are encrypted together.
+ */
+#define AES_GCM_BATCH 8
+
+/*
+ * Describes one message of aes_gcm_encrypt_batch() or aes_gcm_decrypt_batch().
+ */
+struct aes_gcm_message {
+  const void *iv;  /* pointer to the initialization vector */
+  size_t iv_length;  /* number of bytes of the initialization vector (12 is recommended) */
+  const void *aad;  /* pointer to the additional authenticated data */
+  size_t aad_length;  /* number of bytes of the additional authenticated data */
+  const void *input;  /* pointer to the plaintext/ciphertext */
+  void *output;  /* pointer to length bytes of memory to store the ciphertext/plaintext */
+  size_t length;  /* number of bytes of the input */
+  void *tag;  /* pointer to 16 bytes of memory to store the tag, or the tag to verify */
+  int tag_length;  /* number of bytes of the tag to verify (16, 15, 14, 13, 12, 8 or 4) */
+  int result;  /* set to 0 on success, or to -1 on failure */
+};
+
+/*
+ * Internal structure with one of the counter blocks that
+ * aes_gcm_encrypt_slots() encrypts, and what to do with the result.
+ */
+struct aes_gcm_slot {
+  const unsigned char *counter;  /* pointer to the counter block of the lane */
+  int index;  /* number of times to apply inc32 to it first */
+  const unsigned char *input;  /* pointer to length bytes to xor with the result, or NULL to store all of it */
+  unsigned char *output;  /* pointer to memory to store the result */
+  int length;  /* number of bytes of input and output if input is not NULL */
+};
+
+/*
+ * Internal function that completes the output of a slot.
+ */
+static void aes_gcm_slot_output(const struct aes_gcm_slot *slot, const unsigned char *e) {
+  int i;
+
+  if (slot->input) {
+    for (i = 0; i < slot->length; i++) {
+      slot->output[i] = slot->input[i] ^ e[i];
+    }
+  } else {
+    for (i = 0; i < 16; i++) {
+      slot->output[i] = e[i];
+    }
+  }
+}
+
+#ifdef AES_AESNI
+
+/*
+ * Internal function that loads the counter block of a slot,
+ * xored with the first round key.
+ */
+__attribute__((target("aes,sse2,ssse3")))
+static __m128i aes_gcm_slot_load(const struct aes_gcm_slot *slot, __m128i k) {
+  const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i x;
+
+  /* With its bytes reversed, the last 4 bytes of the counter block are a 32-bit integer */
+  x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)slot->counter), swap);
+  x = _mm_add_epi32(x, _mm_set_epi32(0, 0, 0, slot->index));
+  return _mm_xor_si128(_mm_shuffle_epi8(x, swap), k);
+}
+
+/*
+ * Internal function that stores the result of a slot, after the last round.
+ */
+__attribute__((target("aes,sse2")))
+static void aes_gcm_slot_store(const struct aes_gcm_slot *slot, __m128i x) {
+  unsigned char e[16];
+
+  if (!slot->input) {
+    _mm_storeu_si128((__m128i *)slot->output, x);
+  } else if (slot->length == 16) {
+    _mm_storeu_si128((__m128i *)slot->output, _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)slot->input)));
+  } else {
+    _mm_storeu_si128((__m128i *)e, x);
+    aes_gcm_slot_output(slot, e);
+  }
+}
+
+/*
+ * Internal function that encrypts the counter blocks of n slots with the
+ * AES-NI instructions, interleaving the rounds of 8 blocks.
+ * All the blocks of a group of 8 are loaded before any result is stored.
+ */
+__attribute__((target("aes,sse2,ssse3")))
+static void aes_gcm_encrypt_slots_aesni(const struct aes_gcm_slot *slots, int n, const struct aes_key *ctx) {
+  const __m128i *rk = (const __m128i *)ctx->round_keys;
+  __m128i k, b0, b1, b2, b3, b4, b5, b6, b7;
+  int round;
+
+  for (; n > 0; n -= 8, slots += 8) {
+    /* Fill the 8 lanes, repeating the first slot if there are less */
+    k = _mm_loadu_si128(rk);
+    b0 = aes_gcm_slot_load(slots, k);
+    b1 = aes_gcm_slot_load(slots + (n > 1 ? 1 : 0), k);
+    b2 = aes_gcm_slot_load(slots + (n > 2 ? 2 : 0), k);
+    b3 = aes_gcm_slot_load(slots + (n > 3 ? 3 : 0), k);
+    b4 = aes_gcm_slot_load(slots + (n > 4 ? 4 : 0), k);
+    b5 = aes_gcm_slot_load(slots + (n > 5 ? 5 : 0), k);
+    b6 = aes_gcm_slot_load(slots + (n > 6 ? 6 : 0), k);
+    b7 = aes_gcm_slot_load(slots + (n > 7 ? 7 : 0), k);
+    for (round = 1; round < 10; round++) {
+      k = _mm_loadu_si128(rk + round);
+      b0 = _mm_aesenc_si128(b0, k);
+      b1 = _mm_aesenc_si128(b1, k);
+      b2 = _mm_aesenc_si128(b2, k);
+      b3 = _mm_aesenc_si128(b3, k);
+      b4 = _mm_aesenc_si128(b4, k);
+      b5 = _mm_aesenc_si128(b5, k);
+      b6 = _mm_aesenc_si128(b6, k);
+      b7 = _mm_aesenc_si128(b7, k);
+    }
+    k = _mm_loadu_si128(rk + 10);
+    aes_gcm_slot_store(slots, _mm_aesenclast_si128(b0, k));
+    if (n > 1) aes_gcm_slot_store(slots + 1, _mm_aesenclast_si128(b1, k));
+    if (n > 2) aes_gcm_slot_store(slots + 2, _mm_aesenclast_si128(b2, k));
+    if (n > 3) aes_gcm_slot_store(slots + 3, _mm_aesenclast_si128(b3, k));
+    if (n > 4) aes_gcm_slot_store(slots + 4, _mm_aesenclast_si128(b4, k));
+    if (n > 5) aes_gcm_slot_store(slots + 5, _mm_aesenclast_si128(b5, k));
+    if (n > 6) aes_gcm_slot_store(slots + 6, _mm_aesenclast_si128(b6, k));
+    if (n > 7) aes_gcm_slot_store(slots + 7, _mm_aesenclast_si128(b7, k));
+  }
+}
+
+#endif
+
+/*
+ * Internal function that encrypts the counter blocks of n slots,
+ * 8 at a time with aes_encrypt_blocks() or the AES-NI instructions,
+ * and xors them with the input of their slot.
+ */
+static void aes_gcm_encrypt_slots(const struct aes_gcm_slot *slots, int n, const struct aes_key *ctx) {
+  unsigned char x[8 * 16];
+  int count, i, j;
+
+#ifdef AES_AESNI
+  if (ctx->backend == AES_BACKEND_AESNI) {
+    aes_gcm_encrypt_slots_aesni(slots, n, ctx);
+    return;
+  }
+#endif
+  for (; n > 0; n -= count, slots += count) {
+    count = n < 8 ? n : 8;
+    for (i = 0; i < count; i++) {
+      for (j = 0; j < 16; j++) {
+        x[16 * i + j] = slots[i].counter[j];
+      }
+      for (j = 0; j < slots[i].index; j++) {
+        aes_ctr_increment(x + 16 * i, 4);
+      }
+    }
+    aes_encrypt_blocks(ctx, x, x, count);
+    for (i = 0; i < count; i++) {
+      aes_gcm_slot_output(slots + i, x + 16 * i);
+    }
+  }
+}
+
+/*
+ * Maximum number of blocks of the text of each message
+ * that aes_gcm_batch() processes at each step.
+ */
+#define AES_GCM_LANE_BLOCKS 4
+
+/*
+ * Implements aes_gcm_encrypt_batch() and aes_gcm_decrypt_batch().
+ *
+ * For short messages, each AES round waits for the previous one, and
+ * each GHASH multiplication for the previous one, so a single message
+ * leaves the processor mostly idle. Up to AES_GCM_BATCH messages are
+ * processed as lanes, up to AES_GCM_LANE_BLOCKS blocks of each at a time:
+ * the counter blocks of every lane, starting with J0 for the tag, are
+ * encrypted together by aes_gcm_encrypt_slots(), which overlaps their
+ * rounds, and then the blocks are added to the GHASH of their lane,
+ * whose multiplications do not depend on those of the other lanes.
+ * A text of AES_GCM_BATCH blocks or more already fills the AES-NI pipeline
+ * with aes_ctr(), and so does the rest of the last lane left: they are
+ * processed on their own, at once.
+ */
+static int aes_gcm_batch(struct aes_gcm_message *messages, int n, const struct aes_gcm_key *ctx, int decrypt) {
+  struct aes_gcm_message *lanes[AES_GCM_BATCH];  /* the message of each lane */
+  unsigned char cb[AES_GCM_BATCH][16];  /* the counter block of each lane, from J0 */
+  unsigned char e[AES_GCM_BATCH][16];  /* CIPH_K(J0) of each lane */
+  unsigned char y[AES_GCM_BATCH][16];  /* the GHASH value of each lane */
+  unsigned char lengths[AES_GCM_BATCH][16];  /* len(A)64 || len(C)64 of each lane */
+  unsigned char ctr[16];  /* the counter block of a long text */
+  size_t offset[AES_GCM_BATCH];  /* number of bytes of the text of each lane already processed */
+  size_t part[AES_GCM_BATCH];  /* number of bytes of the text of each lane in the current step */
+  int live[AES_GCM_BATCH];  /* the lanes whose text is not all processed */
+  struct aes_gcm_slot slots[AES_GCM_BATCH * (1 + AES_GCM_LANE_BLOCKS)];
+  struct aes_gcm_slot *slot;
+  unsigned char *out;
+  const unsigned char *in;
+  unsigned char diff;
+  struct aes_gcm_message *m;
+  int first, next, count, active, blocks, j, k;
+  int failed = 0;
+  size_t i, length;
+
+  for (first = 0; first < n; first = next) {
+    /* The next lanes, skipping the messages with lengths that are not valid */
+    slot = slots;
+    active = 0;
+    for (next = first, count = 0; next < n && count < AES_GCM_BATCH; next++) {
+      m = messages + next;
+      for (k = 0; k < 16; k++) {
+        y[count][k] = 0;
+        lengths[count][k] = 0;
+      }
+      if (aes_gcm_add_bits(lengths[count], m->aad_length, aes_gcm_max_aad_bits)
+          || aes_gcm_add_bits(lengths[count] + 8, m->length, aes_gcm_max_text_bits)
+          || m->iv_length == 0
+          || (decrypt && aes_gcm_check_tag_length(m->tag_length))) {
+        m->result = -1;
+        failed++;
+        continue;
+      }
+      lanes[count] = m;
+      aes_gcm_j0(ctx, cb[count], m->iv, m->iv_length);
+      aes_gcm_ghash(ctx, y[count], m->aad, m->aad_length);
+      offset[count] = 0;
+      if (m->length >= 16 * AES_GCM_BATCH) {
+        /* A text long enough to fill the lanes on its own, at once */
+        for (k = 0; k < 16; k++) {
+          ctr[k] = cb[count][k];
+        }
+        aes_ctr_increment(ctr, 4);
+        if (decrypt) {
+          aes_gcm_ghash(ctx, y[count], m->input, m->length);
+          aes_ctr(m->output, m->input, m->length, ctr, 4, &ctx->aes);
+        } else {
+          aes_ctr(m->output, m->input, m->length, ctr, 4, &ctx->aes);
+          aes_gcm_ghash(ctx, y[count], m->output, m->length);
+        }
+        offset[count] = m->length;
+      } else if (m->length > 0) {
+        live[active++] = count;
+      }
+      /* CIPH_K(J0) for the tag, encrypted along with the first blocks of the text */
+      slot->counter = cb[count];
+      slot->index = 0;
+      slot->input = NULL;
+      slot->output = e[count];
+      slot++;
+      count++;
+    }
+
+    for (;;) {
+      /* C = GCTR_K(inc32(J0), P), the next blocks of each lane */
+      for (k = 0; k < active; k++) {
+        j = live[k];
+        m = lanes[j];
+        length = m->length - offset[j];
+        part[j] = length < 16 * AES_GCM_LANE_BLOCKS ? length : 16 * AES_GCM_LANE_BLOCKS;
+        in = (const unsigned char *)m->input + offset[j];
+        out = (unsigned char *)m->output + offset[j];
+        if (decrypt) {
+          aes_gcm_ghash(ctx, y[j], in, part[j]);
+        }
+        for (i = 0; i < part[j]; i += 16) {
+          slot->counter = cb[j];
+          slot->index = (offset[j] == 0) + (int)(i / 16);
+          slot->input = in + i;
+          slot->output = out + i;
+          slot->length = part[j] - i < 16 ? (int)(part[j] - i) : 16;
+          slot++;
+        }
+      }
+      if (slot == slots) {
+        break;
+      }
+      aes_gcm_encrypt_slots(slots, (int)(slot - slots), &ctx->aes);
+      slot = slots;
+
+      for (k = 0; k < active; ) {
+        j = live[k];
+        m = lanes[j];
+        if (!decrypt) {
+          aes_gcm_ghash(ctx, y[j], (unsigned char *)m->output + offset[j], part[j]);
+        }
+        for (blocks = (offset[j] == 0) + (int)((part[j] + 15) / 16); blocks > 0; blocks--) {
+          aes_ctr_increment(cb[j], 4);
+        }
+        offset[j] += part[j];
+        if (offset[j] == m->length) {
+          live[k] = live[--active];
+        } else {
+          k++;
+        }
+      }
+
+      if (active == 1) {
+        /* The rest of the last lane on its own, with the whole blocks at once */
+        j = live[0];
+        m = lanes[j];
+        in = (const unsigned char *)m->input + offset[j];
+        out = (unsigned char *)m->output + offset[j];
+        length = m->length - offset[j];
+        if (decrypt) {
+          aes_gcm_ghash(ctx, y[j], in, length);
+          aes_ctr(out, in, length, cb[j], 4, &ctx->aes);
+        } else {
+          aes_ctr(out, in, length, cb[j], 4, &ctx->aes);
+          aes_gcm_ghash(ctx, y[j], out, length);
+        }
+        active = 0;
+      }
+    }
+
+    /* S = GHASH_H(A || 0^v || C || 0^u || len(A)64 || len(C)64), and T = MSBt(GCTRk(J0,S)) */
+    for (j = 0; j < count; j++) {
+      m = lanes[j];
+      aes_gcm_ghash(ctx, y[j], lengths[j], 16);
+      for (k = 0; k < 16; k++) {
+        y[j][k] ^= e[j][k];
+      }
+      m->result = 0;
+      if (!decrypt) {
+        for (k = 0; k < 16; k++) {
+          ((unsigned char *)m->tag)[k] = y[j][k];
+        }
+        continue;
+      }
+      for (diff = 0, k = 0; k < m->tag_length; k++) {
+        diff |= y[j][k] ^ ((unsigned char *)m->tag)[k];
+      }
+      if (diff) {
+        for (i = 0; i < m->length; i++) {
+          ((unsigned char *)m->output)[i] = 0;
+        }
+        m->result = -1;
+        failed++;
+      }
+    }
+  }
+
+  return failed;
+}
+
+/*
+ * Implements the AES-GCM authenticated encryption algorithm for many
+ * messages under the same key, such as network packets.
+ * messages: pointer to the array of messages, each with its iv, iv_length, aad,
+ *           aad_length, input (the plaintext), output (for the ciphertext),
+ *           length and tag (for the 16-byte tag)
+ * n: number of messages
+ * ctx: pointer to the key expanded by aes_gcm_expand_key()
+ *
+ * Processes more short messages per second than calling
+ * aes_gcm_encrypt_ctx() for each of them, by encrypting the counter blocks
+ * of up to AES_GCM_BATCH messages together. The output of a message may
+ * overlap its input only if they are at the same address.
+ * Returns the number of messages that failed because iv_length is 0 or
+ * a length exceeds the maximum of [GCM] 5.2.1.1, whose result is set to -1
+ * (or 0 otherwise).
+ *
+ * [GCM] 7.1 Algorithm for the Authenticated Encryption Function
+ */
+static int aes_gcm_encrypt_batch(struct aes_gcm_message *messages, int n, const struct aes_gcm_key *ctx) {
+  return aes_gcm_batch(messages, n, ctx, 0);
+}
+
+/*
+ * Implements the AES-GCM authenticated decryption algorithm for many
+ * messages under the same key, such as network packets.
+ * messages: pointer to the array of messages, each with its iv, iv_length, aad,
+ *           aad_length, input (the ciphertext), output (for the plaintext),
+ *           length, tag and tag_length
+ * n: number of messages
+ * ctx: pointer to the key expanded by aes_gcm_expand_key()
+ *
+ * Returns the number of messages that failed, whose result is set to -1,
+ * or 0 for the others. The plaintext of a message whose tag does not verify
+ * is overwritten with zeros, and a message whose iv_length is 0, whose
+ * tag_length is not valid or whose lengths exceed the maximum of
+ * [GCM] 5.2.1.1 is not decrypted.
+ *
+ * [GCM] 7.2 Algorithm for the Authenticated Decryption Function
+ */
+static int aes_gcm_decrypt_batch(struct aes_gcm_message *messages, int n, const struct aes_gcm_key *ctx) {
+  return aes_gcm_batch(messages, n, ctx, 1);
+}
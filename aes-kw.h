@@ -8,49 +8,927 @@
  */
 
 /*
- * Computes the AES Key Wrap algorithm.
- * ciphertext: pointer to ((n + 1) * 8) bytes to store the ciphertext
- * plaintext: pointer to (n * 8) bytes with the plaintext
- * n: number of 8-byte blocks of the plaintext (n = length(plaintext) / 8)
- * key: pointer to 16 bytes (128 bits) with the key encryption key
+ * Implements the AES Key Wrap algorithm for 128-bit key encryption keys,
+ * with its Key Unwrap and integrity check, and the AES Key Wrap with Padding
+ * algorithm for keys of any length.
  *
- * Uses the aes_encrypt function in aes.h, so you need to include that too:
+ * Uses the aes_expand_key, aes_encrypt_block(s) and aes_decrypt_block(s)
+ * functions in aes.h, so you need to include that too:
  * #include "aes.h"
  * #include "aes-kw.h"
  *
+ * The 6n encryptions of a key wrap are serial, each one needing the result
+ * of the previous one. With the AES-NI instructions, the round keys are kept
+ * in registers across all of them (along with the AESIMC round keys of the
+ * key unwrap), so that each step only costs the latency of the rounds.
+ * To wrap or unwrap many keys under the same key encryption key,
+ * aes_kw_batch() and aes_kw_unwrap_batch() interleave the steps of
+ * several keys, so they run at the throughput of the rounds instead.
+ *
  * References:
  * [RFC3394] Advanced Encryption Standard (AES) Key Wrap Algorithm, 2002.
+ * [RFC5649] Advanced Encryption Standard (AES) Key Wrap with Padding Algorithm, 2009.
+ */
+
+#include <stddef.h>
+
+#ifdef AES_AESNI
+#include <tmmintrin.h>
+#endif
+
+/*
+ * Computes A = A ^ t, where t is the 64-bit big-endian step counter n*j+i.
+ */
+static void aes_kw_xor_t(unsigned char *a, size_t t) {
+  int w;
+
+  for (w = 7; w >= 0 && t != 0; w--) {
+    a[w] ^= (unsigned char)t;
+    t >>= 8;
+  }
+}
+
+#ifdef AES_AESNI
+
+/*
+ * Returns t = n*j+i as a 64-bit big-endian number in the low half of a register.
+ */
+__attribute__((target("sse2,ssse3")))
+static __m128i aes_kw_t_aesni(size_t t) {
+  const __m128i swap = _mm_set_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, 1, 2, 3, 4, 5, 6, 7);
+
+  return _mm_shuffle_epi8(_mm_set_epi32(0, 0, (int)(unsigned)((t >> 16) >> 16), (int)(unsigned)t), swap);
+}
+
+/*
+ * Computes the steps of aes_kw_wrap() with the AES-NI instructions.
+ */
+__attribute__((target("aes,sse2,ssse3")))
+static void aes_kw_wrap_aesni(unsigned char *a, unsigned char *r, size_t n, const struct aes_key *ctx) {
+  const __m128i *rk = (const __m128i *)ctx->round_keys;
+  __m128i k0, k1, k2, k3, k4, k5, k6, k7, k8, k9, k10, b;
+  size_t i, t;
+  int j;
+
+  k0 = _mm_loadu_si128(rk + 0);
+  k1 = _mm_loadu_si128(rk + 1);
+  k2 = _mm_loadu_si128(rk + 2);
+  k3 = _mm_loadu_si128(rk + 3);
+  k4 = _mm_loadu_si128(rk + 4);
+  k5 = _mm_loadu_si128(rk + 5);
+  k6 = _mm_loadu_si128(rk + 6);
+  k7 = _mm_loadu_si128(rk + 7);
+  k8 = _mm_loadu_si128(rk + 8);
+  k9 = _mm_loadu_si128(rk + 9);
+  k10 = _mm_loadu_si128(rk + 10);
+
+  b = _mm_loadl_epi64((const __m128i *)a);
+  t = 1;
+  for (j = 0; j <= 5; j++) {
+    for (i = 0; i < n; i++, t++) {
+      /* B = AES(K, A | R[i]) */
+      b = _mm_unpacklo_epi64(b, _mm_loadl_epi64((const __m128i *)(r + 8 * i)));
+      b = _mm_xor_si128(b, k0);
+      b = _mm_aesenc_si128(b, k1);
+      b = _mm_aesenc_si128(b, k2);
+      b = _mm_aesenc_si128(b, k3);
+      b = _mm_aesenc_si128(b, k4);
+      b = _mm_aesenc_si128(b, k5);
+      b = _mm_aesenc_si128(b, k6);
+      b = _mm_aesenc_si128(b, k7);
+      b = _mm_aesenc_si128(b, k8);
+      b = _mm_aesenc_si128(b, k9);
+      b = _mm_aesenclast_si128(b, k10);
+      /* R[i] = LSB(64, B), A = MSB(64, B) ^ t */
+      _mm_storel_epi64((__m128i *)(r + 8 * i), _mm_srli_si128(b, 8));
+      b = _mm_xor_si128(b, aes_kw_t_aesni(t));
+    }
+  }
+  _mm_storel_epi64((__m128i *)a, b);
+}
+
+/*
+ * Computes the steps of aes_kw_unwrap_blocks() with the AES-NI instructions.
  */
-static void aes_kw(void *ciphertext, const void *plaintext, int n, const void *key) {
+__attribute__((target("aes,sse2,ssse3")))
+static void aes_kw_unwrap_aesni(unsigned char *a, unsigned char *r, size_t n, const struct aes_key *ctx) {
+  const __m128i *rk = (const __m128i *)ctx->round_keys;
+  __m128i k0, k1, k2, k3, k4, k5, k6, k7, k8, k9, k10, b;
+  size_t i, t;
+  int j;
+
+  /* [AES] 5.3.5 Equivalent Inverse Cipher round keys */
+  k0 = _mm_loadu_si128(rk + 0);
+  k1 = _mm_aesimc_si128(_mm_loadu_si128(rk + 1));
+  k2 = _mm_aesimc_si128(_mm_loadu_si128(rk + 2));
+  k3 = _mm_aesimc_si128(_mm_loadu_si128(rk + 3));
+  k4 = _mm_aesimc_si128(_mm_loadu_si128(rk + 4));
+  k5 = _mm_aesimc_si128(_mm_loadu_si128(rk + 5));
+  k6 = _mm_aesimc_si128(_mm_loadu_si128(rk + 6));
+  k7 = _mm_aesimc_si128(_mm_loadu_si128(rk + 7));
+  k8 = _mm_aesimc_si128(_mm_loadu_si128(rk + 8));
+  k9 = _mm_aesimc_si128(_mm_loadu_si128(rk + 9));
+  k10 = _mm_loadu_si128(rk + 10);
+
+  b = _mm_loadl_epi64((const __m128i *)a);
+  t = 6 * n;
+  for (j = 5; j >= 0; j--) {
+    for (i = n; i-- > 0; t--) {
+      /* B = AES-1(K, (A ^ t) | R[i]) */
+      b = _mm_xor_si128(b, aes_kw_t_aesni(t));
+      b = _mm_unpacklo_epi64(b, _mm_loadl_epi64((const __m128i *)(r + 8 * i)));
+      b = _mm_xor_si128(b, k10);
+      b = _mm_aesdec_si128(b, k9);
+      b = _mm_aesdec_si128(b, k8);
+      b = _mm_aesdec_si128(b, k7);
+      b = _mm_aesdec_si128(b, k6);
+      b = _mm_aesdec_si128(b, k5);
+      b = _mm_aesdec_si128(b, k4);
+      b = _mm_aesdec_si128(b, k3);
+      b = _mm_aesdec_si128(b, k2);
+      b = _mm_aesdec_si128(b, k1);
+      b = _mm_aesdeclast_si128(b, k0);
+      /* A = MSB(64, B), R[i] = LSB(64, B) */
+      _mm_storel_epi64((__m128i *)(r + 8 * i), _mm_srli_si128(b, 8));
+    }
+  }
+  _mm_storel_epi64((__m128i *)a, b);
+}
+
+#endif
+
+/*
+ * Computes the wrapping process W of the key wrap algorithms, in place.
+ * c: pointer to ((n + 1) * 8) bytes with the initial value A followed by
+ *    the n plaintext blocks R[1..n], to be replaced by the ciphertext
+ * n: number of 8-byte blocks of the plaintext, at least 2
+ * ctx: pointer to the expanded key encryption key
+ *
+ * [RFC3394] 2.2.1 Key Wrap (Index Based Implementation)
+ */
+static void aes_kw_wrap(unsigned char *c, size_t n, const struct aes_key *ctx) {
   unsigned char x[16];
   unsigned char *r;
-  unsigned char *c;
-  int i, j, w;
+  size_t i, t;
+  int j, w;
+
+#ifdef AES_AESNI
+  if (ctx->backend == AES_BACKEND_AESNI) {
+    aes_kw_wrap_aesni(c, c + 8, n, ctx);
+    return;
+  }
+#endif
 
   /* 1) Initialize variables. */
-  for (w = 0; w < 8; w++) {  /* A0 = IV = 0xa6a6a6a6a6a6a6a6 */
-    x[w] = 0xa6;
+  for (w = 0; w < 8; w++) {
+    x[w] = c[w];
   }
-  r = (unsigned char *)plaintext;  /* R[i] = P[i] */
 
   /* 2) Calculate intermediate values. */
+  t = 1;
   for (j = 0; j <= 5; j++) {
-    c = (unsigned char *)ciphertext + 8;
-    for (i = 1; i <= n; i++) {
-      for (w = 8; w < 16; w++) {  /* A | R[i] */
-        x[w] = *r++;
+    r = c + 8;
+    for (i = 1; i <= n; i++, t++) {
+      for (w = 0; w < 8; w++) {  /* A | R[i] */
+        x[8 + w] = r[w];
       }
-      aes_encrypt(x, x, key);  /* B = AES(K, A | R[i]) */
-      x[7] ^= n * j + i;  /* A = MSB(64, B) ^ t  (assume n < 43) */
-      for (w = 8; w < 16; w++) {  /* R[i] = LSB(64, B) */
-        *c++ = x[w];
+      aes_encrypt_block(ctx, x, x);  /* B = AES(K, A | R[i]) */
+      aes_kw_xor_t(x, t);  /* A = MSB(64, B) ^ t where t = (n*j)+i */
+      for (w = 0; w < 8; w++) {  /* R[i] = LSB(64, B) */
+        r[w] = x[8 + w];
       }
+      r += 8;
     }
-    r = (unsigned char *)ciphertext + 8;
   }
 
   /* 3) Output the results. */
   for (w = 0; w < 8; w++) {
-    ((unsigned char *)ciphertext)[w] = x[w];
+    c[w] = x[w];
+  }
+}
+
+/*
+ * Computes the unwrapping process W^-1 of the key wrap algorithms.
+ * a: pointer to 8 bytes to store the resulting initial value A
+ * p: pointer to (n * 8) bytes to store the plaintext blocks R[1..n]
+ * c: pointer to ((n + 1) * 8) bytes with the ciphertext
+ * n: number of 8-byte blocks of the plaintext, at least 2
+ * ctx: pointer to the expanded key encryption key
+ *
+ * p may be at the same address as c.
+ *
+ * [RFC3394] 2.2.2 Key Unwrap (Index Based Implementation)
+ */
+static void aes_kw_unwrap_blocks(unsigned char *a, unsigned char *p, const unsigned char *c, size_t n, const struct aes_key *ctx) {
+  unsigned char x[16];
+  unsigned char *r;
+  size_t i, t;
+  int j, w;
+
+  /* 1) Initialize variables. */
+  for (w = 0; w < 8; w++) {  /* A = C[0] */
+    x[w] = c[w];
+  }
+  for (i = 0; i < 8 * n; i++) {  /* R[i] = C[i] */
+    p[i] = c[8 + i];
+  }
+
+#ifdef AES_AESNI
+  if (ctx->backend == AES_BACKEND_AESNI) {
+    aes_kw_unwrap_aesni(x, p, n, ctx);
+    for (w = 0; w < 8; w++) {
+      a[w] = x[w];
+    }
+    return;
+  }
+#endif
+
+  /* 2) Compute intermediate values. */
+  t = 6 * n;
+  for (j = 5; j >= 0; j--) {
+    r = p + 8 * n;
+    for (i = n; i >= 1; i--, t--) {
+      r -= 8;
+      aes_kw_xor_t(x, t);  /* A ^ t where t = n*j+i */
+      for (w = 0; w < 8; w++) {  /* (A ^ t) | R[i] */
+        x[8 + w] = r[w];
+      }
+      aes_decrypt_block(ctx, x, x);  /* B = AES-1(K, (A ^ t) | R[i]) */
+      for (w = 0; w < 8; w++) {  /* A = MSB(64, B), R[i] = LSB(64, B) */
+        r[w] = x[8 + w];
+      }
+    }
+  }
+
+  /* 3) Output results. */
+  for (w = 0; w < 8; w++) {
+    a[w] = x[w];
+  }
+}
+
+/*
+ * Computes the AES Key Wrap algorithm
+ * with a key encryption key previously expanded by aes_expand_key().
+ * ciphertext: pointer to ((n + 1) * 8) bytes to store the ciphertext
+ * plaintext: pointer to (n * 8) bytes with the plaintext
+ * n: number of 8-byte blocks of the plaintext (n = length(plaintext) / 8),
+ *    at least 2
+ * ctx: pointer to the expanded key encryption key
+ * Returns 0, or -1 if n is less than 2 (and then nothing is output).
+ *
+ * The ciphertext may overlap the plaintext only if they are at the same address.
+ *
+ * [RFC3394] 2.2.1 Key Wrap
+ */
+static int aes_kw_ctx(void *ciphertext, const void *plaintext, size_t n, const struct aes_key *ctx) {
+  unsigned char *c = (unsigned char *)ciphertext;
+  const unsigned char *p = (const unsigned char *)plaintext;
+  size_t i;
+
+  if (n < 2) {
+    return -1;
+  }
+  /* R[i] = P[i], copied backwards in case the ciphertext is the plaintext */
+  for (i = 8 * n; i > 0; i--) {
+    c[8 + i - 1] = p[i - 1];
+  }
+  for (i = 0; i < 8; i++) {  /* A = IV = 0xa6a6a6a6a6a6a6a6 */
+    c[i] = 0xa6;
+  }
+  aes_kw_wrap(c, n, ctx);
+  return 0;
+}
+
+/*
+ * Computes the AES Key Wrap algorithm.
+ * ciphertext: pointer to ((n + 1) * 8) bytes to store the ciphertext
+ * plaintext: pointer to (n * 8) bytes with the plaintext
+ * n: number of 8-byte blocks of the plaintext (n = length(plaintext) / 8),
+ *    at least 2
+ * key: pointer to 16 bytes (128 bits) with the key encryption key
+ * Returns 0, or -1 if n is less than 2 (and then nothing is output).
+ *
+ * [RFC3394] 2.2.1 Key Wrap
+ */
+static int aes_kw(void *ciphertext, const void *plaintext, size_t n, const void *key) {
+  struct aes_key ctx;
+
+  aes_expand_key(&ctx, key);
+  return aes_kw_ctx(ciphertext, plaintext, n, &ctx);
+}
+
+/*
+ * Computes the AES Key Unwrap algorithm and checks the integrity of the key
+ * with a key encryption key previously expanded by aes_expand_key().
+ * plaintext: pointer to (n * 8) bytes to store the plaintext
+ * ciphertext: pointer to ((n + 1) * 8) bytes with the ciphertext
+ * n: number of 8-byte blocks of the plaintext (n = length(ciphertext) / 8 - 1),
+ *    at least 2
+ * ctx: pointer to the expanded key encryption key
+ * Returns 0 if the key is authentic, or -1 and zeros the plaintext if not,
+ * or -1 if n is less than 2 (and then nothing is output).
+ *
+ * The plaintext may overlap the ciphertext only if they are at the same address.
+ *
+ * [RFC3394] 2.2.2 Key Unwrap, and 2.2.3 Key Data Integrity -- the Initial Value
+ */
+static int aes_kw_unwrap_ctx(void *plaintext, const void *ciphertext, size_t n, const struct aes_key *ctx) {
+  unsigned char *p = (unsigned char *)plaintext;
+  unsigned char a[8];
+  unsigned char diff;
+  size_t i;
+
+  if (n < 2) {
+    return -1;
+  }
+  aes_kw_unwrap_blocks(a, p, (const unsigned char *)ciphertext, n, ctx);
+
+  /* A must be the default IV 0xa6a6a6a6a6a6a6a6, compared in constant time */
+  diff = 0;
+  for (i = 0; i < 8; i++) {
+    diff |= a[i] ^ 0xa6;
+  }
+  if (diff) {
+    for (i = 0; i < 8 * n; i++) {
+      p[i] = 0;
+    }
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Computes the AES Key Unwrap algorithm and checks the integrity of the key.
+ * plaintext: pointer to (n * 8) bytes to store the plaintext
+ * ciphertext: pointer to ((n + 1) * 8) bytes with the ciphertext
+ * n: number of 8-byte blocks of the plaintext (n = length(ciphertext) / 8 - 1),
+ *    at least 2
+ * key: pointer to 16 bytes (128 bits) with the key encryption key
+ * Returns 0 if the key is authentic, or -1 and zeros the plaintext if not,
+ * or -1 if n is less than 2 (and then nothing is output).
+ *
+ * [RFC3394] 2.2.2 Key Unwrap, and 2.2.3 Key Data Integrity -- the Initial Value
+ */
+static int aes_kw_unwrap(void *plaintext, const void *ciphertext, size_t n, const void *key) {
+  struct aes_key ctx;
+
+  aes_expand_key(&ctx, key);
+  return aes_kw_unwrap_ctx(plaintext, ciphertext, n, &ctx);
+}
+
+/*
+ * Computes the AES Key Wrap with Padding algorithm
+ * with a key encryption key previously expanded by aes_expand_key().
+ * ciphertext: pointer to (8 + ((length + 7) / 8) * 8) bytes to store the ciphertext
+ * plaintext: pointer to length bytes with the plaintext
+ * length: number of bytes of the plaintext, from 1 to 2^32 - 1
+ * ctx: pointer to the expanded key encryption key
+ * Returns 0, or -1 if the length is out of range.
+ *
+ * The ciphertext may overlap the plaintext only if they are at the same address.
+ *
+ * [RFC5649] 4.1 Extended Key Wrapping Process
+ */
+static int aes_kwp_ctx(void *ciphertext, const void *plaintext, size_t length, const struct aes_key *ctx) {
+  unsigned char *c = (unsigned char *)ciphertext;
+  const unsigned char *p = (const unsigned char *)plaintext;
+  size_t i, n;
+
+  if (length == 0 || (length >> 16) >> 16 != 0) {
+    return -1;
+  }
+  n = (length + 7) / 8;
+
+  /* P = the plaintext padded with zeros to a multiple of 8 bytes */
+  for (i = length; i > 0; i--) {
+    c[8 + i - 1] = p[i - 1];
+  }
+  for (i = length; i < 8 * n; i++) {
+    c[8 + i] = 0;
+  }
+
+  /* [RFC5649] 3. Alternative Initial Value: A65959A6 | 32-bit MLI */
+  c[0] = 0xa6;
+  c[1] = 0x59;
+  c[2] = 0x59;
+  c[3] = 0xa6;
+  c[4] = (unsigned char)(length >> 24);
+  c[5] = (unsigned char)(length >> 16);
+  c[6] = (unsigned char)(length >> 8);
+  c[7] = (unsigned char)length;
+
+  if (n == 1) {
+    aes_encrypt_block(ctx, c, c);  /* C[0] | C[1] = ENC(K, A | P[1]) */
+  } else {
+    aes_kw_wrap(c, n, ctx);
+  }
+  return 0;
+}
+
+/*
+ * Computes the AES Key Wrap with Padding algorithm.
+ * ciphertext: pointer to (8 + ((length + 7) / 8) * 8) bytes to store the ciphertext
+ * plaintext: pointer to length bytes with the plaintext
+ * length: number of bytes of the plaintext, from 1 to 2^32 - 1
+ * key: pointer to 16 bytes (128 bits) with the key encryption key
+ * Returns 0, or -1 if the length is out of range.
+ *
+ * [RFC5649] 4.1 Extended Key Wrapping Process
+ */
+static int aes_kwp(void *ciphertext, const void *plaintext, size_t length, const void *key) {
+  struct aes_key ctx;
+
+  aes_expand_key(&ctx, key);
+  return aes_kwp_ctx(ciphertext, plaintext, length, &ctx);
+}
+
+/*
+ * Computes the AES Key Unwrap with Padding algorithm and checks the integrity
+ * of the key with a key encryption key previously expanded by aes_expand_key().
+ * plaintext: pointer to (ciphertext_length - 8) bytes to store the plaintext
+ *            and its padding
+ * length: pointer to store the number of bytes of the plaintext
+ * ciphertext: pointer to the ciphertext
+ * ciphertext_length: number of bytes of the ciphertext, a multiple of 8 from 16
+ * ctx: pointer to the expanded key encryption key
+ * Returns 0 if the key is authentic, or -1 and zeros the plaintext if not.
+ *
+ * The plaintext may overlap the ciphertext only if they are at the same address.
+ *
+ * [RFC5649] 4.2 Extended Key Unwrapping Process
+ */
+static int aes_kwp_unwrap_ctx(void *plaintext, size_t *length, const void *ciphertext, size_t ciphertext_length, const struct aes_key *ctx) {
+  unsigned char *p = (unsigned char *)plaintext;
+  const unsigned char *c = (const unsigned char *)ciphertext;
+  unsigned char x[16];
+  unsigned char diff;
+  size_t i, n, mli;
+
+  if (ciphertext_length < 16 || ciphertext_length % 8 != 0) {
+    return -1;
+  }
+  n = ciphertext_length / 8 - 1;
+
+  if (n == 1) {
+    aes_decrypt_block(ctx, x, c);  /* A | P[1] = DEC(K, C[0] | C[1]) */
+    for (i = 0; i < 8; i++) {
+      p[i] = x[8 + i];
+    }
+  } else {
+    aes_kw_unwrap_blocks(x, p, c, n, ctx);
+  }
+
+  /* [RFC5649] 3. Alternative Initial Value, with 8*(n-1) < MLI <= 8*n */
+  diff = (x[0] ^ 0xa6) | (x[1] ^ 0x59) | (x[2] ^ 0x59) | (x[3] ^ 0xa6);
+  mli = (size_t)x[4] << 24 | (size_t)x[5] << 16 | (size_t)x[6] << 8 | x[7];
+  if (mli <= 8 * (n - 1) || mli > 8 * n) {
+    diff = 1;
+  } else {
+    for (i = mli; i < 8 * n; i++) {  /* the padding must be zeros */
+      diff |= p[i];
+    }
+  }
+  if (diff) {
+    for (i = 0; i < 8 * n; i++) {
+      p[i] = 0;
+    }
+    return -1;
+  }
+  *length = mli;
+  return 0;
+}
+
+/*
+ * Computes the AES Key Unwrap with Padding algorithm and checks the integrity of the key.
+ * plaintext: pointer to (ciphertext_length - 8) bytes to store the plaintext
+ *            and its padding
+ * length: pointer to store the number of bytes of the plaintext
+ * ciphertext: pointer to the ciphertext
+ * ciphertext_length: number of bytes of the ciphertext, a multiple of 8 from 16
+ * key: pointer to 16 bytes (128 bits) with the key encryption key
+ * Returns 0 if the key is authentic, or -1 and zeros the plaintext if not.
+ *
+ * [RFC5649] 4.2 Extended Key Unwrapping Process
+ */
+static int aes_kwp_unwrap(void *plaintext, size_t *length, const void *ciphertext, size_t ciphertext_length, const void *key) {
+  struct aes_key ctx;
+
+  aes_expand_key(&ctx, key);
+  return aes_kwp_unwrap_ctx(plaintext, length, ciphertext, ciphertext_length, &ctx);
+}
+
+/*
+ * The batch functions below wrap or unwrap many keys of the same length
+ * under the same key encryption key. The 6n steps of each key are serial,
+ * but those of different keys are independent, so AES_KW_BATCH keys are
+ * processed together: each step encrypts one block of every key at once,
+ * which keeps the AES pipeline full instead of waiting for each block.
+ */
+#define AES_KW_BATCH 8
+
+#ifdef AES_AESNI
+
+/*
+ * Computes the steps of aes_kw_wrap() for 8 keys with the AES-NI
+ * instructions, interleaving their rounds.
+ * a: pointer to the initial value A of the first key, replaced by its result
+ * a_stride: number of bytes from the A of each key to that of the next one
+ * r: pointer to the blocks R[1..n] of the first key
+ * r_stride: number of bytes from the blocks of each key to those of the next one
+ * n: number of 8-byte blocks of each key
+ * ctx: pointer to the expanded key encryption key
+ */
+__attribute__((target("aes,sse2,ssse3")))
+static void aes_kw_wrap_8_aesni(unsigned char *a, size_t a_stride, unsigned char *r, size_t r_stride, size_t n, const struct aes_key *ctx) {
+  const __m128i *rk = (const __m128i *)ctx->round_keys;
+  __m128i k, b0, b1, b2, b3, b4, b5, b6, b7;
+  size_t i, t;
+  int j, round;
+
+  b0 = _mm_loadl_epi64((const __m128i *)(a + 0 * a_stride));
+  b1 = _mm_loadl_epi64((const __m128i *)(a + 1 * a_stride));
+  b2 = _mm_loadl_epi64((const __m128i *)(a + 2 * a_stride));
+  b3 = _mm_loadl_epi64((const __m128i *)(a + 3 * a_stride));
+  b4 = _mm_loadl_epi64((const __m128i *)(a + 4 * a_stride));
+  b5 = _mm_loadl_epi64((const __m128i *)(a + 5 * a_stride));
+  b6 = _mm_loadl_epi64((const __m128i *)(a + 6 * a_stride));
+  b7 = _mm_loadl_epi64((const __m128i *)(a + 7 * a_stride));
+
+  t = 1;
+  for (j = 0; j <= 5; j++) {
+    for (i = 0; i < 8 * n; i += 8, t++) {
+      /* B = AES(K, A | R[i]) */
+      k = _mm_loadu_si128(rk);
+      b0 = _mm_xor_si128(_mm_unpacklo_epi64(b0, _mm_loadl_epi64((const __m128i *)(r + 0 * r_stride + i))), k);
+      b1 = _mm_xor_si128(_mm_unpacklo_epi64(b1, _mm_loadl_epi64((const __m128i *)(r + 1 * r_stride + i))), k);
+      b2 = _mm_xor_si128(_mm_unpacklo_epi64(b2, _mm_loadl_epi64((const __m128i *)(r + 2 * r_stride + i))), k);
+      b3 = _mm_xor_si128(_mm_unpacklo_epi64(b3, _mm_loadl_epi64((const __m128i *)(r + 3 * r_stride + i))), k);
+      b4 = _mm_xor_si128(_mm_unpacklo_epi64(b4, _mm_loadl_epi64((const __m128i *)(r + 4 * r_stride + i))), k);
+      b5 = _mm_xor_si128(_mm_unpacklo_epi64(b5, _mm_loadl_epi64((const __m128i *)(r + 5 * r_stride + i))), k);
+      b6 = _mm_xor_si128(_mm_unpacklo_epi64(b6, _mm_loadl_epi64((const __m128i *)(r + 6 * r_stride + i))), k);
+      b7 = _mm_xor_si128(_mm_unpacklo_epi64(b7, _mm_loadl_epi64((const __m128i *)(r + 7 * r_stride + i))), k);
+      for (round = 1; round < 10; round++) {
+        k = _mm_loadu_si128(rk + round);
+        b0 = _mm_aesenc_si128(b0, k);
+        b1 = _mm_aesenc_si128(b1, k);
+        b2 = _mm_aesenc_si128(b2, k);
+        b3 = _mm_aesenc_si128(b3, k);
+        b4 = _mm_aesenc_si128(b4, k);
+        b5 = _mm_aesenc_si128(b5, k);
+        b6 = _mm_aesenc_si128(b6, k);
+        b7 = _mm_aesenc_si128(b7, k);
+      }
+      k = _mm_loadu_si128(rk + 10);
+      b0 = _mm_aesenclast_si128(b0, k);
+      b1 = _mm_aesenclast_si128(b1, k);
+      b2 = _mm_aesenclast_si128(b2, k);
+      b3 = _mm_aesenclast_si128(b3, k);
+      b4 = _mm_aesenclast_si128(b4, k);
+      b5 = _mm_aesenclast_si128(b5, k);
+      b6 = _mm_aesenclast_si128(b6, k);
+      b7 = _mm_aesenclast_si128(b7, k);
+
+      /* R[i] = LSB(64, B), A = MSB(64, B) ^ t */
+      _mm_storel_epi64((__m128i *)(r + 0 * r_stride + i), _mm_srli_si128(b0, 8));
+      _mm_storel_epi64((__m128i *)(r + 1 * r_stride + i), _mm_srli_si128(b1, 8));
+      _mm_storel_epi64((__m128i *)(r + 2 * r_stride + i), _mm_srli_si128(b2, 8));
+      _mm_storel_epi64((__m128i *)(r + 3 * r_stride + i), _mm_srli_si128(b3, 8));
+      _mm_storel_epi64((__m128i *)(r + 4 * r_stride + i), _mm_srli_si128(b4, 8));
+      _mm_storel_epi64((__m128i *)(r + 5 * r_stride + i), _mm_srli_si128(b5, 8));
+      _mm_storel_epi64((__m128i *)(r + 6 * r_stride + i), _mm_srli_si128(b6, 8));
+      _mm_storel_epi64((__m128i *)(r + 7 * r_stride + i), _mm_srli_si128(b7, 8));
+      k = aes_kw_t_aesni(t);
+      b0 = _mm_xor_si128(b0, k);
+      b1 = _mm_xor_si128(b1, k);
+      b2 = _mm_xor_si128(b2, k);
+      b3 = _mm_xor_si128(b3, k);
+      b4 = _mm_xor_si128(b4, k);
+      b5 = _mm_xor_si128(b5, k);
+      b6 = _mm_xor_si128(b6, k);
+      b7 = _mm_xor_si128(b7, k);
+    }
+  }
+
+  _mm_storel_epi64((__m128i *)(a + 0 * a_stride), b0);
+  _mm_storel_epi64((__m128i *)(a + 1 * a_stride), b1);
+  _mm_storel_epi64((__m128i *)(a + 2 * a_stride), b2);
+  _mm_storel_epi64((__m128i *)(a + 3 * a_stride), b3);
+  _mm_storel_epi64((__m128i *)(a + 4 * a_stride), b4);
+  _mm_storel_epi64((__m128i *)(a + 5 * a_stride), b5);
+  _mm_storel_epi64((__m128i *)(a + 6 * a_stride), b6);
+  _mm_storel_epi64((__m128i *)(a + 7 * a_stride), b7);
+}
+
+/*
+ * Computes the steps of aes_kw_unwrap_blocks() for 8 keys with the AES-NI
+ * instructions, interleaving their rounds.
+ * a: pointer to the value A of the first key (C[0]), replaced by its result
+ * a_stride: number of bytes from the A of each key to that of the next one
+ * r: pointer to the blocks R[1..n] of the first key
+ * r_stride: number of bytes from the blocks of each key to those of the next one
+ * n: number of 8-byte blocks of each key
+ * ctx: pointer to the expanded key encryption key
+ */
+__attribute__((target("aes,sse2,ssse3")))
+static void aes_kw_unwrap_8_aesni(unsigned char *a, size_t a_stride, unsigned char *r, size_t r_stride, size_t n, const struct aes_key *ctx) {
+  const __m128i *rk = (const __m128i *)ctx->round_keys;
+  __m128i dk[11];  /* [AES] 5.3.5 Equivalent Inverse Cipher round keys */
+  __m128i k, b0, b1, b2, b3, b4, b5, b6, b7;
+  size_t i, t;
+  int j, round;
+
+  dk[0] = _mm_loadu_si128(rk);
+  for (round = 1; round < 10; round++) {
+    dk[round] = _mm_aesimc_si128(_mm_loadu_si128(rk + round));
+  }
+  dk[10] = _mm_loadu_si128(rk + 10);
+
+  b0 = _mm_loadl_epi64((const __m128i *)(a + 0 * a_stride));
+  b1 = _mm_loadl_epi64((const __m128i *)(a + 1 * a_stride));
+  b2 = _mm_loadl_epi64((const __m128i *)(a + 2 * a_stride));
+  b3 = _mm_loadl_epi64((const __m128i *)(a + 3 * a_stride));
+  b4 = _mm_loadl_epi64((const __m128i *)(a + 4 * a_stride));
+  b5 = _mm_loadl_epi64((const __m128i *)(a + 5 * a_stride));
+  b6 = _mm_loadl_epi64((const __m128i *)(a + 6 * a_stride));
+  b7 = _mm_loadl_epi64((const __m128i *)(a + 7 * a_stride));
+
+  t = 6 * n;
+  for (j = 5; j >= 0; j--) {
+    for (i = 8 * n; i >= 8; i -= 8, t--) {
+      /* B = AES-1(K, (A ^ t) | R[i]) */
+      k = aes_kw_t_aesni(t);
+      b0 = _mm_unpacklo_epi64(_mm_xor_si128(b0, k), _mm_loadl_epi64((const __m128i *)(r + 0 * r_stride + i - 8)));
+      b1 = _mm_unpacklo_epi64(_mm_xor_si128(b1, k), _mm_loadl_epi64((const __m128i *)(r + 1 * r_stride + i - 8)));
+      b2 = _mm_unpacklo_epi64(_mm_xor_si128(b2, k), _mm_loadl_epi64((const __m128i *)(r + 2 * r_stride + i - 8)));
+      b3 = _mm_unpacklo_epi64(_mm_xor_si128(b3, k), _mm_loadl_epi64((const __m128i *)(r + 3 * r_stride + i - 8)));
+      b4 = _mm_unpacklo_epi64(_mm_xor_si128(b4, k), _mm_loadl_epi64((const __m128i *)(r + 4 * r_stride + i - 8)));
+      b5 = _mm_unpacklo_epi64(_mm_xor_si128(b5, k), _mm_loadl_epi64((const __m128i *)(r + 5 * r_stride + i - 8)));
+      b6 = _mm_unpacklo_epi64(_mm_xor_si128(b6, k), _mm_loadl_epi64((const __m128i *)(r + 6 * r_stride + i - 8)));
+      b7 = _mm_unpacklo_epi64(_mm_xor_si128(b7, k), _mm_loadl_epi64((const __m128i *)(r + 7 * r_stride + i - 8)));
+      k = dk[10];
+      b0 = _mm_xor_si128(b0, k);
+      b1 = _mm_xor_si128(b1, k);
+      b2 = _mm_xor_si128(b2, k);
+      b3 = _mm_xor_si128(b3, k);
+      b4 = _mm_xor_si128(b4, k);
+      b5 = _mm_xor_si128(b5, k);
+      b6 = _mm_xor_si128(b6, k);
+      b7 = _mm_xor_si128(b7, k);
+      for (round = 9; round > 0; round--) {
+        k = dk[round];
+        b0 = _mm_aesdec_si128(b0, k);
+        b1 = _mm_aesdec_si128(b1, k);
+        b2 = _mm_aesdec_si128(b2, k);
+        b3 = _mm_aesdec_si128(b3, k);
+        b4 = _mm_aesdec_si128(b4, k);
+        b5 = _mm_aesdec_si128(b5, k);
+        b6 = _mm_aesdec_si128(b6, k);
+        b7 = _mm_aesdec_si128(b7, k);
+      }
+      k = dk[0];
+      b0 = _mm_aesdeclast_si128(b0, k);
+      b1 = _mm_aesdeclast_si128(b1, k);
+      b2 = _mm_aesdeclast_si128(b2, k);
+      b3 = _mm_aesdeclast_si128(b3, k);
+      b4 = _mm_aesdeclast_si128(b4, k);
+      b5 = _mm_aesdeclast_si128(b5, k);
+      b6 = _mm_aesdeclast_si128(b6, k);
+      b7 = _mm_aesdeclast_si128(b7, k);
+
+      /* A = MSB(64, B), R[i] = LSB(64, B) */
+      _mm_storel_epi64((__m128i *)(r + 0 * r_stride + i - 8), _mm_srli_si128(b0, 8));
+      _mm_storel_epi64((__m128i *)(r + 1 * r_stride + i - 8), _mm_srli_si128(b1, 8));
+      _mm_storel_epi64((__m128i *)(r + 2 * r_stride + i - 8), _mm_srli_si128(b2, 8));
+      _mm_storel_epi64((__m128i *)(r + 3 * r_stride + i - 8), _mm_srli_si128(b3, 8));
+      _mm_storel_epi64((__m128i *)(r + 4 * r_stride + i - 8), _mm_srli_si128(b4, 8));
+      _mm_storel_epi64((__m128i *)(r + 5 * r_stride + i - 8), _mm_srli_si128(b5, 8));
+      _mm_storel_epi64((__m128i *)(r + 6 * r_stride + i - 8), _mm_srli_si128(b6, 8));
+      _mm_storel_epi64((__m128i *)(r + 7 * r_stride + i - 8), _mm_srli_si128(b7, 8));
+    }
+  }
+
+  _mm_storel_epi64((__m128i *)(a + 0 * a_stride), b0);
+  _mm_storel_epi64((__m128i *)(a + 1 * a_stride), b1);
+  _mm_storel_epi64((__m128i *)(a + 2 * a_stride), b2);
+  _mm_storel_epi64((__m128i *)(a + 3 * a_stride), b3);
+  _mm_storel_epi64((__m128i *)(a + 4 * a_stride), b4);
+  _mm_storel_epi64((__m128i *)(a + 5 * a_stride), b5);
+  _mm_storel_epi64((__m128i *)(a + 6 * a_stride), b6);
+  _mm_storel_epi64((__m128i *)(a + 7 * a_stride), b7);
+}
+
+#endif
+
+/*
+ * Computes the steps of aes_kw_wrap() for up to AES_KW_BATCH keys together.
+ * a: pointer to the initial value A of the first key, replaced by its result
+ * a_stride: number of bytes from the A of each key to that of the next one
+ * r: pointer to the blocks R[1..n] of the first key
+ * r_stride: number of bytes from the blocks of each key to those of the next one
+ * n: number of 8-byte blocks of each key
+ * lanes: number of keys, from 1 to AES_KW_BATCH
+ * ctx: pointer to the expanded key encryption key
+ */
+static void aes_kw_wrap_lanes(unsigned char *a, size_t a_stride, unsigned char *r, size_t r_stride, size_t n, int lanes, const struct aes_key *ctx) {
+  unsigned char x[16 * AES_KW_BATCH];  /* A | R[i] of each key */
+  size_t i, t;
+  int j, k, w;
+
+#ifdef AES_AESNI
+  if (ctx->backend == AES_BACKEND_AESNI) {
+    if (lanes == 8) {
+      aes_kw_wrap_8_aesni(a, a_stride, r, r_stride, n, ctx);
+    } else {
+      for (k = 0; k < lanes; k++) {
+        aes_kw_wrap_aesni(a + k * a_stride, r + k * r_stride, n, ctx);
+      }
+    }
+    return;
+  }
+#endif
+
+  for (k = 0; k < lanes; k++) {
+    for (w = 0; w < 8; w++) {
+      x[16 * k + w] = a[k * a_stride + w];
+    }
+  }
+  t = 1;
+  for (j = 0; j <= 5; j++) {
+    for (i = 0; i < 8 * n; i += 8, t++) {
+      for (k = 0; k < lanes; k++) {
+        for (w = 0; w < 8; w++) {
+          x[16 * k + 8 + w] = r[k * r_stride + i + w];
+        }
+      }
+      aes_encrypt_blocks(ctx, x, x, lanes);
+      for (k = 0; k < lanes; k++) {
+        for (w = 0; w < 8; w++) {
+          r[k * r_stride + i + w] = x[16 * k + 8 + w];
+        }
+        aes_kw_xor_t(x + 16 * k, t);
+      }
+    }
+  }
+  for (k = 0; k < lanes; k++) {
+    for (w = 0; w < 8; w++) {
+      a[k * a_stride + w] = x[16 * k + w];
+    }
+  }
+}
+
+/*
+ * Computes the steps of aes_kw_unwrap_blocks() for up to AES_KW_BATCH keys together.
+ * a: pointer to the value A of the first key (C[0]), replaced by its result
+ * a_stride: number of bytes from the A of each key to that of the next one
+ * r: pointer to the blocks R[1..n] of the first key
+ * r_stride: number of bytes from the blocks of each key to those of the next one
+ * n: number of 8-byte blocks of each key
+ * lanes: number of keys, from 1 to AES_KW_BATCH
+ * ctx: pointer to the expanded key encryption key
+ */
+static void aes_kw_unwrap_lanes(unsigned char *a, size_t a_stride, unsigned char *r, size_t r_stride, size_t n, int lanes, const struct aes_key *ctx) {
+  unsigned char x[16 * AES_KW_BATCH];  /* (A ^ t) | R[i] of each key */
+  size_t i, t;
+  int j, k, w;
+
+#ifdef AES_AESNI
+  if (ctx->backend == AES_BACKEND_AESNI) {
+    if (lanes == 8) {
+      aes_kw_unwrap_8_aesni(a, a_stride, r, r_stride, n, ctx);
+    } else {
+      for (k = 0; k < lanes; k++) {
+        aes_kw_unwrap_aesni(a + k * a_stride, r + k * r_stride, n, ctx);
+      }
+    }
+    return;
+  }
+#endif
+
+  for (k = 0; k < lanes; k++) {
+    for (w = 0; w < 8; w++) {
+      x[16 * k + w] = a[k * a_stride + w];
+    }
+  }
+  t = 6 * n;
+  for (j = 5; j >= 0; j--) {
+    for (i = 8 * n; i >= 8; i -= 8, t--) {
+      for (k = 0; k < lanes; k++) {
+        aes_kw_xor_t(x + 16 * k, t);
+        for (w = 0; w < 8; w++) {
+          x[16 * k + 8 + w] = r[k * r_stride + i - 8 + w];
+        }
+      }
+      aes_decrypt_blocks(ctx, x, x, lanes);
+      for (k = 0; k < lanes; k++) {
+        for (w = 0; w < 8; w++) {
+          r[k * r_stride + i - 8 + w] = x[16 * k + 8 + w];
+        }
+      }
+    }
+  }
+  for (k = 0; k < lanes; k++) {
+    for (w = 0; w < 8; w++) {
+      a[k * a_stride + w] = x[16 * k + w];
+    }
+  }
+}
+
+/*
+ * Computes the AES Key Wrap algorithm for several keys of the same length
+ * with a key encryption key previously expanded by aes_expand_key().
+ * ciphertexts: pointer to (count * (n + 1) * 8) bytes to store the ciphertexts,
+ *              one after the other
+ * plaintexts: pointer to (count * n * 8) bytes with the plaintexts,
+ *             one after the other
+ * n: number of 8-byte blocks of each plaintext, at least 2
+ * count: number of keys
+ * ctx: pointer to the expanded key encryption key
+ *
+ * The ciphertexts must not overlap the plaintexts.
+ *
+ * [RFC3394] 2.2.1 Key Wrap
+ */
+static void aes_kw_batch(void *ciphertexts, const void *plaintexts, size_t n, int count, const struct aes_key *ctx) {
+  unsigned char *c = (unsigned char *)ciphertexts;
+  const unsigned char *p = (const unsigned char *)plaintexts;
+  size_t i;
+  int k, lanes;
+
+  for (; count > 0; count -= lanes) {
+    lanes = count < AES_KW_BATCH ? count : AES_KW_BATCH;
+    for (k = 0; k < lanes; k++) {
+      for (i = 0; i < 8; i++) {  /* A = IV = 0xa6a6a6a6a6a6a6a6 */
+        c[k * 8 * (n + 1) + i] = 0xa6;
+      }
+      for (i = 0; i < 8 * n; i++) {  /* R[i] = P[i] */
+        c[k * 8 * (n + 1) + 8 + i] = p[k * 8 * n + i];
+      }
+    }
+    aes_kw_wrap_lanes(c, 8 * (n + 1), c + 8, 8 * (n + 1), n, lanes, ctx);
+    c += lanes * 8 * (n + 1);
+    p += lanes * 8 * n;
+  }
+}
+
+/*
+ * Computes the AES Key Unwrap algorithm for several keys of the same length,
+ * and checks their integrity, with a key encryption key previously expanded
+ * by aes_expand_key().
+ * plaintexts: pointer to (count * n * 8) bytes to store the plaintexts,
+ *             one after the other
+ * ciphertexts: pointer to (count * (n + 1) * 8) bytes with the ciphertexts,
+ *              one after the other
+ * n: number of 8-byte blocks of each plaintext, at least 2
+ * count: number of keys
+ * ctx: pointer to the expanded key encryption key
+ * results: pointer to count ints to store 0 for each authentic key, and -1
+ *          for the others (whose plaintexts are zeroed), or NULL
+ * Returns the number of keys that are not authentic.
+ *
+ * The plaintexts may overlap the ciphertexts only if they are at the same address.
+ *
+ * [RFC3394] 2.2.2 Key Unwrap, and 2.2.3 Key Data Integrity -- the Initial Value
+ */
+static int aes_kw_unwrap_batch(void *plaintexts, const void *ciphertexts, size_t n, int count, const struct aes_key *ctx, int *results) {
+  unsigned char *p = (unsigned char *)plaintexts;
+  const unsigned char *c = (const unsigned char *)ciphertexts;
+  unsigned char a[8 * AES_KW_BATCH];
+  unsigned char diff;
+  size_t i;
+  int k, lanes, failures;
+
+  failures = 0;
+  for (; count > 0; count -= lanes) {
+    lanes = count < AES_KW_BATCH ? count : AES_KW_BATCH;
+    /* A = C[0], R[i] = C[i], in this order in case the plaintexts are the ciphertexts */
+    for (k = 0; k < lanes; k++) {
+      for (i = 0; i < 8; i++) {
+        a[8 * k + i] = c[i];
+      }
+      for (i = 0; i < 8 * n; i++) {
+        p[k * 8 * n + i] = c[8 + i];
+      }
+      c += 8 * (n + 1);
+    }
+    aes_kw_unwrap_lanes(a, 8, p, 8 * n, n, lanes, ctx);
+
+    /* Each A must be the default IV 0xa6a6a6a6a6a6a6a6 */
+    for (k = 0; k < lanes; k++) {
+      diff = 0;
+      for (i = 0; i < 8; i++) {
+        diff |= a[8 * k + i] ^ 0xa6;
+      }
+      if (diff) {
+        for (i = 0; i < 8 * n; i++) {
+          p[k * 8 * n + i] = 0;
+        }
+        failures++;
+      }
+      if (results) {
+        *results++ = diff ? -1 : 0;
+      }
+    }
+    p += lanes * 8 * n;
   }
+  return failures;
 }
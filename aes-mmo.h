@@ -14,68 +14,569 @@
  * #include "aes.h"
  * #include "aes-mmo.h"
  *
- * digest: pointer to 16 bytes (128 bits) of memory to store the message digest output
- * message: input message
- * length: number of bytes of the input message
+ * aes_mmo() hashes a whole message at once. To hash a message as it arrives,
+ * such as a firmware image being received, call aes_mmo_init(), then
+ * aes_mmo_update() with each part of the message, and then aes_mmo_final().
+ * Both give the same digest. aes_mmo_many() hashes many independent
+ * messages at once, such as the install codes of a batch of devices,
+ * interleaving the blocks of 8 of them to keep the processor busy.
  *
  * Reference:
  * ZigBee specification, document 05-3474-21, Aug 2015,
  * section B.6 Block-Cipher-Based Cryptographic Hash Function.
  */
-static void aes_mmo(void *digest, const void *message, int length) {
-  int i, r;
-  unsigned char p[16];
+
+#include <stddef.h>
+
+#ifdef AES_AESNI
+#include <tmmintrin.h>
+#endif
+
+/*
+ * Limit on the number of bytes of a message: the padding has a 32-bit
+ * length field in bits, so the message must be shorter than 2^29 bytes.
+ */
+#define AES_MMO_MAX_LENGTH 0x20000000UL
+
+/*
+ * Holds the state of a hash computation between aes_mmo_update() calls.
+ */
+struct aes_mmo_state {
+  unsigned char digest[16];  /* Hashj-1 */
+  unsigned char block[16];  /* the bytes received so far of the next block Mj */
+  size_t length;  /* number of bytes of the message received so far, AES_MMO_MAX_LENGTH after an error */
+};
+
+#ifdef AES_AESNI
+
+/*
+ * Computes aes_mmo_blocks() with the AES-NI instructions, keeping Hashj
+ * in a register from one block to the next, and computing the round keys
+ * from it with AESKEYGENASSIST as the rounds need them.
+ */
+__attribute__((target("aes,sse2")))
+static void aes_mmo_blocks_aesni(unsigned char *digest, const unsigned char *blocks, size_t n) {
+  __m128i h, m;
+
+  h = _mm_loadu_si128((const __m128i *)digest);
+  for (; n > 0; n--) {
+    m = _mm_loadu_si128((const __m128i *)blocks);
+    h = _mm_xor_si128(aes_encrypt_aesni_key(m, h), m);
+    blocks += 16;
+  }
+  _mm_storeu_si128((__m128i *)digest, h);
+}
+
+#endif
+
+/*
+ * Computes Hashj = E(Hashj-1, Mj) xor Mj for n consecutive blocks.
+ * digest: pointer to the 16 bytes of Hashj-1, replaced by the last Hashj
+ * blocks: pointer to the (16 * n) bytes of the blocks Mj
+ * n: number of blocks
+ *
+ * Each block uses a new key, Hashj-1, only once: aes_encrypt() computes
+ * its round keys along with the rounds, without storing the key schedule.
+ */
+static void aes_mmo_blocks(unsigned char *digest, const unsigned char *blocks, size_t n) {
+  int i;
+
+#ifdef AES_AESNI
+  if (aes_has_aesni()) {
+    aes_mmo_blocks_aesni(digest, blocks, n);
+    return;
+  }
+#endif
+  for (; n > 0; n--) {
+    aes_encrypt(digest, blocks, digest);
+    for (i = 0; i < 16; i++) {
+      digest[i] ^= blocks[i];
+    }
+    blocks += 16;
+  }
+}
+
+/*
+ * Starts the computation of a hash.
+ * state: pointer to the aes_mmo_state structure to initialize
+ */
+static AES_UNUSED void aes_mmo_init(struct aes_mmo_state *state) {
+  int i;
 
   /* Hash0 = 0^(8n)  n-octet all-zero bit string */
   for (i = 0; i < 16; i++) {
-    ((char *)digest)[i] = 0;
+    state->digest[i] = 0;
   }
+  state->length = 0;
+}
 
-  /* Hashj = E(Hashj-1,Mj) xor Mj */
-  for (r = 0; r <= length - 16; r += 16) {
-    aes_encrypt(digest, (char *)message + r, digest);
-    for (i = 0; i < 16; i++) {
-      ((char *)digest)[i] ^= ((char *)message)[r + i];
+/*
+ * Hashes the next part of the message.
+ * state: pointer to the state initialized by aes_mmo_init()
+ * message: pointer to the next part of the message
+ * length: number of bytes of this part, which can be any number
+ *
+ * Returns 0 on success, or -1 if the message would reach AES_MMO_MAX_LENGTH
+ * (2^29) bytes, which the padding cannot represent: then nothing is hashed,
+ * and the next calls to aes_mmo_update() and aes_mmo_final() fail too.
+ */
+static AES_UNUSED int aes_mmo_update(struct aes_mmo_state *state, const void *message, size_t length) {
+  const unsigned char *m = (const unsigned char *)message;
+  size_t i, n;
+
+  if (length >= AES_MMO_MAX_LENGTH - state->length) {
+    state->length = AES_MMO_MAX_LENGTH;
+    return -1;
+  }
+
+  /* Complete the block left over by the previous call */
+  n = state->length & 15;
+  state->length += length;
+  if (n > 0) {
+    for (; n < 16 && length > 0; n++, length--) {
+      state->block[n] = *m++;
+    }
+    if (n < 16) {
+      return 0;
     }
+    aes_mmo_blocks(state->digest, state->block, 1);
+  }
+
+  /* Hashj = E(Hashj-1,Mj) xor Mj */
+  aes_mmo_blocks(state->digest, m, length / 16);
+  m += length & ~(size_t)15;
+  length &= 15;
+
+  /* Keep the rest for the next call */
+  for (i = 0; i < length; i++) {
+    state->block[i] = m[i];
   }
+  return 0;
+}
 
-  /* Build and process the final padded block(s) */
-  r = length & 15;
+/*
+ * Builds the final padded block(s) of a message.
+ * p: pointer to 32 bytes of memory to store the padded block(s)
+ * tail: pointer to the last (length % 16) bytes of the message
+ * length: number of bytes of the whole message
+ * Returns the number of padded blocks, 1 or 2.
+ *
+ * The padding depends on the total length of the message: it has a 16-bit
+ * length field if the message is shorter than 8192 bytes (2^16 bits), or
+ * a 32-bit one followed by 16 zero bits if not (so the message must be
+ * shorter than AES_MMO_MAX_LENGTH, 2^29 bytes).
+ */
+static int aes_mmo_pad(unsigned char *p, const unsigned char *tail, size_t length) {
+  int i, r, n;
+
+  r = (int)(length & 15);
   for (i = 0; i < r; i++) {
-    p[i] = ((char *)message)[(length & ~15) + i];
+    p[i] = tail[i];
   }
   p[r++] = 0x80;
-  if ((length < 8192 && r > 14) || (length >= 8192 && r > 10)) {
-    /* The first of 2 padded blocks */
-    for (i = r; i < 16; i++) {
-      p[i] = 0;
-    }
-    aes_encrypt(digest, p, digest);
-    for (i = 0; i < 16; i++) {
-      ((char *)digest)[i] ^= p[i];
-    }
-    r = 0;
+  /* A second block if the length field does not fit after the 1 bit */
+  n = (length < 8192 && r > 14) || (length >= 8192 && r > 10) ? 32 : 16;
+  for (i = r; i < n; i++) {
+    p[i] = 0;
   }
-  /* The final padded block with the length in bits */
   if (length < 8192) {
-    for (i = r; i < 14; i++) {
-      p[i] = 0;
-    }
-    p[14] = length >> 5;
-    p[15] = length << 3;
+    p[n - 2] = (unsigned char)(length >> 5);
+    p[n - 1] = (unsigned char)(length << 3);
   } else {
-    for (i = r; i < 10; i++) {
-      p[i] = 0;
+    p[n - 6] = (unsigned char)(length >> 21);
+    p[n - 5] = (unsigned char)(length >> 13);
+    p[n - 4] = (unsigned char)(length >> 5);
+    p[n - 3] = (unsigned char)(length << 3);
+  }
+  return n / 16;
+}
+
+/*
+ * Finishes the computation of a hash.
+ * state: pointer to the state after the last aes_mmo_update()
+ * digest: pointer to 16 bytes (128 bits) of memory to store the message digest output
+ *
+ * Returns 0 on success, or -1 if a call to aes_mmo_update() failed
+ * because the message was too long (and then no digest is stored).
+ */
+static AES_UNUSED int aes_mmo_final(struct aes_mmo_state *state, void *digest) {
+  unsigned char p[32];
+  int i;
+
+  if (state->length >= AES_MMO_MAX_LENGTH) {
+    return -1;
+  }
+  aes_mmo_blocks(state->digest, p, aes_mmo_pad(p, state->block, state->length));
+
+  for (i = 0; i < 16; i++) {
+    ((unsigned char *)digest)[i] = state->digest[i];
+  }
+  return 0;
+}
+
+/*
+ * Computes the hash of a whole message.
+ * digest: pointer to 16 bytes (128 bits) of memory to store the message digest output
+ * message: input message
+ * length: number of bytes of the input message
+ *
+ * Returns 0 on success, or -1 if length is AES_MMO_MAX_LENGTH (2^29) or more,
+ * which the padding cannot represent (and then no digest is stored).
+ */
+static AES_UNUSED int aes_mmo(void *digest, const void *message, size_t length) {
+  struct aes_mmo_state state;
+
+  aes_mmo_init(&state);
+  aes_mmo_update(&state, message, length);
+  return aes_mmo_final(&state, digest);
+}
+
+/*
+ * Hashing many messages: each block of a message depends on the previous
+ * one, so one message at a time waits for every AES encryption to finish.
+ * aes_mmo_many() instead keeps 8 messages in lanes, and encrypts a block of
+ * each of them together, each with its own key; when a message ends,
+ * the next one takes its lane.
+ */
+
+#define AES_MMO_LANES 8
+
+/*
+ * Holds the state of a message being hashed in a lane by aes_mmo_many().
+ */
+struct aes_mmo_lane {
+  const unsigned char *next;  /* the next block Mj, in the message or in padding */
+  size_t blocks;  /* number of whole blocks of the message left, from next */
+  int padded;  /* number of padded blocks left (0 if the lane is free) */
+  unsigned char padding[32];  /* the final padded block(s) */
+  const unsigned char *hash;  /* Hashj-1: Hash0, then the digest */
+  unsigned char *digest;  /* the digest output of the message, for Hashj */
+};
+
+#ifdef AES_AESNI
+
+/*
+ * Computes the next round key from the previous one w, with AESENCLAST
+ * instead of AESKEYGENASSIST so that rcon can be in a register:
+ * the shuffle puts RotWord(w[3]) in every column, where ShiftRows does nothing.
+ * rcon: the round constant in the first byte of every column
+ *
+ * [AES] 5.2 Key Expansion
+ */
+__attribute__((target("aes,sse2,ssse3")))
+static __m128i aes_mmo_next_key_aesni(__m128i w, __m128i rcon) {
+  const __m128i rot = _mm_set_epi8(12, 15, 14, 13, 12, 15, 14, 13, 12, 15, 14, 13, 12, 15, 14, 13);
+  __m128i t;
+
+  t = _mm_aesenclast_si128(_mm_shuffle_epi8(w, rot), rcon);
+  w = _mm_xor_si128(w, _mm_slli_si128(w, 4));
+  w = _mm_xor_si128(w, _mm_slli_si128(w, 4));
+  w = _mm_xor_si128(w, _mm_slli_si128(w, 4));
+  return _mm_xor_si128(w, t);
+}
+
+/*
+ * Computes Hashj = E(Hashj-1, Mj) xor Mj for a block of 8 messages with the
+ * AES-NI instructions, interleaving their rounds and key expansions.
+ * out: pointers to 16 bytes of memory to store Hashj of each message
+ * h: pointers to the 16 bytes of Hashj-1 of each message (may be out)
+ * m: pointers to the 16 bytes of the block Mj of each message
+ */
+__attribute__((target("aes,sse2,ssse3")))
+static void aes_mmo_8_aesni(unsigned char *const *out, const unsigned char *const *h, const unsigned char *const *m) {
+  __m128i k0, k1, k2, k3, k4, k5, k6, k7;
+  __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+  __m128i rc;
+  unsigned char rcon;
+  int round;
+
+  k0 = _mm_loadu_si128((const __m128i *)h[0]);
+  k1 = _mm_loadu_si128((const __m128i *)h[1]);
+  k2 = _mm_loadu_si128((const __m128i *)h[2]);
+  k3 = _mm_loadu_si128((const __m128i *)h[3]);
+  k4 = _mm_loadu_si128((const __m128i *)h[4]);
+  k5 = _mm_loadu_si128((const __m128i *)h[5]);
+  k6 = _mm_loadu_si128((const __m128i *)h[6]);
+  k7 = _mm_loadu_si128((const __m128i *)h[7]);
+  b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)m[0]), k0);
+  b1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)m[1]), k1);
+  b2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)m[2]), k2);
+  b3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)m[3]), k3);
+  b4 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)m[4]), k4);
+  b5 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)m[5]), k5);
+  b6 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)m[6]), k6);
+  b7 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)m[7]), k7);
+
+  rcon = 1;
+  for (round = 1; round < 10; round++) {
+    rc = _mm_set1_epi32(rcon);
+    k0 = aes_mmo_next_key_aesni(k0, rc);
+    k1 = aes_mmo_next_key_aesni(k1, rc);
+    k2 = aes_mmo_next_key_aesni(k2, rc);
+    k3 = aes_mmo_next_key_aesni(k3, rc);
+    k4 = aes_mmo_next_key_aesni(k4, rc);
+    k5 = aes_mmo_next_key_aesni(k5, rc);
+    k6 = aes_mmo_next_key_aesni(k6, rc);
+    k7 = aes_mmo_next_key_aesni(k7, rc);
+    b0 = _mm_aesenc_si128(b0, k0);
+    b1 = _mm_aesenc_si128(b1, k1);
+    b2 = _mm_aesenc_si128(b2, k2);
+    b3 = _mm_aesenc_si128(b3, k3);
+    b4 = _mm_aesenc_si128(b4, k4);
+    b5 = _mm_aesenc_si128(b5, k5);
+    b6 = _mm_aesenc_si128(b6, k6);
+    b7 = _mm_aesenc_si128(b7, k7);
+    rcon = aes_xtime(rcon);
+  }
+  rc = _mm_set1_epi32(rcon);
+  k0 = aes_mmo_next_key_aesni(k0, rc);
+  k1 = aes_mmo_next_key_aesni(k1, rc);
+  k2 = aes_mmo_next_key_aesni(k2, rc);
+  k3 = aes_mmo_next_key_aesni(k3, rc);
+  k4 = aes_mmo_next_key_aesni(k4, rc);
+  k5 = aes_mmo_next_key_aesni(k5, rc);
+  k6 = aes_mmo_next_key_aesni(k6, rc);
+  k7 = aes_mmo_next_key_aesni(k7, rc);
+  b0 = _mm_xor_si128(_mm_aesenclast_si128(b0, k0), _mm_loadu_si128((const __m128i *)m[0]));
+  b1 = _mm_xor_si128(_mm_aesenclast_si128(b1, k1), _mm_loadu_si128((const __m128i *)m[1]));
+  b2 = _mm_xor_si128(_mm_aesenclast_si128(b2, k2), _mm_loadu_si128((const __m128i *)m[2]));
+  b3 = _mm_xor_si128(_mm_aesenclast_si128(b3, k3), _mm_loadu_si128((const __m128i *)m[3]));
+  b4 = _mm_xor_si128(_mm_aesenclast_si128(b4, k4), _mm_loadu_si128((const __m128i *)m[4]));
+  b5 = _mm_xor_si128(_mm_aesenclast_si128(b5, k5), _mm_loadu_si128((const __m128i *)m[5]));
+  b6 = _mm_xor_si128(_mm_aesenclast_si128(b6, k6), _mm_loadu_si128((const __m128i *)m[6]));
+  b7 = _mm_xor_si128(_mm_aesenclast_si128(b7, k7), _mm_loadu_si128((const __m128i *)m[7]));
+  _mm_storeu_si128((__m128i *)out[0], b0);
+  _mm_storeu_si128((__m128i *)out[1], b1);
+  _mm_storeu_si128((__m128i *)out[2], b2);
+  _mm_storeu_si128((__m128i *)out[3], b3);
+  _mm_storeu_si128((__m128i *)out[4], b4);
+  _mm_storeu_si128((__m128i *)out[5], b5);
+  _mm_storeu_si128((__m128i *)out[6], b6);
+  _mm_storeu_si128((__m128i *)out[7], b7);
+}
+
+#endif
+
+#ifdef AES_CONSTANT_TIME
+
+/*
+ * Computes the next round key of each of the 4 bitsliced keys in q[0..7]
+ * (see aes_bitslice_pack() in aes.h): SubWord(RotWord(w[3])) xor rcon is
+ * computed in column 3 and copied to every column, and every column
+ * is xored with those before it.
+ *
+ * [AES] 5.2 Key Expansion
+ */
+static void aes_mmo_next_key_bitslice(unsigned long *q, unsigned char rcon) {
+  unsigned long t[8];
+  int b;
+
+  for (b = 0; b < 8; b++) {
+    t[b] = AES_BITSLICE_ROT1(q[b]);
+  }
+  aes_bitslice_sbox(t);
+  for (b = 0; b < 8; b++) {
+    t[b] &= 0xf000f000f000f000UL;
+    t[b] |= t[b] >> 4;
+    t[b] |= t[b] >> 8;
+    t[b] ^= (unsigned long)(rcon >> b & 1) * 0x1111111111111111UL;
+    q[b] ^= q[b] << 4 & 0xfff0fff0fff0fff0UL;
+    q[b] ^= q[b] << 8 & 0xff00ff00ff00ff00UL;
+    q[b] ^= t[b];
+  }
+}
+
+/*
+ * Computes Hashj = E(Hashj-1, Mj) xor Mj for a block of 8 messages with
+ * the bitsliced implementation, which runs in constant time, expanding
+ * the 8 keys in the bitsliced representation along with the rounds.
+ * out: pointers to 16 bytes of memory to store Hashj of each message
+ * h: pointers to the 16 bytes of Hashj-1 of each message (may be out)
+ * m: pointers to the 16 bytes of the block Mj of each message
+ */
+static void aes_mmo_8_bitslice(unsigned char *const *out, const unsigned char *const *h, const unsigned char *const *m) {
+  unsigned char x[128];
+  unsigned long q[16];  /* blocks 0 to 3 in q[0..7], and 4 to 7 in q[8..15] */
+  unsigned long k[16];  /* their keys */
+  unsigned char rcon;
+  int i, b, round;
+
+  for (i = 0; i < 128; i++) {
+    x[i] = h[i >> 4][i & 15];
+  }
+  aes_bitslice_pack(k, x);
+  aes_bitslice_pack(k + 8, x + 64);
+  for (i = 0; i < 128; i++) {
+    x[i] = m[i >> 4][i & 15];
+  }
+  aes_bitslice_pack(q, x);
+  aes_bitslice_pack(q + 8, x + 64);
+  for (b = 0; b < 16; b++) {
+    q[b] ^= k[b];
+  }
+
+  rcon = 1;
+  for (round = 1; round <= 10; round++) {
+    aes_bitslice_sbox(q);
+    aes_bitslice_sbox(q + 8);
+    aes_bitslice_shift_rows(q);
+    aes_bitslice_shift_rows(q + 8);
+    if (round < 10) {
+      aes_bitslice_mix_columns(q);
+      aes_bitslice_mix_columns(q + 8);
     }
-    p[10] = length >> 21;
-    p[11] = length >> 13;
-    p[12] = length >> 5;
-    p[13] = length << 3;
-    p[14] = 0;
-    p[15] = 0;
-  }
-  aes_encrypt(digest, p, digest);
+    aes_mmo_next_key_bitslice(k, rcon);
+    aes_mmo_next_key_bitslice(k + 8, rcon);
+    rcon = aes_xtime(rcon);
+    for (b = 0; b < 16; b++) {
+      q[b] ^= k[b];
+    }
+  }
+
+  aes_bitslice_unpack(x, q);
+  aes_bitslice_unpack(x + 64, q + 8);
+  for (i = 0; i < 128; i++) {
+    out[i >> 4][i & 15] = x[i] ^ m[i >> 4][i & 15];
+  }
+}
+
+#endif
+
+#if defined(AES_AESNI) || defined(AES_CONSTANT_TIME)
+
+/*
+ * Computes Hashj = E(Hashj-1, Mj) xor Mj for a block of up to 8 messages.
+ * out: array of 8 pointers to 16 bytes of memory to store Hashj of each
+ *      message; the unused ones are overwritten
+ * h: array of 8 pointers to the 16 bytes of Hashj-1 of each message
+ *    (which may be out); the unused ones are overwritten
+ * m: array of 8 pointers to the 16 bytes of the block Mj of each message;
+ *    the unused ones are overwritten
+ * n: number of messages, from 1 to 8
+ */
+static void aes_mmo_lanes(unsigned char **out, const unsigned char **h, const unsigned char **m, int n) {
+  unsigned char idle[16];  /* Hashj-1, Mj and Hashj of the unused lanes */
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    idle[i] = 0;
+  }
+  for (i = n; i < AES_MMO_LANES; i++) {
+    out[i] = idle;
+    h[i] = idle;
+    m[i] = idle;
+  }
+#ifdef AES_AESNI
+  if (aes_has_aesni()) {
+    aes_mmo_8_aesni(out, h, m);
+    return;
+  }
+#endif
+#ifdef AES_CONSTANT_TIME
+  aes_mmo_8_bitslice(out, h, m);
+#endif
+}
+
+/*
+ * Computes aes_mmo_many() with aes_mmo_lanes(), starting the next message
+ * in a lane as soon as the one before it ends.
+ */
+static void aes_mmo_many_lanes(void *digests, const void *const *messages, const size_t *lengths, int count) {
+  struct aes_mmo_lane lanes[AES_MMO_LANES];
+  struct aes_mmo_lane *lane;
+  unsigned char zero[16];  /* Hash0 */
+  unsigned char *out[AES_MMO_LANES];
+  const unsigned char *h[AES_MMO_LANES];
+  const unsigned char *m[AES_MMO_LANES];
+  const unsigned char *message;
+  int next, i, n;
+
   for (i = 0; i < 16; i++) {
-    ((char *)digest)[i] ^= p[i];
+    zero[i] = 0;
+  }
+  for (i = 0; i < AES_MMO_LANES; i++) {
+    lanes[i].blocks = 0;
+    lanes[i].padded = 0;
+  }
+
+  for (next = 0;;) {
+    n = 0;
+    for (i = 0; i < AES_MMO_LANES; i++) {
+      lane = &lanes[i];
+      if (lane->padded == 0) {
+        /* The lane is free: start the next message in it */
+        if (next >= count) {
+          continue;
+        }
+        message = (const unsigned char *)messages[next];
+        lane->hash = zero;
+        lane->digest = (unsigned char *)digests + 16 * next;
+        lane->blocks = lengths[next] / 16;
+        lane->padded = aes_mmo_pad(lane->padding, message + 16 * lane->blocks, lengths[next]);
+        lane->next = lane->blocks > 0 ? message : lane->padding;
+        next++;
+      }
+      out[n] = lane->digest;
+      h[n] = lane->hash;
+      m[n] = lane->next;
+      n++;
+
+      /* Move to the block after this one */
+      lane->hash = lane->digest;
+      if (lane->blocks > 0) {
+        lane->blocks--;
+        lane->next = lane->blocks > 0 ? lane->next + 16 : lane->padding;
+      } else {
+        lane->padded--;
+        lane->next += 16;
+      }
+    }
+    if (n == 0) {
+      break;
+    }
+    aes_mmo_lanes(out, h, m, n);
+  }
+}
+
+#endif
+
+/*
+ * Computes the hashes of many whole messages.
+ * digests: pointer to (16 * count) bytes of memory to store the digest
+ *          of each message, one after the other
+ * messages: array of count pointers to the input messages
+ * lengths: array of the count numbers of bytes of the input messages
+ * count: number of messages
+ *
+ * Gives the same digests as aes_mmo() on each message, but with the AES-NI
+ * instructions or with AES_CONSTANT_TIME it hashes 8 of them at a time
+ * (see above), which is several times faster for short messages.
+ * The digests must not overlap the messages.
+ *
+ * Returns 0 on success, or -1 if a length is AES_MMO_MAX_LENGTH (2^29)
+ * or more (and then no digest is stored).
+ */
+static AES_UNUSED int aes_mmo_many(void *digests, const void *const *messages, const size_t *lengths, int count) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (lengths[i] >= AES_MMO_MAX_LENGTH) {
+      return -1;
+    }
+  }
+#ifdef AES_AESNI
+  if (aes_has_aesni()) {
+    aes_mmo_many_lanes(digests, messages, lengths, count);
+    return 0;
+  }
+#endif
+#ifdef AES_CONSTANT_TIME
+  aes_mmo_many_lanes(digests, messages, lengths, count);
+#else
+  /* The table lookups of the portable code gain nothing from interleaving */
+  for (i = 0; i < count; i++) {
+    aes_mmo((unsigned char *)digests + 16 * i, messages[i], lengths[i]);
   }
+#endif
+  return 0;
 }
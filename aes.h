@@ -8,13 +8,116 @@
  */
 
 /*
- * Implements the AES encryption algorithm for 128-bit keys (AES-128).
+ * Implements the AES encryption algorithm for 128-bit keys (AES-128),
+ * and its inverse with aes_decrypt_block() and aes_decrypt_blocks().
+ *
+ * By default the cipher works on one byte at a time, which keeps it small.
+ * Define AES_TTABLE before including this file to use a faster
+ * implementation that works on 32-bit words with a 1 KB lookup table
+ * combining the SubBytes and MixColumns transformations:
+ * #define AES_TTABLE
+ * #include "aes.h"
+ *
+ * On x86 processors with the AES-NI instructions, compiled with gcc or clang,
+ * aes_expand_key() and aes_encrypt_block() use those instructions instead.
+ * The processor is checked at run time, so the same program still works
+ * on processors without them. Define AES_NO_AESNI to leave them out.
+ *
+ * The table lookups of the plain C implementation depend on the key and on
+ * the data, so their timing can leak them through the processor caches.
+ * Define AES_CONSTANT_TIME to use a bitsliced implementation instead when
+ * the AES-NI instructions are not available. It only uses logical operations
+ * on 64-bit words and encrypts 8 blocks at a time (or 4, in half the time,
+ * for fewer blocks), so it is best used with aes_encrypt_blocks().
+ * It needs a 64-bit unsigned long.
  *
  * References:
  * [AES] Advanced Encryption Standard (AES), FIPS 197, Nov 26 2001.
  *       http://csrc.nist.gov/publications/fips/fips197/fips-197.pdf
  */
 
+/*
+ * Programs that include this file don't always call all of its functions,
+ * so tell the compiler that it is fine for some of them to be unused.
+ */
+#ifdef __GNUC__
+#define AES_UNUSED __attribute__((unused))
+#else
+#define AES_UNUSED
+#endif
+
+#include <limits.h>
+
+#if ULONG_MAX > 0xffffffffUL
+#define AES_BITSLICE
+#elif defined(AES_CONSTANT_TIME)
+#error "AES_CONSTANT_TIME needs a 64-bit unsigned long"
+#endif
+
+#if !defined(AES_NO_AESNI) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AES_AESNI
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
+
+/* The implementations of the cipher that an aes_key can use */
+#define AES_BACKEND_PORTABLE 0  /* plain C (byte-wise, or T-table with AES_TTABLE) */
+#define AES_BACKEND_AESNI 1  /* x86 AES-NI instructions */
+#define AES_BACKEND_BITSLICE 2  /* plain C, bitsliced, constant-time */
+
+/*
+ * Holds an expanded AES-128 cipher key, as computed by aes_expand_key().
+ * Expanding the key once and calling aes_encrypt_block() for each block
+ * avoids recomputing the key schedule for every block.
+ */
+struct aes_key {
+  unsigned char round_keys[176];  /* [AES] 5.2 Key Expansion: w[0..43] */
+  int backend;  /* AES_BACKEND_* used by aes_encrypt_block() */
+#ifdef AES_BITSLICE
+  unsigned long bitsliced_round_keys[11][8];  /* only for AES_BACKEND_BITSLICE */
+#endif
+};
+
+/* [AES] 5.1.1 SubBytes() transformation */
+static const unsigned char aes_sbox[256] = {
+  0x63,0x7c,0x77,0x7b,0xf2,0x6b,0x6f,0xc5,0x30,0x01,0x67,0x2b,0xfe,0xd7,0xab,0x76,
+  0xca,0x82,0xc9,0x7d,0xfa,0x59,0x47,0xf0,0xad,0xd4,0xa2,0xaf,0x9c,0xa4,0x72,0xc0,
+  0xb7,0xfd,0x93,0x26,0x36,0x3f,0xf7,0xcc,0x34,0xa5,0xe5,0xf1,0x71,0xd8,0x31,0x15,
+  0x04,0xc7,0x23,0xc3,0x18,0x96,0x05,0x9a,0x07,0x12,0x80,0xe2,0xeb,0x27,0xb2,0x75,
+  0x09,0x83,0x2c,0x1a,0x1b,0x6e,0x5a,0xa0,0x52,0x3b,0xd6,0xb3,0x29,0xe3,0x2f,0x84,
+  0x53,0xd1,0x00,0xed,0x20,0xfc,0xb1,0x5b,0x6a,0xcb,0xbe,0x39,0x4a,0x4c,0x58,0xcf,
+  0xd0,0xef,0xaa,0xfb,0x43,0x4d,0x33,0x85,0x45,0xf9,0x02,0x7f,0x50,0x3c,0x9f,0xa8,
+  0x51,0xa3,0x40,0x8f,0x92,0x9d,0x38,0xf5,0xbc,0xb6,0xda,0x21,0x10,0xff,0xf3,0xd2,
+  0xcd,0x0c,0x13,0xec,0x5f,0x97,0x44,0x17,0xc4,0xa7,0x7e,0x3d,0x64,0x5d,0x19,0x73,
+  0x60,0x81,0x4f,0xdc,0x22,0x2a,0x90,0x88,0x46,0xee,0xb8,0x14,0xde,0x5e,0x0b,0xdb,
+  0xe0,0x32,0x3a,0x0a,0x49,0x06,0x24,0x5c,0xc2,0xd3,0xac,0x62,0x91,0x95,0xe4,0x79,
+  0xe7,0xc8,0x37,0x6d,0x8d,0xd5,0x4e,0xa9,0x6c,0x56,0xf4,0xea,0x65,0x7a,0xae,0x08,
+  0xba,0x78,0x25,0x2e,0x1c,0xa6,0xb4,0xc6,0xe8,0xdd,0x74,0x1f,0x4b,0xbd,0x8b,0x8a,
+  0x70,0x3e,0xb5,0x66,0x48,0x03,0xf6,0x0e,0x61,0x35,0x57,0xb9,0x86,0xc1,0x1d,0x9e,
+  0xe1,0xf8,0x98,0x11,0x69,0xd9,0x8e,0x94,0x9b,0x1e,0x87,0xe9,0xce,0x55,0x28,0xdf,
+  0x8c,0xa1,0x89,0x0d,0xbf,0xe6,0x42,0x68,0x41,0x99,0x2d,0x0f,0xb0,0x54,0xbb,0x16
+};
+
+/* [AES] 5.3.2 InvSubBytes() transformation */
+static const unsigned char aes_inv_sbox[256] = {
+  0x52,0x09,0x6a,0xd5,0x30,0x36,0xa5,0x38,0xbf,0x40,0xa3,0x9e,0x81,0xf3,0xd7,0xfb,
+  0x7c,0xe3,0x39,0x82,0x9b,0x2f,0xff,0x87,0x34,0x8e,0x43,0x44,0xc4,0xde,0xe9,0xcb,
+  0x54,0x7b,0x94,0x32,0xa6,0xc2,0x23,0x3d,0xee,0x4c,0x95,0x0b,0x42,0xfa,0xc3,0x4e,
+  0x08,0x2e,0xa1,0x66,0x28,0xd9,0x24,0xb2,0x76,0x5b,0xa2,0x49,0x6d,0x8b,0xd1,0x25,
+  0x72,0xf8,0xf6,0x64,0x86,0x68,0x98,0x16,0xd4,0xa4,0x5c,0xcc,0x5d,0x65,0xb6,0x92,
+  0x6c,0x70,0x48,0x50,0xfd,0xed,0xb9,0xda,0x5e,0x15,0x46,0x57,0xa7,0x8d,0x9d,0x84,
+  0x90,0xd8,0xab,0x00,0x8c,0xbc,0xd3,0x0a,0xf7,0xe4,0x58,0x05,0xb8,0xb3,0x45,0x06,
+  0xd0,0x2c,0x1e,0x8f,0xca,0x3f,0x0f,0x02,0xc1,0xaf,0xbd,0x03,0x01,0x13,0x8a,0x6b,
+  0x3a,0x91,0x11,0x41,0x4f,0x67,0xdc,0xea,0x97,0xf2,0xcf,0xce,0xf0,0xb4,0xe6,0x73,
+  0x96,0xac,0x74,0x22,0xe7,0xad,0x35,0x85,0xe2,0xf9,0x37,0xe8,0x1c,0x75,0xdf,0x6e,
+  0x47,0xf1,0x1a,0x71,0x1d,0x29,0xc5,0x89,0x6f,0xb7,0x62,0x0e,0xaa,0x18,0xbe,0x1b,
+  0xfc,0x56,0x3e,0x4b,0xc6,0xd2,0x79,0x20,0x9a,0xdb,0xc0,0xfe,0x78,0xcd,0x5a,0xf4,
+  0x1f,0xdd,0xa8,0x33,0x88,0x07,0xc7,0x31,0xb1,0x12,0x10,0x59,0x27,0x80,0xec,0x5f,
+  0x60,0x51,0x7f,0xa9,0x19,0xb5,0x4a,0x0d,0x2d,0xe5,0x7a,0x9f,0x93,0xc9,0x9c,0xef,
+  0xa0,0xe0,0x3b,0x4d,0xae,0x2a,0xf5,0xb0,0xc8,0xeb,0xbb,0x3c,0x83,0x53,0x99,0x61,
+  0x17,0x2b,0x04,0x7e,0xba,0x77,0xd6,0x26,0xe1,0x69,0x14,0x63,0x55,0x21,0x0c,0x7d
+};
+
 /*
  * Multiply the binary polynomial b with the polynomial x.
  * [AES] 4.2.1 Multiplication by x.
@@ -28,50 +131,257 @@ static unsigned char aes_xtime(unsigned char b) {
 }
 
 /*
- * Performs the AES cipher transform (encryption) for Nk=4 (AES-128).
- * output: pointer to 64 bytes (128 bits) of memory to store the ciphertext
- * intput: pointer to 64 bytes (128 bits) of memory with the plaintext
- * key: pointer to 64 bytes (128 bits) of memory with the cipher key
- */
-static void aes_encrypt(void *output, const void *input, const void *key) {
-  /* [AES] 5.1.1 SubBytes() transformation */
-  const unsigned char sbox[256] = {
-    0x63,0x7c,0x77,0x7b,0xf2,0x6b,0x6f,0xc5,0x30,0x01,0x67,0x2b,0xfe,0xd7,0xab,0x76,
-    0xca,0x82,0xc9,0x7d,0xfa,0x59,0x47,0xf0,0xad,0xd4,0xa2,0xaf,0x9c,0xa4,0x72,0xc0,
-    0xb7,0xfd,0x93,0x26,0x36,0x3f,0xf7,0xcc,0x34,0xa5,0xe5,0xf1,0x71,0xd8,0x31,0x15,
-    0x04,0xc7,0x23,0xc3,0x18,0x96,0x05,0x9a,0x07,0x12,0x80,0xe2,0xeb,0x27,0xb2,0x75,
-    0x09,0x83,0x2c,0x1a,0x1b,0x6e,0x5a,0xa0,0x52,0x3b,0xd6,0xb3,0x29,0xe3,0x2f,0x84,
-    0x53,0xd1,0x00,0xed,0x20,0xfc,0xb1,0x5b,0x6a,0xcb,0xbe,0x39,0x4a,0x4c,0x58,0xcf,
-    0xd0,0xef,0xaa,0xfb,0x43,0x4d,0x33,0x85,0x45,0xf9,0x02,0x7f,0x50,0x3c,0x9f,0xa8,
-    0x51,0xa3,0x40,0x8f,0x92,0x9d,0x38,0xf5,0xbc,0xb6,0xda,0x21,0x10,0xff,0xf3,0xd2,
-    0xcd,0x0c,0x13,0xec,0x5f,0x97,0x44,0x17,0xc4,0xa7,0x7e,0x3d,0x64,0x5d,0x19,0x73,
-    0x60,0x81,0x4f,0xdc,0x22,0x2a,0x90,0x88,0x46,0xee,0xb8,0x14,0xde,0x5e,0x0b,0xdb,
-    0xe0,0x32,0x3a,0x0a,0x49,0x06,0x24,0x5c,0xc2,0xd3,0xac,0x62,0x91,0x95,0xe4,0x79,
-    0xe7,0xc8,0x37,0x6d,0x8d,0xd5,0x4e,0xa9,0x6c,0x56,0xf4,0xea,0x65,0x7a,0xae,0x08,
-    0xba,0x78,0x25,0x2e,0x1c,0xa6,0xb4,0xc6,0xe8,0xdd,0x74,0x1f,0x4b,0xbd,0x8b,0x8a,
-    0x70,0x3e,0xb5,0x66,0x48,0x03,0xf6,0x0e,0x61,0x35,0x57,0xb9,0x86,0xc1,0x1d,0x9e,
-    0xe1,0xf8,0x98,0x11,0x69,0xd9,0x8e,0x94,0x9b,0x1e,0x87,0xe9,0xce,0x55,0x28,0xdf,
-    0x8c,0xa1,0x89,0x0d,0xbf,0xe6,0x42,0x68,0x41,0x99,0x2d,0x0f,0xb0,0x54,0xbb,0x16
-  };
+ * Computes the round keys of an aes_key in plain C.
+ * ctx: pointer to the aes_key structure to store the round keys
+ * key: pointer to 16 bytes (128 bits) of memory with the cipher key
+ *
+ * [AES] 5.2 Key Expansion
+ */
+static void aes_expand_key_portable(struct aes_key *ctx, const void *key) {
+  unsigned char *w;
+  unsigned char rcon;
+  int i;
+
+  w = ctx->round_keys;
+  for (i = 0; i < 16; i++) {
+    w[i] = ((unsigned char *)key)[i];
+  }
+
+  rcon = 1;
+  for (i = 16; i < 176; i += 4) {
+    if ((i & 15) == 0) {
+      /* temp = SubWord(RotWord(temp)) xor Rcon[i/Nk] */
+      w[i + 0] = w[i - 16] ^ aes_sbox[w[i - 3]] ^ rcon;
+      w[i + 1] = w[i - 15] ^ aes_sbox[w[i - 2]];
+      w[i + 2] = w[i - 14] ^ aes_sbox[w[i - 1]];
+      w[i + 3] = w[i - 13] ^ aes_sbox[w[i - 4]];
+      rcon = aes_xtime(rcon);
+    } else {
+      w[i + 0] = w[i - 16] ^ w[i - 4];
+      w[i + 1] = w[i - 15] ^ w[i - 3];
+      w[i + 2] = w[i - 14] ^ w[i - 2];
+      w[i + 3] = w[i - 13] ^ w[i - 1];
+    }
+  }
+}
+
+#ifdef AES_TTABLE
+
+/*
+ * SubBytes() and MixColumns() combined: the column of the state that
+ * results from a byte x in the first row is
+ * aes_te[x] = {02}*S[x] || S[x] || S[x] || {03}*S[x] (big-endian word).
+ * The bytes in the other rows give the same column rotated right by
+ * 8, 16 and 24 bits.
+ */
+static const unsigned aes_te[256] = {
+  0xc66363a5,0xf87c7c84,0xee777799,0xf67b7b8d,0xfff2f20d,0xd66b6bbd,0xde6f6fb1,0x91c5c554,
+  0x60303050,0x02010103,0xce6767a9,0x562b2b7d,0xe7fefe19,0xb5d7d762,0x4dababe6,0xec76769a,
+  0x8fcaca45,0x1f82829d,0x89c9c940,0xfa7d7d87,0xeffafa15,0xb25959eb,0x8e4747c9,0xfbf0f00b,
+  0x41adadec,0xb3d4d467,0x5fa2a2fd,0x45afafea,0x239c9cbf,0x53a4a4f7,0xe4727296,0x9bc0c05b,
+  0x75b7b7c2,0xe1fdfd1c,0x3d9393ae,0x4c26266a,0x6c36365a,0x7e3f3f41,0xf5f7f702,0x83cccc4f,
+  0x6834345c,0x51a5a5f4,0xd1e5e534,0xf9f1f108,0xe2717193,0xabd8d873,0x62313153,0x2a15153f,
+  0x0804040c,0x95c7c752,0x46232365,0x9dc3c35e,0x30181828,0x379696a1,0x0a05050f,0x2f9a9ab5,
+  0x0e070709,0x24121236,0x1b80809b,0xdfe2e23d,0xcdebeb26,0x4e272769,0x7fb2b2cd,0xea75759f,
+  0x1209091b,0x1d83839e,0x582c2c74,0x341a1a2e,0x361b1b2d,0xdc6e6eb2,0xb45a5aee,0x5ba0a0fb,
+  0xa45252f6,0x763b3b4d,0xb7d6d661,0x7db3b3ce,0x5229297b,0xdde3e33e,0x5e2f2f71,0x13848497,
+  0xa65353f5,0xb9d1d168,0x00000000,0xc1eded2c,0x40202060,0xe3fcfc1f,0x79b1b1c8,0xb65b5bed,
+  0xd46a6abe,0x8dcbcb46,0x67bebed9,0x7239394b,0x944a4ade,0x984c4cd4,0xb05858e8,0x85cfcf4a,
+  0xbbd0d06b,0xc5efef2a,0x4faaaae5,0xedfbfb16,0x864343c5,0x9a4d4dd7,0x66333355,0x11858594,
+  0x8a4545cf,0xe9f9f910,0x04020206,0xfe7f7f81,0xa05050f0,0x783c3c44,0x259f9fba,0x4ba8a8e3,
+  0xa25151f3,0x5da3a3fe,0x804040c0,0x058f8f8a,0x3f9292ad,0x219d9dbc,0x70383848,0xf1f5f504,
+  0x63bcbcdf,0x77b6b6c1,0xafdada75,0x42212163,0x20101030,0xe5ffff1a,0xfdf3f30e,0xbfd2d26d,
+  0x81cdcd4c,0x180c0c14,0x26131335,0xc3ecec2f,0xbe5f5fe1,0x359797a2,0x884444cc,0x2e171739,
+  0x93c4c457,0x55a7a7f2,0xfc7e7e82,0x7a3d3d47,0xc86464ac,0xba5d5de7,0x3219192b,0xe6737395,
+  0xc06060a0,0x19818198,0x9e4f4fd1,0xa3dcdc7f,0x44222266,0x542a2a7e,0x3b9090ab,0x0b888883,
+  0x8c4646ca,0xc7eeee29,0x6bb8b8d3,0x2814143c,0xa7dede79,0xbc5e5ee2,0x160b0b1d,0xaddbdb76,
+  0xdbe0e03b,0x64323256,0x743a3a4e,0x140a0a1e,0x924949db,0x0c06060a,0x4824246c,0xb85c5ce4,
+  0x9fc2c25d,0xbdd3d36e,0x43acacef,0xc46262a6,0x399191a8,0x319595a4,0xd3e4e437,0xf279798b,
+  0xd5e7e732,0x8bc8c843,0x6e373759,0xda6d6db7,0x018d8d8c,0xb1d5d564,0x9c4e4ed2,0x49a9a9e0,
+  0xd86c6cb4,0xac5656fa,0xf3f4f407,0xcfeaea25,0xca6565af,0xf47a7a8e,0x47aeaee9,0x10080818,
+  0x6fbabad5,0xf0787888,0x4a25256f,0x5c2e2e72,0x381c1c24,0x57a6a6f1,0x73b4b4c7,0x97c6c651,
+  0xcbe8e823,0xa1dddd7c,0xe874749c,0x3e1f1f21,0x964b4bdd,0x61bdbddc,0x0d8b8b86,0x0f8a8a85,
+  0xe0707090,0x7c3e3e42,0x71b5b5c4,0xcc6666aa,0x904848d8,0x06030305,0xf7f6f601,0x1c0e0e12,
+  0xc26161a3,0x6a35355f,0xae5757f9,0x69b9b9d0,0x17868691,0x99c1c158,0x3a1d1d27,0x279e9eb9,
+  0xd9e1e138,0xebf8f813,0x2b9898b3,0x22111133,0xd26969bb,0xa9d9d970,0x078e8e89,0x339494a7,
+  0x2d9b9bb6,0x3c1e1e22,0x15878792,0xc9e9e920,0x87cece49,0xaa5555ff,0x50282878,0xa5dfdf7a,
+  0x038c8c8f,0x59a1a1f8,0x09898980,0x1a0d0d17,0x65bfbfda,0xd7e6e631,0x844242c6,0xd06868b8,
+  0x824141c3,0x299999b0,0x5a2d2d77,0x1e0f0f11,0x7bb0b0cb,0xa85454fc,0x6dbbbbd6,0x2c16163a
+};
+
+#define AES_ROTR(w, n) ((w) >> (n) | (w) << (32 - (n)))
+
+/*
+ * Loads a big-endian 32-bit word of the state or of the key schedule.
+ */
+#define AES_LOAD32(p) \
+  ((unsigned)(p)[0] << 24 | (unsigned)(p)[1] << 16 | (unsigned)(p)[2] << 8 | (unsigned)(p)[3])
+
+/*
+ * Performs the AES cipher transform (encryption) in plain C.
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to 16 bytes (128 bits) of memory to store the ciphertext
+ * input: pointer to 16 bytes (128 bits) of memory with the plaintext
+ *
+ * This is the 32-bit word version selected by AES_TTABLE: each round
+ * computes every column of the state with four table lookups, which
+ * perform SubBytes(), ShiftRows() and MixColumns() together.
+ */
+static void aes_encrypt_block_portable(const struct aes_key *ctx, void *output, const void *input) {
+  const unsigned char *in = (const unsigned char *)input;
+  unsigned char *out = (unsigned char *)output;
+  const unsigned char *rk;
+  unsigned s0, s1, s2, s3;  /* the state columns */
+  unsigned t0, t1, t2, t3;
+  int round;
+
+  /* [AES] 5.1.4 AddRoundKey() transformation (initial round key addition) */
+  rk = ctx->round_keys;
+  s0 = AES_LOAD32(in + 0) ^ AES_LOAD32(rk + 0);
+  s1 = AES_LOAD32(in + 4) ^ AES_LOAD32(rk + 4);
+  s2 = AES_LOAD32(in + 8) ^ AES_LOAD32(rk + 8);
+  s3 = AES_LOAD32(in + 12) ^ AES_LOAD32(rk + 12);
+
+  /* [AES] 5.1.1 to 5.1.4: rounds 1 to 9 */
+  for (round = 1; round < 10; round++) {
+    rk += 16;
+    t0 = aes_te[s0 >> 24] ^ AES_ROTR(aes_te[(s1 >> 16) & 0xff], 8)
+      ^ AES_ROTR(aes_te[(s2 >> 8) & 0xff], 16) ^ AES_ROTR(aes_te[s3 & 0xff], 24) ^ AES_LOAD32(rk + 0);
+    t1 = aes_te[s1 >> 24] ^ AES_ROTR(aes_te[(s2 >> 16) & 0xff], 8)
+      ^ AES_ROTR(aes_te[(s3 >> 8) & 0xff], 16) ^ AES_ROTR(aes_te[s0 & 0xff], 24) ^ AES_LOAD32(rk + 4);
+    t2 = aes_te[s2 >> 24] ^ AES_ROTR(aes_te[(s3 >> 16) & 0xff], 8)
+      ^ AES_ROTR(aes_te[(s0 >> 8) & 0xff], 16) ^ AES_ROTR(aes_te[s1 & 0xff], 24) ^ AES_LOAD32(rk + 8);
+    t3 = aes_te[s3 >> 24] ^ AES_ROTR(aes_te[(s0 >> 16) & 0xff], 8)
+      ^ AES_ROTR(aes_te[(s1 >> 8) & 0xff], 16) ^ AES_ROTR(aes_te[s2 & 0xff], 24) ^ AES_LOAD32(rk + 12);
+    s0 = t0;
+    s1 = t1;
+    s2 = t2;
+    s3 = t3;
+  }
+
+  /* The final round has no MixColumns() transformation */
+  rk += 16;
+  out[0] = aes_sbox[s0 >> 24] ^ rk[0];
+  out[1] = aes_sbox[(s1 >> 16) & 0xff] ^ rk[1];
+  out[2] = aes_sbox[(s2 >> 8) & 0xff] ^ rk[2];
+  out[3] = aes_sbox[s3 & 0xff] ^ rk[3];
+  out[4] = aes_sbox[s1 >> 24] ^ rk[4];
+  out[5] = aes_sbox[(s2 >> 16) & 0xff] ^ rk[5];
+  out[6] = aes_sbox[(s3 >> 8) & 0xff] ^ rk[6];
+  out[7] = aes_sbox[s0 & 0xff] ^ rk[7];
+  out[8] = aes_sbox[s2 >> 24] ^ rk[8];
+  out[9] = aes_sbox[(s3 >> 16) & 0xff] ^ rk[9];
+  out[10] = aes_sbox[(s0 >> 8) & 0xff] ^ rk[10];
+  out[11] = aes_sbox[s1 & 0xff] ^ rk[11];
+  out[12] = aes_sbox[s3 >> 24] ^ rk[12];
+  out[13] = aes_sbox[(s0 >> 16) & 0xff] ^ rk[13];
+  out[14] = aes_sbox[(s1 >> 8) & 0xff] ^ rk[14];
+  out[15] = aes_sbox[s2 & 0xff] ^ rk[15];
+}
+
+/*
+ * Performs the AES cipher transform (encryption) in plain C with a cipher
+ * key that is used only once, computing each round key just before the
+ * round that needs it instead of expanding the whole key schedule first.
+ * output: pointer to 16 bytes (128 bits) of memory to store the ciphertext
+ * input: pointer to 16 bytes (128 bits) of memory with the plaintext
+ * key: pointer to 16 bytes (128 bits) of memory with the cipher key
+ *
+ * This is the 32-bit word version selected by AES_TTABLE.
+ *
+ * [AES] 5.1 Cipher, and 5.2 Key Expansion
+ */
+static void aes_encrypt_portable(void *output, const void *input, const void *key) {
+  const unsigned char *in = (const unsigned char *)input;
+  const unsigned char *k = (const unsigned char *)key;
+  unsigned char *out = (unsigned char *)output;
+  unsigned k0, k1, k2, k3;  /* the words of the round key */
+  unsigned s0, s1, s2, s3;  /* the state columns */
+  unsigned t0, t1, t2, t3;
+  unsigned rcon;
+  int round;
+
+  k0 = AES_LOAD32(k + 0);
+  k1 = AES_LOAD32(k + 4);
+  k2 = AES_LOAD32(k + 8);
+  k3 = AES_LOAD32(k + 12);
+  s0 = AES_LOAD32(in + 0) ^ k0;
+  s1 = AES_LOAD32(in + 4) ^ k1;
+  s2 = AES_LOAD32(in + 8) ^ k2;
+  s3 = AES_LOAD32(in + 12) ^ k3;
+
+  rcon = 1;
+  for (round = 1; round <= 10; round++) {
+    /* w[i] = w[i-Nk] xor SubWord(RotWord(w[i-1])) xor Rcon[i/Nk], and the next 3 words */
+    k0 ^= (unsigned)aes_sbox[(k3 >> 16) & 0xff] << 24 ^ (unsigned)aes_sbox[(k3 >> 8) & 0xff] << 16
+      ^ (unsigned)aes_sbox[k3 & 0xff] << 8 ^ aes_sbox[k3 >> 24] ^ rcon << 24;
+    k1 ^= k0;
+    k2 ^= k1;
+    k3 ^= k2;
+    rcon = aes_xtime((unsigned char)rcon);
+    if (round == 10) {
+      break;
+    }
+
+    t0 = aes_te[s0 >> 24] ^ AES_ROTR(aes_te[(s1 >> 16) & 0xff], 8)
+      ^ AES_ROTR(aes_te[(s2 >> 8) & 0xff], 16) ^ AES_ROTR(aes_te[s3 & 0xff], 24) ^ k0;
+    t1 = aes_te[s1 >> 24] ^ AES_ROTR(aes_te[(s2 >> 16) & 0xff], 8)
+      ^ AES_ROTR(aes_te[(s3 >> 8) & 0xff], 16) ^ AES_ROTR(aes_te[s0 & 0xff], 24) ^ k1;
+    t2 = aes_te[s2 >> 24] ^ AES_ROTR(aes_te[(s3 >> 16) & 0xff], 8)
+      ^ AES_ROTR(aes_te[(s0 >> 8) & 0xff], 16) ^ AES_ROTR(aes_te[s1 & 0xff], 24) ^ k2;
+    t3 = aes_te[s3 >> 24] ^ AES_ROTR(aes_te[(s0 >> 16) & 0xff], 8)
+      ^ AES_ROTR(aes_te[(s1 >> 8) & 0xff], 16) ^ AES_ROTR(aes_te[s2 & 0xff], 24) ^ k3;
+    s0 = t0;
+    s1 = t1;
+    s2 = t2;
+    s3 = t3;
+  }
+
+  /* The final round has no MixColumns() transformation */
+  out[0] = aes_sbox[s0 >> 24] ^ (unsigned char)(k0 >> 24);
+  out[1] = aes_sbox[(s1 >> 16) & 0xff] ^ (unsigned char)(k0 >> 16);
+  out[2] = aes_sbox[(s2 >> 8) & 0xff] ^ (unsigned char)(k0 >> 8);
+  out[3] = aes_sbox[s3 & 0xff] ^ (unsigned char)k0;
+  out[4] = aes_sbox[s1 >> 24] ^ (unsigned char)(k1 >> 24);
+  out[5] = aes_sbox[(s2 >> 16) & 0xff] ^ (unsigned char)(k1 >> 16);
+  out[6] = aes_sbox[(s3 >> 8) & 0xff] ^ (unsigned char)(k1 >> 8);
+  out[7] = aes_sbox[s0 & 0xff] ^ (unsigned char)k1;
+  out[8] = aes_sbox[s2 >> 24] ^ (unsigned char)(k2 >> 24);
+  out[9] = aes_sbox[(s3 >> 16) & 0xff] ^ (unsigned char)(k2 >> 16);
+  out[10] = aes_sbox[(s0 >> 8) & 0xff] ^ (unsigned char)(k2 >> 8);
+  out[11] = aes_sbox[s1 & 0xff] ^ (unsigned char)k2;
+  out[12] = aes_sbox[s3 >> 24] ^ (unsigned char)(k3 >> 24);
+  out[13] = aes_sbox[(s0 >> 16) & 0xff] ^ (unsigned char)(k3 >> 16);
+  out[14] = aes_sbox[(s1 >> 8) & 0xff] ^ (unsigned char)(k3 >> 8);
+  out[15] = aes_sbox[s2 & 0xff] ^ (unsigned char)k3;
+}
+
+#else
+
+/*
+ * Performs the AES cipher transform (encryption) in plain C.
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to 16 bytes (128 bits) of memory to store the ciphertext
+ * input: pointer to 16 bytes (128 bits) of memory with the plaintext
+ */
+static void aes_encrypt_block_portable(const struct aes_key *ctx, void *output, const void *input) {
   unsigned char *state;
-  unsigned char key_schedule[16];
+  const unsigned char *round_key;
   unsigned char a, b, c, d;
   unsigned char a1, a2, a3, b1, b2, b3, c1, c2, c3, d1, d2, d3;
-  unsigned char rcon;
   int i, round;
 
   /* [AES] 5.1.4 AddRoundKey() transformation (initial round key addition) */
   state = (unsigned char *)output;
+  round_key = ctx->round_keys;
   for (i = 0; i < 16; i++) {
-    key_schedule[i] = ((unsigned char *)key)[i];
-    state[i] = ((unsigned char *)input)[i] ^ key_schedule[i];
+    state[i] = ((unsigned char *)input)[i] ^ round_key[i];
   }
 
-  rcon = 1;
   for (round = 1; round <= 10; round++) {
     /* [AES] 5.1.1 SubBytes() transformation */
     for (i = 0; i < 16; i++) {
-      state[i] = sbox[state[i]];
+      state[i] = aes_sbox[state[i]];
     }
 
     /* [AES] 5.1.2 ShiftRows() transformation */
@@ -96,20 +406,1190 @@ static void aes_encrypt(void *output, const void *input, const void *key) {
       }
     }
 
-    /* [AES] 5.2 Key expansion */
-    key_schedule[0] ^= rcon;
-    rcon = aes_xtime(rcon);
-    key_schedule[0] ^= sbox[key_schedule[13]];
-    key_schedule[1] ^= sbox[key_schedule[14]];
-    key_schedule[2] ^= sbox[key_schedule[15]];
-    key_schedule[3] ^= sbox[key_schedule[12]];
-    for (i = 4; i < 16; i++) {
-      key_schedule[i] ^= key_schedule[i - 4];
+    /* [AES] 5.1.4 AddRoundKey() transformation */
+    round_key = ctx->round_keys + round * 16;
+    for (i = 0; i < 16; i++) {
+      state[i] ^= round_key[i];
     }
+  }
+}
 
-    /* [AES] 5.1.4 AddRoundKey() transformation */
+#endif
+
+/*
+ * Performs the AES inverse cipher transform (decryption) in plain C,
+ * one byte at a time (AES_TTABLE only speeds up the encryption).
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to 16 bytes (128 bits) of memory to store the plaintext
+ * input: pointer to 16 bytes (128 bits) of memory with the ciphertext
+ *
+ * [AES] 5.3 Inverse Cipher
+ */
+static void aes_decrypt_block_portable(const struct aes_key *ctx, void *output, const void *input) {
+  unsigned char *state;
+  const unsigned char *round_key;
+  unsigned char a, b, c, d, u, v;
+  unsigned char a1, a2, a3, b1, b2, b3, c1, c2, c3, d1, d2, d3;
+  int i, round;
+
+  /* [AES] 5.3.4 AddRoundKey() transformation (last round key) */
+  state = (unsigned char *)output;
+  round_key = ctx->round_keys + 160;
+  for (i = 0; i < 16; i++) {
+    state[i] = ((unsigned char *)input)[i] ^ round_key[i];
+  }
+
+  for (round = 9; round >= 0; round--) {
+    /* [AES] 5.3.1 InvShiftRows() transformation */
+    a = state[1]; b = state[5]; c = state[9]; d = state[13];
+    state[1] = d; state[5] = a; state[9] = b; state[13] = c;
+    a = state[2]; b = state[6]; c = state[10]; d = state[14];
+    state[2] = c; state[6] = d; state[10] = a; state[14] = b;
+    a = state[3]; b = state[7]; c = state[11]; d = state[15];
+    state[3] = b; state[7] = c; state[11] = d; state[15] = a;
+
+    /* [AES] 5.3.2 InvSubBytes() transformation */
     for (i = 0; i < 16; i++) {
-      state[i] ^= key_schedule[i];
+      state[i] = aes_inv_sbox[state[i]];
+    }
+
+    /* [AES] 5.3.4 AddRoundKey() transformation */
+    round_key = ctx->round_keys + round * 16;
+    for (i = 0; i < 16; i++) {
+      state[i] ^= round_key[i];
+    }
+
+    /*
+     * [AES] 5.3.3 InvMixColumns() transformation, computed as the
+     * MixColumns() of the column multiplied by {04}x^2 + {05}
+     */
+    if (round > 0) {
+      for (i = 0; i < 16; i += 4) {
+        u = aes_xtime(aes_xtime(state[i + 0] ^ state[i + 2]));
+        v = aes_xtime(aes_xtime(state[i + 1] ^ state[i + 3]));
+        a1 = state[i + 0] ^ u; a2 = aes_xtime(a1); a3 = a1 ^ a2;
+        b1 = state[i + 1] ^ v; b2 = aes_xtime(b1); b3 = b1 ^ b2;
+        c1 = state[i + 2] ^ u; c2 = aes_xtime(c1); c3 = c1 ^ c2;
+        d1 = state[i + 3] ^ v; d2 = aes_xtime(d1); d3 = d1 ^ d2;
+        state[i + 0] = a2 ^ b3 ^ c1 ^ d1;
+        state[i + 1] = a1 ^ b2 ^ c3 ^ d1;
+        state[i + 2] = a1 ^ b1 ^ c2 ^ d3;
+        state[i + 3] = a3 ^ b1 ^ c1 ^ d2;
+      }
+    }
+  }
+}
+
+#ifdef AES_BITSLICE
+
+/*
+ * The bitsliced implementation keeps 4 blocks in 8 64-bit words q[0..7]:
+ * bit b of byte i of block j is stored in bit (16 * j + i) of q[b].
+ * So each 16-bit lane of a word holds one bit of every byte of a block,
+ * and the bytes of a state column c (rows 0 to 3) are the bits 4c to 4c+3.
+ */
+
+/*
+ * Transposes the 8x8 bit matrix whose rows are the bytes of x.
+ */
+static unsigned long aes_bitslice_transpose(unsigned long x) {
+  unsigned long t;
+
+  t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaUL;
+  x ^= t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000cccc0000ccccUL;
+  x ^= t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0UL;
+  x ^= t ^ (t << 28);
+  return x;
+}
+
+/*
+ * Converts 4 blocks (64 bytes) into the bitsliced representation q[0..7].
+ */
+static void aes_bitslice_pack(unsigned long *q, const unsigned char *blocks) {
+  unsigned long x;
+  int i, b;
+
+  for (b = 0; b < 8; b++) {
+    q[b] = 0;
+  }
+  for (i = 0; i < 64; i += 8) {
+    x = (unsigned long)blocks[i + 7] << 56 | (unsigned long)blocks[i + 6] << 48
+      | (unsigned long)blocks[i + 5] << 40 | (unsigned long)blocks[i + 4] << 32
+      | (unsigned long)blocks[i + 3] << 24 | (unsigned long)blocks[i + 2] << 16
+      | (unsigned long)blocks[i + 1] << 8 | (unsigned long)blocks[i];
+    x = aes_bitslice_transpose(x);
+    for (b = 0; b < 8; b++) {
+      q[b] |= (x >> (8 * b) & 0xff) << i;
+    }
+  }
+}
+
+/*
+ * Converts the bitsliced representation q[0..7] back into 4 blocks (64 bytes).
+ */
+static void aes_bitslice_unpack(unsigned char *blocks, const unsigned long *q) {
+  unsigned long x;
+  int i, b;
+
+  for (i = 0; i < 64; i += 8) {
+    x = 0;
+    for (b = 0; b < 8; b++) {
+      x |= (q[b] >> i & 0xff) << (8 * b);
+    }
+    x = aes_bitslice_transpose(x);
+    for (b = 0; b < 8; b++) {
+      blocks[i + b] = (unsigned char)(x >> (8 * b));
+    }
+  }
+}
+
+/*
+ * [AES] 5.1.1 SubBytes() transformation on every bit of q[0..7]
+ * (q[0] has the least significant bits of the bytes, q[7] the most).
+ *
+ * Computes the S-box with the circuit of 113 logical operations in
+ * J. Boyar and R. Peralta, "A depth-16 circuit for the AES S-box", 2011.
+ */
+static void aes_bitslice_sbox(unsigned long *q) {
+  unsigned long x0, x1, x2, x3, x4, x5, x6, x7;
+  unsigned long y1, y2, y3, y4, y5, y6, y7, y8, y9, y10, y11;
+  unsigned long y12, y13, y14, y15, y16, y17, y18, y19, y20, y21;
+  unsigned long z0, z1, z2, z3, z4, z5, z6, z7, z8;
+  unsigned long z9, z10, z11, z12, z13, z14, z15, z16, z17;
+  unsigned long t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11;
+  unsigned long t12, t13, t14, t15, t16, t17, t18, t19, t20, t21, t22, t23;
+  unsigned long t24, t25, t26, t27, t28, t29, t30, t31, t32, t33, t34, t35;
+  unsigned long t36, t37, t38, t39, t40, t41, t42, t43, t44, t45, t46, t47;
+  unsigned long t48, t49, t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+  unsigned long t60, t61, t62, t63, t64, t65, t66, t67;
+  unsigned long s0, s1, s2, s3, s4, s5, s6, s7;
+
+  x0 = q[7];
+  x1 = q[6];
+  x2 = q[5];
+  x3 = q[4];
+  x4 = q[3];
+  x5 = q[2];
+  x6 = q[1];
+  x7 = q[0];
+
+  /* Top linear transformation */
+  y14 = x3 ^ x5;
+  y13 = x0 ^ x6;
+  y9 = x0 ^ x3;
+  y8 = x0 ^ x5;
+  t0 = x1 ^ x2;
+  y1 = t0 ^ x7;
+  y4 = y1 ^ x3;
+  y12 = y13 ^ y14;
+  y2 = y1 ^ x0;
+  y5 = y1 ^ x6;
+  y3 = y5 ^ y8;
+  t1 = x4 ^ y12;
+  y15 = t1 ^ x5;
+  y20 = t1 ^ x1;
+  y6 = y15 ^ x7;
+  y10 = y15 ^ t0;
+  y11 = y20 ^ y9;
+  y7 = x7 ^ y11;
+  y17 = y10 ^ y11;
+  y19 = y10 ^ y8;
+  y16 = t0 ^ y11;
+  y21 = y13 ^ y16;
+  y18 = x0 ^ y16;
+
+  /* Middle non-linear transformation (inversion in GF(2^4)^2) */
+  t2 = y12 & y15;
+  t3 = y3 & y6;
+  t4 = t3 ^ t2;
+  t5 = y4 & x7;
+  t6 = t5 ^ t2;
+  t7 = y13 & y16;
+  t8 = y5 & y1;
+  t9 = t8 ^ t7;
+  t10 = y2 & y7;
+  t11 = t10 ^ t7;
+  t12 = y9 & y11;
+  t13 = y14 & y17;
+  t14 = t13 ^ t12;
+  t15 = y8 & y10;
+  t16 = t15 ^ t12;
+  t17 = t4 ^ t14;
+  t18 = t6 ^ t16;
+  t19 = t9 ^ t14;
+  t20 = t11 ^ t16;
+  t21 = t17 ^ y20;
+  t22 = t18 ^ y19;
+  t23 = t19 ^ y21;
+  t24 = t20 ^ y18;
+  t25 = t21 ^ t22;
+  t26 = t21 & t23;
+  t27 = t24 ^ t26;
+  t28 = t25 & t27;
+  t29 = t28 ^ t22;
+  t30 = t23 ^ t24;
+  t31 = t22 ^ t26;
+  t32 = t31 & t30;
+  t33 = t32 ^ t24;
+  t34 = t23 ^ t33;
+  t35 = t27 ^ t33;
+  t36 = t24 & t35;
+  t37 = t36 ^ t34;
+  t38 = t27 ^ t36;
+  t39 = t29 & t38;
+  t40 = t25 ^ t39;
+  t41 = t40 ^ t37;
+  t42 = t29 ^ t33;
+  t43 = t29 ^ t40;
+  t44 = t33 ^ t37;
+  t45 = t42 ^ t41;
+  z0 = t44 & y15;
+  z1 = t37 & y6;
+  z2 = t33 & x7;
+  z3 = t43 & y16;
+  z4 = t40 & y1;
+  z5 = t29 & y7;
+  z6 = t42 & y11;
+  z7 = t45 & y17;
+  z8 = t41 & y10;
+  z9 = t44 & y12;
+  z10 = t37 & y3;
+  z11 = t33 & y4;
+  z12 = t43 & y13;
+  z13 = t40 & y5;
+  z14 = t29 & y2;
+  z15 = t42 & y9;
+  z16 = t45 & y14;
+  z17 = t41 & y8;
+
+  /* Bottom linear transformation */
+  t46 = z15 ^ z16;
+  t47 = z10 ^ z11;
+  t48 = z5 ^ z13;
+  t49 = z9 ^ z10;
+  t50 = z2 ^ z12;
+  t51 = z2 ^ z5;
+  t52 = z7 ^ z8;
+  t53 = z0 ^ z3;
+  t54 = z6 ^ z7;
+  t55 = z16 ^ z17;
+  t56 = z12 ^ t48;
+  t57 = t50 ^ t53;
+  t58 = z4 ^ t46;
+  t59 = z3 ^ t54;
+  t60 = t46 ^ t57;
+  t61 = z14 ^ t57;
+  t62 = t52 ^ t58;
+  t63 = t49 ^ t58;
+  t64 = z4 ^ t59;
+  t65 = t61 ^ t62;
+  t66 = z1 ^ t63;
+  s0 = t59 ^ t63;
+  s6 = t56 ^ ~t62;
+  s7 = t48 ^ ~t60;
+  t67 = t64 ^ t65;
+  s3 = t53 ^ t66;
+  s4 = t51 ^ t66;
+  s5 = t47 ^ t65;
+  s1 = t64 ^ ~s3;
+  s2 = t55 ^ ~t67;
+
+  q[7] = s0;
+  q[6] = s1;
+  q[5] = s2;
+  q[4] = s3;
+  q[3] = s4;
+  q[2] = s5;
+  q[1] = s6;
+  q[0] = s7;
+}
+
+/*
+ * [AES] 5.1.2 ShiftRows() transformation: in each block, the bits of
+ * row r (bits r, r+4, r+8, r+12 of the lane) rotate by r columns.
+ */
+static void aes_bitslice_shift_rows(unsigned long *q) {
+  unsigned long x;
+  int b;
+
+  for (b = 0; b < 8; b++) {
+    x = q[b];
+    q[b] = (x & 0x1111111111111111UL)
+      | ((x >> 4) & 0x0222022202220222UL) | ((x << 12) & 0x2000200020002000UL)
+      | ((x >> 8) & 0x0044004400440044UL) | ((x << 8) & 0x4400440044004400UL)
+      | ((x >> 12) & 0x0008000800080008UL) | ((x << 4) & 0x8880888088808880UL);
+  }
+}
+
+/* Rotates the rows of every column of the state up by 1 and by 2 */
+#define AES_BITSLICE_ROT1(x) (((x) >> 1 & 0x7777777777777777UL) | ((x) << 3 & 0x8888888888888888UL))
+#define AES_BITSLICE_ROT2(x) (((x) >> 2 & 0x3333333333333333UL) | ((x) << 2 & 0xccccccccccccccccUL))
+
+/*
+ * [AES] 5.1.3 MixColumns() transformation, computed for each row r as
+ * s'[r] = {02}*(s[r] ^ s[r+1]) ^ s[r+1] ^ (s[r+2] ^ s[r+3])
+ */
+static void aes_bitslice_mix_columns(unsigned long *q) {
+  unsigned long r1[8];  /* s[r+1] */
+  unsigned long t[8];  /* s[r] ^ s[r+1] */
+  int b;
+
+  for (b = 0; b < 8; b++) {
+    r1[b] = AES_BITSLICE_ROT1(q[b]);
+    t[b] = q[b] ^ r1[b];
+  }
+  /* [AES] 4.2.1 Multiplication by x (xtime) of t, and the other terms */
+  q[0] = t[7] ^ r1[0] ^ AES_BITSLICE_ROT2(t[0]);
+  q[1] = t[0] ^ t[7] ^ r1[1] ^ AES_BITSLICE_ROT2(t[1]);
+  q[2] = t[1] ^ r1[2] ^ AES_BITSLICE_ROT2(t[2]);
+  q[3] = t[2] ^ t[7] ^ r1[3] ^ AES_BITSLICE_ROT2(t[3]);
+  q[4] = t[3] ^ t[7] ^ r1[4] ^ AES_BITSLICE_ROT2(t[4]);
+  q[5] = t[4] ^ r1[5] ^ AES_BITSLICE_ROT2(t[5]);
+  q[6] = t[5] ^ r1[6] ^ AES_BITSLICE_ROT2(t[6]);
+  q[7] = t[6] ^ r1[7] ^ AES_BITSLICE_ROT2(t[7]);
+}
+
+/*
+ * Computes the round keys of an aes_key without any table lookups,
+ * and their bitsliced representation used by aes_encrypt_blocks_bitslice().
+ * ctx: pointer to the aes_key structure to store the round keys
+ * key: pointer to 16 bytes (128 bits) of memory with the cipher key
+ *
+ * [AES] 5.2 Key Expansion
+ */
+static void aes_expand_key_bitslice(struct aes_key *ctx, const void *key) {
+  unsigned char *w;
+  unsigned char blocks[64];
+  unsigned long q[8];
+  unsigned char rcon;
+  int i, b;
+
+  w = ctx->round_keys;
+  for (i = 0; i < 16; i++) {
+    w[i] = ((unsigned char *)key)[i];
+  }
+
+  rcon = 1;
+  for (i = 16; i < 176; i += 4) {
+    if ((i & 15) == 0) {
+      /* temp = SubWord(RotWord(temp)) xor Rcon[i/Nk], with the bitsliced S-box */
+      for (b = 0; b < 8; b++) {
+        q[b] = (unsigned long)(w[i - 3] >> b & 1) | (unsigned long)(w[i - 2] >> b & 1) << 1
+          | (unsigned long)(w[i - 1] >> b & 1) << 2 | (unsigned long)(w[i - 4] >> b & 1) << 3;
+      }
+      aes_bitslice_sbox(q);
+      w[i + 0] = w[i - 16] ^ rcon;
+      w[i + 1] = w[i - 15];
+      w[i + 2] = w[i - 14];
+      w[i + 3] = w[i - 13];
+      for (b = 0; b < 8; b++) {
+        w[i + 0] ^= (q[b] & 1) << b;
+        w[i + 1] ^= (q[b] >> 1 & 1) << b;
+        w[i + 2] ^= (q[b] >> 2 & 1) << b;
+        w[i + 3] ^= (q[b] >> 3 & 1) << b;
+      }
+      rcon = aes_xtime(rcon);
+    } else {
+      w[i + 0] = w[i - 16] ^ w[i - 4];
+      w[i + 1] = w[i - 15] ^ w[i - 3];
+      w[i + 2] = w[i - 14] ^ w[i - 2];
+      w[i + 3] = w[i - 13] ^ w[i - 1];
+    }
+  }
+
+  /* The same round key for each of the 4 blocks */
+  for (i = 0; i < 11; i++) {
+    for (b = 0; b < 64; b++) {
+      blocks[b] = w[16 * i + (b & 15)];
+    }
+    aes_bitslice_pack(ctx->bitsliced_round_keys[i], blocks);
+  }
+}
+
+/*
+ * Performs the AES cipher transform (encryption) on 8 blocks at once
+ * with the bitsliced implementation, which runs in constant time.
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to 128 bytes of memory to store the 8 ciphertext blocks
+ * input: pointer to 128 bytes of memory with the 8 plaintext blocks
+ */
+static void aes_encrypt_8_blocks_bitslice(const struct aes_key *ctx, unsigned char *output, const unsigned char *input) {
+  unsigned long q[16];  /* blocks 0 to 3 in q[0..7], and 4 to 7 in q[8..15] */
+  const unsigned long *rk;
+  int b, round;
+
+  aes_bitslice_pack(q, input);
+  aes_bitslice_pack(q + 8, input + 64);
+
+  /* [AES] 5.1.4 AddRoundKey() transformation (initial round key addition) */
+  rk = ctx->bitsliced_round_keys[0];
+  for (b = 0; b < 8; b++) {
+    q[b] ^= rk[b];
+    q[b + 8] ^= rk[b];
+  }
+
+  for (round = 1; round <= 10; round++) {
+    aes_bitslice_sbox(q);
+    aes_bitslice_sbox(q + 8);
+    aes_bitslice_shift_rows(q);
+    aes_bitslice_shift_rows(q + 8);
+    if (round < 10) {
+      aes_bitslice_mix_columns(q);
+      aes_bitslice_mix_columns(q + 8);
+    }
+    rk = ctx->bitsliced_round_keys[round];
+    for (b = 0; b < 8; b++) {
+      q[b] ^= rk[b];
+      q[b + 8] ^= rk[b];
+    }
+  }
+
+  aes_bitslice_unpack(output, q);
+  aes_bitslice_unpack(output + 64, q + 8);
+}
+
+/*
+ * Performs the AES cipher transform (encryption) on 4 blocks at once
+ * with the bitsliced implementation, in half the time of 8 blocks,
+ * for a single block or the last few blocks of a message.
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to 64 bytes of memory to store the 4 ciphertext blocks
+ * input: pointer to 64 bytes of memory with the 4 plaintext blocks
+ */
+static void aes_encrypt_4_blocks_bitslice(const struct aes_key *ctx, unsigned char *output, const unsigned char *input) {
+  unsigned long q[8];
+  const unsigned long *rk;
+  int b, round;
+
+  aes_bitslice_pack(q, input);
+
+  rk = ctx->bitsliced_round_keys[0];
+  for (b = 0; b < 8; b++) {
+    q[b] ^= rk[b];
+  }
+
+  for (round = 1; round <= 10; round++) {
+    aes_bitslice_sbox(q);
+    aes_bitslice_shift_rows(q);
+    if (round < 10) {
+      aes_bitslice_mix_columns(q);
+    }
+    rk = ctx->bitsliced_round_keys[round];
+    for (b = 0; b < 8; b++) {
+      q[b] ^= rk[b];
+    }
+  }
+
+  aes_bitslice_unpack(output, q);
+}
+
+/*
+ * Performs the AES cipher transform (encryption) on n blocks
+ * with the bitsliced implementation, 8 blocks at a time,
+ * and the last 4 or fewer blocks at once.
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to (16 * n) bytes of memory to store the ciphertext blocks
+ * input: pointer to (16 * n) bytes of memory with the plaintext blocks
+ * n: number of blocks
+ */
+static void aes_encrypt_blocks_bitslice(const struct aes_key *ctx, void *output, const void *input, int n) {
+  unsigned char *out = (unsigned char *)output;
+  const unsigned char *in = (const unsigned char *)input;
+  unsigned char x[128];
+  int i;
+
+  for (; n >= 8; n -= 8) {
+    aes_encrypt_8_blocks_bitslice(ctx, out, in);
+    out += 128;
+    in += 128;
+  }
+  if (n > 4) {
+    for (i = 0; i < 128; i++) {
+      x[i] = i < n * 16 ? in[i] : 0;
+    }
+    aes_encrypt_8_blocks_bitslice(ctx, x, x);
+  } else if (n > 0) {
+    for (i = 0; i < 64; i++) {
+      x[i] = i < n * 16 ? in[i] : 0;
+    }
+    aes_encrypt_4_blocks_bitslice(ctx, x, x);
+  }
+  for (i = 0; i < n * 16; i++) {
+    out[i] = x[i];
+  }
+}
+
+/*
+ * [AES] 5.3.2 InvSubBytes() transformation on every bit of q[0..7].
+ *
+ * The S-box is S(x) = A(x^-1), where A is the affine transformation of
+ * [AES] 5.1.1, whose inverse is A^-1(y) = L(y) ^ {05} with the linear
+ * L(y)[i] = y[i+2] ^ y[i+5] ^ y[i+7]. So x^-1 = A^-1(S(x)), and the
+ * inverse S-box reuses the S-box circuit: InvS(y) = A^-1(S(A^-1(y))).
+ */
+static void aes_bitslice_inv_sbox(unsigned long *q) {
+  unsigned long t[8];
+  int b;
+
+  for (b = 0; b < 8; b++) {
+    t[b] = q[(b + 2) & 7] ^ q[(b + 5) & 7] ^ q[(b + 7) & 7];
+  }
+  t[0] = ~t[0];
+  t[2] = ~t[2];
+  aes_bitslice_sbox(t);
+  for (b = 0; b < 8; b++) {
+    q[b] = t[(b + 2) & 7] ^ t[(b + 5) & 7] ^ t[(b + 7) & 7];
+  }
+  q[0] = ~q[0];
+  q[2] = ~q[2];
+}
+
+/*
+ * [AES] 5.3.1 InvShiftRows() transformation: in each block, the bits of
+ * row r rotate back by r columns.
+ */
+static void aes_bitslice_inv_shift_rows(unsigned long *q) {
+  unsigned long x;
+  int b;
+
+  for (b = 0; b < 8; b++) {
+    x = q[b];
+    q[b] = (x & 0x1111111111111111UL)
+      | ((x << 4) & 0x2220222022202220UL) | ((x >> 12) & 0x0002000200020002UL)
+      | ((x >> 8) & 0x0044004400440044UL) | ((x << 8) & 0x4400440044004400UL)
+      | ((x >> 4) & 0x0888088808880888UL) | ((x << 12) & 0x8000800080008000UL);
+  }
+}
+
+/*
+ * [AES] 5.3.3 InvMixColumns() transformation, computed as the MixColumns()
+ * of the state after s'[r] = s[r] ^ {04}*(s[r] ^ s[r+2]), that is after
+ * multiplying each column by {04}x^2 + {05}.
+ */
+static void aes_bitslice_inv_mix_columns(unsigned long *q) {
+  unsigned long u[8];  /* s[r] ^ s[r+2] */
+  int b;
+
+  for (b = 0; b < 8; b++) {
+    u[b] = q[b] ^ AES_BITSLICE_ROT2(q[b]);
+  }
+  /* [AES] 4.2.1 Multiplication by x (xtime), twice */
+  q[0] ^= u[6];
+  q[1] ^= u[6] ^ u[7];
+  q[2] ^= u[0] ^ u[7];
+  q[3] ^= u[1] ^ u[6];
+  q[4] ^= u[2] ^ u[6] ^ u[7];
+  q[5] ^= u[3] ^ u[7];
+  q[6] ^= u[4];
+  q[7] ^= u[5];
+  aes_bitslice_mix_columns(q);
+}
+
+/*
+ * Performs the AES inverse cipher transform (decryption) on 8 blocks at once
+ * with the bitsliced implementation, which runs in constant time.
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to 128 bytes of memory to store the 8 plaintext blocks
+ * input: pointer to 128 bytes of memory with the 8 ciphertext blocks
+ *
+ * [AES] 5.3 Inverse Cipher
+ */
+static void aes_decrypt_8_blocks_bitslice(const struct aes_key *ctx, unsigned char *output, const unsigned char *input) {
+  unsigned long q[16];  /* blocks 0 to 3 in q[0..7], and 4 to 7 in q[8..15] */
+  const unsigned long *rk;
+  int b, round;
+
+  aes_bitslice_pack(q, input);
+  aes_bitslice_pack(q + 8, input + 64);
+
+  /* [AES] 5.3.4 AddRoundKey() transformation (last round key) */
+  rk = ctx->bitsliced_round_keys[10];
+  for (b = 0; b < 8; b++) {
+    q[b] ^= rk[b];
+    q[b + 8] ^= rk[b];
+  }
+
+  for (round = 9; round >= 0; round--) {
+    aes_bitslice_inv_shift_rows(q);
+    aes_bitslice_inv_shift_rows(q + 8);
+    aes_bitslice_inv_sbox(q);
+    aes_bitslice_inv_sbox(q + 8);
+    rk = ctx->bitsliced_round_keys[round];
+    for (b = 0; b < 8; b++) {
+      q[b] ^= rk[b];
+      q[b + 8] ^= rk[b];
     }
+    if (round > 0) {
+      aes_bitslice_inv_mix_columns(q);
+      aes_bitslice_inv_mix_columns(q + 8);
+    }
+  }
+
+  aes_bitslice_unpack(output, q);
+  aes_bitslice_unpack(output + 64, q + 8);
+}
+
+/*
+ * Performs the AES inverse cipher transform (decryption) on 4 blocks at once
+ * with the bitsliced implementation, in half the time of 8 blocks.
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to 64 bytes of memory to store the 4 plaintext blocks
+ * input: pointer to 64 bytes of memory with the 4 ciphertext blocks
+ */
+static void aes_decrypt_4_blocks_bitslice(const struct aes_key *ctx, unsigned char *output, const unsigned char *input) {
+  unsigned long q[8];
+  const unsigned long *rk;
+  int b, round;
+
+  aes_bitslice_pack(q, input);
+
+  rk = ctx->bitsliced_round_keys[10];
+  for (b = 0; b < 8; b++) {
+    q[b] ^= rk[b];
+  }
+
+  for (round = 9; round >= 0; round--) {
+    aes_bitslice_inv_shift_rows(q);
+    aes_bitslice_inv_sbox(q);
+    rk = ctx->bitsliced_round_keys[round];
+    for (b = 0; b < 8; b++) {
+      q[b] ^= rk[b];
+    }
+    if (round > 0) {
+      aes_bitslice_inv_mix_columns(q);
+    }
+  }
+
+  aes_bitslice_unpack(output, q);
+}
+
+/*
+ * Performs the AES inverse cipher transform (decryption) on n blocks
+ * with the bitsliced implementation, 8 blocks at a time,
+ * and the last 4 or fewer blocks at once.
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to (16 * n) bytes of memory to store the plaintext blocks
+ * input: pointer to (16 * n) bytes of memory with the ciphertext blocks
+ * n: number of blocks
+ */
+static void aes_decrypt_blocks_bitslice(const struct aes_key *ctx, void *output, const void *input, int n) {
+  unsigned char *out = (unsigned char *)output;
+  const unsigned char *in = (const unsigned char *)input;
+  unsigned char x[128];
+  int i;
+
+  for (; n >= 8; n -= 8) {
+    aes_decrypt_8_blocks_bitslice(ctx, out, in);
+    out += 128;
+    in += 128;
+  }
+  if (n > 4) {
+    for (i = 0; i < 128; i++) {
+      x[i] = i < n * 16 ? in[i] : 0;
+    }
+    aes_decrypt_8_blocks_bitslice(ctx, x, x);
+  } else if (n > 0) {
+    for (i = 0; i < 64; i++) {
+      x[i] = i < n * 16 ? in[i] : 0;
+    }
+    aes_decrypt_4_blocks_bitslice(ctx, x, x);
+  }
+  for (i = 0; i < n * 16; i++) {
+    out[i] = x[i];
+  }
+}
+
+#endif
+
+#ifdef AES_AESNI
+
+/*
+ * Checks if the processor supports the AES-NI instructions
+ * (and the SSE2 and SSSE3 instructions used along with them).
+ * Returns nonzero if it does, or 0 if it doesn't.
+ */
+static int aes_has_aesni(void) {
+  static int has_aesni = -1;  /* not checked yet */
+  unsigned eax, ebx, ecx, edx;
+  int has;
+
+  /* Threads may check at the same time: each stores the same value, atomically */
+  has = __atomic_load_n(&has_aesni, __ATOMIC_RELAXED);
+  if (has < 0) {
+    has = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES) && (ecx & bit_SSSE3) && (edx & bit_SSE2);
+    __atomic_store_n(&has_aesni, has, __ATOMIC_RELAXED);
+  }
+  return has;
+}
+
+/*
+ * Computes the next round key from the previous one w and from
+ * t = AESKEYGENASSIST(w, rcon), whose word 3 is SubWord(RotWord(w[3])) ^ rcon.
+ */
+__attribute__((target("aes,sse2")))
+static __m128i aes_expand_key_aesni_round(__m128i w, __m128i t) {
+  t = _mm_shuffle_epi32(t, 0xff);
+  w = _mm_xor_si128(w, _mm_slli_si128(w, 4));
+  w = _mm_xor_si128(w, _mm_slli_si128(w, 4));
+  w = _mm_xor_si128(w, _mm_slli_si128(w, 4));
+  return _mm_xor_si128(w, t);
+}
+
+/*
+ * Computes the round keys of an aes_key with the AESKEYGENASSIST instruction.
+ * ctx: pointer to the aes_key structure to store the round keys
+ * key: pointer to 16 bytes (128 bits) of memory with the cipher key
+ *
+ * [AES] 5.2 Key Expansion
+ */
+__attribute__((target("aes,sse2")))
+static void aes_expand_key_aesni(struct aes_key *ctx, const void *key) {
+  __m128i *rk = (__m128i *)ctx->round_keys;
+  __m128i w;
+
+  w = _mm_loadu_si128((const __m128i *)key);
+  _mm_storeu_si128(rk + 0, w);
+  w = aes_expand_key_aesni_round(w, _mm_aeskeygenassist_si128(w, 0x01));
+  _mm_storeu_si128(rk + 1, w);
+  w = aes_expand_key_aesni_round(w, _mm_aeskeygenassist_si128(w, 0x02));
+  _mm_storeu_si128(rk + 2, w);
+  w = aes_expand_key_aesni_round(w, _mm_aeskeygenassist_si128(w, 0x04));
+  _mm_storeu_si128(rk + 3, w);
+  w = aes_expand_key_aesni_round(w, _mm_aeskeygenassist_si128(w, 0x08));
+  _mm_storeu_si128(rk + 4, w);
+  w = aes_expand_key_aesni_round(w, _mm_aeskeygenassist_si128(w, 0x10));
+  _mm_storeu_si128(rk + 5, w);
+  w = aes_expand_key_aesni_round(w, _mm_aeskeygenassist_si128(w, 0x20));
+  _mm_storeu_si128(rk + 6, w);
+  w = aes_expand_key_aesni_round(w, _mm_aeskeygenassist_si128(w, 0x40));
+  _mm_storeu_si128(rk + 7, w);
+  w = aes_expand_key_aesni_round(w, _mm_aeskeygenassist_si128(w, 0x80));
+  _mm_storeu_si128(rk + 8, w);
+  w = aes_expand_key_aesni_round(w, _mm_aeskeygenassist_si128(w, 0x1b));
+  _mm_storeu_si128(rk + 9, w);
+  w = aes_expand_key_aesni_round(w, _mm_aeskeygenassist_si128(w, 0x36));
+  _mm_storeu_si128(rk + 10, w);
+}
+
+/*
+ * Performs the AES cipher transform (encryption) of a block in a register
+ * with a cipher key in another one that is used only once, computing each
+ * round key with AESKEYGENASSIST just before the round that needs it,
+ * so that no round key is stored to memory.
+ * state: the plaintext
+ * k: the cipher key
+ * Returns the ciphertext.
+ *
+ * [AES] 5.1 Cipher, and 5.2 Key Expansion
+ */
+__attribute__((target("aes,sse2")))
+static __m128i aes_encrypt_aesni_key(__m128i state, __m128i k) {
+  state = _mm_xor_si128(state, k);
+  k = aes_expand_key_aesni_round(k, _mm_aeskeygenassist_si128(k, 0x01));
+  state = _mm_aesenc_si128(state, k);
+  k = aes_expand_key_aesni_round(k, _mm_aeskeygenassist_si128(k, 0x02));
+  state = _mm_aesenc_si128(state, k);
+  k = aes_expand_key_aesni_round(k, _mm_aeskeygenassist_si128(k, 0x04));
+  state = _mm_aesenc_si128(state, k);
+  k = aes_expand_key_aesni_round(k, _mm_aeskeygenassist_si128(k, 0x08));
+  state = _mm_aesenc_si128(state, k);
+  k = aes_expand_key_aesni_round(k, _mm_aeskeygenassist_si128(k, 0x10));
+  state = _mm_aesenc_si128(state, k);
+  k = aes_expand_key_aesni_round(k, _mm_aeskeygenassist_si128(k, 0x20));
+  state = _mm_aesenc_si128(state, k);
+  k = aes_expand_key_aesni_round(k, _mm_aeskeygenassist_si128(k, 0x40));
+  state = _mm_aesenc_si128(state, k);
+  k = aes_expand_key_aesni_round(k, _mm_aeskeygenassist_si128(k, 0x80));
+  state = _mm_aesenc_si128(state, k);
+  k = aes_expand_key_aesni_round(k, _mm_aeskeygenassist_si128(k, 0x1b));
+  state = _mm_aesenc_si128(state, k);
+  k = aes_expand_key_aesni_round(k, _mm_aeskeygenassist_si128(k, 0x36));
+  return _mm_aesenclast_si128(state, k);
+}
+
+/*
+ * Performs the AES cipher transform (encryption) with aes_encrypt_aesni_key().
+ * output: pointer to 16 bytes (128 bits) of memory to store the ciphertext
+ * input: pointer to 16 bytes (128 bits) of memory with the plaintext
+ * key: pointer to 16 bytes (128 bits) of memory with the cipher key
+ */
+__attribute__((target("aes,sse2")))
+static void aes_encrypt_aesni(void *output, const void *input, const void *key) {
+  __m128i state;
+
+  state = aes_encrypt_aesni_key(_mm_loadu_si128((const __m128i *)input), _mm_loadu_si128((const __m128i *)key));
+  _mm_storeu_si128((__m128i *)output, state);
+}
+
+/*
+ * Performs the AES cipher transform (encryption) with the AESENC and
+ * AESENCLAST instructions, each of which does a whole round.
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to 16 bytes (128 bits) of memory to store the ciphertext
+ * input: pointer to 16 bytes (128 bits) of memory with the plaintext
+ */
+__attribute__((target("aes,sse2")))
+static void aes_encrypt_block_aesni(const struct aes_key *ctx, void *output, const void *input) {
+  const __m128i *rk = (const __m128i *)ctx->round_keys;
+  __m128i state;
+  int round;
+
+  state = _mm_xor_si128(_mm_loadu_si128((const __m128i *)input), _mm_loadu_si128(rk));
+  for (round = 1; round < 10; round++) {
+    state = _mm_aesenc_si128(state, _mm_loadu_si128(rk + round));
+  }
+  state = _mm_aesenclast_si128(state, _mm_loadu_si128(rk + 10));
+  _mm_storeu_si128((__m128i *)output, state);
+}
+
+/*
+ * Performs the AES cipher transform (encryption) on n blocks with the
+ * AES-NI instructions, interleaving the rounds of 8 blocks at a time
+ * so that the processor can work on them in parallel.
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to (16 * n) bytes of memory to store the ciphertext blocks
+ * input: pointer to (16 * n) bytes of memory with the plaintext blocks
+ * n: number of blocks
+ */
+__attribute__((target("aes,sse2")))
+static void aes_encrypt_blocks_aesni(const struct aes_key *ctx, void *output, const void *input, int n) {
+  const __m128i *rk = (const __m128i *)ctx->round_keys;
+  const __m128i *in = (const __m128i *)input;
+  __m128i *out = (__m128i *)output;
+  __m128i k, b0, b1, b2, b3, b4, b5, b6, b7;
+  int round;
+
+  for (; n >= 8; n -= 8) {
+    k = _mm_loadu_si128(rk);
+    b0 = _mm_xor_si128(_mm_loadu_si128(in + 0), k);
+    b1 = _mm_xor_si128(_mm_loadu_si128(in + 1), k);
+    b2 = _mm_xor_si128(_mm_loadu_si128(in + 2), k);
+    b3 = _mm_xor_si128(_mm_loadu_si128(in + 3), k);
+    b4 = _mm_xor_si128(_mm_loadu_si128(in + 4), k);
+    b5 = _mm_xor_si128(_mm_loadu_si128(in + 5), k);
+    b6 = _mm_xor_si128(_mm_loadu_si128(in + 6), k);
+    b7 = _mm_xor_si128(_mm_loadu_si128(in + 7), k);
+    for (round = 1; round < 10; round++) {
+      k = _mm_loadu_si128(rk + round);
+      b0 = _mm_aesenc_si128(b0, k);
+      b1 = _mm_aesenc_si128(b1, k);
+      b2 = _mm_aesenc_si128(b2, k);
+      b3 = _mm_aesenc_si128(b3, k);
+      b4 = _mm_aesenc_si128(b4, k);
+      b5 = _mm_aesenc_si128(b5, k);
+      b6 = _mm_aesenc_si128(b6, k);
+      b7 = _mm_aesenc_si128(b7, k);
+    }
+    k = _mm_loadu_si128(rk + 10);
+    _mm_storeu_si128(out + 0, _mm_aesenclast_si128(b0, k));
+    _mm_storeu_si128(out + 1, _mm_aesenclast_si128(b1, k));
+    _mm_storeu_si128(out + 2, _mm_aesenclast_si128(b2, k));
+    _mm_storeu_si128(out + 3, _mm_aesenclast_si128(b3, k));
+    _mm_storeu_si128(out + 4, _mm_aesenclast_si128(b4, k));
+    _mm_storeu_si128(out + 5, _mm_aesenclast_si128(b5, k));
+    _mm_storeu_si128(out + 6, _mm_aesenclast_si128(b6, k));
+    _mm_storeu_si128(out + 7, _mm_aesenclast_si128(b7, k));
+    in += 8;
+    out += 8;
+  }
+  for (; n > 0; n--) {
+    aes_encrypt_block_aesni(ctx, out++, in++);
+  }
+}
+
+/*
+ * Performs the AES inverse cipher transform (decryption) with the AESDEC
+ * and AESDECLAST instructions, which implement the equivalent inverse cipher:
+ * its round keys 1 to 9 go through InvMixColumns() (the AESIMC instruction).
+ * They are computed on each call, but they don't depend on the data, so the
+ * processor computes them while waiting for the previous rounds.
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to 16 bytes (128 bits) of memory to store the plaintext
+ * input: pointer to 16 bytes (128 bits) of memory with the ciphertext
+ *
+ * [AES] 5.3.5 Equivalent Inverse Cipher
+ */
+__attribute__((target("aes,sse2")))
+static void aes_decrypt_block_aesni(const struct aes_key *ctx, void *output, const void *input) {
+  const __m128i *rk = (const __m128i *)ctx->round_keys;
+  __m128i state;
+  int round;
+
+  state = _mm_xor_si128(_mm_loadu_si128((const __m128i *)input), _mm_loadu_si128(rk + 10));
+  for (round = 9; round > 0; round--) {
+    state = _mm_aesdec_si128(state, _mm_aesimc_si128(_mm_loadu_si128(rk + round)));
+  }
+  state = _mm_aesdeclast_si128(state, _mm_loadu_si128(rk));
+  _mm_storeu_si128((__m128i *)output, state);
+}
+
+/*
+ * Performs the AES inverse cipher transform (decryption) on n blocks with the
+ * AES-NI instructions, interleaving the rounds of 8 blocks at a time.
+ * The AESIMC round keys are computed once for all the blocks.
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to (16 * n) bytes of memory to store the plaintext blocks
+ * input: pointer to (16 * n) bytes of memory with the ciphertext blocks
+ * n: number of blocks
+ */
+__attribute__((target("aes,sse2")))
+static void aes_decrypt_blocks_aesni(const struct aes_key *ctx, void *output, const void *input, int n) {
+  const __m128i *rk = (const __m128i *)ctx->round_keys;
+  const __m128i *in = (const __m128i *)input;
+  __m128i *out = (__m128i *)output;
+  __m128i dk[11];  /* [AES] 5.3.5 Equivalent Inverse Cipher round keys */
+  __m128i k, b0, b1, b2, b3, b4, b5, b6, b7;
+  int round;
+
+  dk[0] = _mm_loadu_si128(rk);
+  for (round = 1; round < 10; round++) {
+    dk[round] = _mm_aesimc_si128(_mm_loadu_si128(rk + round));
+  }
+  dk[10] = _mm_loadu_si128(rk + 10);
+
+  for (; n >= 8; n -= 8) {
+    k = dk[10];
+    b0 = _mm_xor_si128(_mm_loadu_si128(in + 0), k);
+    b1 = _mm_xor_si128(_mm_loadu_si128(in + 1), k);
+    b2 = _mm_xor_si128(_mm_loadu_si128(in + 2), k);
+    b3 = _mm_xor_si128(_mm_loadu_si128(in + 3), k);
+    b4 = _mm_xor_si128(_mm_loadu_si128(in + 4), k);
+    b5 = _mm_xor_si128(_mm_loadu_si128(in + 5), k);
+    b6 = _mm_xor_si128(_mm_loadu_si128(in + 6), k);
+    b7 = _mm_xor_si128(_mm_loadu_si128(in + 7), k);
+    for (round = 9; round > 0; round--) {
+      k = dk[round];
+      b0 = _mm_aesdec_si128(b0, k);
+      b1 = _mm_aesdec_si128(b1, k);
+      b2 = _mm_aesdec_si128(b2, k);
+      b3 = _mm_aesdec_si128(b3, k);
+      b4 = _mm_aesdec_si128(b4, k);
+      b5 = _mm_aesdec_si128(b5, k);
+      b6 = _mm_aesdec_si128(b6, k);
+      b7 = _mm_aesdec_si128(b7, k);
+    }
+    k = dk[0];
+    _mm_storeu_si128(out + 0, _mm_aesdeclast_si128(b0, k));
+    _mm_storeu_si128(out + 1, _mm_aesdeclast_si128(b1, k));
+    _mm_storeu_si128(out + 2, _mm_aesdeclast_si128(b2, k));
+    _mm_storeu_si128(out + 3, _mm_aesdeclast_si128(b3, k));
+    _mm_storeu_si128(out + 4, _mm_aesdeclast_si128(b4, k));
+    _mm_storeu_si128(out + 5, _mm_aesdeclast_si128(b5, k));
+    _mm_storeu_si128(out + 6, _mm_aesdeclast_si128(b6, k));
+    _mm_storeu_si128(out + 7, _mm_aesdeclast_si128(b7, k));
+    in += 8;
+    out += 8;
+  }
+  for (; n > 0; n--) {
+    b0 = _mm_xor_si128(_mm_loadu_si128(in++), dk[10]);
+    for (round = 9; round > 0; round--) {
+      b0 = _mm_aesdec_si128(b0, dk[round]);
+    }
+    _mm_storeu_si128(out++, _mm_aesdeclast_si128(b0, dk[0]));
+  }
+}
+
+#endif
+
+/*
+ * Expands a cipher key into the round keys used by aes_encrypt_block()
+ * for a given implementation of the cipher.
+ * ctx: pointer to the aes_key structure to store the expanded key
+ * key: pointer to 16 bytes (128 bits) of memory with the cipher key
+ * backend: one of the AES_BACKEND_* implementations available in this program
+ *          and on this processor (aes_expand_key() selects the best one)
+ *
+ * [AES] 5.2 Key Expansion
+ */
+static void aes_expand_key_backend(struct aes_key *ctx, const void *key, int backend) {
+  ctx->backend = backend;
+#ifdef AES_AESNI
+  if (backend == AES_BACKEND_AESNI) {
+    aes_expand_key_aesni(ctx, key);
+    return;
+  }
+#endif
+#ifdef AES_BITSLICE
+  if (backend == AES_BACKEND_BITSLICE) {
+    aes_expand_key_bitslice(ctx, key);
+    return;
+  }
+#endif
+  ctx->backend = AES_BACKEND_PORTABLE;
+  aes_expand_key_portable(ctx, key);
+}
+
+/*
+ * Expands a cipher key into the round keys used by aes_encrypt_block(),
+ * and selects the fastest implementation available on this processor
+ * (or the fastest constant-time one if AES_CONSTANT_TIME is defined).
+ * ctx: pointer to the aes_key structure to store the expanded key
+ * key: pointer to 16 bytes (128 bits) of memory with the cipher key
+ *
+ * [AES] 5.2 Key Expansion
+ */
+static AES_UNUSED void aes_expand_key(struct aes_key *ctx, const void *key) {
+#ifdef AES_AESNI
+  if (aes_has_aesni()) {
+    aes_expand_key_backend(ctx, key, AES_BACKEND_AESNI);
+    return;
+  }
+#endif
+#ifdef AES_CONSTANT_TIME
+  aes_expand_key_backend(ctx, key, AES_BACKEND_BITSLICE);
+#else
+  aes_expand_key_backend(ctx, key, AES_BACKEND_PORTABLE);
+#endif
+}
+
+/*
+ * Performs the AES cipher transform (encryption) for Nk=4 (AES-128)
+ * with a key previously expanded by aes_expand_key().
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to 16 bytes (128 bits) of memory to store the ciphertext
+ * input: pointer to 16 bytes (128 bits) of memory with the plaintext
+ *
+ * The output may overlap the input.
+ */
+static void aes_encrypt_block(const struct aes_key *ctx, void *output, const void *input) {
+#ifdef AES_AESNI
+  if (ctx->backend == AES_BACKEND_AESNI) {
+    aes_encrypt_block_aesni(ctx, output, input);
+    return;
+  }
+#endif
+#ifdef AES_BITSLICE
+  if (ctx->backend == AES_BACKEND_BITSLICE) {
+    aes_encrypt_blocks_bitslice(ctx, output, input, 1);
+    return;
+  }
+#endif
+  aes_encrypt_block_portable(ctx, output, input);
+}
+
+/*
+ * Performs the AES cipher transform (encryption) on several independent
+ * blocks, such as the counter blocks of the CTR mode, with a key
+ * previously expanded by aes_expand_key().
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to (16 * n) bytes of memory to store the ciphertext blocks
+ * input: pointer to (16 * n) bytes of memory with the plaintext blocks
+ * n: number of blocks
+ *
+ * The output may overlap the input only if they are at the same address.
+ * The AES-NI and bitsliced implementations process 8 blocks at a time,
+ * so n should be a multiple of 8 if possible.
+ */
+static AES_UNUSED void aes_encrypt_blocks(const struct aes_key *ctx, void *output, const void *input, int n) {
+  int i;
+
+#ifdef AES_AESNI
+  if (ctx->backend == AES_BACKEND_AESNI) {
+    aes_encrypt_blocks_aesni(ctx, output, input, n);
+    return;
+  }
+#endif
+#ifdef AES_BITSLICE
+  if (ctx->backend == AES_BACKEND_BITSLICE) {
+    aes_encrypt_blocks_bitslice(ctx, output, input, n);
+    return;
+  }
+#endif
+  for (i = 0; i < n; i++) {
+    aes_encrypt_block(ctx, (unsigned char *)output + 16 * i, (const unsigned char *)input + 16 * i);
+  }
+}
+
+/*
+ * Performs the AES inverse cipher transform (decryption) for Nk=4 (AES-128)
+ * with a key previously expanded by aes_expand_key().
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to 16 bytes (128 bits) of memory to store the plaintext
+ * input: pointer to 16 bytes (128 bits) of memory with the ciphertext
+ *
+ * The output may overlap the input.
+ *
+ * [AES] 5.3 Inverse Cipher
+ */
+static AES_UNUSED void aes_decrypt_block(const struct aes_key *ctx, void *output, const void *input) {
+#ifdef AES_AESNI
+  if (ctx->backend == AES_BACKEND_AESNI) {
+    aes_decrypt_block_aesni(ctx, output, input);
+    return;
+  }
+#endif
+#ifdef AES_BITSLICE
+  if (ctx->backend == AES_BACKEND_BITSLICE) {
+    aes_decrypt_blocks_bitslice(ctx, output, input, 1);
+    return;
+  }
+#endif
+  aes_decrypt_block_portable(ctx, output, input);
+}
+
+/*
+ * Performs the AES inverse cipher transform (decryption) on several
+ * independent blocks with a key previously expanded by aes_expand_key().
+ * ctx: pointer to the expanded cipher key
+ * output: pointer to (16 * n) bytes of memory to store the plaintext blocks
+ * input: pointer to (16 * n) bytes of memory with the ciphertext blocks
+ * n: number of blocks
+ *
+ * The output may overlap the input only if they are at the same address.
+ * The AES-NI and bitsliced implementations process 8 blocks at a time,
+ * so n should be a multiple of 8 if possible.
+ */
+static AES_UNUSED void aes_decrypt_blocks(const struct aes_key *ctx, void *output, const void *input, int n) {
+  int i;
+
+#ifdef AES_AESNI
+  if (ctx->backend == AES_BACKEND_AESNI) {
+    aes_decrypt_blocks_aesni(ctx, output, input, n);
+    return;
+  }
+#endif
+#ifdef AES_BITSLICE
+  if (ctx->backend == AES_BACKEND_BITSLICE) {
+    aes_decrypt_blocks_bitslice(ctx, output, input, n);
+    return;
+  }
+#endif
+  for (i = 0; i < n; i++) {
+    aes_decrypt_block_portable(ctx, (unsigned char *)output + 16 * i, (const unsigned char *)input + 16 * i);
+  }
+}
+
+/*
+ * Performs the AES cipher transform (encryption) for Nk=4 (AES-128).
+ * output: pointer to 16 bytes (128 bits) of memory to store the ciphertext
+ * input: pointer to 16 bytes (128 bits) of memory with the plaintext
+ * key: pointer to 16 bytes (128 bits) of memory with the cipher key
+ *
+ * Expands the key on every call: when encrypting several blocks with the
+ * same key, use aes_expand_key() once and then aes_encrypt_block().
+ * For keys used only once, such as the chaining values of a hash function,
+ * the AES-NI and AES_TTABLE implementations compute each round key just
+ * before the round that needs it, instead of the whole key schedule first.
+ *
+ * The output may overlap the input or the key.
+ */
+static AES_UNUSED void aes_encrypt(void *output, const void *input, const void *key) {
+#if !defined(AES_TTABLE) || defined(AES_CONSTANT_TIME)
+  struct aes_key ctx;
+#endif
+
+#ifdef AES_AESNI
+  if (aes_has_aesni()) {
+    aes_encrypt_aesni(output, input, key);
+    return;
   }
+#endif
+#if defined(AES_TTABLE) && !defined(AES_CONSTANT_TIME)
+  aes_encrypt_portable(output, input, key);
+#else
+  aes_expand_key(&ctx, key);
+  aes_encrypt_block(&ctx, output, input);
+#endif
 }
@@ -7,6 +7,241 @@
  * For more information, please refer to UNLICENSE or http://unlicense.org
  */
 
+/*
+ * Encodes bytes into base 64 format with base64_encode(), and decodes them
+ * with base64_decode(), which accepts only strictly valid input, or with
+ * base64_decode_mime(), which also skips the whitespace of line breaks.
+ *
+ * On x86 processors, they encode and decode 12 or 24 bytes at a time with
+ * the SSSE3 or AVX2 instructions, if the processor supports them, and the
+ * rest with plain C; define BASE64_NO_SIMD (or BASE64_NO_AVX2) to use only
+ * plain C (or not AVX2).
+ *
+ * References:
+ * [RFC4648] The Base16, Base32, and Base64 Data Encodings.
+ * [RFC2045] Multipurpose Internet Mail Extensions (MIME) Part One:
+ *           Format of Internet Message Bodies.
+ */
+
+#ifdef __GNUC__
+#define BASE64_UNUSED __attribute__((unused))
+#else
+#define BASE64_UNUSED
+#endif
+
+#if !defined(BASE64_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64_SSSE3
+#ifndef BASE64_NO_AVX2
+#define BASE64_AVX2
+#endif
+#include <immintrin.h>
+#endif
+
+/*
+ * The value of each base 64 character (from 0 to 63), or
+ * BASE64_SPACE for the whitespace characters space, tab, CR and LF, or
+ * BASE64_INVALID for the other characters, including the pad '='.
+ */
+#define BASE64_SPACE 0x40
+#define BASE64_INVALID 0x80
+static const unsigned char base64_values[256] = {
+  0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x40,0x40,0x80,0x80,0x40,0x80,0x80,
+  0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,
+  0x40,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x3e,0x80,0x80,0x80,0x3f,
+  0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x3b,0x3c,0x3d,0x80,0x80,0x80,0x80,0x80,0x80,
+  0x80,0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,
+  0x0f,0x10,0x11,0x12,0x13,0x14,0x15,0x16,0x17,0x18,0x19,0x80,0x80,0x80,0x80,0x80,
+  0x80,0x1a,0x1b,0x1c,0x1d,0x1e,0x1f,0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,0x28,
+  0x29,0x2a,0x2b,0x2c,0x2d,0x2e,0x2f,0x30,0x31,0x32,0x33,0x80,0x80,0x80,0x80,0x80,
+  0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,
+  0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,
+  0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,
+  0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,
+  0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,
+  0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,
+  0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,
+  0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,
+};
+
+#ifdef BASE64_SSSE3
+
+/*
+ * Checks which SIMD instructions the processor supports.
+ * Returns 2 for AVX2 (and SSSE3), 1 for SSSE3 only, or 0 for neither.
+ */
+static int base64_simd(void) {
+  static int simd = -1;  /* not checked yet */
+  int level;
+
+  /* Threads may check at the same time: each stores the same value, atomically */
+  level = __atomic_load_n(&simd, __ATOMIC_RELAXED);
+  if (level < 0) {
+    __builtin_cpu_init();
+    level = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("ssse3") ? 1 : 0;
+    __atomic_store_n(&simd, level, __ATOMIC_RELAXED);
+  }
+  return level;
+}
+
+/*
+ * Encodes whole groups of 3 bytes with the SSSE3 instructions, 12 bytes
+ * into 16 characters at a time, as long as 16 bytes can be read.
+ * Returns the number of bytes encoded, a multiple of 12.
+ *
+ * The 4 6-bit values of each group are shifted into the 4 bytes of a
+ * 32-bit word with multiplications, and the characters are computed by
+ * adding to each value the offset of its range (A-Z, a-z, 0-9, +, /):
+ * values 0-51 give 0, and 52-63 give 1-12 with a saturated subtraction,
+ * then 0-25 are told apart from 26-51 with a comparison, and the resulting
+ * index selects the offset in a table with PSHUFB.
+ */
+__attribute__((target("ssse3")))
+static int base64_encode_ssse3(unsigned char *output, const unsigned char *input, int length) {
+  const __m128i split = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  __m128i x, a, b;
+  int i;
+
+  for (i = 0; i <= length - 16; i += 12) {
+    /* Bytes 1 0 2 1 of each group in a 32-bit word */
+    x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(input + i)), split);
+    a = _mm_mulhi_epu16(_mm_and_si128(x, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+    b = _mm_mullo_epi16(_mm_and_si128(x, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+    x = _mm_or_si128(a, b);
+    a = _mm_subs_epu8(x, _mm_set1_epi8(51));
+    a = _mm_or_si128(a, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), x), _mm_set1_epi8(13)));
+    x = _mm_add_epi8(x, _mm_shuffle_epi8(offsets, a));
+    _mm_storeu_si128((__m128i *)(output + i / 3 * 4), x);
+  }
+  return i;
+}
+
+/*
+ * Decodes whole groups of 4 characters with the SSSE3 instructions,
+ * 16 characters into 12 bytes at a time, stopping before 16 characters
+ * that are not all in the alphabet, and as long as 24 characters are left
+ * (so that the 16 bytes stored each time fit in 3/4 of the input length).
+ * Returns the number of characters decoded, a multiple of 16.
+ *
+ * The characters are checked with 2 tables indexed by their low and high
+ * 4 bits with PSHUFB: the bits of the entries of a character have nothing
+ * in common only if the character is in the alphabet. Then the offset
+ * from each character to its value is found by its high 4 bits (with
+ * '/' apart from '+'), and the 6-bit values are packed into bytes with
+ * multiplications and additions.
+ *
+ * W. Mula, D. Lemire, "Faster Base64 Encoding and Decoding Using AVX2
+ * Instructions", ACM Transactions on the Web 12(3), 2018.
+ */
+__attribute__((target("ssse3")))
+static int base64_decode_ssse3(unsigned char *output, const unsigned char *input, int length) {
+  const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i x, hi, lo;
+  int i;
+
+  for (i = 0; i <= length - 24; i += 16) {
+    x = _mm_loadu_si128((const __m128i *)(input + i));
+    hi = _mm_and_si128(_mm_srli_epi32(x, 4), nibble);
+    lo = _mm_and_si128(_mm_shuffle_epi8(lut_lo, _mm_and_si128(x, nibble)), _mm_shuffle_epi8(lut_hi, hi));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(lo, _mm_setzero_si128())) != 0xffff) {
+      break;
+    }
+    hi = _mm_add_epi8(hi, _mm_cmpeq_epi8(x, _mm_set1_epi8('/')));
+    x = _mm_add_epi8(x, _mm_shuffle_epi8(lut_roll, hi));
+    x = _mm_maddubs_epi16(x, _mm_set1_epi32(0x01400140));
+    x = _mm_madd_epi16(x, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128((__m128i *)(output + i / 4 * 3), _mm_shuffle_epi8(x, pack));
+  }
+  return i;
+}
+
+#endif
+
+#ifdef BASE64_AVX2
+
+/*
+ * Encodes like base64_encode_ssse3() with the AVX2 instructions,
+ * 24 bytes into 32 characters at a time, as long as 28 bytes can be read.
+ * Returns the number of bytes encoded, a multiple of 24.
+ */
+__attribute__((target("avx2")))
+static int base64_encode_avx2(unsigned char *output, const unsigned char *input, int length) {
+  const __m256i split = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+    10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m256i offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  __m256i x, a, b;
+  int i;
+
+  for (i = 0; i <= length - 28; i += 24) {
+    /* 12 bytes in each 128-bit lane, as PSHUFB does not cross lanes */
+    x = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(input + i))),
+      _mm_loadu_si128((const __m128i *)(input + i + 12)), 1);
+    x = _mm256_shuffle_epi8(x, split);
+    a = _mm256_mulhi_epu16(_mm256_and_si256(x, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+    b = _mm256_mullo_epi16(_mm256_and_si256(x, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+    x = _mm256_or_si256(a, b);
+    a = _mm256_subs_epu8(x, _mm256_set1_epi8(51));
+    a = _mm256_or_si256(a, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), x), _mm256_set1_epi8(13)));
+    x = _mm256_add_epi8(x, _mm256_shuffle_epi8(offsets, a));
+    _mm256_storeu_si256((__m256i *)(output + i / 3 * 4), x);
+  }
+  return i;
+}
+
+/*
+ * Decodes like base64_decode_ssse3() with the AVX2 instructions,
+ * 32 characters into 24 bytes at a time, as long as 44 characters are left
+ * (so that the 32 bytes stored each time fit in 3/4 of the input length).
+ * Returns the number of characters decoded, a multiple of 32.
+ */
+__attribute__((target("avx2")))
+static int base64_decode_avx2(unsigned char *output, const unsigned char *input, int length) {
+  const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i x, hi, lo;
+  int i;
+
+  for (i = 0; i <= length - 44; i += 32) {
+    x = _mm256_loadu_si256((const __m256i *)(input + i));
+    hi = _mm256_and_si256(_mm256_srli_epi32(x, 4), nibble);
+    lo = _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, _mm256_and_si256(x, nibble)), _mm256_shuffle_epi8(lut_hi, hi));
+    if (!_mm256_testz_si256(lo, lo)) {
+      break;
+    }
+    hi = _mm256_add_epi8(hi, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('/')));
+    x = _mm256_add_epi8(x, _mm256_shuffle_epi8(lut_roll, hi));
+    x = _mm256_maddubs_epi16(x, _mm256_set1_epi32(0x01400140));
+    x = _mm256_madd_epi16(x, _mm256_set1_epi32(0x00011000));
+    /* The 12 bytes of each lane, next to each other */
+    x = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(x, pack), _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+    _mm256_storeu_si256((__m256i *)(output + i / 4 * 3), x);
+  }
+  return i;
+}
+
+#endif
+
 /*
  * Encodes a sequence of bytes into base 64 format.
  * output: pointer to (length+2)/3*4 bytes of memory to store the base 64 encoded data
@@ -14,10 +249,9 @@
  * length: number of bytes of the input data
  * Returns the number of bytes stored in output, always (length+2)/3*4.
  *
- * References:
- * [RFC4648] The Base16, Base32, and Base64 Data Encodings.
+ * [RFC4648] 4. Base 64 Encoding
  */
-static int base64_encode(void *output, const void *input, int length) {
+static BASE64_UNUSED int base64_encode(void *output, const void *input, int length) {
   const char alphabet[64] = {
     'A','B','C','D','E','F','G','H','I','J','K','L','M',
     'N','O','P','Q','R','S','T','U','V','W','X','Y','Z',
@@ -28,8 +262,19 @@ static int base64_encode(void *output, const void *input, int length) {
   unsigned char a, b, c;
   int i, n;
 
-  n = 0;
-  for (i = 0; i <= length - 3; i += 3) {
+  i = 0;
+#ifdef BASE64_AVX2
+  if (base64_simd() >= 2) {
+    i = base64_encode_avx2((unsigned char *)output, (const unsigned char *)input, length);
+  }
+#endif
+#ifdef BASE64_SSSE3
+  if (base64_simd() >= 1) {
+    i += base64_encode_ssse3((unsigned char *)output + i / 3 * 4, (const unsigned char *)input + i, length - i);
+  }
+#endif
+  n = i / 3 * 4;
+  for (; i <= length - 3; i += 3) {
     a = ((unsigned char *)input)[i];
     b = ((unsigned char *)input)[i + 1];
     c = ((unsigned char *)input)[i + 2];
@@ -55,3 +300,156 @@ static int base64_encode(void *output, const void *input, int length) {
 
   return n;
 }
+
+/*
+ * Decodes base 64 data, stopping at the first character that is not
+ * in a whole group of 4 valid characters, or at the end of the input.
+ * output: pointer to memory to store the decoded bytes
+ * input: pointer to the base 64 encoded data
+ * length: number of characters of the input
+ * n: pointer to the number of bytes stored in output so far, updated
+ * Returns the number of characters decoded.
+ *
+ * The SSSE3 or AVX2 instructions decode as much as they can first. Then
+ * each group of 4 characters is assembled into a 24-bit word, whose
+ * 3 bytes are then stored together. The values of invalid and whitespace
+ * characters have bits 6 or 7 set, so one test checks all 4 of them.
+ */
+static int base64_decode_groups(unsigned char *output, const unsigned char *input, int length, int *n) {
+  unsigned a, b, c, d, w;
+  int i, j;
+
+  i = 0;
+#ifdef BASE64_AVX2
+  if (base64_simd() >= 2) {
+    i = base64_decode_avx2(output + *n, input, length);
+  }
+#endif
+#ifdef BASE64_SSSE3
+  if (base64_simd() >= 1) {
+    i += base64_decode_ssse3(output + *n + i / 4 * 3, input + i, length - i);
+  }
+#endif
+  j = *n + i / 4 * 3;
+  for (; i <= length - 4; i += 4) {
+    a = base64_values[input[i]];
+    b = base64_values[input[i + 1]];
+    c = base64_values[input[i + 2]];
+    d = base64_values[input[i + 3]];
+    if ((a | b | c | d) & (BASE64_SPACE | BASE64_INVALID)) {
+      break;
+    }
+    w = a << 18 | b << 12 | c << 6 | d;
+    output[j] = (unsigned char)(w >> 16);
+    output[j + 1] = (unsigned char)(w >> 8);
+    output[j + 2] = (unsigned char)w;
+    j += 3;
+  }
+  *n = j;
+  return i;
+}
+
+/*
+ * Decodes base 64 data with base64_decode() or base64_decode_mime().
+ * skip_spaces: nonzero to skip whitespace, or 0 to reject it
+ */
+static int base64_decode_spaces(void *output, const void *input, int length, int skip_spaces) {
+  const unsigned char *in = (const unsigned char *)input;
+  unsigned char *out = (unsigned char *)output;
+  unsigned char q[4];  /* the characters of a group */
+  unsigned w;
+  int i, j, n;
+
+  n = 0;
+  i = 0;
+  for (;;) {
+    /* The groups of valid characters */
+    i += base64_decode_groups(out, in + i, length - i, &n);
+
+    /* The next group, with whitespace, padding, or invalid characters */
+    for (j = 0; j < 4 && i < length; i++) {
+      if (base64_values[in[i]] == BASE64_SPACE && skip_spaces) {
+        continue;
+      }
+      q[j++] = in[i];
+    }
+    if (j == 0) {
+      return n;
+    }
+    if (j < 4) {
+      return -1;
+    }
+    if (q[3] == '=') {
+      break;
+    }
+    /* A group of valid characters split by whitespace */
+    if ((base64_values[q[0]] | base64_values[q[1]] | base64_values[q[2]] | base64_values[q[3]]) & (BASE64_SPACE | BASE64_INVALID)) {
+      return -1;
+    }
+    w = (unsigned)base64_values[q[0]] << 18 | (unsigned)base64_values[q[1]] << 12
+      | (unsigned)base64_values[q[2]] << 6 | base64_values[q[3]];
+    out[n++] = (unsigned char)(w >> 16);
+    out[n++] = (unsigned char)(w >> 8);
+    out[n++] = (unsigned char)w;
+  }
+
+  /*
+   * The final group, padded to 1 or 2 bytes. The bits of the last character
+   * beyond those bytes must be zero (see [RFC4648] 3.5 Canonical Encoding).
+   */
+  if ((base64_values[q[0]] | base64_values[q[1]]) & (BASE64_SPACE | BASE64_INVALID)) {
+    return -1;
+  }
+  if (q[2] == '=') {
+    if (base64_values[q[1]] & 0x0f) {
+      return -1;
+    }
+    out[n++] = (unsigned char)(base64_values[q[0]] << 2 | base64_values[q[1]] >> 4);
+  } else {
+    if (base64_values[q[2]] & (BASE64_SPACE | BASE64_INVALID | 0x03)) {
+      return -1;
+    }
+    out[n++] = (unsigned char)(base64_values[q[0]] << 2 | base64_values[q[1]] >> 4);
+    out[n++] = (unsigned char)(base64_values[q[1]] << 4 | base64_values[q[2]] >> 2);
+  }
+
+  /* Nothing may follow the padding, but whitespace if skipped */
+  for (; i < length; i++) {
+    if (base64_values[in[i]] != BASE64_SPACE || !skip_spaces) {
+      return -1;
+    }
+  }
+  return n;
+}
+
+/*
+ * Decodes base 64 data, which must be strictly valid: made of whole groups
+ * of 4 characters of the base 64 alphabet, without whitespace, and with
+ * the pad character '=' only at the end, as base64_encode() produces it.
+ * output: pointer to length/4*3 bytes of memory to store the decoded data
+ * input: pointer to the base 64 encoded data
+ * length: number of characters of the input
+ * Returns the number of bytes stored in output, or -1 if the input is not
+ * valid (then the contents of output are undefined).
+ *
+ * [RFC4648] 4. Base 64 Encoding
+ */
+static BASE64_UNUSED int base64_decode(void *output, const void *input, int length) {
+  return base64_decode_spaces(output, input, length, 0);
+}
+
+/*
+ * Decodes base 64 data like base64_decode(), but skipping any whitespace
+ * (spaces, tabs, CR and LF), such as the line breaks of MIME bodies,
+ * anywhere in the input.
+ * output: pointer to length/4*3 bytes of memory to store the decoded data
+ * input: pointer to the base 64 encoded data
+ * length: number of characters of the input
+ * Returns the number of bytes stored in output, or -1 if the input is not
+ * valid (then the contents of output are undefined).
+ *
+ * [RFC2045] 6.8 Base64 Content-Transfer-Encoding
+ */
+static BASE64_UNUSED int base64_decode_mime(void *output, const void *input, int length) {
+  return base64_decode_spaces(output, input, length, 1);
+}
@@ -6,33 +6,82 @@
 #include <stdlib.h>
 
 
-void hex_string_to_byte_array(const char *hex_string, unsigned char *byte_array, int byte_array_length) {
-    for (int i = 0; i < byte_array_length; i++) {
-        sscanf(&hex_string[i*2], "%2hhx", &byte_array[i]);
-    }
+int hex_digit_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
 }
 
-int main() {
-char* installCode = "A87710C3E5C332E5327EE532C3C310E5DFE0"; // install code of the zigbee device
-    int length = strlen(installCode) / 2; // Each byte is represented by 2 hex characters
-    unsigned char* message = malloc(length);
-    hex_string_to_byte_array(installCode, message, length);
-    char digest[16];
-    aes_mmo(digest, message, length);
-
-    for (int i = 0; i < 16; i++) {
-        printf("%02x", (unsigned char)digest[i]);
+// Returns -1 if one of the first 2*byte_array_length characters is not a hex digit
+int hex_string_to_byte_array(const char *hex_string, unsigned char *byte_array, size_t byte_array_length) {
+    for (size_t i = 0; i < byte_array_length; i++) {
+        int high = hex_digit_value(hex_string[i*2]);
+        int low = hex_digit_value(hex_string[i*2 + 1]);
+        if (high < 0 || low < 0) return -1;
+        byte_array[i] = high << 4 | low;
     }
-    printf("\n");
-
-    free(message);
     return 0;
 }
 
+// Derives the link keys of a batch of devices from their install codes (hex strings),
+// hashing them all together with aes_mmo_many(); link_keys receives 16 bytes per device.
+// Returns -1, leaving link_keys untouched, if an install code is empty, has an odd length
+// or contains a character that is not a hex digit, or if an allocation fails
+int install_codes_to_link_keys(const char **install_codes, int count, unsigned char *link_keys) {
+    if (count <= 0) return count < 0 ? -1 : 0;
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        size_t digits = strlen(install_codes[i]);
+        if (digits == 0 || digits % 2 != 0) return -1;
+        total += digits / 2; // Each byte is represented by 2 hex characters
+    }
+    // calloc() checks count * size for overflow
+    const void **messages = calloc(count, sizeof(*messages));
+    size_t *lengths = calloc(count, sizeof(*lengths));
+    unsigned char* bytes = malloc(total);
+    unsigned char* p = bytes;
+    int result = -1;
+    if (messages == NULL || lengths == NULL || bytes == NULL) goto done;
+    for (int i = 0; i < count; i++) {
+        lengths[i] = strlen(install_codes[i]) / 2;
+        if (hex_string_to_byte_array(install_codes[i], p, lengths[i]) != 0) goto done;
+        messages[i] = p;
+        p += lengths[i];
+    }
+    if (aes_mmo_many(link_keys, messages, lengths, count) != 0) goto done;
+    result = 0;
 
+done:
+    free(bytes);
+    free(lengths);
+    free(messages);
+    return result;
+}
 
+int main() {
+    const char* installCodes[] = {
+        "A87710C3E5C332E5327EE532C3C310E5DFE0", // install code of the zigbee device
+    };
+    int count = sizeof(installCodes) / sizeof(installCodes[0]);
+    unsigned char* digests = calloc(count, 16);
+    if (digests == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if (install_codes_to_link_keys(installCodes, count, digests) != 0) {
+        fprintf(stderr, "Invalid install code or out of memory\n");
+        free(digests);
+        return 1;
+    }
 
+    for (int j = 0; j < count; j++) {
+        for (int i = 0; i < 16; i++) {
+            printf("%02x", digests[16*j + i]);
+        }
+        printf("\n");
+    }
 
-
-
-
+    free(digests);
+    return 0;
+}
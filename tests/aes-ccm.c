@@ -8,6 +8,7 @@
  */
 
 #include "../aes.h"
+#include "../aes-ctr.h"
 #include "../aes-ccm.h"
 #include <stdio.h>
 #include <string.h>
@@ -22,7 +23,42 @@
  *
  * [ZIGBEE] ZigBee Specification, document 053474r20, Sep 2012
  *          Annex C Test Vectors for Cryptographic Building Blocks
+ *
+ * and against a separate CBC-MAC and CTR computation for several payload lengths.
+ */
+
+/*
+ * Computes the AES-CCM ciphertext, without associated data, with the CBC-MAC
+ * and the CTR mode in two separate passes.
  */
+static void reference_ccm(unsigned char *ciphertext, int mac_length, const unsigned char *nonce, const unsigned char *payload, int payload_length, const struct aes_key *ctx) {
+  unsigned char y[16];
+  unsigned char cb[16];
+  int i, j;
+
+  /* B0 with a 13-byte nonce, and the blocks of the payload */
+  y[0] = ((mac_length - 2) / 2) << 3 | 1;
+  memcpy(y + 1, nonce, 13);
+  y[14] = payload_length >> 8;
+  y[15] = payload_length;
+  aes_encrypt_block(ctx, y, y);
+  for (i = 0; i < payload_length; i += 16) {
+    for (j = 0; j < 16 && i + j < payload_length; j++) {
+      y[j] ^= payload[i + j];
+    }
+    aes_encrypt_block(ctx, y, y);
+  }
+
+  /* CTR1 onwards for the payload, then Ctr0 for the MAC */
+  cb[0] = 1;
+  memcpy(cb + 1, nonce, 13);
+  cb[14] = 0;
+  cb[15] = 1;
+  aes_ctr(ciphertext, payload, payload_length, cb, 2, ctx);
+  cb[15] = 0;
+  aes_ctr(ciphertext + payload_length, y, mac_length, cb, 2, ctx);
+}
+
 int main(int argc, char **argv) {
 
   /* [CCM] C.1 Example 1 */
@@ -170,6 +206,8 @@ int main(int argc, char **argv) {
       0xb4, 0xac, 0x6b, 0xec, 0x93, 0xe8, 0x59, 0x8e,
       0x7f, 0x0d, 0xad, 0xbc, 0xea, 0x5b
     };
+    struct aes_key ctx;
+    struct aes_ccm_state state;
     unsigned char x[sizeof(ciphertext)];
     unsigned i;
 
@@ -190,6 +228,34 @@ int main(int argc, char **argv) {
       fputs("aes_ccm_decrypt() payload failed CCM example 4\n", stderr);
       return 1;
     }
+
+    /* The same, streamed in parts */
+    aes_expand_key(&ctx, key);
+    aes_ccm_init(&state, 14, nonce, sizeof(nonce), sizeof(ad), sizeof(payload), &ctx, 0);
+    if (aes_ccm_update(&state, x, payload, 1) != -1 || aes_ccm_final(&state, x) != -1) {
+      fputs("aes_ccm_update() accepted the payload before the associated data\n", stderr);
+      return 1;
+    }
+    if (aes_ccm_aad(&state, ad, 7) || aes_ccm_aad(&state, ad + 7, 0) || aes_ccm_aad(&state, ad + 7, sizeof(ad) - 7)
+        || aes_ccm_aad(&state, ad, 1) != -1) {
+      fputs("aes_ccm_aad() failed CCM example 4\n", stderr);
+      return 1;
+    }
+    if (aes_ccm_update(&state, x, payload, 1) || aes_ccm_update(&state, x + 1, payload + 1, 15)
+        || aes_ccm_update(&state, x + 16, payload + 16, 17) != -1 || aes_ccm_update(&state, x + 16, payload + 16, 16)
+        || aes_ccm_final(&state, x + 32) || memcmp(x, ciphertext, sizeof(ciphertext))) {
+      fputs("aes_ccm_update() failed CCM example 4\n", stderr);
+      return 1;
+    }
+    aes_ccm_init(&state, 14, nonce, sizeof(nonce), sizeof(ad), sizeof(payload), &ctx, 1);
+    aes_ccm_aad(&state, ad, sizeof(ad));
+    aes_ccm_update(&state, x, ciphertext, 20);
+    aes_ccm_update(&state, x + 20, ciphertext + 20, 12);
+    memcpy(x + 32, ciphertext + 32, 14);
+    if (aes_ccm_final(&state, x + 32) || memcmp(x, payload, sizeof(payload))) {
+      fputs("aes_ccm_final() failed CCM example 4\n", stderr);
+      return 1;
+    }
   }
 
   /* [ZIGBEE] C.3 CCM* Mode Encryption and Authentication Transformation */
@@ -216,7 +282,10 @@ int main(int argc, char **argv) {
       0xd4, 0x66, 0x4e, 0xca, 0xd8, 0x54, 0xa8, 0x0a,
       0x89, 0x5c, 0xc1, 0xd8, 0xff, 0x94, 0x69
     };
+    const unsigned char zeros[sizeof(payload)] = { 0 };
+    struct aes_key ctx;
     unsigned char x[sizeof(ciphertext)];
+    unsigned char y[sizeof(ciphertext)];
 
     aes_ccm_encrypt(x, 8, nonce, sizeof(nonce), ad, sizeof(ad), payload, sizeof(payload), key);
     if (memcmp(x, ciphertext, sizeof(ciphertext))) {
@@ -232,6 +301,287 @@ int main(int argc, char **argv) {
       fputs("aes_ccm_decrypt() payload failed ZigBee example\n", stderr);
       return 1;
     }
+
+    aes_expand_key(&ctx, key);
+    aes_ccm_encrypt_ctx(x, 8, nonce, sizeof(nonce), ad, sizeof(ad), payload, sizeof(payload), &ctx);
+    if (memcmp(x, ciphertext, sizeof(ciphertext))) {
+      fputs("aes_ccm_encrypt_ctx() failed ZigBee example\n", stderr);
+      return 1;
+    }
+    if (aes_ccm_decrypt_ctx(x, 8, nonce, sizeof(nonce), ad, sizeof(ad), ciphertext, sizeof(ciphertext), &ctx)
+        || memcmp(x, payload, sizeof(payload))) {
+      fputs("aes_ccm_decrypt_ctx() failed ZigBee example\n", stderr);
+      return 1;
+    }
+
+    /* In place, and with a modified MAC */
+    memcpy(x, payload, sizeof(payload));
+    aes_ccm_encrypt_ctx(x, 8, nonce, sizeof(nonce), ad, sizeof(ad), x, sizeof(payload), &ctx);
+    if (memcmp(x, ciphertext, sizeof(ciphertext))) {
+      fputs("aes_ccm_encrypt_ctx() failed in place\n", stderr);
+      return 1;
+    }
+    memcpy(y, ciphertext, sizeof(ciphertext));
+    y[sizeof(y) - 1] ^= 1;
+    if (!aes_ccm_decrypt_ctx(x, 8, nonce, sizeof(nonce), ad, sizeof(ad), y, sizeof(y), &ctx)
+        || memcmp(x, zeros, sizeof(payload))) {
+      fputs("aes_ccm_decrypt_ctx() accepted a modified MAC\n", stderr);
+      return 1;
+    }
+  }
+
+  /* Single-pass encryption and decryption of several lengths, in place */
+  {
+    const unsigned char key[16] = { 0x40,0x41,0x42,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x4b,0x4c,0x4d,0x4e,0x4f };
+    const unsigned char nonce[13] = { 0x10,0x11,0x12,0x13,0x14,0x15,0x16,0x17,0x18,0x19,0x1a,0x1b,0x1c };
+    const int lengths[] = { 0, 1, 15, 16, 17, 31, 32, 33, 100, 128, 1000 };
+    const unsigned parts[8] = { 1, 15, 16, 17, 100, 0, 33, 48 };
+    struct aes_key ctx;
+    struct aes_ccm_state state;
+    unsigned char payload[1000];
+    unsigned char expected[1000 + 16];
+    unsigned char x[1000 + 16];
+    unsigned i, j;
+    int length;
+
+    aes_expand_key(&ctx, key);
+    for (i = 0; i < sizeof(payload); i++) {
+      payload[i] = i * 7;
+    }
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+      length = lengths[i];
+      reference_ccm(expected, 16, nonce, payload, length, &ctx);
+      memcpy(x, payload, length);
+      aes_ccm_encrypt_ctx(x, 16, nonce, sizeof(nonce), NULL, 0, x, length, &ctx);
+      if (memcmp(x, expected, length + 16)) {
+        fprintf(stderr, "aes_ccm_encrypt_ctx() failed with %d bytes\n", length);
+        return 1;
+      }
+      if (aes_ccm_decrypt_ctx(x, 16, nonce, sizeof(nonce), NULL, 0, x, length + 16, &ctx)
+          || memcmp(x, payload, length)) {
+        fprintf(stderr, "aes_ccm_decrypt_ctx() failed with %d bytes\n", length);
+        return 1;
+      }
+    }
+
+    /* Streamed in parts of several lengths */
+    aes_ccm_init(&state, 16, nonce, sizeof(nonce), 0, sizeof(payload), &ctx, 0);
+    for (i = 0, j = 0; i < sizeof(payload); i += parts[j++ % 8]) {
+      aes_ccm_update(&state, x + i, payload + i, i + parts[j % 8] < sizeof(payload) ? parts[j % 8] : sizeof(payload) - i);
+    }
+    aes_ccm_final(&state, x + sizeof(payload));
+    if (memcmp(x, expected, sizeof(payload) + 16)) {
+      fputs("aes_ccm_update() failed to encrypt\n", stderr);
+      return 1;
+    }
+    aes_ccm_init(&state, 16, nonce, sizeof(nonce), 0, sizeof(payload), &ctx, 1);
+    for (i = 0, j = 3; i < sizeof(payload); i += parts[j++ % 8]) {
+      aes_ccm_update(&state, x + i, x + i, i + parts[j % 8] < sizeof(payload) ? parts[j % 8] : sizeof(payload) - i);
+    }
+    if (aes_ccm_final(&state, expected + sizeof(payload)) || memcmp(x, payload, sizeof(payload))) {
+      fputs("aes_ccm_update() failed to decrypt\n", stderr);
+      return 1;
+    }
+    expected[sizeof(payload)] ^= 1;
+    if (aes_ccm_final(&state, expected + sizeof(payload)) != -1) {
+      fputs("aes_ccm_final() accepted a modified MAC\n", stderr);
+      return 1;
+    }
+  }
+
+  /* Many frames, each with its own key, in batches */
+  {
+    struct aes_key keys[20];
+    struct aes_ccm_frame frames[20];
+    unsigned char key[16];
+    unsigned char nonce[13];
+    unsigned char data[300];
+    unsigned char ciphertexts[20][300 + 16];
+    unsigned char expected[300 + 16];
+    unsigned i, j;
+
+    for (i = 0; i < sizeof(data); i++) {
+      data[i] = i * 13;
+    }
+    for (i = 0; i < 13; i++) {
+      nonce[i] = i;
+    }
+    for (i = 0; i < 20; i++) {
+      for (j = 0; j < 16; j++) {
+        key[j] = i * 16 + j;
+      }
+      aes_expand_key(&keys[i], key);
+      frames[i].key = &keys[i];
+      frames[i].nonce = nonce;
+      frames[i].nonce_length = 7 + i % 7;
+      frames[i].ad = data + 100;
+      frames[i].ad_length = i * i % 41;
+      frames[i].input = data;
+      frames[i].input_length = i * i * 7 % 300;
+      frames[i].output = ciphertexts[i];
+      frames[i].mac_length = 4 + i % 7 * 2;
+      frames[i].result = 1;
+    }
+    if (aes_ccm_encrypt_batch(frames, 20)) {
+      fputs("aes_ccm_encrypt_batch() failed\n", stderr);
+      return 1;
+    }
+    for (i = 0; i < 20; i++) {
+      aes_ccm_encrypt_ctx(expected, frames[i].mac_length, nonce, frames[i].nonce_length, data + 100, frames[i].ad_length,
+        data, frames[i].input_length, &keys[i]);
+      if (frames[i].result || memcmp(ciphertexts[i], expected, frames[i].input_length + frames[i].mac_length)) {
+        fprintf(stderr, "aes_ccm_encrypt_batch() failed frame %u\n", i);
+        return 1;
+      }
+    }
+
+    /* Decrypt in place, with two modified frames */
+    for (i = 0; i < 20; i++) {
+      frames[i].input = ciphertexts[i];
+      frames[i].input_length += frames[i].mac_length;
+    }
+    ciphertexts[3][0] ^= 1;
+    ciphertexts[17][frames[17].input_length - 1] ^= 0x80;
+    if (aes_ccm_decrypt_batch(frames, 20) != 2) {
+      fputs("aes_ccm_decrypt_batch() failed\n", stderr);
+      return 1;
+    }
+    for (i = 0; i < 20; i++) {
+      if (i == 3 || i == 17 ? frames[i].result != -1
+          : frames[i].result || memcmp(ciphertexts[i], data, frames[i].input_length - frames[i].mac_length)) {
+        fprintf(stderr, "aes_ccm_decrypt_batch() failed frame %u\n", i);
+        return 1;
+      }
+    }
+    for (j = 0; j < frames[3].input_length - frames[3].mac_length; j++) {
+      if (ciphertexts[3][j] || ciphertexts[17][j]) {
+        fputs("aes_ccm_decrypt_batch() released the payload of a modified frame\n", stderr);
+        return 1;
+      }
+    }
+  }
+
+  /* Lengths of the payload and of the associated data */
+  {
+    const unsigned char key[16] = { 0x40,0x41,0x42,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x4b,0x4c,0x4d,0x4e,0x4f };
+    const unsigned char nonce[13] = { 0x10,0x11,0x12,0x13,0x14,0x15,0x16,0x17,0x18,0x19,0x1a,0x1b,0x1c };
+    static unsigned char big[0x10000 + 16];
+    struct aes_key ctx;
+    struct aes_ccm_context c;
+    struct aes_ccm_state state;
+    struct aes_ccm_frame frame;
+    unsigned char b0[16];
+    unsigned char a[10];
+
+    aes_expand_key(&ctx, key);
+    aes_ccm_set_nonce(&c, &ctx, nonce, 13);
+    memcpy(b0, c.ctr0, 16);
+    if (aes_ccm_format_b0(b0, 8, 0, 0xffff, &c) || b0[0] != 0x19 || b0[14] != 0xff || b0[15] != 0xff
+        || aes_ccm_format_b0(b0, 8, 0, 0x10000, &c) != -1) {
+      fputs("aes_ccm_format_b0() failed with a 13-byte nonce\n", stderr);
+      return 1;
+    }
+    aes_ccm_set_nonce(&c, &ctx, nonce, 12);
+    memcpy(b0, c.ctr0, 16);
+    if (aes_ccm_format_b0(b0, 4, 1, 0x123456, &c) || memcmp(b0, "\x4a\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x12\x34\x56", 16)
+        || aes_ccm_format_b0(b0, 4, 1, 0x1000000, &c) != -1) {
+      fputs("aes_ccm_format_b0() failed with a 12-byte nonce\n", stderr);
+      return 1;
+    }
+    aes_ccm_set_nonce(&c, &ctx, nonce, 7);
+    memcpy(b0, c.ctr0, 16);
+    if (aes_ccm_format_b0(b0, 16, 0, (size_t)-1, &c) || memcmp(b0 + 8, "\0\0\0\0", 8 - sizeof(size_t))
+        || b0[16 - sizeof(size_t)] != 0xff || b0[15] != 0xff) {
+      fputs("aes_ccm_format_b0() failed with a 7-byte nonce\n", stderr);
+      return 1;
+    }
+
+    if (aes_ccm_format_ad_length(a, 0) != 0
+        || aes_ccm_format_ad_length(a, 0xfeff) != 2 || memcmp(a, "\xfe\xff", 2)
+        || aes_ccm_format_ad_length(a, 0xff00) != 6 || memcmp(a, "\xff\xfe\x00\x00\xff\x00", 6)
+        || aes_ccm_format_ad_length(a, 0x12345678) != 6 || memcmp(a, "\xff\xfe\x12\x34\x56\x78", 6)) {
+      fputs("aes_ccm_format_ad_length() failed\n", stderr);
+      return 1;
+    }
+    if (sizeof(size_t) > 4 && (aes_ccm_format_ad_length(a, (size_t)0x12 << 16 << 16 | 0x3456789a) != 10
+        || memcmp(a, "\xff\xff\x00\x00\x00\x12\x34\x56\x78\x9a", 10))) {
+      fputs("aes_ccm_format_ad_length() failed with 64 bits\n", stderr);
+      return 1;
+    }
+
+    /* Up to 2^16 - 1 bytes of payload with a 13-byte nonce */
+    if (aes_ccm_encrypt_ctx(big, 16, nonce, 13, NULL, 0, big, 0xffff, &ctx)
+        || aes_ccm_decrypt_ctx(big, 16, nonce, 13, NULL, 0, big, 0xffff + 16, &ctx)
+        || aes_ccm_encrypt_ctx(big, 16, nonce, 13, NULL, 0, big, 0x10000, &ctx) != -1
+        || aes_ccm_decrypt_ctx(big, 16, nonce, 13, NULL, 0, big, 0x10000 + 16, &ctx) != -1
+        || aes_ccm_decrypt_ctx(big, 16, nonce, 13, NULL, 0, big, 15, &ctx) != -1
+        || aes_ccm_init(&state, 16, nonce, 13, 0, 0x10000, &ctx, 0) != -1) {
+      fputs("aes_ccm_encrypt_ctx() failed to limit the length of the payload\n", stderr);
+      return 1;
+    }
+    frame.key = &ctx;
+    frame.nonce = nonce;
+    frame.nonce_length = 13;
+    frame.ad = NULL;
+    frame.ad_length = 0;
+    frame.input = big;
+    frame.input_length = 0x10000;
+    frame.output = big;
+    frame.mac_length = 16;
+    if (aes_ccm_encrypt_batch(&frame, 1) != 1 || frame.result != -1) {
+      fputs("aes_ccm_encrypt_batch() failed to limit the length of the payload\n", stderr);
+      return 1;
+    }
+  }
+
+  /* Lengths of the MAC and of the nonce outside [CCM] A.1 */
+  {
+    const unsigned char key[16] = { 0x40,0x41,0x42,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x4b,0x4c,0x4d,0x4e,0x4f };
+    const unsigned char nonce[13] = { 0x10,0x11,0x12,0x13,0x14,0x15,0x16,0x17,0x18,0x19,0x1a,0x1b,0x1c };
+    const int mac_lengths[] = { 0, -2, 2, 5, 15, 17, 18 };
+    const int nonce_lengths[] = { 0, 6, 14, 15, 16 };
+    unsigned char x[64];
+    struct aes_key ctx;
+    struct aes_ccm_state state;
+    struct aes_ccm_frame frames[2];
+    unsigned int i;
+
+    aes_expand_key(&ctx, key);
+    for (i = 0; i < sizeof(mac_lengths) / sizeof(mac_lengths[0]); i++) {
+      memset(x, 0, sizeof(x));
+      if (aes_ccm_encrypt_ctx(x, mac_lengths[i], nonce, 13, NULL, 0, x, 16, &ctx) != -1
+          || aes_ccm_decrypt_ctx(x, mac_lengths[i], nonce, 13, NULL, 0, x, 40, &ctx) != -1
+          || aes_ccm_init(&state, mac_lengths[i], nonce, 13, 0, 16, &ctx, 0) != -1
+          || memcmp(x, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16)) {
+        fprintf(stderr, "aes_ccm_encrypt_ctx() failed to reject a %d-byte MAC\n", mac_lengths[i]);
+        return 1;
+      }
+    }
+    for (i = 0; i < sizeof(nonce_lengths) / sizeof(nonce_lengths[0]); i++) {
+      memset(x, 0, sizeof(x));
+      if (aes_ccm_encrypt_ctx(x, 16, nonce, nonce_lengths[i], NULL, 0, x, 16, &ctx) != -1
+          || aes_ccm_decrypt_ctx(x, 16, nonce, nonce_lengths[i], NULL, 0, x, 32, &ctx) != -1
+          || aes_ccm_init(&state, 16, nonce, nonce_lengths[i], 0, 16, &ctx, 0) != -1
+          || memcmp(x, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16)) {
+        fprintf(stderr, "aes_ccm_encrypt_ctx() failed to reject a %d-byte nonce\n", nonce_lengths[i]);
+        return 1;
+      }
+    }
+    for (i = 0; i < 2; i++) {
+      frames[i].key = &ctx;
+      frames[i].nonce = nonce;
+      frames[i].nonce_length = i ? 16 : 13;
+      frames[i].ad = NULL;
+      frames[i].ad_length = 0;
+      frames[i].input = x;
+      frames[i].input_length = 32;
+      frames[i].output = x;
+      frames[i].mac_length = i ? 16 : 0;
+    }
+    if (aes_ccm_decrypt_batch(frames, 2) != 2 || frames[0].result != -1 || frames[1].result != -1) {
+      fputs("aes_ccm_decrypt_batch() failed to reject the lengths of the MAC and the nonce\n", stderr);
+      return 1;
+    }
   }
 
   return 0;
@@ -0,0 +1,106 @@
+/*
+ * tests/aes-ctr.c: tests for ../aes-ctr.h
+ *
+ * https://github.com/andrebdo/c-crumbs/blob/master/tests/aes-ctr.c
+ *
+ * This is free and unencumbered software released into the public domain.
+ * For more information, please refer to UNLICENSE or http://unlicense.org
+ */
+
+#include "../aes.h"
+#include "../aes-ctr.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Tests the aes_ctr function with the example values in
+ * [CTR] NIST Special Publication 800-38A, F.5.1 CTR-AES128.Encrypt,
+ * and with counters that wrap around, against aes_encrypt_block.
+ */
+int main(int argc, char **argv) {
+  const unsigned char key[16] = {
+    0x2b,0x7e,0x15,0x16,0x28,0xae,0xd2,0xa6,0xab,0xf7,0x15,0x88,0x09,0xcf,0x4f,0x3c
+  };
+  const unsigned char counter[16] = {
+    0xf0,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa,0xfb,0xfc,0xfd,0xfe,0xff
+  };
+  const unsigned char plaintext[64] = {
+    0x6b,0xc1,0xbe,0xe2,0x2e,0x40,0x9f,0x96,0xe9,0x3d,0x7e,0x11,0x73,0x93,0x17,0x2a,
+    0xae,0x2d,0x8a,0x57,0x1e,0x03,0xac,0x9c,0x9e,0xb7,0x6f,0xac,0x45,0xaf,0x8e,0x51,
+    0x30,0xc8,0x1c,0x46,0xa3,0x5c,0xe4,0x11,0xe5,0xfb,0xc1,0x19,0x1a,0x0a,0x52,0xef,
+    0xf6,0x9f,0x24,0x45,0xdf,0x4f,0x9b,0x17,0xad,0x2b,0x41,0x7b,0xe6,0x6c,0x37,0x10
+  };
+  const unsigned char ciphertext[64] = {
+    0x87,0x4d,0x61,0x91,0xb6,0x20,0xe3,0x26,0x1b,0xef,0x68,0x64,0x99,0x0d,0xb6,0xce,
+    0x98,0x06,0xf6,0x6b,0x79,0x70,0xfd,0xff,0x86,0x17,0x18,0x7b,0xb9,0xff,0xfd,0xff,
+    0x5a,0xe4,0xdf,0x3e,0xdb,0xd5,0xd3,0x5e,0x5b,0x4f,0x09,0x02,0x0d,0xb0,0x3e,0xab,
+    0x1e,0x03,0x1d,0xda,0x2f,0xbe,0x03,0xd1,0x79,0x21,0x70,0xa0,0xf3,0x00,0x9c,0xee
+  };
+  /* Counter sizes, and initial counter values close to where they wrap around */
+  const struct { int counter_bytes; unsigned char last_bytes[4]; } wraps[] = {
+    { 16, {0xff,0xff,0xff,0xf0} },
+    { 8, {0xff,0xff,0xff,0xf8} },
+    { 4, {0xff,0xff,0xff,0xfd} },
+    { 3, {0x00,0xff,0xff,0xf9} },
+    { 2, {0x00,0x00,0xff,0xfa} },
+    { 1, {0x00,0x00,0x00,0xfe} },
+  };
+  struct aes_key ctx;
+  unsigned char cb[16];
+  unsigned char x[333];
+  unsigned char expected[sizeof(x)];
+  unsigned char block[16];
+  unsigned i, j;
+  int k;
+
+  aes_expand_key(&ctx, key);
+
+  /* [CTR] F.5.1 CTR-AES128.Encrypt, and F.5.2 CTR-AES128.Decrypt */
+  memcpy(cb, counter, 16);
+  aes_ctr(x, plaintext, sizeof(plaintext), cb, 16, &ctx);
+  if (memcmp(x, ciphertext, sizeof(ciphertext))) {
+    fputs("aes_ctr() failed to encrypt\n", stderr);
+    return 1;
+  }
+  if (memcmp(cb, counter, 14) || cb[14] != 0xff || cb[15] != 0x03) {
+    fputs("aes_ctr() failed to update the counter block\n", stderr);
+    return 1;
+  }
+  memcpy(cb, counter, 16);
+  aes_ctr(x, ciphertext, 16, cb, 16, &ctx);
+  aes_ctr(x + 16, ciphertext + 16, sizeof(ciphertext) - 16, cb, 16, &ctx);
+  if (memcmp(x, plaintext, sizeof(plaintext))) {
+    fputs("aes_ctr() failed to decrypt\n", stderr);
+    return 1;
+  }
+
+  for (i = 0; i < sizeof(wraps) / sizeof(wraps[0]); i++) {
+    /* Reference key stream, one block at a time */
+    memcpy(cb, counter, 12);
+    memcpy(cb + 12, wraps[i].last_bytes, 4);
+    for (j = 0; j < sizeof(x); j += 16) {
+      aes_encrypt_block(&ctx, block, cb);
+      for (k = 0; k < 16 && j + k < sizeof(x); k++) {
+        expected[j + k] = block[k] ^ (unsigned char)(j + k);
+      }
+      for (k = 15; k >= 16 - wraps[i].counter_bytes; k--) {
+        if (++cb[k]) {
+          break;
+        }
+      }
+    }
+
+    for (j = 0; j < sizeof(x); j++) {
+      x[j] = j;
+    }
+    memcpy(cb, counter, 12);
+    memcpy(cb + 12, wraps[i].last_bytes, 4);
+    aes_ctr(x, x, sizeof(x), cb, wraps[i].counter_bytes, &ctx);
+    if (memcmp(x, expected, sizeof(x))) {
+      fprintf(stderr, "aes_ctr() failed with %d counter bytes\n", wraps[i].counter_bytes);
+      return 1;
+    }
+  }
+
+  return 0;
+}
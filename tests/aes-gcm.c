@@ -8,10 +8,22 @@
  */
 
 #include "../aes.h"
+#include "../aes-ctr.h"
 #include "../aes-gcm.h"
 #include <stdio.h>
 #include <string.h>
 
+/*
+ * Runs the tasks of aes_gcm_encrypt_parallel() and aes_gcm_decrypt_parallel()
+ * in the reverse order, counting them in the pool.
+ */
+static void run_reversed(void *pool, void (*task)(void *arg, int i), void *arg, int n) {
+  while (n-- > 0) {
+    task(arg, n);
+    ++*(int *)pool;
+  }
+}
+
 /*
  * Tests the aes_gcm_* functions with the example values in
  * https://csrc.nist.gov/CSRC/media/Projects/Cryptographic-Standards-and-Guidelines/documents/examples/AES_GCM.pdf
@@ -63,9 +75,96 @@ int main(int argc, char **argv) {
       60, 20, 12, {0xf0,0x7c,0x25,0x28,0xee,0xa2,0xfc,0xa1,0x21,0x1f,0x90,0x5e}
     }
   };
+  /*
+   * [GCM-SPEC] D. McGrew and J. Viega, The Galois/Counter Mode of Operation (GCM),
+   * Test Cases 5 and 6, with the same key and plaintext (60 bytes).
+   */
+  const unsigned char feedface[20] = {
+    0xfe,0xed,0xfa,0xce,0xde,0xad,0xbe,0xef,0xfe,0xed,0xfa,0xce,0xde,0xad,0xbe,0xef,0xab,0xad,0xda,0xd2
+  };
+  const struct {
+    unsigned iv_length;
+    unsigned char iv[60];
+    unsigned char ciphertext[60];
+    unsigned char tag[16];
+  } iv_vectors[2] = {{
+    8, {0xca,0xfe,0xba,0xbe,0xfa,0xce,0xdb,0xad},
+    {
+      0x61,0x35,0x3b,0x4c,0x28,0x06,0x93,0x4a,0x77,0x7f,0xf5,0x1f,0xa2,0x2a,0x47,0x55,
+      0x69,0x9b,0x2a,0x71,0x4f,0xcd,0xc6,0xf8,0x37,0x66,0xe5,0xf9,0x7b,0x6c,0x74,0x23,
+      0x73,0x80,0x69,0x00,0xe4,0x9f,0x24,0xb2,0x2b,0x09,0x75,0x44,0xd4,0x89,0x6b,0x42,
+      0x49,0x89,0xb5,0xe1,0xeb,0xac,0x0f,0x07,0xc2,0x3f,0x45,0x98
+    },
+    {0x36,0x12,0xd2,0xe7,0x9e,0x3b,0x07,0x85,0x56,0x1b,0xe1,0x4a,0xac,0xa2,0xfc,0xcb}
+  },{
+    60, {
+      0x93,0x13,0x22,0x5d,0xf8,0x84,0x06,0xe5,0x55,0x90,0x9c,0x5a,0xff,0x52,0x69,0xaa,
+      0x6a,0x7a,0x95,0x38,0x53,0x4f,0x7d,0xa1,0xe4,0xc3,0x03,0xd2,0xa3,0x18,0xa7,0x28,
+      0xc3,0xc0,0xc9,0x51,0x56,0x80,0x95,0x39,0xfc,0xf0,0xe2,0x42,0x9a,0x6b,0x52,0x54,
+      0x16,0xae,0xdb,0xf5,0xa0,0xde,0x6a,0x57,0xa6,0x37,0xb3,0x9b
+    },
+    {
+      0x8c,0xe2,0x49,0x98,0x62,0x56,0x15,0xb6,0x03,0xa0,0x33,0xac,0xa1,0x3f,0xb8,0x94,
+      0xbe,0x91,0x12,0xa5,0xc3,0xa2,0x11,0xa8,0xba,0x26,0x2a,0x3c,0xca,0x7e,0x2c,0xa7,
+      0x01,0xe4,0xa9,0xa4,0xfb,0xa4,0x3c,0x90,0xcc,0xdc,0xb2,0x81,0xd4,0x8c,0x7c,0x6f,
+      0xd6,0x28,0x75,0xd2,0xac,0xa4,0x17,0x03,0x4c,0x34,0xae,0xe5
+    },
+    {0x61,0x9c,0xc5,0xae,0xff,0xfe,0x0b,0xfa,0x46,0x2a,0xf4,0x3c,0x16,0x99,0xd0,0x50}
+  }};
+  struct aes_gcm_key ctx;
   unsigned char text[64];
   unsigned char tag[16];
-  unsigned i;
+  static unsigned char big[10000];
+  static unsigned char big_ciphertext[sizeof(big)];
+  static unsigned char batch[24 * 2500];
+  unsigned char tags[24][16];
+  struct aes_gcm_message messages[24];
+  const unsigned parts[8] = { 1, 15, 16, 17, 100, 4099, 0, 4096 };
+  struct aes_gcm_state state;
+  const int segments[] = { 1, 2, 3, 7, 64, 100, 0 };
+  int tasks;
+  unsigned char h[16];
+  unsigned char x[16];
+  unsigned i, j;
+
+  aes_gcm_expand_key(&ctx, key);
+
+  /* Compare the table multiplication by H with the reference multiplication */
+  memset(h, 0, 16);
+  aes_encrypt_block(&ctx.aes, h, h);
+  for (i = 0; i < 64; i++) {
+    memcpy(text, ciphertext + i % 48, 16);
+    for (j = 0; j < 16; j++) {
+      text[j] = (unsigned char)(text[j] * (i + 1));
+    }
+    memcpy(x, text, 16);
+    aes_gcm_mul(text, h);
+    aes_gcm_mul_h(&ctx, x);
+    if (memcmp(text, x, 16)) {
+      fprintf(stderr, "aes_gcm_mul_h() failed for test value %u\n", i);
+      return 1;
+    }
+  }
+
+#ifdef AES_AESNI
+  /* Compare the GHASH with the PCLMULQDQ instruction and with the tables */
+  if (ctx.clmul) {
+    memcpy(tag, key, 16);
+    for (i = 0; i <= 64; i++) {
+      memcpy(h, tag, 16);
+      memcpy(x, tag, 16);
+      aes_gcm_ghash(&ctx, h, ciphertext, i);
+      ctx.clmul = 0;
+      aes_gcm_ghash(&ctx, x, ciphertext, i);
+      ctx.clmul = 1;
+      if (memcmp(h, x, 16)) {
+        fprintf(stderr, "aes_gcm_ghash() with PCLMULQDQ failed for length %u\n", i);
+        return 1;
+      }
+      memcpy(tag, h, 16);
+    }
+  }
+#endif
 
   for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
     const struct vector *v = vectors + i;
@@ -88,6 +187,263 @@ int main(int argc, char **argv) {
       fprintf(stderr, "aes_gcm_decrypt() plaintext failed for test vector %u\n", i);
       return 1;
     }
+
+    aes_gcm_tag(tag, iv, aad, v->aad_length, ciphertext, v->plaintext_length, key);
+    if (memcmp(tag, v->tag, v->tag_length)) {
+      fprintf(stderr, "aes_gcm_tag() failed for test vector %u\n", i);
+      return 1;
+    }
+
+    aes_gcm_encrypt_ctx(text, tag, iv, 12, plaintext, v->plaintext_length, aad, v->aad_length, &ctx);
+    if (memcmp(tag, v->tag, v->tag_length) || memcmp(text, ciphertext, v->plaintext_length)) {
+      fprintf(stderr, "aes_gcm_encrypt_ctx() failed for test vector %u\n", i);
+      return 1;
+    }
+
+    if (aes_gcm_decrypt_ctx(text, iv, 12, ciphertext, v->plaintext_length, aad, v->aad_length, v->tag, v->tag_length, &ctx)
+        || memcmp(text, plaintext, v->plaintext_length)) {
+      fprintf(stderr, "aes_gcm_decrypt_ctx() failed for test vector %u\n", i);
+      return 1;
+    }
+  }
+
+  /* IVs that are not 96 bits long: [GCM-SPEC] Test Cases 5 and 6 */
+  for (i = 0; i < 2; i++) {
+    if (aes_gcm_encrypt_ctx(text, tag, iv_vectors[i].iv, iv_vectors[i].iv_length, plaintext, 60, feedface, 20, &ctx)
+        || memcmp(text, iv_vectors[i].ciphertext, 60) || memcmp(tag, iv_vectors[i].tag, 16)) {
+      fprintf(stderr, "aes_gcm_encrypt_ctx() failed with a %u-byte IV\n", iv_vectors[i].iv_length);
+      return 1;
+    }
+    aes_gcm_tag_ctx(x, iv_vectors[i].iv, iv_vectors[i].iv_length, feedface, 20, iv_vectors[i].ciphertext, 60, &ctx);
+    if (memcmp(x, iv_vectors[i].tag, 16)
+        || aes_gcm_decrypt_ctx(text, iv_vectors[i].iv, iv_vectors[i].iv_length, iv_vectors[i].ciphertext, 60, feedface, 20, iv_vectors[i].tag, 16, &ctx)
+        || memcmp(text, plaintext, 60)) {
+      fprintf(stderr, "aes_gcm_decrypt_ctx() failed with a %u-byte IV\n", iv_vectors[i].iv_length);
+      return 1;
+    }
+  }
+
+  /* Encrypt and decrypt in place a message of several chunks */
+  for (i = 0; i < sizeof(big); i++) {
+    big[i] = (unsigned char)i;
+  }
+  aes_gcm_encrypt_ctx(big_ciphertext, tag, iv, 12, big, sizeof(big), aad, 20, &ctx);
+  aes_gcm_tag_ctx(h, iv, 12, aad, 20, big_ciphertext, sizeof(big), &ctx);
+  if (memcmp(tag, h, 16)) {
+    fputs("aes_gcm_encrypt_ctx() failed for a long message\n", stderr);
+    return 1;
+  }
+  aes_gcm_encrypt_ctx(big, x, iv, 12, big, sizeof(big), aad, 20, &ctx);
+  if (memcmp(big, big_ciphertext, sizeof(big)) || memcmp(x, tag, 16)) {
+    fputs("aes_gcm_encrypt_ctx() failed in place\n", stderr);
+    return 1;
+  }
+  if (aes_gcm_decrypt_ctx(big, iv, 12, big, sizeof(big), aad, 20, tag, 16, &ctx)) {
+    fputs("aes_gcm_decrypt_ctx() failed in place\n", stderr);
+    return 1;
+  }
+  for (i = 0; i < sizeof(big); i++) {
+    if (big[i] != (unsigned char)i) {
+      fputs("aes_gcm_decrypt_ctx() failed in place\n", stderr);
+      return 1;
+    }
+  }
+
+  /* Encrypt and decrypt the same message in parts of several lengths */
+  aes_gcm_init(&state, iv, 12, &ctx, 0);
+  aes_gcm_aad(&state, aad, 7);
+  aes_gcm_aad(&state, aad + 7, 13);
+  for (i = 0, j = 0; i < sizeof(big); i += parts[j++ % 8]) {
+    aes_gcm_update(&state, big + i, big + i, i + parts[j % 8] < sizeof(big) ? parts[j % 8] : sizeof(big) - i);
+  }
+  aes_gcm_final(&state, x, 16);
+  if (memcmp(x, tag, 16) || memcmp(big, big_ciphertext, sizeof(big))) {
+    fputs("aes_gcm_update() failed to encrypt\n", stderr);
+    return 1;
+  }
+  aes_gcm_init(&state, iv, 12, &ctx, 1);
+  aes_gcm_aad(&state, aad, 20);
+  for (i = 0, j = 3; i < sizeof(big); i += parts[j++ % 8]) {
+    aes_gcm_update(&state, big + i, big + i, i + parts[j % 8] < sizeof(big) ? parts[j % 8] : sizeof(big) - i);
+  }
+  if (aes_gcm_aad(&state, aad, 1) != -1) {
+    fputs("aes_gcm_aad() accepted data after aes_gcm_update()\n", stderr);
+    return 1;
+  }
+  if (aes_gcm_final(&state, tag, 16)) {
+    fputs("aes_gcm_final() failed to verify the tag\n", stderr);
+    return 1;
+  }
+  for (i = 0; i < sizeof(big); i++) {
+    if (big[i] != (unsigned char)i) {
+      fputs("aes_gcm_update() failed to decrypt\n", stderr);
+      return 1;
+    }
+  }
+
+  /* Encrypt and decrypt the same message in parallel segments */
+  for (i = 0; i < sizeof(segments) / sizeof(segments[0]); i++) {
+    tasks = 0;
+    if (aes_gcm_encrypt_parallel(big, x, iv, 12, big, sizeof(big), aad, 20, &ctx, segments[i], run_reversed, &tasks)
+        || memcmp(x, tag, 16) || memcmp(big, big_ciphertext, sizeof(big)) || tasks < 1) {
+      fprintf(stderr, "aes_gcm_encrypt_parallel() failed with %d segments\n", segments[i]);
+      return 1;
+    }
+    if (aes_gcm_decrypt_parallel(big, iv, 12, big, sizeof(big), aad, 20, tag, 16, &ctx, segments[i], i & 1 ? NULL : run_reversed, &tasks)) {
+      fprintf(stderr, "aes_gcm_decrypt_parallel() failed with %d segments\n", segments[i]);
+      return 1;
+    }
+    for (j = 0; j < sizeof(big); j++) {
+      if (big[j] != (unsigned char)j) {
+        fprintf(stderr, "aes_gcm_decrypt_parallel() failed with %d segments\n", segments[i]);
+        return 1;
+      }
+    }
+    aes_gcm_encrypt_parallel(text, x, iv, 12, plaintext, 60, aad, 20, &ctx, segments[i], NULL, NULL);
+    if (memcmp(x, vectors[4].tag, 16) || memcmp(text, ciphertext, 60)) {
+      fprintf(stderr, "aes_gcm_encrypt_parallel() failed for a short text with %d segments\n", segments[i]);
+      return 1;
+    }
+  }
+  big_ciphertext[9999] ^= 1;
+  if (aes_gcm_decrypt_parallel(big, iv, 12, big_ciphertext, sizeof(big), aad, 20, tag, 16, &ctx, 4, NULL, NULL) != -1 || big[0]) {
+    fputs("aes_gcm_decrypt_parallel() accepted a modified ciphertext\n", stderr);
+    return 1;
+  }
+  big_ciphertext[9999] ^= 1;
+
+  /* Encrypt and decrypt a batch of messages of several lengths */
+  for (i = 0, j = 0; i < sizeof(messages) / sizeof(messages[0]); j += messages[i++].length) {
+    messages[i].iv = big + i;
+    messages[i].iv_length = i % 3 ? 12 : 1 + i;
+    messages[i].aad = big + 2 * i;
+    messages[i].aad_length = i % 3 * 7;
+    messages[i].input = big + 37 * i;
+    messages[i].output = batch + j;
+    messages[i].length = i * i * 31 % 2500;
+    messages[i].tag = tags[i];
+    messages[i].tag_length = 16;
+  }
+  if (aes_gcm_encrypt_batch(messages, sizeof(messages) / sizeof(messages[0]), &ctx)) {
+    fputs("aes_gcm_encrypt_batch() failed\n", stderr);
+    return 1;
+  }
+  for (i = 0; i < sizeof(messages) / sizeof(messages[0]); i++) {
+    aes_gcm_encrypt_ctx(big_ciphertext, x, big + i, messages[i].iv_length, big + 37 * i, messages[i].length, big + 2 * i, i % 3 * 7, &ctx);
+    if (messages[i].result || memcmp(x, tags[i], 16) || memcmp(messages[i].output, big_ciphertext, messages[i].length)) {
+      fprintf(stderr, "aes_gcm_encrypt_batch() failed for message %u\n", i);
+      return 1;
+    }
+    messages[i].input = messages[i].output;
+  }
+  ((unsigned char *)messages[5].output)[100] ^= 1;
+  messages[7].tag_length = 0;
+  messages[8].tag_length = 17;
+  messages[9].tag_length = -5;
+  messages[10].tag_length = 12;
+  messages[11].iv_length = 0;
+  if (aes_gcm_decrypt_batch(messages, sizeof(messages) / sizeof(messages[0]), &ctx) != 5) {
+    fputs("aes_gcm_decrypt_batch() failed\n", stderr);
+    return 1;
+  }
+  for (i = 0; i < sizeof(messages) / sizeof(messages[0]); i++) {
+    if (i == 5 ? messages[i].result != -1 || ((unsigned char *)messages[i].output)[0]
+        : (i >= 7 && i <= 9) || i == 11 ? messages[i].result != -1
+        : messages[i].result || memcmp(messages[i].output, big + 37 * i, messages[i].length)) {
+      fprintf(stderr, "aes_gcm_decrypt_batch() failed for message %u\n", i);
+      return 1;
+    }
+  }
+
+  /* 64-bit bit lengths, and the maximum length of the text */
+  memset(x, 0, 8);
+  if (aes_gcm_add_bits(x, 0x12345678, aes_gcm_max_aad_bits) || aes_gcm_add_bits(x, 0x76543210, aes_gcm_max_aad_bits)
+      || memcmp(x, "\x00\x00\x00\x04\x44\x44\x44\x40", 8)) {
+    fputs("aes_gcm_add_bits() failed\n", stderr);
+    return 1;
+  }
+  aes_gcm_init(&state, iv, 12, &ctx, 0);
+  memcpy(state.lengths + 8, "\x00\x00\x00\x7f\xff\xff\xfe\x00", 8);
+  if (aes_gcm_update(&state, big, big, 33) != -1 || aes_gcm_update(&state, big, big, 32) || aes_gcm_update(&state, big, big, 1) != -1) {
+    fputs("aes_gcm_update() failed to limit the length of the text\n", stderr);
+    return 1;
+  }
+
+  /* A modified ciphertext is rejected, and its plaintext is not output */
+  big_ciphertext[5000] ^= 1;
+  if (aes_gcm_decrypt_ctx(big, iv, 12, big_ciphertext, sizeof(big), aad, 20, tag, 16, &ctx) != -1) {
+    fputs("aes_gcm_decrypt_ctx() accepted a modified ciphertext\n", stderr);
+    return 1;
+  }
+  for (i = 0; i < sizeof(big); i++) {
+    if (big[i]) {
+      fputs("aes_gcm_decrypt_ctx() did not clear the plaintext\n", stderr);
+      return 1;
+    }
+  }
+
+  /* Tag lengths that [GCM] does not allow are rejected before any output */
+  {
+    const int bad_lengths[] = {0, -5, 17, 11, 3};
+
+    for (i = 0; i < sizeof(bad_lengths) / sizeof(bad_lengths[0]); i++) {
+      memset(big, 0x5a, sizeof(big));
+      if (aes_gcm_decrypt_ctx(big, iv, 12, big_ciphertext, sizeof(big), aad, 20, tag, bad_lengths[i], &ctx) != -1 || big[0] != 0x5a) {
+        fprintf(stderr, "aes_gcm_decrypt_ctx() accepted a %d-byte tag\n", bad_lengths[i]);
+        return 1;
+      }
+      if (aes_gcm_decrypt_parallel(big, iv, 12, big_ciphertext, sizeof(big), aad, 20, tag, bad_lengths[i], &ctx, 4, NULL, NULL) != -1 || big[0] != 0x5a) {
+        fprintf(stderr, "aes_gcm_decrypt_parallel() accepted a %d-byte tag\n", bad_lengths[i]);
+        return 1;
+      }
+      aes_gcm_init(&state, iv, 12, &ctx, 0);
+      memset(x, 0x5a, sizeof(x));
+      if (aes_gcm_final(&state, x, bad_lengths[i]) != -1 || x[0] != 0x5a) {
+        fprintf(stderr, "aes_gcm_final() accepted a %d-byte tag\n", bad_lengths[i]);
+        return 1;
+      }
+    }
+    if (aes_gcm_decrypt_ctx(text, iv, 12, ciphertext, 60, aad, 20, vectors[4].tag, 12, &ctx) || memcmp(text, plaintext, 60)) {
+      fputs("aes_gcm_decrypt_ctx() failed with a 12-byte tag\n", stderr);
+      return 1;
+    }
+  }
+
+  /* An empty IV, whose J0 would be 0 for every message, is rejected before any output */
+  memset(big, 0x5a, sizeof(big));
+  memset(x, 0x5a, sizeof(x));
+  if (aes_gcm_encrypt_ctx(big, x, iv, 0, plaintext, 60, aad, 20, &ctx) != -1 || big[0] != 0x5a || x[0] != 0x5a) {
+    fputs("aes_gcm_encrypt_ctx() accepted an empty IV\n", stderr);
+    return 1;
+  }
+  if (aes_gcm_decrypt_ctx(big, iv, 0, ciphertext, 60, aad, 20, tag, 16, &ctx) != -1 || big[0] != 0x5a) {
+    fputs("aes_gcm_decrypt_ctx() accepted an empty IV\n", stderr);
+    return 1;
+  }
+  if (aes_gcm_tag_ctx(x, iv, 0, aad, 20, ciphertext, 60, &ctx) != -1 || x[0] != 0x5a) {
+    fputs("aes_gcm_tag_ctx() accepted an empty IV\n", stderr);
+    return 1;
+  }
+  if (aes_gcm_encrypt_parallel(big, x, iv, 0, plaintext, 60, aad, 20, &ctx, 4, NULL, NULL) != -1 || big[0] != 0x5a) {
+    fputs("aes_gcm_encrypt_parallel() accepted an empty IV\n", stderr);
+    return 1;
+  }
+  if (aes_gcm_decrypt_parallel(big, iv, 0, ciphertext, 60, aad, 20, tag, 16, &ctx, 4, NULL, NULL) != -1 || big[0] != 0x5a) {
+    fputs("aes_gcm_decrypt_parallel() accepted an empty IV\n", stderr);
+    return 1;
+  }
+  if (aes_gcm_init(&state, iv, 0, &ctx, 0) != -1 || aes_gcm_aad(&state, aad, 20) != -1
+      || aes_gcm_update(&state, big, plaintext, 60) != -1 || big[0] != 0x5a || aes_gcm_final(&state, x, 16) != -1) {
+    fputs("aes_gcm_init() accepted an empty IV\n", stderr);
+    return 1;
+  }
+  messages[0].iv_length = 0;
+  messages[0].input = plaintext;
+  messages[0].output = big;
+  messages[0].length = 60;
+  if (aes_gcm_encrypt_batch(messages, 1, &ctx) != 1 || messages[0].result != -1 || big[0] != 0x5a) {
+    fputs("aes_gcm_encrypt_batch() accepted an empty IV\n", stderr);
+    return 1;
   }
 
   return 0;
@@ -13,8 +13,11 @@
 #include <string.h>
 
 /*
- * Tests the aes_kw function with the example values in RFC3394:
+ * Tests the aes_kw functions with the example values in RFC3394:
  * Test Vectors 4.1 Wrap 128 bits of Key Data with a 128-bit KEK.
+ * RFC5649 only has examples with a 192-bit KEK, so the aes_kwp functions
+ * are tested with values computed by OpenSSL (id-aes128-wrap-pad),
+ * and so are the wraps of more than 255 steps, whose t needs several bytes.
  */
 int main(int argc, char **argv) {
   const unsigned char key[16] = {
@@ -30,7 +33,40 @@ int main(int argc, char **argv) {
     0xae, 0xf3, 0x4b, 0xd8, 0xfb, 0x5a, 0x7b, 0x82,
     0x9d, 0x3e, 0x86, 0x23, 0x71, 0xd2, 0xcf, 0xe5
   };
+  /* 512 bytes with x[i] = i * 7, wrapped: the first 24 bytes */
+  const unsigned char long_ciphertext[24] = {
+    0xc9, 0x7d, 0x81, 0x4e, 0xc2, 0x74, 0x7f, 0x10,
+    0xb3, 0x94, 0x37, 0xbd, 0x03, 0x5b, 0xbf, 0xd4,
+    0x75, 0x5b, 0xd3, 0x02, 0xfd, 0xa7, 0x08, 0x2e
+  };
+  const unsigned char kwp_plaintext7[7] = {
+    0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd
+  };
+  const unsigned char kwp_ciphertext7[16] = {
+    0x74, 0x18, 0x35, 0xed, 0x9f, 0x9b, 0xf8, 0x87,
+    0xbd, 0xdb, 0xb8, 0x5e, 0xc6, 0xc0, 0x67, 0xb7
+  };
+  /* 20 bytes with x[i] = 0x10 + i */
+  const unsigned char kwp_ciphertext20[32] = {
+    0x37, 0xd7, 0x6c, 0xd7, 0x15, 0x5e, 0x10, 0xc2,
+    0xfc, 0x26, 0x37, 0x20, 0x75, 0x33, 0x92, 0xd7,
+    0xce, 0x4a, 0x41, 0x34, 0x1b, 0x84, 0x64, 0x2c,
+    0x37, 0x49, 0x63, 0x32, 0x57, 0x4b, 0x63, 0x7d
+  };
+  /* 1001 bytes with x[i] = i * 7, wrapped with padding: the first 24 bytes */
+  const unsigned char kwp_long_ciphertext[24] = {
+    0x2b, 0x31, 0xc9, 0xef, 0xf0, 0x65, 0x83, 0x2e,
+    0x95, 0x76, 0x6d, 0x7a, 0x30, 0x8a, 0x69, 0xad,
+    0x9f, 0xe8, 0xfb, 0xe8, 0xac, 0xde, 0x40, 0xef
+  };
+  struct aes_key ctx;
   unsigned char x[sizeof(ciphertext)];
+  unsigned char y[1016];
+  unsigned char z[sizeof(y)];
+  unsigned char expected[40];
+  int results[21];
+  size_t i, length;
+  int k;
 
   aes_kw(x, plaintext, sizeof(plaintext) / 8, key);
   if (memcmp(x, ciphertext, sizeof(ciphertext))) {
@@ -38,5 +74,174 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  aes_expand_key(&ctx, key);
+  aes_kw_ctx(x, plaintext, sizeof(plaintext) / 8, &ctx);
+  if (memcmp(x, ciphertext, sizeof(ciphertext))) {
+    fputs("aes_kw_ctx() failed\n", stderr);
+    return 1;
+  }
+
+  /* [RFC3394] 2.2.2 Key Unwrap, and in place */
+  if (aes_kw_unwrap(x, ciphertext, sizeof(plaintext) / 8, key) || memcmp(x, plaintext, sizeof(plaintext))) {
+    fputs("aes_kw_unwrap() failed\n", stderr);
+    return 1;
+  }
+  memcpy(x, ciphertext, sizeof(ciphertext));
+  if (aes_kw_unwrap_ctx(x, x, sizeof(plaintext) / 8, &ctx) || memcmp(x, plaintext, sizeof(plaintext))) {
+    fputs("aes_kw_unwrap_ctx() failed in place\n", stderr);
+    return 1;
+  }
+  memcpy(x, plaintext, sizeof(plaintext));
+  aes_kw_ctx(x, x, sizeof(plaintext) / 8, &ctx);
+  if (memcmp(x, ciphertext, sizeof(ciphertext))) {
+    fputs("aes_kw_ctx() failed in place\n", stderr);
+    return 1;
+  }
+
+  /* [RFC3394] 2.2.3 Key Data Integrity: a modified ciphertext is rejected */
+  memcpy(x, ciphertext, sizeof(ciphertext));
+  x[20] ^= 1;
+  if (aes_kw_unwrap_ctx(x, x, sizeof(plaintext) / 8, &ctx) != -1 || x[0] || x[15]) {
+    fputs("aes_kw_unwrap_ctx() failed to reject a modified ciphertext\n", stderr);
+    return 1;
+  }
+
+  /* [RFC3394] 2.2 at least two 64-bit blocks */
+  memset(x, 0x55, sizeof(x));
+  for (i = 0; i < 2; i++) {
+    if (aes_kw(x, plaintext, i, key) != -1 || aes_kw_ctx(x, plaintext, i, &ctx) != -1
+        || aes_kw_unwrap(x, ciphertext, i, key) != -1 || aes_kw_unwrap_ctx(x, ciphertext, i, &ctx) != -1
+        || x[0] != 0x55 || x[sizeof(x) - 1] != 0x55) {
+      fprintf(stderr, "aes_kw() failed to reject %u blocks\n", (unsigned)i);
+      return 1;
+    }
+  }
+
+  /* More than 255 steps, 6 * 64 */
+  for (i = 0; i < 512; i++) {
+    y[i] = (unsigned char)(i * 7);
+  }
+  aes_kw_ctx(z, y, 64, &ctx);
+  if (memcmp(z, long_ciphertext, sizeof(long_ciphertext))) {
+    fputs("aes_kw_ctx() failed with 64 blocks\n", stderr);
+    return 1;
+  }
+  if (aes_kw_unwrap_ctx(z, z, 64, &ctx) || memcmp(z, y, 512)) {
+    fputs("aes_kw_unwrap_ctx() failed with 64 blocks\n", stderr);
+    return 1;
+  }
+
+  /* [RFC5649] with a single block, which is encrypted directly */
+  if (aes_kwp(x, kwp_plaintext7, sizeof(kwp_plaintext7), key) || memcmp(x, kwp_ciphertext7, sizeof(kwp_ciphertext7))) {
+    fputs("aes_kwp() failed\n", stderr);
+    return 1;
+  }
+  if (aes_kwp_unwrap(x, &length, kwp_ciphertext7, sizeof(kwp_ciphertext7), key)
+      || length != sizeof(kwp_plaintext7) || memcmp(x, kwp_plaintext7, length)) {
+    fputs("aes_kwp_unwrap() failed\n", stderr);
+    return 1;
+  }
+
+  /* [RFC5649] with padding and several blocks */
+  for (i = 0; i < 20; i++) {
+    y[i] = (unsigned char)(0x10 + i);
+  }
+  if (aes_kwp_ctx(z, y, 20, &ctx) || memcmp(z, kwp_ciphertext20, sizeof(kwp_ciphertext20))) {
+    fputs("aes_kwp_ctx() failed\n", stderr);
+    return 1;
+  }
+  if (aes_kwp_unwrap_ctx(z, &length, z, sizeof(kwp_ciphertext20), &ctx) || length != 20 || memcmp(z, y, 20)) {
+    fputs("aes_kwp_unwrap_ctx() failed\n", stderr);
+    return 1;
+  }
+  for (i = 0; i < 1001; i++) {
+    y[i] = (unsigned char)(i * 7);
+  }
+  if (aes_kwp_ctx(z, y, 1001, &ctx) || memcmp(z, kwp_long_ciphertext, sizeof(kwp_long_ciphertext))) {
+    fputs("aes_kwp_ctx() failed with 1001 bytes\n", stderr);
+    return 1;
+  }
+  if (aes_kwp_unwrap_ctx(z, &length, z, 1016, &ctx) || length != 1001 || memcmp(z, y, 1001)) {
+    fputs("aes_kwp_unwrap_ctx() failed with 1001 bytes\n", stderr);
+    return 1;
+  }
+
+  /* Every length up to 40 bytes, in place */
+  for (length = 1; length <= 40; length++) {
+    memcpy(z, y, length);
+    aes_kwp_ctx(z, z, length, &ctx);
+    if (aes_kwp_unwrap_ctx(z, &i, z, 8 + (length + 7) / 8 * 8, &ctx) || i != length || memcmp(z, y, length)) {
+      fprintf(stderr, "aes_kwp_ctx() failed with %u bytes\n", (unsigned)length);
+      return 1;
+    }
+  }
+
+  /* [RFC5649] 4.2: integrity checks */
+  memcpy(x, kwp_ciphertext7, sizeof(kwp_ciphertext7));
+  x[3] ^= 0x80;
+  if (aes_kwp_unwrap_ctx(x, &length, x, sizeof(kwp_ciphertext7), &ctx) != -1 || x[0] || x[7]) {
+    fputs("aes_kwp_unwrap_ctx() failed to reject a modified ciphertext\n", stderr);
+    return 1;
+  }
+  if (aes_kwp_unwrap_ctx(x, &length, ciphertext, sizeof(ciphertext), &ctx) != -1) {
+    fputs("aes_kwp_unwrap_ctx() failed to reject a key wrap without padding\n", stderr);
+    return 1;
+  }
+  for (i = 0; i < 3; i++) {  /* MLI 5 with zero padding, then a nonzero padding byte, then MLI 9 */
+    memcpy(x, "\xa6\x59\x59\xa6\x00\x00\x00\x05\x01\x02\x03\x04\x05\x00\x00\x00", 16);
+    x[7] += i == 2 ? 4 : 0;
+    x[13] += i == 1 ? 6 : 0;
+    aes_encrypt_block(&ctx, x, x);
+    if (aes_kwp_unwrap_ctx(x, &length, x, 16, &ctx) != (i == 0 ? 0 : -1)) {
+      fprintf(stderr, "aes_kwp_unwrap_ctx() failed to check the padding %u\n", (unsigned)i);
+      return 1;
+    }
+  }
+  if (aes_kwp_unwrap_ctx(z, &length, kwp_ciphertext20, 24, &ctx) != -1
+      || aes_kwp_unwrap_ctx(z, &length, kwp_ciphertext20, 15, &ctx) != -1
+      || aes_kwp_unwrap_ctx(z, &length, kwp_ciphertext20, 8, &ctx) != -1
+      || aes_kwp_ctx(z, y, 0, &ctx) != -1) {
+    fputs("aes_kwp functions failed to reject invalid lengths\n", stderr);
+    return 1;
+  }
+
+  /* Batches of 21 keys of 32 bytes, and of 8 keys of 16 bytes, against aes_kw_ctx() */
+  for (i = 0; i < 21 * 32; i++) {
+    y[i] = (unsigned char)(i * 13 + 5);
+  }
+  aes_kw_batch(z, y, 4, 21, &ctx);
+  for (k = 0; k < 21; k++) {
+    aes_kw_ctx(expected, y + 32 * k, 4, &ctx);
+    if (memcmp(z + 40 * k, expected, 40)) {
+      fprintf(stderr, "aes_kw_batch() failed for key %d\n", k);
+      return 1;
+    }
+  }
+  z[40 * 3 + 17] ^= 1;
+  z[40 * 20] ^= 1;
+  if (aes_kw_unwrap_batch(z, z, 4, 21, &ctx, results) != 2) {
+    fputs("aes_kw_unwrap_batch() failed to reject 2 modified keys\n", stderr);
+    return 1;
+  }
+  for (k = 0; k < 21; k++) {
+    if (k == 3 || k == 20) {
+      for (i = 0; i < 32 && z[32 * k + i] == 0; i++) {
+      }
+      if (results[k] != -1 || i != 32) {
+        fprintf(stderr, "aes_kw_unwrap_batch() failed to reject key %d\n", k);
+        return 1;
+      }
+    } else if (results[k] != 0 || memcmp(z + 32 * k, y + 32 * k, 32)) {
+      fprintf(stderr, "aes_kw_unwrap_batch() failed for key %d\n", k);
+      return 1;
+    }
+  }
+  aes_kw_batch(z, y, 2, 8, &ctx);
+  if (aes_kw_unwrap_batch(x, z + 24 * 7, 2, 1, &ctx, NULL) || memcmp(x, y + 16 * 7, 16)
+      || aes_kw_unwrap_batch(z, z, 2, 8, &ctx, NULL) || memcmp(z, y, 8 * 16)) {
+    fputs("aes_kw_unwrap_batch() failed with 8 keys\n", stderr);
+    return 1;
+  }
+
   return 0;
 }
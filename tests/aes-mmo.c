@@ -13,7 +13,7 @@
 #include <string.h>
 
 /*
- * Tests the aes_mmo function with the example values in the
+ * Tests the aes_mmo functions with the example values in the
  * ZigBee specification, document 05-3474-21, Aug 2015,
  * section C.5 Cryptographic Hash Function.
  */
@@ -105,5 +105,100 @@ int main(int argc, char **argv) {
     }
   }
 
+  /* Test vectors 1 to 6 again, hashed in parts of several sizes */
+  {
+    const struct { unsigned length; unsigned char first; unsigned char h[16]; } vectors[] = {
+      { 1, 0xc0, {0xae,0x3a,0x10,0x2a,0x28,0xd4,0x3e,0xe0,0xd4,0xa0,0x9e,0x22,0x78,0x8b,0x20,0x6c} },
+      { 16, 0xc0, {0xa7,0x97,0x7e,0x88,0xbc,0x0b,0x61,0xe8,0x21,0x08,0x27,0x10,0x9a,0x22,0x8f,0x2d} },
+      { 8191, 0, {0x24,0xec,0x2f,0xe7,0x5b,0xbf,0xfc,0xb3,0x47,0x89,0xbc,0x06,0x10,0xe7,0xf1,0x65} },
+      { 8192, 0, {0xdc,0x6b,0x06,0x87,0xf0,0x9f,0x86,0x07,0x13,0x1c,0x17,0x0b,0x3b,0xd3,0x15,0x91} },
+      { 8201, 0, {0x72,0xc9,0xb1,0x5e,0x17,0x8a,0xa8,0x43,0xe4,0xa1,0x6c,0x58,0xe3,0x36,0x43,0xa3} },
+      { 8202, 0, {0xbc,0x98,0x28,0xd5,0x9b,0x2a,0xa3,0x23,0xda,0xf2,0x0b,0xe5,0xf2,0xe6,0x65,0x11} }
+    };
+    const unsigned parts[] = {1, 15, 16, 17, 0, 100, 1000, 3};
+    unsigned char m[8202];
+    struct aes_mmo_state state;
+    unsigned v, n, part;
+
+    for (v = 0; v < sizeof(vectors) / sizeof(vectors[0]); v++) {
+      for (i = 0; i < vectors[v].length; i++) {
+        m[i] = vectors[v].first + i;
+      }
+      aes_mmo_init(&state);
+      for (n = 0, part = 0; n < vectors[v].length; n += i, part++) {
+        i = parts[part % (sizeof(parts) / sizeof(parts[0]))];
+        i = i < vectors[v].length - n ? i : vectors[v].length - n;
+        aes_mmo_update(&state, m + n, i);
+      }
+      aes_mmo_final(&state, x);
+      if (memcmp(x, vectors[v].h, 16)) {
+        fprintf(stderr, "aes_mmo_update() failed test vector %u\n", v + 1);
+        return 1;
+      }
+    }
+  }
+
+  /* Many messages of different lengths at once, against aes_mmo() */
+  {
+    static unsigned char m[8202 + 45];
+    const void *messages[45];
+    size_t lengths[45];
+    unsigned char digests[45 * 16];
+    unsigned n;
+
+    for (i = 0; i < sizeof(m); i++) {
+      m[i] = i;
+    }
+    for (n = 0; n < 45; n++) {
+      /* Lengths of 0 to 48, with long ones among them to vary the lanes */
+      lengths[n] = n == 3 ? 8202 : n == 20 ? 8191 : n == 21 ? 1000 : n * 13 % 49;
+      messages[n] = m + n;
+    }
+    aes_mmo_many(digests, messages, lengths, 45);
+    for (n = 0; n < 45; n++) {
+      aes_mmo(x, messages[n], lengths[n]);
+      if (memcmp(x, digests + 16 * n, 16)) {
+        fprintf(stderr, "aes_mmo_many() failed message %u\n", n);
+        return 1;
+      }
+    }
+    aes_mmo_many(digests, messages, lengths, 0);
+    aes_mmo_many(digests, messages + 1, lengths + 1, 1);
+    aes_mmo(x, messages[1], lengths[1]);
+    if (memcmp(x, digests, 16)) {
+      fputs("aes_mmo_many() failed with one message\n", stderr);
+      return 1;
+    }
+  }
+
+  /* Messages of 2^29 bytes or more, whose length the padding cannot represent */
+  {
+    static const unsigned char m[1] = {0};
+    const void *messages[2];
+    size_t lengths[2];
+    struct aes_mmo_state state;
+
+    memset(x, 0x5a, 16);
+    if (aes_mmo(x, m, AES_MMO_MAX_LENGTH) != -1 || x[0] != 0x5a) {
+      fputs("aes_mmo() accepted a message of 2^29 bytes\n", stderr);
+      return 1;
+    }
+    messages[0] = m;
+    messages[1] = m;
+    lengths[0] = 1;
+    lengths[1] = AES_MMO_MAX_LENGTH;
+    if (aes_mmo_many(x, messages, lengths, 2) != -1 || x[0] != 0x5a) {
+      fputs("aes_mmo_many() accepted a message of 2^29 bytes\n", stderr);
+      return 1;
+    }
+    aes_mmo_init(&state);
+    state.length = AES_MMO_MAX_LENGTH - 2;
+    if (aes_mmo_update(&state, m, 1) || aes_mmo_update(&state, m, 1) != -1 || aes_mmo_update(&state, m, 0) != -1
+        || aes_mmo_final(&state, x) != -1 || x[0] != 0x5a) {
+      fputs("aes_mmo_update() failed to limit the length of the message\n", stderr);
+      return 1;
+    }
+  }
+
   return 0;
 }
@@ -12,7 +12,7 @@
 #include <string.h>
 
 /*
- * Tests the aes_encrypt function with the example values in
+ * Tests the aes_* functions with the example values in
  * [AES] Advanced Encryption Standard (AES), FIPS 197, Nov 26 2001.
  *       http://csrc.nist.gov/publications/fips/fips197/fips-197.pdf
  */
@@ -32,8 +32,17 @@ int main(int argc, char **argv) {
       {0x69,0xc4,0xe0,0xd8,0x6a,0x7b,0x04,0x30,0xd8,0xcd,0xb7,0x80,0x70,0xb4,0xc5,0x5a}
     }
   };
+  /* [AES] Appendix A.1 Expansion of a 128-bit Cipher Key: w[40..43] */
+  const unsigned char last_round_key[16] = {
+    0xd0,0x14,0xf9,0xa8,0xc9,0xee,0x25,0x89,0xe1,0x3f,0x0c,0xc8,0xb6,0x63,0x0c,0xa6
+  };
+  int backends[3];
+  int n;  /* number of backends to test */
+  struct aes_key ctx;
   unsigned char ciphertext[16];
-  unsigned i;
+  unsigned char blocks[37 * 16];
+  unsigned char expected[sizeof(blocks)];
+  unsigned i, b;
 
   for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
     aes_encrypt(ciphertext, vectors[i].plaintext, vectors[i].key);
@@ -41,6 +50,104 @@ int main(int argc, char **argv) {
       fprintf(stderr, "aes_encrypt() failed for test vector %u\n", i);
       return 1;
     }
+    memcpy(ciphertext, vectors[i].key, 16);  /* the output replaces the key, as in aes-mmo.h */
+    aes_encrypt(ciphertext, vectors[i].plaintext, ciphertext);
+    if (memcmp(ciphertext, vectors[i].ciphertext, 16)) {
+      fprintf(stderr, "aes_encrypt() failed in place for test vector %u\n", i);
+      return 1;
+    }
+  }
+
+  /* Test every implementation available in this program and on this processor */
+  n = 0;
+  backends[n++] = AES_BACKEND_PORTABLE;
+#ifdef AES_BITSLICE
+  backends[n++] = AES_BACKEND_BITSLICE;
+#endif
+#ifdef AES_AESNI
+  if (aes_has_aesni()) {
+    backends[n++] = AES_BACKEND_AESNI;
+  }
+#endif
+
+  /* Reference results for aes_encrypt_blocks() */
+  for (i = 0; i < sizeof(blocks); i++) {
+    blocks[i] = i * 7;
+  }
+  aes_expand_key_backend(&ctx, vectors[0].key, AES_BACKEND_PORTABLE);
+  for (i = 0; i < sizeof(blocks); i += 16) {
+    aes_encrypt_block(&ctx, expected + i, blocks + i);
+  }
+
+  for (b = 0; b < (unsigned)n; b++) {
+    aes_expand_key_backend(&ctx, vectors[0].key, backends[b]);
+    if (ctx.backend != backends[b] || memcmp(ctx.round_keys + 160, last_round_key, 16)) {
+      fprintf(stderr, "aes_expand_key_backend() failed for backend %d\n", backends[b]);
+      return 1;
+    }
+
+    for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+      aes_expand_key_backend(&ctx, vectors[i].key, backends[b]);
+      aes_encrypt_block(&ctx, ciphertext, vectors[i].plaintext);
+      if (memcmp(ciphertext, vectors[i].ciphertext, 16)) {
+        fprintf(stderr, "aes_encrypt_block() failed for backend %d test vector %u\n", backends[b], i);
+        return 1;
+      }
+      aes_decrypt_block(&ctx, ciphertext, ciphertext);
+      if (memcmp(ciphertext, vectors[i].plaintext, 16)) {
+        fprintf(stderr, "aes_decrypt_block() failed for backend %d test vector %u\n", backends[b], i);
+        return 1;
+      }
+    }
+
+    aes_expand_key_backend(&ctx, vectors[0].key, backends[b]);
+    aes_encrypt_blocks(&ctx, ciphertext, vectors[0].plaintext, 1);
+    if (memcmp(ciphertext, vectors[0].ciphertext, 16)) {
+      fprintf(stderr, "aes_encrypt_blocks() failed for backend %d with 1 block\n", backends[b]);
+      return 1;
+    }
+    aes_encrypt_blocks(&ctx, blocks, blocks, sizeof(blocks) / 16);
+    if (memcmp(blocks, expected, sizeof(blocks))) {
+      fprintf(stderr, "aes_encrypt_blocks() failed for backend %d\n", backends[b]);
+      return 1;
+    }
+    for (i = 0; i < sizeof(blocks); i += 16) {
+      aes_decrypt_block(&ctx, blocks + i, blocks + i);
+    }
+    for (i = 0; i < sizeof(blocks); i++) {
+      if (blocks[i] != (unsigned char)(i * 7)) {
+        fprintf(stderr, "aes_decrypt_block() failed for backend %d\n", backends[b]);
+        return 1;
+      }
+    }
+    memcpy(blocks, expected, sizeof(blocks));
+    aes_decrypt_blocks(&ctx, blocks, blocks, sizeof(blocks) / 16);
+    for (i = 0; i < sizeof(blocks); i++) {
+      if (blocks[i] != (unsigned char)(i * 7)) {
+        fprintf(stderr, "aes_decrypt_blocks() failed for backend %d\n", backends[b]);
+        return 1;
+      }
+    }
+    /* Every count of blocks of a last group, with 4 blocks or fewer on their own */
+    for (i = 1; i <= 9; i++) {
+      memcpy(blocks, expected, 16 * i);
+      aes_decrypt_blocks(&ctx, blocks, blocks, i);
+      aes_encrypt_blocks(&ctx, blocks + 16 * i, blocks, i);
+      if (blocks[16 * i - 1] != (unsigned char)((16 * i - 1) * 7) || memcmp(blocks + 16 * i, expected, 16 * i)) {
+        fprintf(stderr, "aes_encrypt_blocks() failed for backend %d with %u blocks\n", backends[b], i);
+        return 1;
+      }
+    }
+    for (i = 0; i < sizeof(blocks); i++) {
+      blocks[i] = i * 7;
+    }
+  }
+
+  aes_expand_key(&ctx, vectors[0].key);
+  aes_encrypt_block(&ctx, ciphertext, vectors[0].plaintext);
+  if (memcmp(ciphertext, vectors[0].ciphertext, 16)) {
+    fputs("aes_expand_key() failed\n", stderr);
+    return 1;
   }
 
   return 0;
@@ -12,8 +12,9 @@
 #include <string.h>
 
 /*
- * Tests the base64_encode function with the example values in
- * [RFC4648] The Base16, Base32, and Base64 Data Encodings.
+ * Tests the base64_encode and base64_decode functions with the example values in
+ * [RFC4648] The Base16, Base32, and Base64 Data Encodings,
+ * and the decoding of invalid input and of input with whitespace.
  */
 int main(int argc, char **argv) {
   const struct { char input[7]; char output[9]; } vectors[] = {
@@ -30,8 +31,18 @@ int main(int argc, char **argv) {
     { "fooba", "Zm9vYmE=" },
     { "foobar", "Zm9vYmFy" },
   };
+  /* Input that base64_decode() and base64_decode_mime() must reject */
+  const char *const invalid[] = {
+    "Zg=", "Zg", "Z", "Zm9vY", "Zm9vYg=", "Zm9vYmE",
+    "Zg==Zg==", "Zm8=Zm9v", "Z===", "====", "Zg=a", "=Zm9",
+    "Zh==", "Zm9=", "Zm9vYmF!", "Zm9v\x80mFy", "Zm9-", "Zm9_",
+    "Zg==\x01", "Zm 9 v=",
+  };
   char output[sizeof(vectors[0].output)];
-  unsigned i;
+  unsigned char data[300], decoded[300];
+  char encoded[500];
+  unsigned i, j, k;
+  int n;
 
   for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
     unsigned n = base64_encode(output, vectors[i].input, strlen(vectors[i].input));
@@ -45,5 +56,90 @@ int main(int argc, char **argv) {
     }
   }
 
+  for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    n = base64_decode(decoded, vectors[i].output, strlen(vectors[i].output));
+    if (n != (int)strlen(vectors[i].input) || memcmp(decoded, vectors[i].input, n)) {
+      fprintf(stderr, "base64_decode() failed for test vector %u\n", i);
+      return 1;
+    }
+  }
+
+  for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    if (base64_decode(decoded, invalid[i], strlen(invalid[i])) != -1
+        || base64_decode_mime(decoded, invalid[i], strlen(invalid[i])) != -1) {
+      fprintf(stderr, "base64_decode() accepted invalid input %u\n", i);
+      return 1;
+    }
+  }
+
+  /* Whitespace, rejected by base64_decode() and skipped by base64_decode_mime() */
+  {
+    const char *const spaced[] = {
+      "Zm9v YmFy", "Zm9vYmFy\r\n", " Zm9vYmFy", "Z m 9 v Y m F y", "Zm9v\nYmFy\n",
+      "Zm\t9vYmFy", "\r\nZm9vYmFy\r\n\r\n",
+    };
+    const char *const padded[] = {"Zm9vYg==\r\n", "Zm9vY g==", "Zm9vYg= =", "Zm9vYg\n==\n"};
+
+    for (i = 0; i < sizeof(spaced) / sizeof(spaced[0]); i++) {
+      if (base64_decode(decoded, spaced[i], strlen(spaced[i])) != -1) {
+        fprintf(stderr, "base64_decode() accepted whitespace in input %u\n", i);
+        return 1;
+      }
+      n = base64_decode_mime(decoded, spaced[i], strlen(spaced[i]));
+      if (n != 6 || memcmp(decoded, "foobar", 6)) {
+        fprintf(stderr, "base64_decode_mime() failed to skip whitespace in input %u\n", i);
+        return 1;
+      }
+    }
+    for (i = 0; i < sizeof(padded) / sizeof(padded[0]); i++) {
+      n = base64_decode_mime(decoded, padded[i], strlen(padded[i]));
+      if (n != 4 || memcmp(decoded, "foob", 4)) {
+        fprintf(stderr, "base64_decode_mime() failed to skip whitespace in padded input %u\n", i);
+        return 1;
+      }
+    }
+  }
+
+  /* Every length up to 300 bytes, and in MIME lines of 76 characters */
+  for (i = 0; i < sizeof(data); i++) {
+    data[i] = (unsigned char)(i * 151 + 7);
+  }
+  for (i = 0; i <= sizeof(data); i++) {
+    n = base64_encode(encoded, data, i);
+    if (base64_decode(decoded, encoded, n) != (int)i || memcmp(decoded, data, i)) {
+      fprintf(stderr, "base64_decode() failed for %u bytes\n", i);
+      return 1;
+    }
+    for (j = n, k = n + (n - 1) / 76 * 2; j > 0; j--) {
+      if (j % 76 == 0 && j < (unsigned)n) {
+        encoded[--k] = '\n';
+        encoded[--k] = '\r';
+      }
+      encoded[--k] = encoded[j - 1];
+    }
+    n += n > 0 ? (n - 1) / 76 * 2 : 0;
+    if (base64_decode_mime(decoded, encoded, n) != (int)i || memcmp(decoded, data, i)) {
+      fprintf(stderr, "base64_decode_mime() failed for %u bytes\n", i);
+      return 1;
+    }
+  }
+
+  /* Every character at several positions of long input, against the table of values */
+  n = base64_encode(encoded, data, 120);
+  for (i = 0; i < 256; i++) {
+    for (j = 0; j < 160; j += 13) {
+      char c = encoded[j];
+      int valid = (i >= 'A' && i <= 'Z') || (i >= 'a' && i <= 'z') || (i >= '0' && i <= '9') || i == '+' || i == '/';
+
+      encoded[j] = (char)i;
+      k = base64_decode(decoded, encoded, n);
+      encoded[j] = c;
+      if (valid ? k != 120 || memcmp(decoded + j / 4 * 3 + 3, data + j / 4 * 3 + 3, 120 - j / 4 * 3 - 3) : k != (unsigned)-1) {
+        fprintf(stderr, "base64_decode() failed with character %u at position %u\n", i, j);
+        return 1;
+      }
+    }
+  }
+
   return 0;
 }
@@ -1,8 +1,10 @@
 #!/bin/sh
 set -e
 for c in $*; do
-	gcc -Wall -Werror -ansi -pedantic -O2 $c
-	./a.out
-	g++ -Wall -Werror -O2 $c
-	./a.out
+	for d in "" "-DAES_NO_AESNI -DBASE64_NO_AVX2" "-DAES_NO_AESNI -DAES_TTABLE -DBASE64_NO_SIMD" "-DAES_NO_AESNI -DAES_CONSTANT_TIME -DBASE64_NO_SIMD"; do
+		gcc -Wall -Werror -ansi -pedantic -O2 $d $c
+		./a.out
+		g++ -Wall -Werror -O2 $d $c
+		./a.out
+	done
 done